@@ -117,7 +117,7 @@ void nbd_server_start(SocketAddress *addr, const char *tls_creds,
     qio_channel_set_name(QIO_CHANNEL(nbd_server->listen_ioc),
                          "nbd-listener");
     if (qio_channel_socket_listen_sync(
-            nbd_server->listen_ioc, addr, errp) < 0) {
+            nbd_server->listen_ioc, addr, 1, errp) < 0) {
         goto error;
     }
 
@@ -943,7 +943,7 @@ static void qmp_chardev_open_socket(Chardev *chr,
             qio_channel_set_name(QIO_CHANNEL(sioc), name);
             g_free(name);
 
-            if (qio_channel_socket_listen_sync(sioc, s->addr, errp) < 0) {
+            if (qio_channel_socket_listen_sync(sioc, s->addr, 1, errp) < 0) {
                 goto error;
             }
 
@@ -1129,6 +1129,44 @@ bool cpu_physical_memory_test_and_clear_dirty(ram_addr_t start,
     return dirty;
 }
 
+uint64_t cpu_physical_memory_count_and_clear_dirty(ram_addr_t start,
+                                                   ram_addr_t length,
+                                                   unsigned client)
+{
+    DirtyMemoryBlocks *blocks;
+    unsigned long end, page;
+    uint64_t count = 0;
+
+    if (length == 0) {
+        return 0;
+    }
+
+    end = TARGET_PAGE_ALIGN(start + length) >> TARGET_PAGE_BITS;
+    page = start >> TARGET_PAGE_BITS;
+
+    rcu_read_lock();
+
+    blocks = atomic_rcu_read(&ram_list.dirty_memory[client]);
+
+    while (page < end) {
+        unsigned long idx = page / DIRTY_MEMORY_BLOCK_SIZE;
+        unsigned long offset = page % DIRTY_MEMORY_BLOCK_SIZE;
+        unsigned long num = MIN(end - page, DIRTY_MEMORY_BLOCK_SIZE - offset);
+
+        count += bitmap_count_and_clear_atomic(blocks->blocks[idx],
+                                               offset, num);
+        page += num;
+    }
+
+    rcu_read_unlock();
+
+    if (count && tcg_enabled()) {
+        tlb_reset_dirty_range_all(start, length);
+    }
+
+    return count;
+}
+
 DirtyBitmapSnapshot *cpu_physical_memory_snapshot_and_clear_dirty
      (ram_addr_t start, ram_addr_t length, unsigned client)
 {
@@ -1700,6 +1738,11 @@ const char *qemu_ram_get_idstr(RAMBlock *rb)
     return rb->idstr;
 }
 
+ram_addr_t qemu_ram_get_used_length(RAMBlock *rb)
+{
+    return rb->used_length;
+}
+
 bool qemu_ram_is_shared(RAMBlock *rb)
 {
     return rb->flags & RAM_SHARED;
@@ -561,6 +561,35 @@ STEXI
 @item info migrate_cache_size
 @findex migrate_cache_size
 Show current migration xbzrle cache size.
+ETEXI
+
+    {
+        .name       = "migrate_sections",
+        .args_type  = "",
+        .params     = "",
+        .help       = "show the size and duration of each section of the last migration",
+        .cmd        = hmp_info_migrate_sections,
+    },
+
+STEXI
+@item info migrate_sections
+@findex migrate_sections
+Show how many bytes each section of the last migration took, and how long
+it took to save or load them.
+ETEXI
+
+    {
+        .name       = "dirty_rate",
+        .args_type  = "",
+        .params     = "",
+        .help       = "show the result of the last dirty rate measurement",
+        .cmd        = hmp_info_dirty_rate,
+    },
+
+STEXI
+@item info dirty_rate
+@findex dirty_rate
+Show the result of the last dirty rate measurement.
 ETEXI
 
     {
@@ -1071,6 +1071,25 @@ STEXI
 @findex migrate_start_postcopy
 Switch in-progress migration to postcopy mode. Ignored after the end of
 migration (or once already in postcopy).
+ETEXI
+
+    {
+        .name       = "calc_dirty_rate",
+        .args_type  = "sampling:-s,second:l",
+        .params     = "[-s] second",
+        .help       = "measure how fast the guest dirties its memory for "
+                      "'second' seconds (-s: sample page contents instead "
+                      "of enabling dirty logging)",
+        .cmd        = hmp_calc_dirty_rate,
+    },
+
+STEXI
+@item calc_dirty_rate [-s] @var{second}
+@findex calc_dirty_rate
+Start measuring how many pages the guest dirties per second over
+@var{second} seconds, without migrating.  With -s a sample of the pages
+is hashed instead of enabling dirty logging.  See @code{info dirty_rate}
+for the result.
 ETEXI
 
     {
@@ -223,6 +223,9 @@ void hmp_info_migrate(Monitor *mon, const QDict *qdict)
                        info->ram->normal_bytes >> 10);
         monitor_printf(mon, "dirty sync count: %" PRIu64 "\n",
                        info->ram->dirty_sync_count);
+        monitor_printf(mon, "dirty sync time: %" PRIu64 " us (max %" PRIu64
+                       " us)\n", info->ram->dirty_sync_time,
+                       info->ram->dirty_sync_time_max);
         monitor_printf(mon, "page size: %" PRIu64 " kbytes\n",
                        info->ram->page_size >> 10);
 
@@ -234,6 +237,48 @@ void hmp_info_migrate(Monitor *mon, const QDict *qdict)
             monitor_printf(mon, "postcopy request count: %" PRIu64 "\n",
                            info->ram->postcopy_requests);
         }
+        if (info->ram->multifd_bytes) {
+            monitor_printf(mon, "multifd bytes: %" PRIu64 " kbytes\n",
+                           info->ram->multifd_bytes >> 10);
+        }
+        if (info->ram->avoided_resend_bytes) {
+            monitor_printf(mon, "avoided resend bytes: %" PRIu64 " kbytes\n",
+                           info->ram->avoided_resend_bytes >> 10);
+        }
+        if (info->ram->dedup_pages) {
+            monitor_printf(mon, "dedup pages: %" PRIu64 " pages\n",
+                           info->ram->dedup_pages);
+        }
+    }
+
+    if (info->has_convergence) {
+        monitor_printf(mon, "convergence bandwidth: %" PRId64 " kbytes/s\n",
+                       info->convergence->bandwidth >> 10);
+        monitor_printf(mon, "convergence dirty rate: %" PRId64
+                       " kbytes/s\n", info->convergence->dirty_rate >> 10);
+        if (info->convergence->has_remaining_time) {
+            monitor_printf(mon, "predicted remaining time: %" PRId64
+                           " milliseconds\n",
+                           info->convergence->remaining_time);
+        } else {
+            monitor_printf(mon, "predicted remaining time: not converging\n");
+        }
+        monitor_printf(mon, "predicted downtime: %" PRId64
+                       " milliseconds\n",
+                       info->convergence->expected_downtime);
+    }
+
+    if (info->has_colo_checkpoint) {
+        monitor_printf(mon, "colo checkpoints: %" PRIu64 "\n",
+                       info->colo_checkpoint->checkpoints);
+        monitor_printf(mon, "colo checkpoint pause: %" PRIu64
+                       " milliseconds\n", info->colo_checkpoint->pause_time);
+        monitor_printf(mon, "colo checkpoint size: %" PRIu64 " kbytes\n",
+                       info->colo_checkpoint->bytes >> 10);
+        monitor_printf(mon, "colo checkpoint dirty pages: %" PRIu64 "\n",
+                       info->colo_checkpoint->dirty_pages);
+        monitor_printf(mon, "colo live sync: %" PRIu64 " kbytes\n",
+                       info->colo_checkpoint->live_bytes >> 10);
     }
 
     if (info->has_disk) {
@@ -258,6 +303,56 @@ void hmp_info_migrate(Monitor *mon, const QDict *qdict)
                        info->xbzrle_cache->cache_miss_rate);
         monitor_printf(mon, "xbzrle overflow : %" PRIu64 "\n",
                        info->xbzrle_cache->overflow);
+        if (info->xbzrle_cache->has_ways) {
+            XBZRLECacheWayStatsList *way;
+
+            for (way = info->xbzrle_cache->ways; way; way = way->next) {
+                monitor_printf(mon, "xbzrle cache way %" PRId64 ": "
+                               "hits %" PRIu64 " misses %" PRIu64
+                               " evictions %" PRIu64 "\n",
+                               way->value->way, way->value->hits,
+                               way->value->misses, way->value->evictions);
+            }
+        }
+    }
+
+    if (info->has_incoming) {
+        monitor_printf(mon, "Incoming migration status: %s\n",
+                       MigrationStatus_lookup[info->incoming->status]);
+    }
+
+    if (info->has_incoming && info->incoming->has_postcopy_faults) {
+        PostcopyFaultInfo *faults = info->incoming->postcopy_faults;
+        PostcopyFaultLatencyBucketList *bucket;
+
+        monitor_printf(mon, "postcopy faults: %" PRIu64 "\n",
+                       faults->faults);
+        monitor_printf(mon, "postcopy duplicate faults: %" PRIu64 "\n",
+                       faults->duplicates);
+        monitor_printf(mon, "postcopy page requests: %" PRIu64 "\n",
+                       faults->requests);
+        monitor_printf(mon, "postcopy prefetch: %" PRIu64 " pages\n",
+                       faults->prefetch_pages);
+        for (bucket = faults->latency; bucket; bucket = bucket->next) {
+            monitor_printf(mon, "postcopy fault latency >= %" PRIu64
+                           " us: %" PRIu64 "\n",
+                           bucket->value->min_us, bucket->value->count);
+        }
+        if (faults->has_blocktime) {
+            monitor_printf(mon, "postcopy blocktime: %" PRIu64 " ms\n",
+                           faults->blocktime);
+        }
+        if (faults->has_vcpu_blocktime) {
+            intList *item;
+            const char *sep = "";
+
+            monitor_printf(mon, "postcopy vcpu blocktime (ms): [");
+            for (item = faults->vcpu_blocktime; item; item = item->next) {
+                monitor_printf(mon, "%s%" PRId64, sep, item->value);
+                sep = ", ";
+            }
+            monitor_printf(mon, "]\n");
+        }
     }
 
     if (info->has_cpu_throttle_percentage) {
@@ -337,6 +432,50 @@ void hmp_info_migrate_parameters(Monitor *mon, const QDict *qdict)
         monitor_printf(mon, "%s: %s\n",
             MigrationParameter_lookup[MIGRATION_PARAMETER_BLOCK_INCREMENTAL],
                        params->block_incremental ? "on" : "off");
+        assert(params->has_x_multifd_channels);
+        monitor_printf(mon, "%s: %" PRId64 "\n",
+            MigrationParameter_lookup[MIGRATION_PARAMETER_X_MULTIFD_CHANNELS],
+            params->x_multifd_channels);
+        assert(params->has_x_multifd_page_count);
+        monitor_printf(mon, "%s: %" PRId64 "\n",
+            MigrationParameter_lookup[MIGRATION_PARAMETER_X_MULTIFD_PAGE_COUNT],
+            params->x_multifd_page_count);
+        assert(params->has_compress_method);
+        monitor_printf(mon, "%s: %s\n",
+            MigrationParameter_lookup[MIGRATION_PARAMETER_COMPRESS_METHOD],
+            MigrationCompressMethod_lookup[params->compress_method]);
+        assert(params->has_x_postcopy_prefetch_pages);
+        monitor_printf(mon, "%s: %" PRId64 "\n",
+            MigrationParameter_lookup[MIGRATION_PARAMETER_X_POSTCOPY_PREFETCH_PAGES],
+            params->x_postcopy_prefetch_pages);
+        assert(params->has_x_dirty_sync_threads);
+        monitor_printf(mon, "%s: %" PRId64 "\n",
+            MigrationParameter_lookup[MIGRATION_PARAMETER_X_DIRTY_SYNC_THREADS],
+            params->x_dirty_sync_threads);
+        assert(params->has_x_ram_load_threads);
+        monitor_printf(mon, "%s: %" PRId64 "\n",
+            MigrationParameter_lookup[MIGRATION_PARAMETER_X_RAM_LOAD_THREADS],
+            params->x_ram_load_threads);
+        assert(params->has_x_rdma_queue_pairs);
+        monitor_printf(mon, "%s: %" PRId64 "\n",
+            MigrationParameter_lookup[MIGRATION_PARAMETER_X_RDMA_QUEUE_PAIRS],
+            params->x_rdma_queue_pairs);
+        assert(params->has_x_rdma_reg_cache_size);
+        monitor_printf(mon, "%s: %" PRIu64 " bytes\n",
+            MigrationParameter_lookup[MIGRATION_PARAMETER_X_RDMA_REG_CACHE_SIZE],
+            params->x_rdma_reg_cache_size);
+        assert(params->has_x_section_stats_file);
+        monitor_printf(mon, "%s: '%s'\n",
+            MigrationParameter_lookup[MIGRATION_PARAMETER_X_SECTION_STATS_FILE],
+            params->x_section_stats_file);
+        assert(params->has_x_block_inflight_reads);
+        monitor_printf(mon, "%s: %" PRId64 "\n",
+            MigrationParameter_lookup[MIGRATION_PARAMETER_X_BLOCK_INFLIGHT_READS],
+            params->x_block_inflight_reads);
+        assert(params->has_cpu_throttle_policy);
+        monitor_printf(mon, "%s: %s\n",
+            MigrationParameter_lookup[MIGRATION_PARAMETER_CPU_THROTTLE_POLICY],
+            MigrationThrottlePolicy_lookup[params->cpu_throttle_policy]);
     }
 
     qapi_free_MigrationParameters(params);
@@ -348,6 +487,57 @@ void hmp_info_migrate_cache_size(Monitor *mon, const QDict *qdict)
                    qmp_query_migrate_cache_size(NULL) >> 10);
 }
 
+void hmp_info_migrate_sections(Monitor *mon, const QDict *qdict)
+{
+    MigrationSectionInfoList *sections, *s;
+
+    sections = qmp_query_migrate_sections(NULL);
+    for (s = sections; s; s = s->next) {
+        MigrationSectionInfo *info = s->value;
+
+        monitor_printf(mon, "%s/%" PRId64 ": live %" PRId64 " bytes %" PRId64
+                       " us, stop %" PRId64 " bytes %" PRId64
+                       " us, load %" PRId64 " bytes %" PRId64 " us\n",
+                       info->name, info->instance_id,
+                       info->live_bytes, info->live_time,
+                       info->stop_bytes, info->stop_time,
+                       info->load_bytes, info->load_time);
+    }
+    qapi_free_MigrationSectionInfoList(sections);
+}
+
+void hmp_info_dirty_rate(Monitor *mon, const QDict *qdict)
+{
+    DirtyRateInfo *info = qmp_query_dirty_rate(NULL);
+    DirtyRateBlockInfoList *block;
+    DirtyRateNodeInfoList *node;
+
+    monitor_printf(mon, "Status: %s\n",
+                   DirtyRateStatus_lookup[info->status]);
+    if (info->has_mode) {
+        monitor_printf(mon, "Mode: %s\n",
+                       DirtyRateMeasureMode_lookup[info->mode]);
+        monitor_printf(mon, "Start time: %" PRId64 " ms\n",
+                       info->start_time);
+        monitor_printf(mon, "Window: %" PRId64 " ms\n", info->calc_time);
+    }
+    if (info->has_dirty_rate) {
+        monitor_printf(mon, "Dirty rate: %" PRId64 " pages/s (%" PRId64
+                       " kbytes/s)\n", info->dirty_rate,
+                       (info->dirty_rate * info->page_size) >> 10);
+    }
+    for (block = info->blocks; block; block = block->next) {
+        monitor_printf(mon, "  block %s: %" PRId64 " pages/s of %" PRId64
+                       " pages\n", block->value->id,
+                       block->value->dirty_rate, block->value->pages);
+    }
+    for (node = info->nodes; node; node = node->next) {
+        monitor_printf(mon, "  node %" PRId64 ": %" PRId64 " pages/s\n",
+                       node->value->node, node->value->dirty_rate);
+    }
+    qapi_free_DirtyRateInfo(info);
+}
+
 void hmp_info_cpus(Monitor *mon, const QDict *qdict)
 {
     CpuInfoList *cpu_list, *cpu;
@@ -1622,6 +1812,55 @@ void hmp_migrate_set_parameter(Monitor *mon, const QDict *qdict)
                 p->has_block_incremental = true;
                 visit_type_bool(v, param, &p->block_incremental, &err);
                 break;
+            case MIGRATION_PARAMETER_X_MULTIFD_CHANNELS:
+                p->has_x_multifd_channels = true;
+                visit_type_int(v, param, &p->x_multifd_channels, &err);
+                break;
+            case MIGRATION_PARAMETER_X_MULTIFD_PAGE_COUNT:
+                p->has_x_multifd_page_count = true;
+                visit_type_int(v, param, &p->x_multifd_page_count, &err);
+                break;
+            case MIGRATION_PARAMETER_COMPRESS_METHOD:
+                p->has_compress_method = true;
+                visit_type_MigrationCompressMethod(v, param,
+                                                   &p->compress_method, &err);
+                break;
+            case MIGRATION_PARAMETER_X_POSTCOPY_PREFETCH_PAGES:
+                p->has_x_postcopy_prefetch_pages = true;
+                visit_type_int(v, param, &p->x_postcopy_prefetch_pages, &err);
+                break;
+            case MIGRATION_PARAMETER_X_DIRTY_SYNC_THREADS:
+                p->has_x_dirty_sync_threads = true;
+                visit_type_int(v, param, &p->x_dirty_sync_threads, &err);
+                break;
+            case MIGRATION_PARAMETER_X_RAM_LOAD_THREADS:
+                p->has_x_ram_load_threads = true;
+                visit_type_int(v, param, &p->x_ram_load_threads, &err);
+                break;
+            case MIGRATION_PARAMETER_X_RDMA_QUEUE_PAIRS:
+                p->has_x_rdma_queue_pairs = true;
+                visit_type_int(v, param, &p->x_rdma_queue_pairs, &err);
+                break;
+            case MIGRATION_PARAMETER_X_RDMA_REG_CACHE_SIZE:
+                p->has_x_rdma_reg_cache_size = true;
+                visit_type_size(v, param, &p->x_rdma_reg_cache_size, &err);
+                break;
+            case MIGRATION_PARAMETER_X_SECTION_STATS_FILE:
+                p->has_x_section_stats_file = true;
+                p->x_section_stats_file = g_new0(StrOrNull, 1);
+                p->x_section_stats_file->type = QTYPE_QSTRING;
+                visit_type_str(v, param, &p->x_section_stats_file->u.s, &err);
+                break;
+            case MIGRATION_PARAMETER_X_BLOCK_INFLIGHT_READS:
+                p->has_x_block_inflight_reads = true;
+                visit_type_int(v, param, &p->x_block_inflight_reads, &err);
+                break;
+            case MIGRATION_PARAMETER_CPU_THROTTLE_POLICY:
+                p->has_cpu_throttle_policy = true;
+                visit_type_MigrationThrottlePolicy(v, param,
+                                                   &p->cpu_throttle_policy,
+                                                   &err);
+                break;
             }
 
             if (err) {
@@ -1669,6 +1908,23 @@ void hmp_migrate_start_postcopy(Monitor *mon, const QDict *qdict)
     hmp_handle_error(mon, &err);
 }
 
+void hmp_calc_dirty_rate(Monitor *mon, const QDict *qdict)
+{
+    int64_t sec = qdict_get_int(qdict, "second");
+    bool sampling = qdict_get_try_bool(qdict, "sampling", false);
+    Error *err = NULL;
+
+    qmp_calc_dirty_rate(sec, true,
+                        sampling ? DIRTY_RATE_MEASURE_MODE_PAGE_SAMPLING
+                                 : DIRTY_RATE_MEASURE_MODE_DIRTY_LOG,
+                        false, 0, &err);
+    if (!err) {
+        monitor_printf(mon, "Measuring for %" PRId64 " seconds, "
+                       "see 'info dirty_rate'\n", sec);
+    }
+    hmp_handle_error(mon, &err);
+}
+
 void hmp_x_colo_lost_heartbeat(Monitor *mon, const QDict *qdict)
 {
     Error *err = NULL;
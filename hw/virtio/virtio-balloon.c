@@ -332,6 +332,42 @@ out:
     }
 }
 
+/*
+ * Number of free page hints collected from the free page vq before they
+ * are applied to the migration bitmap in one go.
+ */
+#define VIRTIO_BALLOON_FREE_PAGE_BATCH 32
+
+/* How long the driver gets to acknowledge a stop request */
+#define VIRTIO_BALLOON_FREE_PAGE_STOP_TIMEOUT_MS 1000
+
+static void virtio_balloon_free_page_report_done(VirtIOBalloon *s)
+{
+    s->free_page_report_status = FREE_PAGE_REPORT_S_STOP;
+    s->free_page_cmd_pending = -1;
+    timer_del(s->free_page_stop_timer);
+}
+
+/* Send @cmd in the in buffer the driver has posted on the ctrlq */
+static void virtio_balloon_send_free_page_cmd(VirtIOBalloon *s, uint32_t cmd)
+{
+    VirtIODevice *vdev = VIRTIO_DEVICE(s);
+    struct virtio_balloon_ctrlq_cmd ctrlq_cmd = {
+        .class = virtio_tswap32(vdev, VIRTIO_BALLOON_CTRLQ_CLASS_FREE_PAGE),
+        .cmd = virtio_tswap32(vdev, cmd),
+    };
+
+    iov_from_buf(s->free_page_elem->in_sg, s->free_page_elem->in_num, 0,
+                 &ctrlq_cmd, sizeof(struct virtio_balloon_ctrlq_cmd));
+    virtqueue_push(s->ctrlq, s->free_page_elem,
+                   sizeof(struct virtio_balloon_ctrlq_cmd));
+    virtio_notify(vdev, s->ctrlq);
+    g_free(s->free_page_elem);
+    s->free_page_elem = NULL;
+    s->free_page_cmd_pending = -1;
+    trace_virtio_balloon_free_page_cmd(cmd);
+}
+
 /* Guest to host control of various features */
 static void virtio_balloon_handle_ctrlq(VirtIODevice *vdev, VirtQueue *vq)
 {
@@ -349,107 +385,145 @@ static void virtio_balloon_handle_ctrlq(VirtIODevice *vdev, VirtQueue *vq)
         if (elem->in_num) {
             iov_to_buf(elem->in_sg, elem->in_num, 0, &ctrlq_cmd,
                        sizeof(struct virtio_balloon_ctrlq_cmd));
-            switch (ctrlq_cmd.class) {
+            switch (virtio_tswap32(vdev, ctrlq_cmd.class)) {
             case VIRTIO_BALLOON_CTRLQ_CLASS_FREE_PAGE:
+                /* Hand an older buffer back unused, we only need one */
+                if (s->free_page_elem) {
+                    virtqueue_push(s->ctrlq, s->free_page_elem, 0);
+                    virtio_notify(vdev, s->ctrlq);
+                    g_free(s->free_page_elem);
+                }
                 s->free_page_elem = elem;
-            break;
+                if (s->free_page_cmd_pending >= 0) {
+                    virtio_balloon_send_free_page_cmd(s,
+                                                s->free_page_cmd_pending);
+                }
+                continue;
             default:
                 fprintf(stderr, "%s: Input cmd class: %d not supported\n",
-                        __func__, ctrlq_cmd.class);
+                        __func__, virtio_tswap32(vdev, ctrlq_cmd.class));
             }
         }
 
         /* Outbuf: handle the request from the guest */
         if (elem->out_num) {
-           iov_to_buf(elem->out_sg, elem->out_num, 0, &ctrlq_cmd,
+            iov_to_buf(elem->out_sg, elem->out_num, 0, &ctrlq_cmd,
                        sizeof(struct virtio_balloon_ctrlq_cmd));
-            switch (ctrlq_cmd.class) {
+            switch (virtio_tswap32(vdev, ctrlq_cmd.class)) {
             case VIRTIO_BALLOON_CTRLQ_CLASS_FREE_PAGE:
                 /* The driver has reported all the free pages */
-                if (ctrlq_cmd.cmd == VIRTIO_BALLOON_FREE_PAGE_F_STOP)
-                    s->free_page_stop = true;
+                if (virtio_tswap32(vdev, ctrlq_cmd.cmd) ==
+                    VIRTIO_BALLOON_FREE_PAGE_F_STOP) {
+                    trace_virtio_balloon_free_page_report_done(
+                        s->free_page_report_status);
+                    virtio_balloon_free_page_report_done(s);
+                }
                 break;
             default:
                 fprintf(stderr, "%s: Output cmd class: %d not supported\n",
-                        __func__, ctrlq_cmd.class);
+                        __func__, virtio_tswap32(vdev, ctrlq_cmd.class));
             }
-            virtqueue_push(s->ctrlq, elem,
-                           sizeof(struct virtio_balloon_ctrlq_cmd));
-            virtio_notify(vdev, s->ctrlq);
         }
+        virtqueue_push(s->ctrlq, elem,
+                       sizeof(struct virtio_balloon_ctrlq_cmd));
+        virtio_notify(vdev, s->ctrlq);
+        g_free(elem);
     }
 }
 
-/* Host to guest control of the free page report work */
-static int virtio_balloon_ctrlq_free_page(VirtIOBalloon *s, uint32_t cmd)
+static void virtio_balloon_free_page_stop_timeout(void *opaque)
 {
-    VirtIODevice *vdev = VIRTIO_DEVICE(s);
-    struct virtio_balloon_ctrlq_cmd ctrlq_cmd = {
-        .class = VIRTIO_BALLOON_CTRLQ_CLASS_FREE_PAGE,
-        .cmd = cmd,
-    };
+    VirtIOBalloon *s = opaque;
 
-    if (cmd == VIRTIO_BALLOON_FREE_PAGE_F_STOP) {
-        if (s->free_page_stop) {
-             return 0;
-        } else {
-             while(!s->free_page_stop);
-             return 0;
-        }
+    if (s->free_page_report_status == FREE_PAGE_REPORT_S_STOP_REQUESTED) {
+        trace_virtio_balloon_free_page_stop_timeout();
+        virtio_balloon_free_page_report_done(s);
     }
+}
 
+/*
+ * Host to guest control of the free page report work.
+ *
+ * Nothing here waits for the driver: a stop request is sent (or queued
+ * until the driver posts its next ctrlq buffer) and the report is
+ * considered finished when the driver acknowledges it, or when
+ * VIRTIO_BALLOON_FREE_PAGE_STOP_TIMEOUT_MS have passed.
+ */
+static int virtio_balloon_ctrlq_free_page(VirtIOBalloon *s, uint32_t cmd)
+{
     if (!balloon_free_page_supported(s)) {
         return -1;
     }
 
-    /* FIXME: Maybe this is not necessary - just return -1 */
-    if (!s->free_page_elem) {
-            fprintf(stderr, "%s: free_page_elem is NULL\n", __func__);
+    if (cmd == VIRTIO_BALLOON_FREE_PAGE_F_STOP) {
+        if (s->free_page_report_status != FREE_PAGE_REPORT_S_START) {
+            return 0;
+        }
+        s->free_page_report_status = FREE_PAGE_REPORT_S_STOP_REQUESTED;
+        timer_mod(s->free_page_stop_timer,
+                  qemu_clock_get_ms(QEMU_CLOCK_REALTIME) +
+                  VIRTIO_BALLOON_FREE_PAGE_STOP_TIMEOUT_MS);
+    } else {
+        if (!s->free_page_elem) {
             return -1;
+        }
+        timer_del(s->free_page_stop_timer);
+        s->free_page_report_status = FREE_PAGE_REPORT_S_START;
     }
 
-    iov_from_buf(s->free_page_elem->in_sg, s->free_page_elem->in_num, 0,
-                 &ctrlq_cmd, sizeof(struct virtio_balloon_ctrlq_cmd));
-    virtqueue_push(s->ctrlq, s->free_page_elem, sizeof(struct virtio_balloon_ctrlq_cmd));
-    virtio_notify(vdev, s->ctrlq);
-    g_free(s->free_page_elem);
-    s->free_page_elem = NULL;
-    if (cmd == VIRTIO_BALLOON_FREE_PAGE_F_STOP)
-        s->free_page_stop = true;
-    else
-        s->free_page_stop = false;
+    if (s->free_page_elem) {
+        virtio_balloon_send_free_page_cmd(s, cmd);
+    } else {
+        s->free_page_cmd_pending = cmd;
+    }
 
     return 0;
 }
 
 static void virtio_balloon_handle_free_pages(VirtIODevice *vdev, VirtQueue *vq)
 {
-    VirtQueueElement *elem;
-    uint32_t flag, size;
+    VirtQueueElement *elems[VIRTIO_BALLOON_FREE_PAGE_BATCH];
+    FreePageHint hints[VIRTIO_BALLOON_FREE_PAGE_BATCH];
+    unsigned int nr_elems, nr_hints, i;
 
-    for (;;) {
-        elem = virtqueue_pop(vq, sizeof(VirtQueueElement));
-        if (!elem) {
-            break;
+    do {
+        nr_elems = 0;
+        nr_hints = 0;
+
+        while (nr_elems < VIRTIO_BALLOON_FREE_PAGE_BATCH) {
+            VirtQueueElement *elem = virtqueue_pop(vq,
+                                                   sizeof(VirtQueueElement));
+            if (!elem) {
+                break;
+            }
+            elems[nr_elems++] = elem;
+
+            if (elem->out_num) {
+                fprintf(stderr, "%s: This vq should not have outbuf\n",
+                        __func__);
+            }
+            if (elem->in_num) {
+                FreePageHint *hint = &hints[nr_hints];
+
+                hint->block = qemu_ram_block_from_host(elem->in_sg[0].iov_base,
+                                                       false, &hint->offset);
+                hint->len = elem->in_sg[0].iov_len;
+                if (hint->block) {
+                    nr_hints++;
+                }
+            }
         }
 
-        if (elem->out_num) {
-            fprintf(stderr, "%s: This vq should not have outbuf\n", __func__);
-         }
-
-	if (elem->in_num) {
-            RAMBlock *block;
-            ram_addr_t offset;
-
-            block = qemu_ram_block_from_host(elem->in_sg[0].iov_base, false,
-                                             &offset);
-            size = elem->in_sg[0].iov_len;
-            skip_free_pages_from_dirty_bitmap(block, offset, size);
-            virtqueue_push(vq, elem, sizeof(flag));
+        skip_free_pages_from_dirty_bitmap(hints, nr_hints);
+
+        for (i = 0; i < nr_elems; i++) {
+            virtqueue_push(vq, elems[i], sizeof(uint32_t));
+            g_free(elems[i]);
+        }
+        if (nr_elems) {
             virtio_notify(vdev, vq);
-            g_free(elem);
         }
-    }
+    } while (nr_elems == VIRTIO_BALLOON_FREE_PAGE_BATCH);
 }
 
 static bool virtio_balloon_free_page_support(void *opaque)
@@ -652,6 +726,11 @@ static void virtio_balloon_device_realize(DeviceState *dev, Error **errp)
         s->ctrlq = virtio_add_queue(vdev, 128, virtio_balloon_handle_ctrlq);
         s->free_page_vq = virtio_add_queue(vdev, 128,
                                            virtio_balloon_handle_free_pages);
+        s->free_page_report_status = FREE_PAGE_REPORT_S_STOP;
+        s->free_page_cmd_pending = -1;
+        s->free_page_stop_timer =
+            timer_new_ms(QEMU_CLOCK_REALTIME,
+                         virtio_balloon_free_page_stop_timeout, s);
     }
 
     reset_stats(s);
@@ -663,6 +742,11 @@ static void virtio_balloon_device_unrealize(DeviceState *dev, Error **errp)
     VirtIOBalloon *s = VIRTIO_BALLOON(dev);
 
     balloon_stats_destroy_timer(s);
+    if (s->free_page_stop_timer) {
+        timer_del(s->free_page_stop_timer);
+        timer_free(s->free_page_stop_timer);
+        s->free_page_stop_timer = NULL;
+    }
     qemu_remove_balloon_handler(s);
     virtio_cleanup(vdev);
 }
@@ -682,6 +766,10 @@ static void virtio_balloon_device_reset(VirtIODevice *vdev)
             g_free(s->free_page_elem);
             s->free_page_elem = NULL;
     }
+
+    if (s->free_page_stop_timer) {
+        virtio_balloon_free_page_report_done(s);
+    }
 }
 
 static void virtio_balloon_set_status(VirtIODevice *vdev, uint8_t status)
@@ -47,6 +47,20 @@ struct RAMBlock {
      * of the postcopy phase
      */
     unsigned long *unsentmap;
+    /* copy of the block a COLO secondary loads checkpoints into */
+    uint8_t *colo_cache;
+    /* with x-mapped-ram, pages present in the file and where they are */
+    unsigned long *file_bmap;
+    int64_t bitmap_offset;
+    int64_t pages_offset;
+    /* with x-lazy-restore, host pages not placed yet */
+    unsigned long *lazymap;
+    /* with x-defer-hot-pages, decayed dirty count of each word of bmap */
+    uint8_t *dirty_heat;
+    /* and the words of bmap passed over as hot since the last sync */
+    unsigned long *hot_skipmap;
+    /* with x-dedup-pages, digest of what was last sent for each page */
+    uint8_t *dedup_digest;
 };
 
 static inline bool offset_in_ramblock(RAMBlock *b, ram_addr_t offset)
@@ -60,6 +74,20 @@ static inline void *ramblock_ptr(RAMBlock *block, ram_addr_t offset)
     return (char *)block->host + offset;
 }
 
+/*
+ * Every sync of the migration bitmap halves the heat of each of its words
+ * and adds the number of pages of the word that the guest dirtied since
+ * the previous sync.  A word is hot once it was dirtied completely in two
+ * syncs in a row, or by three quarters in every sync for a while.
+ */
+#define DIRTY_HEAT_HOT (BITS_PER_LONG + BITS_PER_LONG / 2)
+
+static inline bool ramblock_page_is_hot(RAMBlock *block, unsigned long page)
+{
+    return block->dirty_heat &&
+           block->dirty_heat[BIT_WORD(page)] >= DIRTY_HEAT_HOT;
+}
+
 long qemu_getrampagesize(void);
 unsigned long last_ram_page(void);
 RAMBlock *qemu_ram_alloc_from_file(ram_addr_t size, MemoryRegion *mr,
@@ -354,6 +382,11 @@ bool cpu_physical_memory_test_and_clear_dirty(ram_addr_t start,
                                               ram_addr_t length,
                                               unsigned client);
 
+/* Returns the number of dirty pages in the range, which is cleared */
+uint64_t cpu_physical_memory_count_and_clear_dirty(ram_addr_t start,
+                                                   ram_addr_t length,
+                                                   unsigned client);
+
 DirtyBitmapSnapshot *cpu_physical_memory_snapshot_and_clear_dirty
     (ram_addr_t start, ram_addr_t length, unsigned client);
 
@@ -370,16 +403,26 @@ static inline void cpu_physical_memory_clear_dirty_range(ram_addr_t start,
 }
 
 
+/*
+ * Move the migration dirty bits of [start, start + length) of @rb into
+ * rb->bmap, returning the number of bits that were not set there yet.
+ * Pages the guest dirtied are added to @real_dirty_pages; those of them
+ * that were still waiting to be sent in a word passed over as hot, to
+ * @hot_redirty_pages.
+ */
 static inline
 uint64_t cpu_physical_memory_sync_dirty_bitmap(RAMBlock *rb,
                                                ram_addr_t start,
                                                ram_addr_t length,
-                                               uint64_t *real_dirty_pages)
+                                               uint64_t *real_dirty_pages,
+                                               uint64_t *hot_redirty_pages)
 {
     ram_addr_t addr;
     unsigned long word = BIT_WORD((start + rb->offset) >> TARGET_PAGE_BITS);
     uint64_t num_dirty = 0;
     unsigned long *dest = rb->bmap;
+    uint8_t *heat = rb->dirty_heat;
+    unsigned long *skipped = rb->hot_skipmap;
 
     /* start address is aligned at the start of a word? */
     if (((word * BITS_PER_LONG) << TARGET_PAGE_BITS) ==
@@ -398,15 +441,23 @@ uint64_t cpu_physical_memory_sync_dirty_bitmap(RAMBlock *rb,
                 &ram_list.dirty_memory[DIRTY_MEMORY_MIGRATION])->blocks;
 
         for (k = page; k < page + nr; k++) {
+            unsigned long bits = 0;
+
             if (src[idx][offset]) {
-                unsigned long bits = atomic_xchg(&src[idx][offset], 0);
                 unsigned long new_dirty;
+                bits = atomic_xchg(&src[idx][offset], 0);
                 *real_dirty_pages += ctpopl(bits);
+                if (skipped && test_bit(k, skipped)) {
+                    *hot_redirty_pages += ctpopl(dest[k] & bits);
+                }
                 new_dirty = ~dest[k];
                 dest[k] |= bits;
                 new_dirty &= bits;
                 num_dirty += ctpopl(new_dirty);
             }
+            if (heat) {
+                heat[k] = (heat[k] >> 1) + ctpopl(bits);
+            }
 
             if (++offset >= BITS_TO_LONGS(DIRTY_MEMORY_BLOCK_SIZE)) {
                 offset = 0;
@@ -418,6 +469,16 @@ uint64_t cpu_physical_memory_sync_dirty_bitmap(RAMBlock *rb,
     } else {
         ram_addr_t offset = rb->offset;
 
+        if (heat && length) {
+            unsigned long w;
+
+            for (w = BIT_WORD(start >> TARGET_PAGE_BITS);
+                 w <= BIT_WORD((start + length - 1) >> TARGET_PAGE_BITS);
+                 w++) {
+                heat[w] >>= 1;
+            }
+        }
+
         for (addr = 0; addr < length; addr += TARGET_PAGE_SIZE) {
             if (cpu_physical_memory_test_and_clear_dirty(
                         start + addr + offset,
@@ -425,6 +486,13 @@ uint64_t cpu_physical_memory_sync_dirty_bitmap(RAMBlock *rb,
                         DIRTY_MEMORY_MIGRATION)) {
                 *real_dirty_pages += 1;
                 long k = (start + addr) >> TARGET_PAGE_BITS;
+                if (skipped && test_bit(BIT_WORD(k), skipped) &&
+                    test_bit(k, dest)) {
+                    *hot_redirty_pages += 1;
+                }
+                if (heat) {
+                    heat[BIT_WORD(k)]++;
+                }
                 if (!test_and_set_bit(k, dest)) {
                     num_dirty++;
                 }
@@ -31,6 +31,12 @@ typedef struct virtio_balloon_stat_modern {
        uint64_t val;
 } VirtIOBalloonStatModern;
 
+enum virtio_balloon_free_page_report_status {
+    FREE_PAGE_REPORT_S_STOP = 0,
+    FREE_PAGE_REPORT_S_START = 1,
+    FREE_PAGE_REPORT_S_STOP_REQUESTED = 2,
+};
+
 typedef struct VirtIOBalloon {
     VirtIODevice parent_obj;
     VirtQueue *ivq, *dvq, *svq, *ctrlq, *free_page_vq;
@@ -44,7 +50,10 @@ typedef struct VirtIOBalloon {
     int64_t stats_last_update;
     int64_t stats_poll_interval;
     uint32_t host_features;
-    bool free_page_stop;
+    uint32_t free_page_report_status;
+    /* Command waiting for the driver to post a ctrlq in buffer, or -1 */
+    int32_t free_page_cmd_pending;
+    QEMUTimer *free_page_stop_timer;
 } VirtIOBalloon;
 
 #endif
@@ -32,4 +32,10 @@ COLOMode get_colo_mode(void);
 void colo_do_failover(MigrationState *s);
 
 void colo_checkpoint_notify(void *opaque);
+COLOCheckpointInfo *colo_checkpoint_info(MigrationState *s);
+
+/* RAM cache of the secondary */
+int colo_init_ram_cache(void);
+void colo_release_ram_cache(void);
+uint64_t colo_flush_ram_cache(void);
 #endif
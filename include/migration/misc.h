@@ -20,8 +20,15 @@
 /* migration/ram.c */
 
 void ram_mig_init(void);
-void skip_free_pages_from_dirty_bitmap(RAMBlock *block, ram_addr_t offset,
-                                       size_t len);
+
+typedef struct FreePageHint {
+    RAMBlock *block;
+    ram_addr_t offset;
+    size_t len;
+} FreePageHint;
+
+void skip_free_pages_from_dirty_bitmap(const FreePageHint *hints,
+                                       unsigned int nr);
 
 /* migration/block.c */
 
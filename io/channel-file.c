@@ -33,6 +33,9 @@ qio_channel_file_new_fd(int fd)
     ioc = QIO_CHANNEL_FILE(object_new(TYPE_QIO_CHANNEL_FILE));
 
     ioc->fd = fd;
+    if (lseek(fd, 0, SEEK_CUR) != (off_t)-1) {
+        qio_channel_set_feature(QIO_CHANNEL(ioc), QIO_CHANNEL_FEATURE_SEEKABLE);
+    }
 
     trace_qio_channel_file_new_fd(ioc, fd);
 
@@ -61,6 +64,9 @@ qio_channel_file_new_path(const char *path,
                          "Unable to open %s", path);
         return NULL;
     }
+    if (lseek(ioc->fd, 0, SEEK_CUR) != (off_t)-1) {
+        qio_channel_set_feature(QIO_CHANNEL(ioc), QIO_CHANNEL_FEATURE_SEEKABLE);
+    }
 
     trace_qio_channel_file_new_path(ioc, path, flags, mode, ioc->fd);
 
@@ -117,6 +123,7 @@ static ssize_t qio_channel_file_writev(QIOChannel *ioc,
                                        size_t niov,
                                        int *fds,
                                        size_t nfds,
+                                       int flags,
                                        Error **errp)
 {
     QIOChannelFile *fioc = QIO_CHANNEL_FILE(ioc);
@@ -172,6 +179,67 @@ static off_t qio_channel_file_seek(QIOChannel *ioc,
 }
 
 
+#ifndef _WIN32
+static ssize_t qio_channel_file_pwrite(QIOChannel *ioc,
+                                       const char *buf,
+                                       size_t buflen,
+                                       off_t offset,
+                                       Error **errp)
+{
+    QIOChannelFile *fioc = QIO_CHANNEL_FILE(ioc);
+    size_t done = 0;
+    ssize_t ret;
+
+    while (done < buflen) {
+        ret = pwrite(fioc->fd, buf + done, buflen - done, offset + done);
+        if (ret < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            error_setg_errno(errp, errno,
+                             "Unable to write to file at offset %lld",
+                             (long long int)(offset + done));
+            return -1;
+        }
+        done += ret;
+    }
+    return done;
+}
+
+
+static ssize_t qio_channel_file_pread(QIOChannel *ioc,
+                                      char *buf,
+                                      size_t buflen,
+                                      off_t offset,
+                                      Error **errp)
+{
+    QIOChannelFile *fioc = QIO_CHANNEL_FILE(ioc);
+    size_t done = 0;
+    ssize_t ret;
+
+    while (done < buflen) {
+        ret = pread(fioc->fd, buf + done, buflen - done, offset + done);
+        if (ret < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            error_setg_errno(errp, errno,
+                             "Unable to read from file at offset %lld",
+                             (long long int)(offset + done));
+            return -1;
+        }
+        if (ret == 0) {
+            error_setg(errp, "Unexpected end of file at offset %lld",
+                       (long long int)(offset + done));
+            return -1;
+        }
+        done += ret;
+    }
+    return done;
+}
+#endif /* !_WIN32 */
+
+
 static int qio_channel_file_close(QIOChannel *ioc,
                                   Error **errp)
 {
@@ -214,6 +282,10 @@ static void qio_channel_file_class_init(ObjectClass *klass,
     ioc_klass->io_readv = qio_channel_file_readv;
     ioc_klass->io_set_blocking = qio_channel_file_set_blocking;
     ioc_klass->io_seek = qio_channel_file_seek;
+#ifndef _WIN32
+    ioc_klass->io_pwrite = qio_channel_file_pwrite;
+    ioc_klass->io_pread = qio_channel_file_pread;
+#endif
     ioc_klass->io_close = qio_channel_file_close;
     ioc_klass->io_create_watch = qio_channel_file_create_watch;
     ioc_klass->io_set_aio_fd_handler = qio_channel_file_set_aio_fd_handler;
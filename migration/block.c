@@ -82,6 +82,8 @@ typedef struct BlkMigBlock {
     BlkMigDevState *bmds;
     int64_t sector;
     int nr_sectors;
+    /* The block status says the chunk reads as zero, it was not read */
+    bool zero;
     struct iovec iov;
     QEMUIOVector qiov;
     BlockAIOCB *aiocb;
@@ -100,6 +102,12 @@ typedef struct BlkMigState {
     QSIMPLEQ_HEAD(blk_list, BlkMigBlock) blk_list;
     int submitted;
     int read_done;
+    /* Blocks whose buffer is kept for the next chunks */
+    QSIMPLEQ_HEAD(free_list, BlkMigBlock) free_list;
+    int nr_free;
+
+    /* Written during setup phase.  Can be read without a lock.  */
+    int max_inflight;
 
     /* Only used by migration thread.  Does not need a lock.  */
     int transferred;
@@ -132,7 +140,7 @@ static void blk_send(QEMUFile *f, BlkMigBlock * blk)
     uint64_t flags = BLK_MIG_FLAG_DEVICE_BLOCK;
 
     if (block_mig_state.zero_blocks &&
-        buffer_is_zero(blk->buf, BLOCK_SIZE)) {
+        (blk->zero || buffer_is_zero(blk->buf, BLOCK_SIZE))) {
         flags |= BLK_MIG_FLAG_ZERO_BLOCK;
     }
 
@@ -147,9 +155,12 @@ static void blk_send(QEMUFile *f, BlkMigBlock * blk)
 
     /* if a block is zero we need to flush here since the network
      * bandwidth is now a lot higher than the storage device bandwidth.
-     * thus if we queue zero blocks we slow down the migration */
+     * thus if we queue zero blocks we slow down the migration.
+     * Chunks known to be zero were never read, so they can be batched. */
     if (flags & BLK_MIG_FLAG_ZERO_BLOCK) {
-        qemu_fflush(f);
+        if (!blk->zero) {
+            qemu_fflush(f);
+        }
         return;
     }
 
@@ -240,6 +251,50 @@ static void alloc_aio_bitmap(BlkMigDevState *bmds)
     bmds->aio_bitmap = g_malloc0(bitmap_size);
 }
 
+/* Called with no lock taken.  */
+
+static BlkMigBlock *blk_mig_block_get(BlkMigDevState *bmds, int64_t sector,
+                                      int nr_sectors)
+{
+    BlkMigBlock *blk;
+
+    blk_mig_lock();
+    blk = QSIMPLEQ_FIRST(&block_mig_state.free_list);
+    if (blk) {
+        QSIMPLEQ_REMOVE_HEAD(&block_mig_state.free_list, entry);
+        block_mig_state.nr_free--;
+    }
+    blk_mig_unlock();
+
+    if (!blk) {
+        blk = g_new(BlkMigBlock, 1);
+        blk->buf = g_malloc(BLOCK_SIZE);
+    }
+    blk->bmds = bmds;
+    blk->sector = sector;
+    blk->nr_sectors = nr_sectors;
+    blk->zero = false;
+    blk->ret = 0;
+
+    blk->iov.iov_base = blk->buf;
+    blk->iov.iov_len = nr_sectors * BDRV_SECTOR_SIZE;
+    qemu_iovec_init_external(&blk->qiov, &blk->iov, 1);
+    return blk;
+}
+
+/* Called with migration lock held.  */
+
+static void blk_mig_block_put(BlkMigBlock *blk)
+{
+    if (block_mig_state.nr_free < block_mig_state.max_inflight) {
+        QSIMPLEQ_INSERT_HEAD(&block_mig_state.free_list, blk, entry);
+        block_mig_state.nr_free++;
+    } else {
+        g_free(blk->buf);
+        g_free(blk);
+    }
+}
+
 /* Never hold migration lock when yielding to the main loop!  */
 
 static void blk_mig_read_cb(void *opaque, int ret)
@@ -258,83 +313,105 @@ static void blk_mig_read_cb(void *opaque, int ret)
     blk_mig_unlock();
 }
 
-/* Called with no lock taken.  */
+/* Called with no lock taken.
+ *
+ * Queues up to @max_chunks chunks of the device, reading them unless the
+ * block status says they read as zero.  Returns 1 once the whole device
+ * has been queued.
+ */
 
-static int mig_save_device_bulk(QEMUFile *f, BlkMigDevState *bmds)
+static int mig_save_device_bulk(QEMUFile *f, BlkMigDevState *bmds,
+                                int max_chunks)
 {
     int64_t total_sectors = bmds->total_sectors;
     int64_t cur_sector = bmds->cur_sector;
     BlockBackend *bb = bmds->blk;
+    BlockDriverState *bs, *file;
     BlkMigBlock *blk;
-    int nr_sectors;
-    int64_t count;
-
-    if (bmds->shared_base) {
-        qemu_mutex_lock_iothread();
-        aio_context_acquire(blk_get_aio_context(bb));
-        /* Skip unallocated sectors; intentionally treats failure or
-         * partial sector as an allocated sector */
-        while (cur_sector < total_sectors &&
-               !bdrv_is_allocated(blk_bs(bb), cur_sector * BDRV_SECTOR_SIZE,
-                                  MAX_IS_ALLOCATED_SEARCH, &count)) {
-            if (count < BDRV_SECTOR_SIZE) {
-                break;
+    int nr_sectors, pnum;
+    int64_t count, status;
+    int chunks = 0;
+
+    /* We do not know if bs is under the main thread (and thus does
+     * not acquire the AioContext when doing AIO) or rather under
+     * dataplane.  Thus acquire both the iothread mutex and the
+     * AioContext.
+     *
+     * This is ugly and will disappear when we make bdrv_* thread-safe,
+     * without the need to acquire the AioContext.  Until then take them
+     * once for a batch of chunks rather than once per chunk.
+     */
+    qemu_mutex_lock_iothread();
+    aio_context_acquire(blk_get_aio_context(bb));
+    bs = blk_bs(bb);
+
+    while (chunks < max_chunks) {
+        if (bmds->shared_base) {
+            /* Skip unallocated sectors; intentionally treats failure or
+             * partial sector as an allocated sector */
+            while (cur_sector < total_sectors &&
+                   !bdrv_is_allocated(bs, cur_sector * BDRV_SECTOR_SIZE,
+                                      MAX_IS_ALLOCATED_SEARCH, &count)) {
+                if (count < BDRV_SECTOR_SIZE) {
+                    break;
+                }
+                cur_sector += count >> BDRV_SECTOR_BITS;
             }
-            cur_sector += count >> BDRV_SECTOR_BITS;
         }
-        aio_context_release(blk_get_aio_context(bb));
-        qemu_mutex_unlock_iothread();
-    }
 
-    if (cur_sector >= total_sectors) {
-        bmds->cur_sector = bmds->completed_sectors = total_sectors;
-        return 1;
-    }
+        if (cur_sector >= total_sectors) {
+            break;
+        }
 
-    bmds->completed_sectors = cur_sector;
+        bmds->completed_sectors = cur_sector;
 
-    cur_sector &= ~((int64_t)BDRV_SECTORS_PER_DIRTY_CHUNK - 1);
+        cur_sector &= ~((int64_t)BDRV_SECTORS_PER_DIRTY_CHUNK - 1);
 
-    /* we are going to transfer a full block even if it is not allocated */
-    nr_sectors = BDRV_SECTORS_PER_DIRTY_CHUNK;
+        /* we are going to transfer a full block even if it is not allocated */
+        nr_sectors = BDRV_SECTORS_PER_DIRTY_CHUNK;
 
-    if (total_sectors - cur_sector < BDRV_SECTORS_PER_DIRTY_CHUNK) {
-        nr_sectors = total_sectors - cur_sector;
-    }
+        if (total_sectors - cur_sector < BDRV_SECTORS_PER_DIRTY_CHUNK) {
+            nr_sectors = total_sectors - cur_sector;
+        }
 
-    blk = g_new(BlkMigBlock, 1);
-    blk->buf = g_malloc(BLOCK_SIZE);
-    blk->bmds = bmds;
-    blk->sector = cur_sector;
-    blk->nr_sectors = nr_sectors;
+        blk = blk_mig_block_get(bmds, cur_sector, nr_sectors);
 
-    blk->iov.iov_base = blk->buf;
-    blk->iov.iov_len = nr_sectors * BDRV_SECTOR_SIZE;
-    qemu_iovec_init_external(&blk->qiov, &blk->iov, 1);
+        status = bdrv_get_block_status_above(bs, NULL, cur_sector,
+                                             nr_sectors, &pnum, &file);
+        if (status >= 0 && (status & BDRV_BLOCK_ZERO) && pnum >= nr_sectors) {
+            /* Thin-provisioned or discarded: no need to read it */
+            blk->zero = true;
+            if (!block_mig_state.zero_blocks) {
+                memset(blk->buf, 0, BLOCK_SIZE);
+            }
+            blk_mig_lock();
+            QSIMPLEQ_INSERT_TAIL(&block_mig_state.blk_list, blk, entry);
+            block_mig_state.read_done++;
+            blk_mig_unlock();
+        } else {
+            blk_mig_lock();
+            block_mig_state.submitted++;
+            blk_mig_unlock();
 
-    blk_mig_lock();
-    block_mig_state.submitted++;
-    blk_mig_unlock();
+            blk->aiocb = blk_aio_preadv(bb, cur_sector * BDRV_SECTOR_SIZE,
+                                        &blk->qiov, 0, blk_mig_read_cb, blk);
+        }
 
-    /* We do not know if bs is under the main thread (and thus does
-     * not acquire the AioContext when doing AIO) or rather under
-     * dataplane.  Thus acquire both the iothread mutex and the
-     * AioContext.
-     *
-     * This is ugly and will disappear when we make bdrv_* thread-safe,
-     * without the need to acquire the AioContext.
-     */
-    qemu_mutex_lock_iothread();
-    aio_context_acquire(blk_get_aio_context(bmds->blk));
-    blk->aiocb = blk_aio_preadv(bb, cur_sector * BDRV_SECTOR_SIZE, &blk->qiov,
-                                0, blk_mig_read_cb, blk);
+        bdrv_reset_dirty_bitmap(bmds->dirty_bitmap, cur_sector, nr_sectors);
+        cur_sector += nr_sectors;
+        chunks++;
+    }
 
-    bdrv_reset_dirty_bitmap(bmds->dirty_bitmap, cur_sector, nr_sectors);
-    aio_context_release(blk_get_aio_context(bmds->blk));
+    aio_context_release(blk_get_aio_context(bb));
     qemu_mutex_unlock_iothread();
 
-    bmds->cur_sector = cur_sector + nr_sectors;
-    return (bmds->cur_sector >= total_sectors);
+    if (cur_sector >= total_sectors) {
+        bmds->cur_sector = bmds->completed_sectors = total_sectors;
+        return 1;
+    }
+
+    bmds->cur_sector = cur_sector;
+    return 0;
 }
 
 /* Called with iothread lock taken.  */
@@ -395,6 +472,8 @@ static int init_blk_migration(QEMUFile *f)
     block_mig_state.prev_progress = -1;
     block_mig_state.bulk_completed = 0;
     block_mig_state.zero_blocks = migrate_zero_blocks();
+    block_mig_state.max_inflight = MIN(migrate_block_inflight_reads(),
+                                       MAX_INFLIGHT_IO);
 
     for (bs = bdrv_first(&it); bs; bs = bdrv_next(&it)) {
         num_bs++;
@@ -463,7 +542,7 @@ out:
 
 /* Called with no lock taken.  */
 
-static int blk_mig_save_bulked_block(QEMUFile *f)
+static int blk_mig_save_bulked_block(QEMUFile *f, int max_chunks)
 {
     int64_t completed_sector_sum = 0;
     BlkMigDevState *bmds;
@@ -472,7 +551,7 @@ static int blk_mig_save_bulked_block(QEMUFile *f)
 
     QSIMPLEQ_FOREACH(bmds, &block_mig_state.bmds_list, entry) {
         if (bmds->bulk_completed == 0) {
-            if (mig_save_device_bulk(f, bmds) == 1) {
+            if (mig_save_device_bulk(f, bmds, max_chunks) == 1) {
                 /* completed bulk section for this device */
                 bmds->bulk_completed = 1;
             }
@@ -539,17 +618,9 @@ static int mig_save_device_dirty(QEMUFile *f, BlkMigDevState *bmds,
             bdrv_reset_dirty_bitmap_locked(bmds->dirty_bitmap, sector, nr_sectors);
             bdrv_dirty_bitmap_unlock(bmds->dirty_bitmap);
 
-            blk = g_new(BlkMigBlock, 1);
-            blk->buf = g_malloc(BLOCK_SIZE);
-            blk->bmds = bmds;
-            blk->sector = sector;
-            blk->nr_sectors = nr_sectors;
+            blk = blk_mig_block_get(bmds, sector, nr_sectors);
 
             if (is_async) {
-                blk->iov.iov_base = blk->buf;
-                blk->iov.iov_len = nr_sectors * BDRV_SECTOR_SIZE;
-                qemu_iovec_init_external(&blk->qiov, &blk->iov, 1);
-
                 blk->aiocb = blk_aio_preadv(bmds->blk,
                                             sector * BDRV_SECTOR_SIZE,
                                             &blk->qiov, 0, blk_mig_read_cb,
@@ -567,8 +638,9 @@ static int mig_save_device_dirty(QEMUFile *f, BlkMigDevState *bmds,
                 }
                 blk_send(f, blk);
 
-                g_free(blk->buf);
-                g_free(blk);
+                blk_mig_lock();
+                blk_mig_block_put(blk);
+                blk_mig_unlock();
             }
 
             sector += nr_sectors;
@@ -585,8 +657,9 @@ static int mig_save_device_dirty(QEMUFile *f, BlkMigDevState *bmds,
 
 error:
     DPRINTF("Error reading sector %" PRId64 "\n", sector);
-    g_free(blk->buf);
-    g_free(blk);
+    blk_mig_lock();
+    blk_mig_block_put(blk);
+    blk_mig_unlock();
     return ret;
 }
 
@@ -639,8 +712,7 @@ static int flush_blks(QEMUFile *f)
         blk_send(f, blk);
         blk_mig_lock();
 
-        g_free(blk->buf);
-        g_free(blk);
+        blk_mig_block_put(blk);
 
         block_mig_state.read_done--;
         block_mig_state.transferred++;
@@ -712,6 +784,12 @@ static void block_migration_cleanup(void *opaque)
         g_free(blk->buf);
         g_free(blk);
     }
+    while ((blk = QSIMPLEQ_FIRST(&block_mig_state.free_list)) != NULL) {
+        QSIMPLEQ_REMOVE_HEAD(&block_mig_state.free_list, entry);
+        g_free(blk->buf);
+        g_free(blk);
+    }
+    block_mig_state.nr_free = 0;
     blk_mig_unlock();
 }
 
@@ -761,18 +839,23 @@ static int block_save_iterate(QEMUFile *f, void *opaque)
 
     blk_mig_reset_dirty_cursor();
 
-    /* control the rate of transfer */
+    /* Keep up to max_inflight chunks read ahead, but do not read more
+     * than the rate limit lets us send in this round.
+     */
     blk_mig_lock();
-    while ((block_mig_state.submitted +
-            block_mig_state.read_done) * BLOCK_SIZE <
+    while (block_mig_state.read_done * BLOCK_SIZE <
            qemu_file_get_rate_limit(f) &&
            (block_mig_state.submitted +
             block_mig_state.read_done) <
-           MAX_INFLIGHT_IO) {
+           block_mig_state.max_inflight) {
+        int max_chunks = block_mig_state.max_inflight -
+                         block_mig_state.submitted -
+                         block_mig_state.read_done;
+
         blk_mig_unlock();
         if (block_mig_state.bulk_completed == 0) {
             /* first finish the bulk phase */
-            if (blk_mig_save_bulked_block(f) == 0) {
+            if (blk_mig_save_bulked_block(f, max_chunks) == 0) {
                 /* finished saving bulk on all devices */
                 block_mig_state.bulk_completed = 1;
             }
@@ -1021,6 +1104,7 @@ void blk_mig_init(void)
 {
     QSIMPLEQ_INIT(&block_mig_state.bmds_list);
     QSIMPLEQ_INIT(&block_mig_state.blk_list);
+    QSIMPLEQ_INIT(&block_mig_state.free_list);
     qemu_mutex_init(&block_mig_state.lock);
 
     register_savevm_live(NULL, "block", 0, 1, &savevm_block_handlers,
@@ -24,11 +24,15 @@
 #include "migration/failover.h"
 #include "replication.h"
 #include "qmp-commands.h"
+#include "ram.h"
 
 static bool vmstate_loading;
 
 #define COLO_BUFFER_BASE_SIZE (4 * 1024 * 1024)
 
+/* Interval (in ms) at which dirty RAM is sent between two checkpoints */
+#define COLO_RAM_SYNC_INTERVAL 50
+
 bool migration_in_colo_state(void)
 {
     MigrationState *s = migrate_get_current();
@@ -304,11 +308,61 @@ static uint64_t colo_receive_message_value(QEMUFile *f, uint32_t expect_msg,
     return value;
 }
 
+/* Pages of RAM sent so far, whatever their encoding */
+static uint64_t colo_ram_pages_sent(void)
+{
+    return ram_counters.normal + ram_counters.duplicate +
+           xbzrle_counters.pages;
+}
+
+/*
+ * Send the RAM the primary dirtied since the last checkpoint or sync while
+ * it keeps running, so that the next checkpoint only has to send the
+ * pages dirtied since then.
+ */
+static void colo_ram_sync(MigrationState *s, Error **errp)
+{
+    QEMUFile *f = s->to_dst_file;
+    Error *local_err = NULL;
+    uint64_t pend_non_post, pend_post;
+    int64_t start = qemu_ftell(f);
+    int ret;
+
+    /* Only sync the dirty bitmap once the previous round has been sent */
+    qemu_savevm_state_pending(f, 1, &pend_non_post, &pend_post);
+    if (!pend_non_post && !pend_post) {
+        return;
+    }
+
+    colo_send_message(f, COLO_MESSAGE_RAM_SYNC, &local_err);
+    if (local_err) {
+        error_propagate(errp, local_err);
+        return;
+    }
+    qemu_file_reset_rate_limit(f);
+    while (!qemu_file_rate_limit(f)) {
+        if (qemu_savevm_state_iterate(f, false)) {
+            break;
+        }
+    }
+    qemu_put_byte(f, QEMU_VM_EOF);
+    qemu_fflush(f);
+
+    ret = qemu_file_get_error(f);
+    if (ret < 0) {
+        error_setg_errno(errp, -ret, "Failed to send dirty RAM");
+        return;
+    }
+    s->colo_live_bytes += qemu_ftell(f) - start;
+}
+
 static int colo_do_checkpoint_transaction(MigrationState *s,
                                           QIOChannelBuffer *bioc,
                                           QEMUFile *fb)
 {
     Error *local_err = NULL;
+    int64_t pause_start, bytes_start;
+    uint64_t pages_start;
     int ret = -1;
 
     colo_send_message(s->to_dst_file, COLO_MESSAGE_CHECKPOINT_REQUEST,
@@ -326,6 +380,10 @@ static int colo_do_checkpoint_transaction(MigrationState *s,
     qio_channel_io_seek(QIO_CHANNEL(bioc), 0, 0, NULL);
     bioc->usage = 0;
 
+    pause_start = qemu_clock_get_ms(QEMU_CLOCK_REALTIME);
+    bytes_start = qemu_ftell(s->to_dst_file);
+    pages_start = colo_ram_pages_sent();
+
     qemu_mutex_lock_iothread();
     if (failover_get_state() != FAILOVER_STATUS_NONE) {
         qemu_mutex_unlock_iothread();
@@ -344,18 +402,26 @@ static int colo_do_checkpoint_transaction(MigrationState *s,
 
     /* Disable block migration */
     migrate_set_block_enabled(false, &local_err);
-    qemu_savevm_state_header(fb);
-    qemu_savevm_state_setup(fb);
-    qemu_mutex_lock_iothread();
-    qemu_savevm_state_complete_precopy(fb, false, false);
-    qemu_mutex_unlock_iothread();
-
-    qemu_fflush(fb);
 
     colo_send_message(s->to_dst_file, COLO_MESSAGE_VMSTATE_SEND, &local_err);
     if (local_err) {
         goto out;
     }
+
+    qemu_mutex_lock_iothread();
+    /*
+     * Dirty RAM goes straight to the socket, only the device state is
+     * buffered: the secondary must have all of it before loading any.
+     */
+    qemu_savevm_live_state(s->to_dst_file);
+    ret = qemu_save_device_state(fb);
+    qemu_mutex_unlock_iothread();
+    if (ret < 0) {
+        goto out;
+    }
+
+    qemu_fflush(fb);
+
     /*
      * We need the size of the VMstate data in Secondary side,
      * With which we can decide how much data should be read.
@@ -363,6 +429,7 @@ static int colo_do_checkpoint_transaction(MigrationState *s,
     colo_send_message_value(s->to_dst_file, COLO_MESSAGE_VMSTATE_SIZE,
                             bioc->usage, &local_err);
     if (local_err) {
+        ret = -1;
         goto out;
     }
 
@@ -372,6 +439,7 @@ static int colo_do_checkpoint_transaction(MigrationState *s,
     if (ret < 0) {
         goto out;
     }
+    ret = -1;
 
     colo_receive_check_message(s->rp_state.from_dst_file,
                        COLO_MESSAGE_VMSTATE_RECEIVED, &local_err);
@@ -392,6 +460,16 @@ static int colo_do_checkpoint_transaction(MigrationState *s,
     qemu_mutex_unlock_iothread();
     trace_colo_vm_state_change("stop", "run");
 
+    s->colo_checkpoints++;
+    s->colo_pause_time = qemu_clock_get_ms(QEMU_CLOCK_REALTIME) -
+                         pause_start;
+    s->colo_checkpoint_bytes = qemu_ftell(s->to_dst_file) - bytes_start;
+    s->colo_checkpoint_pages = colo_ram_pages_sent() - pages_start;
+    trace_colo_checkpoint(s->colo_pause_time, s->colo_checkpoint_bytes,
+                          s->colo_checkpoint_pages, s->colo_live_bytes);
+    s->colo_checkpoint_live_bytes = s->colo_live_bytes;
+    s->colo_live_bytes = 0;
+
 out:
     if (local_err) {
         error_report_err(local_err);
@@ -442,7 +520,15 @@ static void colo_process_checkpoint(MigrationState *s)
             goto out;
         }
 
-        qemu_sem_wait(&s->colo_checkpoint_sem);
+        /* Keep sending dirty RAM until the next checkpoint is due */
+        if (qemu_sem_timedwait(&s->colo_checkpoint_sem,
+                               COLO_RAM_SYNC_INTERVAL) < 0) {
+            colo_ram_sync(s, &local_err);
+            if (local_err) {
+                goto out;
+            }
+            continue;
+        }
 
         ret = colo_do_checkpoint_transaction(s, bioc, fb);
         if (ret < 0) {
@@ -487,9 +573,28 @@ void colo_checkpoint_notify(void *opaque)
     timer_mod(s->colo_delay_timer, next_notify_time);
 }
 
+COLOCheckpointInfo *colo_checkpoint_info(MigrationState *s)
+{
+    COLOCheckpointInfo *info;
+
+    if (!s->colo_checkpoints) {
+        return NULL;
+    }
+
+    info = g_new0(COLOCheckpointInfo, 1);
+    info->checkpoints = s->colo_checkpoints;
+    info->pause_time = s->colo_pause_time;
+    info->bytes = s->colo_checkpoint_bytes;
+    info->dirty_pages = s->colo_checkpoint_pages;
+    info->live_bytes = s->colo_checkpoint_live_bytes;
+    return info;
+}
+
 void migrate_start_colo_process(MigrationState *s)
 {
     qemu_mutex_unlock_iothread();
+    s->colo_checkpoints = 0;
+    s->colo_live_bytes = 0;
     qemu_sem_init(&s->colo_checkpoint_sem, 0);
     s->colo_delay_timer =  timer_new_ms(QEMU_CLOCK_HOST,
                                 colo_checkpoint_notify, s);
@@ -501,13 +606,26 @@ void migrate_start_colo_process(MigrationState *s)
     qemu_mutex_lock_iothread();
 }
 
-static void colo_wait_handle_message(QEMUFile *f, int *checkpoint_request,
-                                     Error **errp)
+/* Load the dirty RAM sent by colo_ram_sync() into the RAM cache */
+static void colo_load_ram_sync(MigrationIncomingState *mis, Error **errp)
+{
+    int ret;
+
+    qemu_mutex_lock_iothread();
+    ret = qemu_loadvm_state_main(mis->from_src_file, mis);
+    qemu_mutex_unlock_iothread();
+    if (ret < 0) {
+        error_setg_errno(errp, -ret, "Failed to load dirty RAM");
+    }
+}
+
+static void colo_wait_handle_message(MigrationIncomingState *mis,
+                                     int *checkpoint_request, Error **errp)
 {
     COLOMessage msg;
     Error *local_err = NULL;
 
-    msg = colo_receive_message(f, &local_err);
+    msg = colo_receive_message(mis->from_src_file, &local_err);
     if (local_err) {
         error_propagate(errp, local_err);
         return;
@@ -517,6 +635,10 @@ static void colo_wait_handle_message(QEMUFile *f, int *checkpoint_request,
     case COLO_MESSAGE_CHECKPOINT_REQUEST:
         *checkpoint_request = 1;
         break;
+    case COLO_MESSAGE_RAM_SYNC:
+        *checkpoint_request = 0;
+        colo_load_ram_sync(mis, errp);
+        break;
     default:
         *checkpoint_request = 0;
         error_setg(errp, "Got unknown COLO message: %d", msg);
@@ -532,6 +654,7 @@ void *colo_process_incoming_thread(void *opaque)
     uint64_t total_size;
     uint64_t value;
     Error *local_err = NULL;
+    bool load_setup = false;
 
     qemu_sem_init(&mis->colo_incoming_sem, 0);
 
@@ -540,6 +663,18 @@ void *colo_process_incoming_thread(void *opaque)
 
     failover_init_state();
 
+    /*
+     * Checkpoints are loaded into a RAM cache and only flushed into guest
+     * memory once complete; the load state set up by the initial
+     * migration has been released by qemu_loadvm_state().
+     */
+    if (colo_init_ram_cache() < 0 ||
+        qemu_loadvm_state_setup(mis->from_src_file) < 0) {
+        error_report("COLO incoming thread: Init RAM cache failed");
+        goto out;
+    }
+    load_setup = true;
+
     mis->to_src_file = qemu_file_get_return_path(mis->from_src_file);
     if (!mis->to_src_file) {
         error_report("COLO incoming thread: Open QEMUFile to_src_file failed");
@@ -566,11 +701,13 @@ void *colo_process_incoming_thread(void *opaque)
     while (mis->state == MIGRATION_STATUS_COLO) {
         int request = 0;
 
-        colo_wait_handle_message(mis->from_src_file, &request, &local_err);
+        colo_wait_handle_message(mis, &request, &local_err);
         if (local_err) {
             goto out;
         }
-        assert(request);
+        if (!request) {
+            continue;
+        }
         if (failover_get_state() != FAILOVER_STATUS_NONE) {
             error_report("failover request");
             goto out;
@@ -589,6 +726,15 @@ void *colo_process_incoming_thread(void *opaque)
             goto out;
         }
 
+        /* The dirty RAM of the checkpoint goes into the RAM cache */
+        qemu_mutex_lock_iothread();
+        if (qemu_loadvm_state_main(mis->from_src_file, mis) < 0) {
+            error_report("COLO: load RAM failed");
+            qemu_mutex_unlock_iothread();
+            goto out;
+        }
+        qemu_mutex_unlock_iothread();
+
         value = colo_receive_message_value(mis->from_src_file,
                                  COLO_MESSAGE_VMSTATE_SIZE, &local_err);
         if (local_err) {
@@ -622,7 +768,8 @@ void *colo_process_incoming_thread(void *opaque)
         qemu_mutex_lock_iothread();
         qemu_system_reset(SHUTDOWN_CAUSE_NONE);
         vmstate_loading = true;
-        if (qemu_loadvm_state(fb) < 0) {
+        colo_flush_ram_cache();
+        if (qemu_load_device_state(fb) < 0) {
             error_report("COLO: loadvm failed");
             qemu_mutex_unlock_iothread();
             goto out;
@@ -655,6 +802,10 @@ out:
     if (fb) {
         qemu_fclose(fb);
     }
+    if (load_setup) {
+        qemu_loadvm_state_cleanup();
+    }
+    colo_release_ram_cache();
 
     /* Hope this not to be too long to loop here */
     qemu_sem_wait(&mis->colo_incoming_sem);
@@ -0,0 +1,326 @@
+/*
+ * Compression engines for RAM migration
+ *
+ * Every engine keeps its library state in a CompressContext so that the
+ * compression threads don't reinitialise it for each page.
+ *
+ * This work is licensed under the terms of the GNU GPL, version 2 or later.
+ * See the COPYING file in the top-level directory.
+ *
+ */
+
+#include "qemu/osdep.h"
+#include <zlib.h>
+#ifdef CONFIG_ZSTD
+#include <zstd.h>
+#endif
+#ifdef CONFIG_LZ4
+#include <lz4.h>
+#endif
+#include "qapi/error.h"
+#include "compress.h"
+
+typedef struct CompressOps {
+    /* Returns the library state, or NULL on failure */
+    void *(*init)(int level, bool decompress);
+    void (*fini)(void *state, bool decompress);
+    size_t (*bound)(size_t len);
+    ssize_t (*compress)(void *state, uint8_t *dest, size_t dest_len,
+                        const uint8_t *src, size_t src_len);
+    ssize_t (*decompress)(void *state, uint8_t *dest, size_t dest_len,
+                          const uint8_t *src, size_t src_len);
+} CompressOps;
+
+struct CompressContext {
+    const CompressOps *ops;
+    void *state;
+    bool decompress;
+};
+
+/* zlib: the stream is reset for every buffer, so the output is the same
+ * as compress2() and can be read back with uncompress().
+ */
+static void *zlib_init(int level, bool decompress)
+{
+    z_stream *zs = g_new0(z_stream, 1);
+    int ret;
+
+    if (decompress) {
+        ret = inflateInit(zs);
+    } else {
+        ret = deflateInit(zs, level);
+    }
+    if (ret != Z_OK) {
+        g_free(zs);
+        return NULL;
+    }
+    return zs;
+}
+
+static void zlib_fini(void *state, bool decompress)
+{
+    z_stream *zs = state;
+
+    if (decompress) {
+        inflateEnd(zs);
+    } else {
+        deflateEnd(zs);
+    }
+    g_free(zs);
+}
+
+static size_t zlib_bound(size_t len)
+{
+    return compressBound(len);
+}
+
+static ssize_t zlib_compress(void *state, uint8_t *dest, size_t dest_len,
+                             const uint8_t *src, size_t src_len)
+{
+    z_stream *zs = state;
+
+    if (deflateReset(zs) != Z_OK) {
+        return -1;
+    }
+    zs->next_in = (Bytef *)src;
+    zs->avail_in = src_len;
+    zs->next_out = dest;
+    zs->avail_out = dest_len;
+    if (deflate(zs, Z_FINISH) != Z_STREAM_END) {
+        return -1;
+    }
+    return dest_len - zs->avail_out;
+}
+
+static ssize_t zlib_decompress(void *state, uint8_t *dest, size_t dest_len,
+                               const uint8_t *src, size_t src_len)
+{
+    z_stream *zs = state;
+
+    if (inflateReset(zs) != Z_OK) {
+        return -1;
+    }
+    zs->next_in = (Bytef *)src;
+    zs->avail_in = src_len;
+    zs->next_out = dest;
+    zs->avail_out = dest_len;
+    if (inflate(zs, Z_FINISH) != Z_STREAM_END) {
+        return -1;
+    }
+    return dest_len - zs->avail_out;
+}
+
+static const CompressOps zlib_ops = {
+    .init = zlib_init,
+    .fini = zlib_fini,
+    .bound = zlib_bound,
+    .compress = zlib_compress,
+    .decompress = zlib_decompress,
+};
+
+#ifdef CONFIG_ZSTD
+typedef struct ZstdState {
+    ZSTD_CCtx *cctx;
+    ZSTD_DCtx *dctx;
+    int level;
+} ZstdState;
+
+static void *zstd_init(int level, bool decompress)
+{
+    ZstdState *zs = g_new0(ZstdState, 1);
+
+    /* zstd treats 0 as "default level", keep 0..9 monotonic instead */
+    zs->level = MAX(level, 1);
+    if (decompress) {
+        zs->dctx = ZSTD_createDCtx();
+    } else {
+        zs->cctx = ZSTD_createCCtx();
+    }
+    if (!zs->cctx && !zs->dctx) {
+        g_free(zs);
+        return NULL;
+    }
+    return zs;
+}
+
+static void zstd_fini(void *state, bool decompress)
+{
+    ZstdState *zs = state;
+
+    if (decompress) {
+        ZSTD_freeDCtx(zs->dctx);
+    } else {
+        ZSTD_freeCCtx(zs->cctx);
+    }
+    g_free(zs);
+}
+
+static size_t zstd_bound(size_t len)
+{
+    return ZSTD_compressBound(len);
+}
+
+static ssize_t zstd_compress(void *state, uint8_t *dest, size_t dest_len,
+                             const uint8_t *src, size_t src_len)
+{
+    ZstdState *zs = state;
+    size_t ret;
+
+    ret = ZSTD_compressCCtx(zs->cctx, dest, dest_len, src, src_len,
+                            zs->level);
+    return ZSTD_isError(ret) ? -1 : ret;
+}
+
+static ssize_t zstd_decompress(void *state, uint8_t *dest, size_t dest_len,
+                               const uint8_t *src, size_t src_len)
+{
+    ZstdState *zs = state;
+    size_t ret;
+
+    ret = ZSTD_decompressDCtx(zs->dctx, dest, dest_len, src, src_len);
+    return ZSTD_isError(ret) ? -1 : ret;
+}
+
+static const CompressOps zstd_ops = {
+    .init = zstd_init,
+    .fini = zstd_fini,
+    .bound = zstd_bound,
+    .compress = zstd_compress,
+    .decompress = zstd_decompress,
+};
+#endif
+
+#ifdef CONFIG_LZ4
+typedef struct Lz4State {
+    int acceleration;
+    /* LZ4_sizeofState() bytes, too large for the thread stack */
+    void *hash_table;
+} Lz4State;
+
+static void *lz4_init(int level, bool decompress)
+{
+    Lz4State *ls = g_new0(Lz4State, 1);
+
+    /* Level 9 is the slowest and tightest, i.e. acceleration 1 */
+    ls->acceleration = 10 - MIN(MAX(level, 1), 9);
+    if (!decompress) {
+        ls->hash_table = g_malloc(LZ4_sizeofState());
+    }
+    return ls;
+}
+
+static void lz4_fini(void *state, bool decompress)
+{
+    Lz4State *ls = state;
+
+    g_free(ls->hash_table);
+    g_free(ls);
+}
+
+static size_t lz4_bound(size_t len)
+{
+    return LZ4_compressBound(len);
+}
+
+static ssize_t lz4_compress(void *state, uint8_t *dest, size_t dest_len,
+                            const uint8_t *src, size_t src_len)
+{
+    Lz4State *ls = state;
+    int ret;
+
+    ret = LZ4_compress_fast_extState(ls->hash_table, (const char *)src,
+                                     (char *)dest, src_len, dest_len,
+                                     ls->acceleration);
+    return ret > 0 ? ret : -1;
+}
+
+static ssize_t lz4_decompress(void *state, uint8_t *dest, size_t dest_len,
+                              const uint8_t *src, size_t src_len)
+{
+    int ret;
+
+    ret = LZ4_decompress_safe((const char *)src, (char *)dest,
+                              src_len, dest_len);
+    return ret >= 0 ? ret : -1;
+}
+
+static const CompressOps lz4_ops = {
+    .init = lz4_init,
+    .fini = lz4_fini,
+    .bound = lz4_bound,
+    .compress = lz4_compress,
+    .decompress = lz4_decompress,
+};
+#endif
+
+static const CompressOps *compress_ops[MIGRATION_COMPRESS_METHOD__MAX] = {
+    [MIGRATION_COMPRESS_METHOD_ZLIB] = &zlib_ops,
+#ifdef CONFIG_ZSTD
+    [MIGRATION_COMPRESS_METHOD_ZSTD] = &zstd_ops,
+#endif
+#ifdef CONFIG_LZ4
+    [MIGRATION_COMPRESS_METHOD_LZ4] = &lz4_ops,
+#endif
+};
+
+bool compress_method_supported(MigrationCompressMethod method)
+{
+    return method < MIGRATION_COMPRESS_METHOD__MAX && compress_ops[method];
+}
+
+size_t compress_bound(MigrationCompressMethod method, size_t len)
+{
+    assert(compress_method_supported(method));
+    return compress_ops[method]->bound(len);
+}
+
+CompressContext *compress_context_new(MigrationCompressMethod method,
+                                      int level, bool decompress,
+                                      Error **errp)
+{
+    CompressContext *ctx;
+    void *state;
+
+    if (!compress_method_supported(method)) {
+        error_setg(errp, "Compression method '%s' is not supported "
+                   "by this QEMU binary",
+                   MigrationCompressMethod_lookup[method]);
+        return NULL;
+    }
+    state = compress_ops[method]->init(level, decompress);
+    if (!state) {
+        error_setg(errp, "Failed to initialize %s %scompression",
+                   MigrationCompressMethod_lookup[method],
+                   decompress ? "de" : "");
+        return NULL;
+    }
+    ctx = g_new0(CompressContext, 1);
+    ctx->ops = compress_ops[method];
+    ctx->state = state;
+    ctx->decompress = decompress;
+    return ctx;
+}
+
+void compress_context_free(CompressContext *ctx)
+{
+    if (!ctx) {
+        return;
+    }
+    ctx->ops->fini(ctx->state, ctx->decompress);
+    g_free(ctx);
+}
+
+ssize_t compress_buffer(CompressContext *ctx, uint8_t *dest, size_t dest_len,
+                        const uint8_t *src, size_t src_len)
+{
+    assert(!ctx->decompress);
+    return ctx->ops->compress(ctx->state, dest, dest_len, src, src_len);
+}
+
+ssize_t decompress_buffer(CompressContext *ctx, uint8_t *dest,
+                          size_t dest_len, const uint8_t *src,
+                          size_t src_len)
+{
+    assert(ctx->decompress);
+    return ctx->ops->decompress(ctx->state, dest, dest_len, src, src_len);
+}
@@ -0,0 +1,50 @@
+/*
+ * Compression engines for RAM migration
+ *
+ * This work is licensed under the terms of the GNU GPL, version 2 or later.
+ * See the COPYING file in the top-level directory.
+ *
+ */
+
+#ifndef QEMU_MIGRATION_COMPRESS_H
+#define QEMU_MIGRATION_COMPRESS_H
+
+#include "qapi-types.h"
+
+typedef struct CompressContext CompressContext;
+
+/* Whether @method was compiled into this binary */
+bool compress_method_supported(MigrationCompressMethod method);
+
+/*
+ * Worst case size of the output of compressing @len bytes with @method;
+ * compressed data received from the peer is never larger than this.
+ */
+size_t compress_bound(MigrationCompressMethod method, size_t len);
+
+/*
+ * Allocate the per-thread state of @method.  @level is the
+ * compress-level parameter (0 to 9) and is ignored when @decompress
+ * is true.  A context must only be used by one thread at a time.
+ */
+CompressContext *compress_context_new(MigrationCompressMethod method,
+                                      int level, bool decompress,
+                                      Error **errp);
+void compress_context_free(CompressContext *ctx);
+
+/*
+ * Compress @src_len bytes of @src into @dest, which must hold at least
+ * compress_bound() bytes.  Returns the compressed length or -1.
+ */
+ssize_t compress_buffer(CompressContext *ctx, uint8_t *dest, size_t dest_len,
+                        const uint8_t *src, size_t src_len);
+
+/*
+ * Decompress @src_len bytes of @src into @dest.  Returns the length of
+ * the decompressed data or -1 if @src is corrupt or does not fit.
+ */
+ssize_t decompress_buffer(CompressContext *ctx, uint8_t *dest,
+                          size_t dest_len, const uint8_t *src,
+                          size_t src_len);
+
+#endif
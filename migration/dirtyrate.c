@@ -0,0 +1,389 @@
+/*
+ * Dirty page rate measurement
+ *
+ * Tells how fast the guest dirties its memory without migrating it, so
+ * that management can tell beforehand whether a migration would
+ * converge.
+ *
+ * This work is licensed under the terms of the GNU GPL, version 2 or later.
+ * See the COPYING file in the top-level directory.
+ *
+ */
+
+#include "qemu/osdep.h"
+#include <zlib.h>
+#include "cpu.h"
+#include "qapi/error.h"
+#include "qapi/qmp/qerror.h"
+#include "qapi/clone-visitor.h"
+#include "qapi-visit.h"
+#include "qmp-commands.h"
+#include "qemu/main-loop.h"
+#include "qemu/rcu_queue.h"
+#include "qemu/timer.h"
+#include "exec/ram_addr.h"
+#include "sysemu/numa.h"
+#include "migration/blocker.h"
+#include "trace.h"
+
+#define DIRTY_RATE_MAX_CALC_TIME 60
+#define DIRTY_RATE_DEFAULT_SAMPLE_PAGES 512
+#define DIRTY_RATE_MIN_SAMPLE_PAGES 16
+#define DIRTY_RATE_MAX_SAMPLE_PAGES 16384
+
+typedef struct DirtyRateBlock {
+    char *idstr;
+    uint64_t pages;
+    /* Pages dirtied during the window, extrapolated when sampling */
+    uint64_t dirty;
+    /* page-sampling mode: offsets and CRCs of the sampled pages */
+    unsigned int nr_samples;
+    ram_addr_t *sample_offset;
+    uint32_t *sample_crc;
+} DirtyRateBlock;
+
+typedef struct DirtyRateMeasurement {
+    DirtyRateMeasureMode mode;
+    int64_t calc_time;          /* requested window, ms */
+    int64_t sample_pages;       /* per GiB */
+    int64_t start_time;         /* ms since the epoch */
+    int64_t elapsed;            /* actual window, ms */
+    GArray *blocks;             /* of DirtyRateBlock */
+    double node_dirty[MAX_NODES];
+} DirtyRateMeasurement;
+
+/* All protected by the iothread lock */
+static DirtyRateInfo *dirty_rate_info;
+static bool dirty_rate_measuring;
+static Error *dirty_rate_blocker;
+
+static void dirty_rate_measurement_free(DirtyRateMeasurement *m)
+{
+    unsigned int i;
+
+    for (i = 0; i < m->blocks->len; i++) {
+        DirtyRateBlock *drb = &g_array_index(m->blocks, DirtyRateBlock, i);
+
+        g_free(drb->idstr);
+        g_free(drb->sample_offset);
+        g_free(drb->sample_crc);
+    }
+    g_array_free(m->blocks, true);
+    g_free(m);
+}
+
+static DirtyRateBlock *dirty_rate_add_block(DirtyRateMeasurement *m,
+                                            RAMBlock *block)
+{
+    DirtyRateBlock drb = {
+        .idstr = g_strdup(qemu_ram_get_idstr(block)),
+        .pages = qemu_ram_get_used_length(block) >> TARGET_PAGE_BITS,
+    };
+
+    g_array_append_val(m->blocks, drb);
+    return &g_array_index(m->blocks, DirtyRateBlock, m->blocks->len - 1);
+}
+
+/* dirty-log mode: count and clear the dirty bits of @block, per node */
+static void dirty_rate_count_block(DirtyRateMeasurement *m, RAMBlock *block)
+{
+    DirtyRateBlock *drb = dirty_rate_add_block(m, block);
+    ram_addr_t used = qemu_ram_get_used_length(block);
+    ram_addr_t offset = 0, len;
+    uint64_t dirty;
+    int node;
+
+    while (offset < used) {
+        node = numa_ram_block_node(block, offset, &len);
+        dirty = cpu_physical_memory_count_and_clear_dirty(
+                    block->offset + offset, len, DIRTY_MEMORY_MIGRATION);
+        drb->dirty += dirty;
+        if (node >= 0) {
+            m->node_dirty[node] += dirty;
+        }
+        offset += len;
+    }
+}
+
+static void dirty_rate_measure_log(DirtyRateMeasurement *m)
+{
+    RAMBlock *block;
+
+    qemu_mutex_lock_iothread();
+    memory_global_dirty_log_start();
+    memory_global_dirty_log_sync();
+    /* Drop whatever was dirtied before the window */
+    rcu_read_lock();
+    RAMBLOCK_FOREACH(block) {
+        cpu_physical_memory_count_and_clear_dirty(block->offset,
+                                                  block->used_length,
+                                                  DIRTY_MEMORY_MIGRATION);
+    }
+    rcu_read_unlock();
+    m->start_time = qemu_clock_get_ms(QEMU_CLOCK_REALTIME);
+    qemu_mutex_unlock_iothread();
+
+    g_usleep(m->calc_time * 1000);
+
+    qemu_mutex_lock_iothread();
+    memory_global_dirty_log_sync();
+    m->elapsed = qemu_clock_get_ms(QEMU_CLOCK_REALTIME) - m->start_time;
+    rcu_read_lock();
+    RAMBLOCK_FOREACH(block) {
+        dirty_rate_count_block(m, block);
+    }
+    rcu_read_unlock();
+    memory_global_dirty_log_stop();
+    qemu_mutex_unlock_iothread();
+}
+
+static bool dirty_rate_can_sample(RAMBlock *block)
+{
+    /* Reading device memory could have side effects */
+    return !memory_region_is_ram_device(block->mr) &&
+           block->used_length >= TARGET_PAGE_SIZE;
+}
+
+static uint32_t dirty_rate_page_crc(RAMBlock *block, ram_addr_t offset)
+{
+    return crc32(0, (uint8_t *)block->host + offset, TARGET_PAGE_SIZE);
+}
+
+static void dirty_rate_sample_blocks(DirtyRateMeasurement *m)
+{
+    RAMBlock *block;
+    unsigned int i;
+
+    rcu_read_lock();
+    RAMBLOCK_FOREACH(block) {
+        DirtyRateBlock *drb;
+
+        if (!dirty_rate_can_sample(block)) {
+            continue;
+        }
+        drb = dirty_rate_add_block(m, block);
+        drb->nr_samples = MIN(drb->pages,
+                              MAX(1, m->sample_pages *
+                                     block->used_length >> 30));
+        drb->sample_offset = g_new(ram_addr_t, drb->nr_samples);
+        drb->sample_crc = g_new(uint32_t, drb->nr_samples);
+        for (i = 0; i < drb->nr_samples; i++) {
+            uint64_t page = (((uint64_t)g_random_int() << 32) |
+                             g_random_int()) % drb->pages;
+
+            drb->sample_offset[i] = page << TARGET_PAGE_BITS;
+            drb->sample_crc[i] = dirty_rate_page_crc(block,
+                                                     drb->sample_offset[i]);
+        }
+    }
+    rcu_read_unlock();
+}
+
+/* page-sampling mode: extrapolate from the samples whose CRC changed */
+static void dirty_rate_compare_samples(DirtyRateMeasurement *m)
+{
+    RAMBlock *block;
+    unsigned int b, i;
+    ram_addr_t len;
+    int node;
+
+    rcu_read_lock();
+    for (b = 0; b < m->blocks->len; b++) {
+        DirtyRateBlock *drb = &g_array_index(m->blocks, DirtyRateBlock, b);
+        double scale = (double)drb->pages / drb->nr_samples;
+        uint64_t changed = 0;
+
+        block = qemu_ram_block_by_name(drb->idstr);
+        if (!block || qemu_ram_get_used_length(block) >> TARGET_PAGE_BITS !=
+                      drb->pages) {
+            /* Unplugged or resized during the window */
+            continue;
+        }
+        for (i = 0; i < drb->nr_samples; i++) {
+            if (dirty_rate_page_crc(block, drb->sample_offset[i]) ==
+                drb->sample_crc[i]) {
+                continue;
+            }
+            changed++;
+            node = numa_ram_block_node(block, drb->sample_offset[i], &len);
+            if (node >= 0) {
+                m->node_dirty[node] += scale;
+            }
+        }
+        drb->dirty = changed * scale;
+    }
+    rcu_read_unlock();
+}
+
+static void dirty_rate_measure_sampling(DirtyRateMeasurement *m)
+{
+    m->start_time = qemu_clock_get_ms(QEMU_CLOCK_REALTIME);
+    dirty_rate_sample_blocks(m);
+
+    g_usleep(m->calc_time * 1000);
+
+    m->elapsed = qemu_clock_get_ms(QEMU_CLOCK_REALTIME) - m->start_time;
+    dirty_rate_compare_samples(m);
+}
+
+static int64_t dirty_rate_per_second(DirtyRateMeasurement *m, double dirty)
+{
+    return dirty * 1000 / MAX(m->elapsed, 1);
+}
+
+static DirtyRateInfo *dirty_rate_info_new(DirtyRateMeasurement *m,
+                                          DirtyRateStatus status)
+{
+    DirtyRateInfo *info = g_new0(DirtyRateInfo, 1);
+
+    info->status = status;
+    info->has_mode = true;
+    info->mode = m->mode;
+    info->has_start_time = true;
+    info->start_time = m->start_time;
+    info->has_calc_time = true;
+    info->calc_time = status == DIRTY_RATE_STATUS_MEASURED ? m->elapsed
+                                                           : m->calc_time;
+    info->page_size = TARGET_PAGE_SIZE;
+    return info;
+}
+
+static void dirty_rate_info_fill(DirtyRateInfo *info, DirtyRateMeasurement *m)
+{
+    DirtyRateBlockInfoList **btail = &info->blocks;
+    DirtyRateNodeInfoList **ntail = &info->nodes;
+    uint64_t total = 0;
+    unsigned int i;
+
+    info->has_blocks = true;
+    for (i = 0; i < m->blocks->len; i++) {
+        DirtyRateBlock *drb = &g_array_index(m->blocks, DirtyRateBlock, i);
+        DirtyRateBlockInfoList *entry = g_new0(DirtyRateBlockInfoList, 1);
+
+        entry->value = g_new0(DirtyRateBlockInfo, 1);
+        entry->value->id = g_strdup(drb->idstr);
+        entry->value->pages = drb->pages;
+        entry->value->dirty_rate = dirty_rate_per_second(m, drb->dirty);
+        total += drb->dirty;
+        *btail = entry;
+        btail = &entry->next;
+    }
+    info->has_dirty_rate = true;
+    info->dirty_rate = dirty_rate_per_second(m, total);
+
+    if (!nb_numa_nodes) {
+        return;
+    }
+    info->has_nodes = true;
+    for (i = 0; i < nb_numa_nodes; i++) {
+        DirtyRateNodeInfoList *entry = g_new0(DirtyRateNodeInfoList, 1);
+
+        entry->value = g_new0(DirtyRateNodeInfo, 1);
+        entry->value->node = i;
+        entry->value->dirty_rate = dirty_rate_per_second(m, m->node_dirty[i]);
+        *ntail = entry;
+        ntail = &entry->next;
+    }
+}
+
+static void *dirty_rate_thread(void *opaque)
+{
+    DirtyRateMeasurement *m = opaque;
+    DirtyRateInfo *info;
+
+    rcu_register_thread();
+    trace_dirty_rate_measure_start(DirtyRateMeasureMode_lookup[m->mode],
+                                   m->calc_time);
+
+    if (m->mode == DIRTY_RATE_MEASURE_MODE_DIRTY_LOG) {
+        dirty_rate_measure_log(m);
+    } else {
+        dirty_rate_measure_sampling(m);
+    }
+
+    info = dirty_rate_info_new(m, DIRTY_RATE_STATUS_MEASURED);
+    dirty_rate_info_fill(info, m);
+    trace_dirty_rate_measure_done(info->dirty_rate, m->elapsed);
+
+    qemu_mutex_lock_iothread();
+    qapi_free_DirtyRateInfo(dirty_rate_info);
+    dirty_rate_info = info;
+    dirty_rate_measuring = false;
+    if (dirty_rate_blocker) {
+        migrate_del_blocker(dirty_rate_blocker);
+        error_free(dirty_rate_blocker);
+        dirty_rate_blocker = NULL;
+    }
+    qemu_mutex_unlock_iothread();
+
+    dirty_rate_measurement_free(m);
+    rcu_unregister_thread();
+    return NULL;
+}
+
+void qmp_calc_dirty_rate(int64_t calc_time, bool has_mode,
+                         DirtyRateMeasureMode mode, bool has_sample_pages,
+                         int64_t sample_pages, Error **errp)
+{
+    DirtyRateMeasurement *m;
+    QemuThread thread;
+
+    if (calc_time < 1 || calc_time > DIRTY_RATE_MAX_CALC_TIME) {
+        error_setg(errp, QERR_INVALID_PARAMETER_VALUE, "calc-time",
+                   "a value between 1 and 60");
+        return;
+    }
+    if (!has_mode) {
+        mode = DIRTY_RATE_MEASURE_MODE_DIRTY_LOG;
+    }
+    if (!has_sample_pages) {
+        sample_pages = DIRTY_RATE_DEFAULT_SAMPLE_PAGES;
+    } else if (sample_pages < DIRTY_RATE_MIN_SAMPLE_PAGES ||
+               sample_pages > DIRTY_RATE_MAX_SAMPLE_PAGES) {
+        error_setg(errp, QERR_INVALID_PARAMETER_VALUE, "sample-pages",
+                   "a value between 16 and 16384");
+        return;
+    }
+    if (dirty_rate_measuring) {
+        error_setg(errp, "A dirty rate measurement is already in progress");
+        return;
+    }
+
+    if (mode == DIRTY_RATE_MEASURE_MODE_DIRTY_LOG) {
+        /* Migration owns the dirty log while it runs */
+        error_setg(&dirty_rate_blocker,
+                   "A dirty rate measurement is in progress");
+        if (migrate_add_blocker(dirty_rate_blocker, errp) < 0) {
+            error_free(dirty_rate_blocker);
+            dirty_rate_blocker = NULL;
+            return;
+        }
+    }
+
+    m = g_new0(DirtyRateMeasurement, 1);
+    m->mode = mode;
+    m->calc_time = calc_time * 1000;
+    m->sample_pages = sample_pages;
+    m->start_time = qemu_clock_get_ms(QEMU_CLOCK_REALTIME);
+    m->blocks = g_array_new(false, true, sizeof(DirtyRateBlock));
+
+    qapi_free_DirtyRateInfo(dirty_rate_info);
+    dirty_rate_info = dirty_rate_info_new(m, DIRTY_RATE_STATUS_MEASURING);
+    dirty_rate_measuring = true;
+
+    qemu_thread_create(&thread, "dirtyrate", dirty_rate_thread, m,
+                       QEMU_THREAD_DETACHED);
+}
+
+DirtyRateInfo *qmp_query_dirty_rate(Error **errp)
+{
+    DirtyRateInfo *info;
+
+    if (!dirty_rate_info) {
+        info = g_new0(DirtyRateInfo, 1);
+        info->status = DIRTY_RATE_STATUS_UNSTARTED;
+        info->page_size = TARGET_PAGE_SIZE;
+        return info;
+    }
+    return QAPI_CLONE(DirtyRateInfo, dirty_rate_info);
+}
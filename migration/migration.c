@@ -19,6 +19,7 @@
 #include "migration/blocker.h"
 #include "exec.h"
 #include "fd.h"
+#include "file.h"
 #include "socket.h"
 #include "rdma.h"
 #include "ram.h"
@@ -35,12 +36,14 @@
 #include "qemu/rcu.h"
 #include "block.h"
 #include "postcopy-ram.h"
+#include "compress.h"
 #include "qemu/thread.h"
 #include "qmp-commands.h"
 #include "trace.h"
 #include "qapi-event.h"
 #include "exec/target_page.h"
 #include "io/channel-buffer.h"
+#include "crypto/hash.h"
 #include "migration/colo.h"
 #include "hw/boards.h"
 #include "monitor/monitor.h"
@@ -79,6 +82,10 @@
  */
 #define DEFAULT_MIGRATE_X_CHECKPOINT_DELAY 200
 
+/* Default number of multifd channels and pages sent in one batch */
+#define DEFAULT_MIGRATE_MULTIFD_CHANNELS 2
+#define DEFAULT_MIGRATE_MULTIFD_PAGE_COUNT 16
+
 static NotifierList migration_state_notifiers =
     NOTIFIER_LIST_INITIALIZER(migration_state_notifiers);
 
@@ -145,6 +152,7 @@ MigrationIncomingState *migration_incoming_get_current(void)
         mis_current.state = MIGRATION_STATUS_NONE;
         memset(&mis_current, 0, sizeof(MigrationIncomingState));
         qemu_mutex_init(&mis_current.rp_mutex);
+        qemu_mutex_init(&mis_current.postcopy_fault_lock);
         qemu_event_init(&mis_current.main_thread_load_event, false);
         once = true;
     }
@@ -163,7 +171,10 @@ void migration_incoming_state_destroy(void)
     }
 
     if (mis->from_src_file) {
-        qemu_fclose(mis->from_src_file);
+        /* A lazy restore may still be reading RAM pages from the file */
+        if (!ram_lazy_restore_release_file(mis->from_src_file)) {
+            qemu_fclose(mis->from_src_file);
+        }
         mis->from_src_file = NULL;
     }
 
@@ -255,6 +266,8 @@ void qemu_start_incoming_migration(const char *uri, Error **errp)
         unix_start_incoming_migration(p, errp);
     } else if (strstart(uri, "fd:", &p)) {
         fd_start_incoming_migration(p, errp);
+    } else if (strstart(uri, "file:", &p)) {
+        file_start_incoming_migration(p, errp);
     } else {
         error_setg(errp, "unknown migration protocol: %s", uri);
     }
@@ -318,6 +331,7 @@ static void process_incoming_migration_co(void *opaque)
     migrate_set_state(&mis->state, MIGRATION_STATUS_NONE,
                       MIGRATION_STATUS_ACTIVE);
     ret = qemu_loadvm_state(f);
+    multifd_load_cleanup();
 
     ps = postcopy_state_get();
     trace_process_incoming_migration_co_end(ret, ps);
@@ -339,6 +353,7 @@ static void process_incoming_migration_co(void *opaque)
         }
         /* Else if something went wrong then just fall out of the normal exit */
     }
+    qemu_savevm_dump_section_stats();
 
     /* we get COLO info, and know if we are in COLO mode */
     if (!ret && migration_incoming_enable_colo()) {
@@ -371,6 +386,42 @@ void migration_fd_process_incoming(QEMUFile *f)
     qemu_coroutine_enter(co);
 }
 
+void migration_ioc_process_incoming(QIOChannel *ioc)
+{
+    MigrationIncomingState *mis = migration_incoming_get_current();
+
+    if (!mis->from_src_file) {
+        QEMUFile *f = qemu_fopen_channel_input(ioc);
+
+        mis->from_src_file = f;
+        multifd_load_setup();
+    } else {
+        /* Any further connection is one of the multifd channels */
+        multifd_recv_new_channel(ioc);
+    }
+
+    /*
+     * Loading only starts once all the channels are there, the main
+     * stream may wait for the multifd channels from the main loop.
+     */
+    if (migration_has_all_channels()) {
+        migration_fd_process_incoming(mis->from_src_file);
+    }
+}
+
+/**
+ * migration_has_all_channels: We have received all channels that we need
+ *
+ * Returns true when we have got connections to all the channels that
+ * we need for migration.
+ */
+bool migration_has_all_channels(void)
+{
+    MigrationIncomingState *mis = migration_incoming_get_current();
+
+    return mis->from_src_file && multifd_recv_all_channels_created();
+}
+
 /*
  * Send a 'SHUT' message on the return channel with the given value
  * to indicate that we've finished with the RP.  Non-0 value indicates
@@ -457,6 +508,28 @@ MigrationParameters *qmp_query_migrate_parameters(Error **errp)
     params->x_checkpoint_delay = s->parameters.x_checkpoint_delay;
     params->has_block_incremental = true;
     params->block_incremental = s->parameters.block_incremental;
+    params->has_x_multifd_channels = true;
+    params->x_multifd_channels = s->parameters.x_multifd_channels;
+    params->has_x_multifd_page_count = true;
+    params->x_multifd_page_count = s->parameters.x_multifd_page_count;
+    params->has_compress_method = true;
+    params->compress_method = s->parameters.compress_method;
+    params->has_x_postcopy_prefetch_pages = true;
+    params->x_postcopy_prefetch_pages = s->parameters.x_postcopy_prefetch_pages;
+    params->has_x_dirty_sync_threads = true;
+    params->x_dirty_sync_threads = s->parameters.x_dirty_sync_threads;
+    params->has_x_ram_load_threads = true;
+    params->x_ram_load_threads = s->parameters.x_ram_load_threads;
+    params->has_x_rdma_queue_pairs = true;
+    params->x_rdma_queue_pairs = s->parameters.x_rdma_queue_pairs;
+    params->has_x_rdma_reg_cache_size = true;
+    params->x_rdma_reg_cache_size = s->parameters.x_rdma_reg_cache_size;
+    params->has_x_section_stats_file = true;
+    params->x_section_stats_file = g_strdup(s->parameters.x_section_stats_file);
+    params->has_x_block_inflight_reads = true;
+    params->x_block_inflight_reads = s->parameters.x_block_inflight_reads;
+    params->has_cpu_throttle_policy = true;
+    params->cpu_throttle_policy = s->parameters.cpu_throttle_policy;
 
     return params;
 }
@@ -495,6 +568,16 @@ static void populate_ram_info(MigrationInfo *info, MigrationState *s)
     info->ram->dirty_sync_count = ram_counters.dirty_sync_count;
     info->ram->postcopy_requests = ram_counters.postcopy_requests;
     info->ram->page_size = qemu_target_page_size();
+    info->ram->multifd_bytes = ram_counters.multifd_bytes;
+    info->ram->dirty_sync_time = ram_counters.dirty_sync_time;
+    info->ram->dirty_sync_time_max = ram_counters.dirty_sync_time_max;
+    info->ram->avoided_resend_bytes = ram_counters.avoided_resend_bytes;
+    info->ram->dedup_pages = ram_counters.dedup_pages;
+
+    if (s->state == MIGRATION_STATUS_ACTIVE) {
+        info->convergence = ram_convergence_info();
+        info->has_convergence = info->convergence != NULL;
+    }
 
     if (migrate_use_xbzrle()) {
         info->has_xbzrle_cache = true;
@@ -505,6 +588,8 @@ static void populate_ram_info(MigrationInfo *info, MigrationState *s)
         info->xbzrle_cache->cache_miss = xbzrle_counters.cache_miss;
         info->xbzrle_cache->cache_miss_rate = xbzrle_counters.cache_miss_rate;
         info->xbzrle_cache->overflow = xbzrle_counters.overflow;
+        info->xbzrle_cache->has_ways = true;
+        info->xbzrle_cache->ways = xbzrle_cache_way_stats();
     }
 
     if (cpu_throttle_active()) {
@@ -529,6 +614,21 @@ static void populate_disk_info(MigrationInfo *info)
     }
 }
 
+static void fill_destination_migration_info(MigrationInfo *info)
+{
+    MigrationIncomingState *mis = migration_incoming_get_current();
+
+    if (mis->state == MIGRATION_STATUS_NONE) {
+        return;
+    }
+    info->has_incoming = true;
+    info->incoming = g_malloc0(sizeof(*info->incoming));
+    info->incoming->status = mis->state;
+    info->incoming->postcopy_faults = postcopy_fault_info(mis);
+    info->incoming->has_postcopy_faults =
+        info->incoming->postcopy_faults != NULL;
+}
+
 MigrationInfo *qmp_query_migrate(Error **errp)
 {
     MigrationInfo *info = g_malloc0(sizeof(*info));
@@ -560,7 +660,8 @@ MigrationInfo *qmp_query_migrate(Error **errp)
         break;
     case MIGRATION_STATUS_COLO:
         info->has_status = true;
-        /* TODO: display COLO specific information (checkpoint info etc.) */
+        info->colo_checkpoint = colo_checkpoint_info(s);
+        info->has_colo_checkpoint = info->colo_checkpoint != NULL;
         break;
     case MIGRATION_STATUS_COMPLETED:
         info->has_status = true;
@@ -586,9 +687,19 @@ MigrationInfo *qmp_query_migrate(Error **errp)
     }
     info->status = s->state;
 
+    if (s->state == MIGRATION_STATUS_NONE) {
+        /* Not a source, report the incoming migration if there is one */
+        fill_destination_migration_info(info);
+    }
+
     return info;
 }
 
+static bool migrate_tls_creds_set(MigrationParameters *params)
+{
+    return params->tls_creds && *params->tls_creds;
+}
+
 /**
  * @migration_caps_check - check capability validity
  *
@@ -603,9 +714,10 @@ static bool migrate_caps_check(bool *cap_list,
                                Error **errp)
 {
     MigrationCapabilityStatusList *cap;
-    bool old_postcopy_cap;
+    bool old_postcopy_cap, old_lazy_restore_cap;
 
     old_postcopy_cap = cap_list[MIGRATION_CAPABILITY_POSTCOPY_RAM];
+    old_lazy_restore_cap = cap_list[MIGRATION_CAPABILITY_X_LAZY_RESTORE];
 
     for (cap = params; cap; cap = cap->next) {
         cap_list[cap->value->capability] = cap->value->state;
@@ -644,6 +756,136 @@ static bool migrate_caps_check(bool *cap_list,
             error_setg(errp, "Postcopy is not supported");
             return false;
         }
+
+        if (cap_list[MIGRATION_CAPABILITY_X_MULTIFD]) {
+            /* The multifd receive threads write pages straight into guest
+             * memory, which is not safe once userfaultfd is registered.
+             */
+            error_setg(errp, "Postcopy is not currently compatible "
+                       "with multifd");
+            return false;
+        }
+    }
+
+    if (cap_list[MIGRATION_CAPABILITY_X_MULTIFD]) {
+        if (cap_list[MIGRATION_CAPABILITY_COMPRESS]) {
+            error_setg(errp, "Multifd is not currently compatible "
+                       "with compression");
+            return false;
+        }
+        if (cap_list[MIGRATION_CAPABILITY_X_COLO]) {
+            error_setg(errp, "Multifd is not currently compatible "
+                       "with COLO");
+            return false;
+        }
+        if (cap_list[MIGRATION_CAPABILITY_XBZRLE]) {
+            /* Multifd pages go out whole, XBZRLE would never be used */
+            error_setg(errp, "Multifd is not currently compatible "
+                       "with xbzrle");
+            return false;
+        }
+        if (migrate_tls_creds_set(&migrate_get_current()->parameters)) {
+            error_setg(errp, "Multifd is not currently compatible "
+                       "with TLS");
+            return false;
+        }
+    }
+
+    if (cap_list[MIGRATION_CAPABILITY_ZERO_COPY_SEND]) {
+#ifndef CONFIG_MSG_ZEROCOPY
+        error_setg(errp, "Zero copy send is not supported on this host");
+        return false;
+#endif
+        if (cap_list[MIGRATION_CAPABILITY_COMPRESS]) {
+            error_setg(errp, "Zero copy send is not compatible "
+                       "with compression");
+            return false;
+        }
+    }
+
+    if (cap_list[MIGRATION_CAPABILITY_X_IGNORE_SHARED]) {
+        /* Both of them need every page of guest RAM to go through the
+         * migration stream: postcopy to resolve faults, COLO to keep the
+         * secondary's checkpoint cache.
+         */
+        if (cap_list[MIGRATION_CAPABILITY_POSTCOPY_RAM]) {
+            error_setg(errp, "Ignoring shared memory is not compatible "
+                       "with postcopy");
+            return false;
+        }
+        if (cap_list[MIGRATION_CAPABILITY_X_COLO]) {
+            error_setg(errp, "Ignoring shared memory is not compatible "
+                       "with COLO");
+            return false;
+        }
+    }
+
+    if (cap_list[MIGRATION_CAPABILITY_X_MAPPED_RAM]) {
+        /* Pages are only ever written whole, at their place in the file */
+        static const MigrationCapability incompatible[] = {
+            MIGRATION_CAPABILITY_XBZRLE,
+            MIGRATION_CAPABILITY_COMPRESS,
+            MIGRATION_CAPABILITY_POSTCOPY_RAM,
+            MIGRATION_CAPABILITY_X_COLO,
+            MIGRATION_CAPABILITY_X_MULTIFD,
+            MIGRATION_CAPABILITY_ZERO_COPY_SEND,
+        };
+        int i;
+
+        for (i = 0; i < ARRAY_SIZE(incompatible); i++) {
+            if (cap_list[incompatible[i]]) {
+                error_setg(errp, "Mapped RAM is not compatible with %s",
+                           MigrationCapability_lookup[incompatible[i]]);
+                return false;
+            }
+        }
+    }
+
+    if (cap_list[MIGRATION_CAPABILITY_X_DEDUP_PAGES]) {
+        /*
+         * The source must know what each destination page holds, so
+         * every page has to go through the plain page path.
+         */
+        static const MigrationCapability incompatible[] = {
+            MIGRATION_CAPABILITY_XBZRLE,
+            MIGRATION_CAPABILITY_COMPRESS,
+            MIGRATION_CAPABILITY_POSTCOPY_RAM,
+            MIGRATION_CAPABILITY_X_COLO,
+            MIGRATION_CAPABILITY_X_MULTIFD,
+            MIGRATION_CAPABILITY_X_MAPPED_RAM,
+        };
+        int i;
+
+        for (i = 0; i < ARRAY_SIZE(incompatible); i++) {
+            if (cap_list[incompatible[i]]) {
+                error_setg(errp, "Page deduplication is not compatible "
+                           "with %s",
+                           MigrationCapability_lookup[incompatible[i]]);
+                return false;
+            }
+        }
+        if (!qcrypto_hash_supports(QCRYPTO_HASH_ALG_SHA256)) {
+            error_setg(errp, "Page deduplication needs SHA-256 support");
+            return false;
+        }
+    }
+
+    if (cap_list[MIGRATION_CAPABILITY_X_LAZY_RESTORE]) {
+        if (!cap_list[MIGRATION_CAPABILITY_X_MAPPED_RAM]) {
+            error_setg(errp, "Lazy restore needs mapped RAM");
+            return false;
+        }
+        /* RAM is emptied before the pages are read from the file */
+        if (cap_list[MIGRATION_CAPABILITY_X_IGNORE_SHARED]) {
+            error_setg(errp, "Lazy restore is not compatible "
+                       "with ignoring shared memory");
+            return false;
+        }
+        if (!old_lazy_restore_cap && runstate_check(RUN_STATE_INMIGRATE) &&
+            !postcopy_ram_supported_by_host()) {
+            error_setg(errp, "Lazy restore is not supported");
+            return false;
+        }
     }
 
     return true;
@@ -675,6 +917,11 @@ void qmp_migrate_set_capabilities(MigrationCapabilityStatusList *params,
  */
 static bool migrate_params_check(MigrationParameters *params, Error **errp)
 {
+    if (migrate_tls_creds_set(params) && migrate_use_multifd()) {
+        error_setg(errp, "Multifd is not currently compatible with TLS");
+        return false;
+    }
+
     if (params->has_compress_level &&
         (params->compress_level < 0 || params->compress_level > 9)) {
         error_setg(errp, QERR_INVALID_PARAMETER_VALUE, "compress_level",
@@ -739,6 +986,76 @@ static bool migrate_params_check(MigrationParameters *params, Error **errp)
         return false;
     }
 
+    if (params->has_x_multifd_channels &&
+        (params->x_multifd_channels < 1 ||
+         params->x_multifd_channels > MULTIFD_MAX_CHANNELS)) {
+        error_setg(errp, QERR_INVALID_PARAMETER_VALUE,
+                   "multifd_channels",
+                   "is invalid, it should be in the range of 1 to 255");
+        return false;
+    }
+
+    if (params->has_x_multifd_page_count &&
+        (params->x_multifd_page_count < 1 ||
+         params->x_multifd_page_count > 10000)) {
+        error_setg(errp, QERR_INVALID_PARAMETER_VALUE,
+                   "multifd_page_count",
+                   "is invalid, it should be in the range of 1 to 10000");
+        return false;
+    }
+
+    if (params->has_compress_method &&
+        !compress_method_supported(params->compress_method)) {
+        error_setg(errp, QERR_INVALID_PARAMETER_VALUE, "compress_method",
+                   "a compression library built into this QEMU binary");
+        return false;
+    }
+
+    if (params->has_x_postcopy_prefetch_pages &&
+        (params->x_postcopy_prefetch_pages < 0 ||
+         params->x_postcopy_prefetch_pages > 256)) {
+        error_setg(errp, QERR_INVALID_PARAMETER_VALUE,
+                   "x_postcopy_prefetch_pages",
+                   "is invalid, it should be in the range of 0 to 256");
+        return false;
+    }
+
+    if (params->has_x_dirty_sync_threads &&
+        (params->x_dirty_sync_threads < 0 ||
+         params->x_dirty_sync_threads > 64)) {
+        error_setg(errp, QERR_INVALID_PARAMETER_VALUE,
+                   "x_dirty_sync_threads",
+                   "is invalid, it should be in the range of 0 to 64");
+        return false;
+    }
+
+    if (params->has_x_ram_load_threads &&
+        (params->x_ram_load_threads < 0 ||
+         params->x_ram_load_threads > 64)) {
+        error_setg(errp, QERR_INVALID_PARAMETER_VALUE,
+                   "x_ram_load_threads",
+                   "is invalid, it should be in the range of 0 to 64");
+        return false;
+    }
+
+    if (params->has_x_rdma_queue_pairs &&
+        (params->x_rdma_queue_pairs < 1 ||
+         params->x_rdma_queue_pairs > 16)) {
+        error_setg(errp, QERR_INVALID_PARAMETER_VALUE,
+                   "x_rdma_queue_pairs",
+                   "is invalid, it should be in the range of 1 to 16");
+        return false;
+    }
+
+    if (params->has_x_block_inflight_reads &&
+        (params->x_block_inflight_reads < 1 ||
+         params->x_block_inflight_reads > 512)) {
+        error_setg(errp, QERR_INVALID_PARAMETER_VALUE,
+                   "x_block_inflight_reads",
+                   "is invalid, it should be in the range of 1 to 512");
+        return false;
+    }
+
     return true;
 }
 
@@ -794,6 +1111,41 @@ static void migrate_params_test_apply(MigrateSetParameters *params,
     if (params->has_block_incremental) {
         dest->block_incremental = params->block_incremental;
     }
+    if (params->has_x_multifd_channels) {
+        dest->x_multifd_channels = params->x_multifd_channels;
+    }
+    if (params->has_x_multifd_page_count) {
+        dest->x_multifd_page_count = params->x_multifd_page_count;
+    }
+    if (params->has_compress_method) {
+        dest->compress_method = params->compress_method;
+    }
+    if (params->has_x_postcopy_prefetch_pages) {
+        dest->x_postcopy_prefetch_pages = params->x_postcopy_prefetch_pages;
+    }
+    if (params->has_x_dirty_sync_threads) {
+        dest->x_dirty_sync_threads = params->x_dirty_sync_threads;
+    }
+    if (params->has_x_ram_load_threads) {
+        dest->x_ram_load_threads = params->x_ram_load_threads;
+    }
+    if (params->has_x_rdma_queue_pairs) {
+        dest->x_rdma_queue_pairs = params->x_rdma_queue_pairs;
+    }
+    if (params->has_x_rdma_reg_cache_size) {
+        dest->x_rdma_reg_cache_size = params->x_rdma_reg_cache_size;
+    }
+    if (params->has_x_section_stats_file) {
+        assert(params->x_section_stats_file->type == QTYPE_QSTRING);
+        dest->x_section_stats_file =
+            g_strdup(params->x_section_stats_file->u.s);
+    }
+    if (params->has_x_block_inflight_reads) {
+        dest->x_block_inflight_reads = params->x_block_inflight_reads;
+    }
+    if (params->has_cpu_throttle_policy) {
+        dest->cpu_throttle_policy = params->cpu_throttle_policy;
+    }
 }
 
 static void migrate_params_apply(MigrateSetParameters *params)
@@ -856,6 +1208,43 @@ static void migrate_params_apply(MigrateSetParameters *params)
     if (params->has_block_incremental) {
         s->parameters.block_incremental = params->block_incremental;
     }
+    if (params->has_x_multifd_channels) {
+        s->parameters.x_multifd_channels = params->x_multifd_channels;
+    }
+    if (params->has_x_multifd_page_count) {
+        s->parameters.x_multifd_page_count = params->x_multifd_page_count;
+    }
+    if (params->has_compress_method) {
+        s->parameters.compress_method = params->compress_method;
+    }
+    if (params->has_x_postcopy_prefetch_pages) {
+        s->parameters.x_postcopy_prefetch_pages =
+            params->x_postcopy_prefetch_pages;
+    }
+    if (params->has_x_dirty_sync_threads) {
+        s->parameters.x_dirty_sync_threads = params->x_dirty_sync_threads;
+    }
+    if (params->has_x_ram_load_threads) {
+        s->parameters.x_ram_load_threads = params->x_ram_load_threads;
+    }
+    if (params->has_x_rdma_queue_pairs) {
+        s->parameters.x_rdma_queue_pairs = params->x_rdma_queue_pairs;
+    }
+    if (params->has_x_rdma_reg_cache_size) {
+        s->parameters.x_rdma_reg_cache_size = params->x_rdma_reg_cache_size;
+    }
+    if (params->has_x_section_stats_file) {
+        g_free(s->parameters.x_section_stats_file);
+        assert(params->x_section_stats_file->type == QTYPE_QSTRING);
+        s->parameters.x_section_stats_file =
+            g_strdup(params->x_section_stats_file->u.s);
+    }
+    if (params->has_x_block_inflight_reads) {
+        s->parameters.x_block_inflight_reads = params->x_block_inflight_reads;
+    }
+    if (params->has_cpu_throttle_policy) {
+        s->parameters.cpu_throttle_policy = params->cpu_throttle_policy;
+    }
 }
 
 void qmp_migrate_set_parameters(MigrateSetParameters *params, Error **errp)
@@ -876,6 +1265,12 @@ void qmp_migrate_set_parameters(MigrateSetParameters *params, Error **errp)
         params->tls_hostname->type = QTYPE_QSTRING;
         params->tls_hostname->u.s = strdup("");
     }
+    if (params->has_x_section_stats_file
+        && params->x_section_stats_file->type == QTYPE_QNULL) {
+        QDECREF(params->x_section_stats_file->u.n);
+        params->x_section_stats_file->type = QTYPE_QSTRING;
+        params->x_section_stats_file->u.s = strdup("");
+    }
 
     migrate_params_test_apply(params, &tmp);
 
@@ -976,9 +1371,13 @@ static void migrate_fd_cleanup(void *opaque)
         }
         qemu_mutex_lock_iothread();
 
+        qemu_savevm_dump_section_stats();
+
+        multifd_save_cleanup();
         qemu_fclose(s->to_dst_file);
         s->to_dst_file = NULL;
     }
+    socket_send_channel_cleanup();
 
     assert((s->state != MIGRATION_STATUS_ACTIVE) &&
            (s->state != MIGRATION_STATUS_POSTCOPY_ACTIVE));
@@ -1003,6 +1402,7 @@ void migrate_fd_error(MigrationState *s, const Error *error)
     }
     notifier_list_notify(&migration_state_notifiers, s);
     block_cleanup_parameters(s);
+    socket_send_channel_cleanup();
 }
 
 static void migrate_fd_cancel(MigrationState *s)
@@ -1259,6 +1659,8 @@ void qmp_migrate(const char *uri, bool has_blk, bool blk,
         unix_start_outgoing_migration(s, p, &local_err);
     } else if (strstart(uri, "fd:", &p)) {
         fd_start_outgoing_migration(s, p, &local_err);
+    } else if (strstart(uri, "file:", &p)) {
+        file_start_outgoing_migration(s, p, &local_err);
     } else {
         error_setg(errp, QERR_INVALID_PARAMETER_VALUE, "uri",
                    "a valid migration protocol");
@@ -1352,6 +1754,69 @@ bool migrate_release_ram(void)
     return s->enabled_capabilities[MIGRATION_CAPABILITY_RELEASE_RAM];
 }
 
+bool migrate_postcopy_blocktime(void)
+{
+    MigrationState *s;
+
+    s = migrate_get_current();
+
+    return s->enabled_capabilities[MIGRATION_CAPABILITY_POSTCOPY_BLOCKTIME];
+}
+
+bool migrate_use_zero_copy_send(void)
+{
+    MigrationState *s;
+
+    s = migrate_get_current();
+
+    return s->enabled_capabilities[MIGRATION_CAPABILITY_ZERO_COPY_SEND];
+}
+
+bool migrate_ignore_shared(void)
+{
+    MigrationState *s;
+
+    s = migrate_get_current();
+
+    return s->enabled_capabilities[MIGRATION_CAPABILITY_X_IGNORE_SHARED];
+}
+
+bool migrate_mapped_ram(void)
+{
+    MigrationState *s;
+
+    s = migrate_get_current();
+
+    return s->enabled_capabilities[MIGRATION_CAPABILITY_X_MAPPED_RAM];
+}
+
+bool migrate_lazy_restore(void)
+{
+    MigrationState *s;
+
+    s = migrate_get_current();
+
+    return s->enabled_capabilities[MIGRATION_CAPABILITY_X_LAZY_RESTORE];
+}
+
+bool migrate_defer_hot_pages(void)
+{
+    MigrationState *s;
+
+    s = migrate_get_current();
+
+    return s->enabled_capabilities[MIGRATION_CAPABILITY_X_DEFER_HOT_PAGES];
+}
+
+bool migrate_dedup_pages(void)
+{
+    MigrationState *s;
+
+    s = migrate_get_current();
+
+    return s->enabled_capabilities[MIGRATION_CAPABILITY_X_DEDUP_PAGES];
+}
+
 bool migrate_postcopy_ram(void)
 {
     MigrationState *s;
@@ -1361,6 +1826,69 @@ bool migrate_postcopy_ram(void)
     return s->enabled_capabilities[MIGRATION_CAPABILITY_POSTCOPY_RAM];
 }
 
+int migrate_postcopy_prefetch_pages(void)
+{
+    MigrationState *s;
+
+    s = migrate_get_current();
+
+    return s->parameters.x_postcopy_prefetch_pages;
+}
+
+int migrate_dirty_sync_threads(void)
+{
+    MigrationState *s;
+
+    s = migrate_get_current();
+
+    return s->parameters.x_dirty_sync_threads;
+}
+
+int migrate_ram_load_threads(void)
+{
+    MigrationState *s;
+
+    s = migrate_get_current();
+
+    return s->parameters.x_ram_load_threads;
+}
+
+int migrate_rdma_queue_pairs(void)
+{
+    MigrationState *s;
+
+    s = migrate_get_current();
+
+    return s->parameters.x_rdma_queue_pairs;
+}
+
+uint64_t migrate_rdma_reg_cache_size(void)
+{
+    MigrationState *s;
+
+    s = migrate_get_current();
+
+    return s->parameters.x_rdma_reg_cache_size;
+}
+
+int migrate_block_inflight_reads(void)
+{
+    MigrationState *s;
+
+    s = migrate_get_current();
+
+    return s->parameters.x_block_inflight_reads;
+}
+
+MigrationThrottlePolicy migrate_cpu_throttle_policy(void)
+{
+    MigrationState *s;
+
+    s = migrate_get_current();
+
+    return s->parameters.cpu_throttle_policy;
+}
+
 bool migrate_auto_converge(void)
 {
     MigrationState *s;
@@ -1397,6 +1925,15 @@ int migrate_compress_level(void)
     return s->parameters.compress_level;
 }
 
+MigrationCompressMethod migrate_compress_method(void)
+{
+    MigrationState *s;
+
+    s = migrate_get_current();
+
+    return s->parameters.compress_method;
+}
+
 int migrate_compress_threads(void)
 {
     MigrationState *s;
@@ -1469,6 +2006,33 @@ bool migrate_use_block_incremental(void)
     return s->parameters.block_incremental;
 }
 
+bool migrate_use_multifd(void)
+{
+    MigrationState *s;
+
+    s = migrate_get_current();
+
+    return s->enabled_capabilities[MIGRATION_CAPABILITY_X_MULTIFD];
+}
+
+int migrate_multifd_channels(void)
+{
+    MigrationState *s;
+
+    s = migrate_get_current();
+
+    return s->parameters.x_multifd_channels;
+}
+
+int migrate_multifd_page_count(void)
+{
+    MigrationState *s;
+
+    s = migrate_get_current();
+
+    return s->parameters.x_multifd_page_count;
+}
+
 /* migration thread support */
 /*
  * Something bad happened to the RP stream, mark an error
@@ -1957,6 +2521,11 @@ static void *migration_thread(void *opaque)
 
     rcu_register_thread();
 
+    if (multifd_send_wait_connected() < 0) {
+        error_report("failed to connect the multifd channels");
+        qemu_file_set_error(s->to_dst_file, -EIO);
+    }
+
     qemu_savevm_state_header(s->to_dst_file);
 
     /*
@@ -2120,6 +2689,15 @@ void migrate_fd_connect(MigrationState *s)
     qemu_file_set_rate_limit(s->to_dst_file,
                              s->parameters.max_bandwidth / XFER_LIMIT_RATIO);
 
+    if (migrate_use_zero_copy_send() &&
+        qemu_file_set_zero_copy(s->to_dst_file, true) < 0) {
+        error_report("Zero copy send is only available for tcp: migration");
+        migrate_set_state(&s->state, MIGRATION_STATUS_SETUP,
+                          MIGRATION_STATUS_FAILED);
+        migrate_fd_cleanup(s);
+        return;
+    }
+
     /* Notify before starting migration thread */
     notifier_list_notify(&migration_state_notifiers, s);
 
@@ -2138,6 +2716,13 @@ void migrate_fd_connect(MigrationState *s)
         }
     }
 
+    if (multifd_save_setup() != 0) {
+        migrate_set_state(&s->state, MIGRATION_STATUS_SETUP,
+                          MIGRATION_STATUS_FAILED);
+        migrate_fd_cleanup(s);
+        return;
+    }
+
     qemu_thread_create(&s->thread, "live_migration", migration_thread, s,
                        QEMU_THREAD_JOINABLE);
     s->migration_thread_running = true;
@@ -2189,6 +2774,24 @@ static Property migration_properties[] = {
     DEFINE_PROP_INT64("x-checkpoint-delay", MigrationState,
                       parameters.x_checkpoint_delay,
                       DEFAULT_MIGRATE_X_CHECKPOINT_DELAY),
+    DEFINE_PROP_INT64("x-multifd-channels", MigrationState,
+                      parameters.x_multifd_channels,
+                      DEFAULT_MIGRATE_MULTIFD_CHANNELS),
+    DEFINE_PROP_INT64("x-multifd-page-count", MigrationState,
+                      parameters.x_multifd_page_count,
+                      DEFAULT_MIGRATE_MULTIFD_PAGE_COUNT),
+    DEFINE_PROP_INT64("x-postcopy-prefetch-pages", MigrationState,
+                      parameters.x_postcopy_prefetch_pages, 0),
+    DEFINE_PROP_INT64("x-dirty-sync-threads", MigrationState,
+                      parameters.x_dirty_sync_threads, 0),
+    DEFINE_PROP_INT64("x-ram-load-threads", MigrationState,
+                      parameters.x_ram_load_threads, 0),
+    DEFINE_PROP_INT64("x-rdma-queue-pairs", MigrationState,
+                      parameters.x_rdma_queue_pairs, 1),
+    DEFINE_PROP_SIZE("x-rdma-reg-cache-size", MigrationState,
+                     parameters.x_rdma_reg_cache_size, 0),
+    DEFINE_PROP_INT64("x-block-inflight-reads", MigrationState,
+                      parameters.x_block_inflight_reads, 16),
 
     /* Migration capabilities */
     DEFINE_PROP_MIG_CAP("x-xbzrle", MIGRATION_CAPABILITY_XBZRLE),
@@ -2202,6 +2805,19 @@ static Property migration_properties[] = {
     DEFINE_PROP_MIG_CAP("x-release-ram", MIGRATION_CAPABILITY_RELEASE_RAM),
     DEFINE_PROP_MIG_CAP("x-block", MIGRATION_CAPABILITY_BLOCK),
     DEFINE_PROP_MIG_CAP("x-return-path", MIGRATION_CAPABILITY_RETURN_PATH),
+    DEFINE_PROP_MIG_CAP("x-multifd", MIGRATION_CAPABILITY_X_MULTIFD),
+    DEFINE_PROP_MIG_CAP("x-postcopy-blocktime",
+                        MIGRATION_CAPABILITY_POSTCOPY_BLOCKTIME),
+    DEFINE_PROP_MIG_CAP("x-zero-copy-send",
+                        MIGRATION_CAPABILITY_ZERO_COPY_SEND),
+    DEFINE_PROP_MIG_CAP("x-ignore-shared",
+                        MIGRATION_CAPABILITY_X_IGNORE_SHARED),
+    DEFINE_PROP_MIG_CAP("x-mapped-ram", MIGRATION_CAPABILITY_X_MAPPED_RAM),
+    DEFINE_PROP_MIG_CAP("x-lazy-restore",
+                        MIGRATION_CAPABILITY_X_LAZY_RESTORE),
+    DEFINE_PROP_MIG_CAP("x-defer-hot-pages",
+                        MIGRATION_CAPABILITY_X_DEFER_HOT_PAGES),
+    DEFINE_PROP_MIG_CAP("x-dedup-pages", MIGRATION_CAPABILITY_X_DEDUP_PAGES),
 
     DEFINE_PROP_END_OF_LIST(),
 };
@@ -2221,6 +2837,7 @@ static void migration_instance_finalize(Object *obj)
 
     g_free(params->tls_hostname);
     g_free(params->tls_creds);
+    g_free(params->x_section_stats_file);
 }
 
 static void migration_instance_init(Object *obj)
@@ -2234,6 +2851,7 @@ static void migration_instance_init(Object *obj)
 
     params->tls_hostname = g_strdup("");
     params->tls_creds = g_strdup("");
+    params->x_section_stats_file = g_strdup("");
 
     /* Set has_* up only for parameter checks */
     params->has_compress_level = true;
@@ -2245,6 +2863,18 @@ static void migration_instance_init(Object *obj)
     params->has_downtime_limit = true;
     params->has_x_checkpoint_delay = true;
     params->has_block_incremental = true;
+    params->has_x_multifd_channels = true;
+    params->has_x_multifd_page_count = true;
+    params->has_compress_method = true;
+    params->compress_method = MIGRATION_COMPRESS_METHOD_ZLIB;
+    params->has_x_postcopy_prefetch_pages = true;
+    params->has_x_dirty_sync_threads = true;
+    params->has_cpu_throttle_policy = true;
+    params->cpu_throttle_policy = MIGRATION_THROTTLE_POLICY_LEGACY;
+    params->has_x_ram_load_threads = true;
+    params->has_x_rdma_queue_pairs = true;
+    params->has_x_rdma_reg_cache_size = true;
+    params->has_x_block_inflight_reads = true;
 }
 
 /*
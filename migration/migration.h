@@ -20,6 +20,9 @@
 #include "exec/cpu-common.h"
 #include "qemu/coroutine_int.h"
 #include "hw/qdev.h"
+#include "io/channel.h"
+
+typedef struct PostcopyFaultStats PostcopyFaultStats;
 
 /* State for the incoming migration */
 struct MigrationIncomingState {
@@ -33,6 +36,8 @@ struct MigrationIncomingState {
 
     size_t         largest_page_size;
     bool           have_fault_thread;
+    /* The fault thread loads pages from the file, see ram_lazy_restore */
+    bool           lazy_restore;
     QemuThread     fault_thread;
     QemuSemaphore  fault_thread_sem;
 
@@ -58,6 +63,10 @@ struct MigrationIncomingState {
     /* The coroutine we should enter (back) after failover */
     Coroutine *migration_incoming_co;
     QemuSemaphore colo_incoming_sem;
+
+    /* Postcopy page fault statistics, see postcopy-ram.c */
+    QemuMutex postcopy_fault_lock;
+    PostcopyFaultStats *postcopy_fault_stats;
 };
 
 MigrationIncomingState *migration_incoming_get_current(void);
@@ -127,6 +136,13 @@ struct MigrationState
     QemuSemaphore colo_checkpoint_sem;
     int64_t colo_checkpoint_time;
     QEMUTimer *colo_delay_timer;
+    /* Statistics of the COLO checkpoints, see COLOCheckpointInfo */
+    uint64_t colo_checkpoints;
+    int64_t colo_pause_time;
+    uint64_t colo_checkpoint_bytes;
+    uint64_t colo_checkpoint_pages;
+    uint64_t colo_checkpoint_live_bytes;
+    uint64_t colo_live_bytes;
 
     /* The last error that occurred */
     Error *error;
@@ -152,6 +168,8 @@ struct MigrationState
 void migrate_set_state(int *state, int old_state, int new_state);
 
 void migration_fd_process_incoming(QEMUFile *f);
+void migration_ioc_process_incoming(QIOChannel *ioc);
+bool migration_has_all_channels(void);
 
 uint64_t migrate_max_downtime(void);
 
@@ -166,7 +184,21 @@ bool migration_in_postcopy(void);
 MigrationState *migrate_get_current(void);
 
 bool migrate_release_ram(void);
+bool migrate_postcopy_blocktime(void);
+bool migrate_use_zero_copy_send(void);
+bool migrate_ignore_shared(void);
+bool migrate_mapped_ram(void);
+bool migrate_lazy_restore(void);
+bool migrate_defer_hot_pages(void);
+bool migrate_dedup_pages(void);
 bool migrate_postcopy_ram(void);
+int migrate_postcopy_prefetch_pages(void);
+int migrate_dirty_sync_threads(void);
+int migrate_ram_load_threads(void);
+int migrate_rdma_queue_pairs(void);
+uint64_t migrate_rdma_reg_cache_size(void);
+int migrate_block_inflight_reads(void);
+MigrationThrottlePolicy migrate_cpu_throttle_policy(void);
 bool migrate_zero_blocks(void);
 
 bool migrate_auto_converge(void);
@@ -179,8 +211,16 @@ bool migrate_use_block(void);
 bool migrate_use_block_incremental(void);
 bool migrate_use_return_path(void);
 
+/* Upper limit of the x-multifd-channels parameter */
+#define MULTIFD_MAX_CHANNELS 255
+
+bool migrate_use_multifd(void);
+int migrate_multifd_channels(void);
+int migrate_multifd_page_count(void);
+
 bool migrate_use_compression(void);
 int migrate_compress_level(void);
+MigrationCompressMethod migrate_compress_method(void);
 int migrate_compress_threads(void);
 int migrate_decompress_threads(void);
 bool migrate_use_events(void);
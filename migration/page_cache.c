@@ -1,6 +1,6 @@
 /*
  * Page cache for QEMU
- * The cache is base on a hash of the page address
+ * The cache is an N-way set-associative table indexed by the page address
  *
  * Copyright 2012 Red Hat, Inc. and/or its affiliates
  *
@@ -34,15 +34,22 @@ typedef struct CacheItem CacheItem;
 struct CacheItem {
     uint64_t it_addr;
     uint64_t it_age;
+    /* number of hits, halved whenever another page of the set is evicted */
+    uint32_t it_hits;
     uint8_t *it_data;
 };
 
 struct PageCache {
     CacheItem *page_cache;
+    /* page data of all the items, one allocation for the whole cache */
+    uint8_t *arena;
     unsigned int page_size;
+    unsigned int num_ways;
+    int64_t num_sets;
     int64_t max_num_items;
     uint64_t max_item_age;
     int64_t num_items;
+    PageCacheWayStats stats[PAGE_CACHE_WAYS];
 };
 
 PageCache *cache_init(int64_t num_pages, unsigned int page_size)
@@ -57,7 +64,7 @@ PageCache *cache_init(int64_t num_pages, unsigned int page_size)
     }
 
     /* We prefer not to abort if there is no memory */
-    cache = g_try_malloc(sizeof(*cache));
+    cache = g_try_malloc0(sizeof(*cache));
     if (!cache) {
         DPRINTF("Failed to allocate cache\n");
         return NULL;
@@ -71,8 +78,11 @@ PageCache *cache_init(int64_t num_pages, unsigned int page_size)
     cache->num_items = 0;
     cache->max_item_age = 0;
     cache->max_num_items = num_pages;
+    cache->num_ways = MIN(num_pages, PAGE_CACHE_WAYS);
+    cache->num_sets = num_pages / cache->num_ways;
 
-    DPRINTF("Setting cache buckets to %" PRId64 "\n", cache->max_num_items);
+    DPRINTF("Setting cache buckets to %" PRId64 " (%" PRId64 " sets of %u)\n",
+            cache->max_num_items, cache->num_sets, cache->num_ways);
 
     /* We prefer not to abort if there is no memory */
     cache->page_cache = g_try_malloc((cache->max_num_items) *
@@ -83,9 +93,22 @@ PageCache *cache_init(int64_t num_pages, unsigned int page_size)
         return NULL;
     }
 
+    /*
+     * The arena is only touched as pages get inserted, so a large cache
+     * doesn't become resident before it is used.
+     */
+    cache->arena = g_try_malloc(cache->max_num_items * page_size);
+    if (!cache->arena) {
+        DPRINTF("Failed to allocate cache->arena\n");
+        g_free(cache->page_cache);
+        g_free(cache);
+        return NULL;
+    }
+
     for (i = 0; i < cache->max_num_items; i++) {
-        cache->page_cache[i].it_data = NULL;
+        cache->page_cache[i].it_data = cache->arena + i * page_size;
         cache->page_cache[i].it_age = 0;
+        cache->page_cache[i].it_hits = 0;
         cache->page_cache[i].it_addr = -1;
     }
 
@@ -94,97 +117,152 @@ PageCache *cache_init(int64_t num_pages, unsigned int page_size)
 
 void cache_fini(PageCache *cache)
 {
-    int64_t i;
-
     g_assert(cache);
     g_assert(cache->page_cache);
 
-    for (i = 0; i < cache->max_num_items; i++) {
-        g_free(cache->page_cache[i].it_data);
-    }
-
+    g_free(cache->arena);
     g_free(cache->page_cache);
     cache->page_cache = NULL;
     g_free(cache);
 }
 
-static size_t cache_get_cache_pos(const PageCache *cache,
-                                  uint64_t address)
+static CacheItem *cache_get_set(const PageCache *cache, uint64_t address)
 {
-    g_assert(cache->max_num_items);
-    return (address / cache->page_size) & (cache->max_num_items - 1);
-}
-
-static CacheItem *cache_get_by_addr(const PageCache *cache, uint64_t addr)
-{
-    size_t pos;
+    size_t set;
 
     g_assert(cache);
     g_assert(cache->page_cache);
+    g_assert(cache->num_sets);
+
+    set = (address / cache->page_size) & (cache->num_sets - 1);
+    return &cache->page_cache[set * cache->num_ways];
+}
 
-    pos = cache_get_cache_pos(cache, addr);
+static CacheItem *cache_get_by_addr(const PageCache *cache, uint64_t addr,
+                                    unsigned int *way)
+{
+    CacheItem *set = cache_get_set(cache, addr);
+    unsigned int i;
 
-    return &cache->page_cache[pos];
+    for (i = 0; i < cache->num_ways; i++) {
+        if (set[i].it_addr == addr) {
+            if (way) {
+                *way = i;
+            }
+            return &set[i];
+        }
+    }
+    return NULL;
 }
 
 uint8_t *get_cached_data(const PageCache *cache, uint64_t addr)
 {
-    return cache_get_by_addr(cache, addr)->it_data;
+    CacheItem *it = cache_get_by_addr(cache, addr, NULL);
+
+    return it ? it->it_data : NULL;
 }
 
-bool cache_is_cached(const PageCache *cache, uint64_t addr,
-                     uint64_t current_age)
+bool cache_is_cached(PageCache *cache, uint64_t addr, uint64_t current_age)
 {
     CacheItem *it;
+    unsigned int way;
 
-    it = cache_get_by_addr(cache, addr);
+    it = cache_get_by_addr(cache, addr, &way);
 
-    if (it->it_addr == addr) {
+    if (it) {
         /* update the it_age when the cache hit */
         it->it_age = current_age;
+        if (it->it_hits < UINT32_MAX) {
+            it->it_hits++;
+        }
+        cache->stats[way].hits++;
         return true;
     }
     return false;
 }
 
-int cache_insert(PageCache *cache, uint64_t addr, const uint8_t *pdata,
-                 uint64_t current_age)
+/*
+ * Pick the way of @set that @addr goes to: an empty way if there is one,
+ * otherwise the least frequently hit page among those that have not been
+ * used for CACHED_PAGE_LIFETIME generations, the older one on a tie.
+ *
+ * Returns -1 when every way holds a fresh page.
+ */
+static int cache_pick_victim(const PageCache *cache, CacheItem *set,
+                             uint64_t current_age)
 {
+    int victim = -1;
+    unsigned int i;
 
-    CacheItem *it;
-
-    /* actual update of entry */
-    it = cache_get_by_addr(cache, addr);
+    for (i = 0; i < cache->num_ways; i++) {
+        CacheItem *it = &set[i];
 
-    if (it->it_data && it->it_addr != addr &&
-        it->it_age + CACHED_PAGE_LIFETIME > current_age) {
-        /* the cache page is fresh, don't replace it */
-        return -1;
+        if (it->it_addr == -1) {
+            return i;
+        }
+        if (it->it_age + CACHED_PAGE_LIFETIME > current_age) {
+            continue;
+        }
+        if (victim < 0 || it->it_hits < set[victim].it_hits ||
+            (it->it_hits == set[victim].it_hits &&
+             it->it_age < set[victim].it_age)) {
+            victim = i;
+        }
     }
-    /* allocate page */
-    if (!it->it_data) {
-        it->it_data = g_try_malloc(cache->page_size);
-        if (!it->it_data) {
-            DPRINTF("Error allocating page\n");
+    return victim;
+}
+
+static int cache_insert_item(PageCache *cache, uint64_t addr,
+                             const uint8_t *pdata, uint64_t current_age,
+                             uint64_t age, uint32_t hits)
+{
+    CacheItem *set, *it;
+    unsigned int i;
+    int way;
+
+    /* actual update of entry */
+    it = cache_get_by_addr(cache, addr, NULL);
+    if (!it) {
+        set = cache_get_set(cache, addr);
+        way = cache_pick_victim(cache, set, current_age);
+        if (way < 0) {
+            /* all the cached pages are fresh, don't replace them */
             return -1;
         }
-        cache->num_items++;
+        it = &set[way];
+        if (it->it_addr == -1) {
+            cache->num_items++;
+        } else {
+            cache->stats[way].evictions++;
+            /* age the frequency of the pages that stay */
+            for (i = 0; i < cache->num_ways; i++) {
+                set[i].it_hits >>= 1;
+            }
+        }
+        cache->stats[way].misses++;
+        it->it_hits = hits;
     }
 
     memcpy(it->it_data, pdata, cache->page_size);
 
-    it->it_age = current_age;
+    it->it_age = age;
     it->it_addr = addr;
 
     return 0;
 }
 
+int cache_insert(PageCache *cache, uint64_t addr, const uint8_t *pdata,
+                 uint64_t current_age)
+{
+    return cache_insert_item(cache, addr, pdata, current_age, current_age, 0);
+}
+
 int64_t cache_resize(PageCache *cache, int64_t new_num_pages)
 {
     PageCache *new_cache;
     int64_t i;
 
-    CacheItem *old_it, *new_it;
+    CacheItem *old_it;
 
     g_assert(cache);
 
@@ -204,29 +282,31 @@ int64_t cache_resize(PageCache *cache, int64_t new_num_pages)
         return -1;
     }
 
-    /* move all data from old cache */
+    /*
+     * Move all data from old cache; on collisions the replacement policy
+     * decides which pages are kept, with none of them counting as fresh.
+     */
     for (i = 0; i < cache->max_num_items; i++) {
         old_it = &cache->page_cache[i];
         if (old_it->it_addr != -1) {
-            /* check for collision, if there is, keep MRU page */
-            new_it = cache_get_by_addr(new_cache, old_it->it_addr);
-            if (new_it->it_data && new_it->it_age >= old_it->it_age) {
-                /* keep the MRU page */
-                g_free(old_it->it_data);
-            } else {
-                if (!new_it->it_data) {
-                    new_cache->num_items++;
-                }
-                g_free(new_it->it_data);
-                new_it->it_data = old_it->it_data;
-                new_it->it_age = old_it->it_age;
-                new_it->it_addr = old_it->it_addr;
-            }
+            cache->max_item_age = MAX(cache->max_item_age, old_it->it_age);
+        }
+    }
+    for (i = 0; i < cache->max_num_items; i++) {
+        old_it = &cache->page_cache[i];
+        if (old_it->it_addr != -1) {
+            cache_insert_item(new_cache, old_it->it_addr, old_it->it_data,
+                              cache->max_item_age + CACHED_PAGE_LIFETIME,
+                              old_it->it_age, old_it->it_hits);
         }
     }
 
+    g_free(cache->arena);
     g_free(cache->page_cache);
+    cache->arena = new_cache->arena;
     cache->page_cache = new_cache->page_cache;
+    cache->num_ways = new_cache->num_ways;
+    cache->num_sets = new_cache->num_sets;
     cache->max_num_items = new_cache->max_num_items;
     cache->num_items = new_cache->num_items;
 
@@ -234,3 +314,14 @@ int64_t cache_resize(PageCache *cache, int64_t new_num_pages)
 
     return cache->max_num_items;
 }
+
+void cache_get_way_stats(const PageCache *cache, PageCacheWayStats *stats)
+{
+    unsigned int i;
+
+    for (i = 0; i < PAGE_CACHE_WAYS; i++) {
+        stats[i].hits += cache->stats[i].hits;
+        stats[i].misses += cache->stats[i].misses;
+        stats[i].evictions += cache->stats[i].evictions;
+    }
+}
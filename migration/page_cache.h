@@ -1,6 +1,6 @@
 /*
  * Page cache for QEMU
- * The cache is base on a hash of the page address
+ * The cache is an N-way set-associative table indexed by the page address
  *
  * Copyright 2012 Red Hat, Inc. and/or its affiliates
  *
@@ -18,6 +18,19 @@
 /* Page cache for storing guest pages */
 typedef struct PageCache PageCache;
 
+/* Number of ways in each set of the cache */
+#define PAGE_CACHE_WAYS 4
+
+/* Per-way cache statistics */
+typedef struct PageCacheWayStats {
+    /* lookups that found the page in this way */
+    uint64_t hits;
+    /* pages that missed the cache and were then stored in this way */
+    uint64_t misses;
+    /* valid pages that were replaced by another page */
+    uint64_t evictions;
+} PageCacheWayStats;
+
 /**
  * cache_init: Initialize the page cache
  *
@@ -45,8 +58,7 @@ void cache_fini(PageCache *cache);
  * @addr: page addr
  * @current_age: current bitmap generation
  */
-bool cache_is_cached(const PageCache *cache, uint64_t addr,
-                     uint64_t current_age);
+bool cache_is_cached(PageCache *cache, uint64_t addr, uint64_t current_age);
 
 /**
  * get_cached_data: Get the data cached for an addr
@@ -83,4 +95,12 @@ int cache_insert(PageCache *cache, uint64_t addr, const uint8_t *pdata,
  */
 int64_t cache_resize(PageCache *cache, int64_t num_pages);
 
+/**
+ * cache_get_way_stats: add up the per-way statistics of the cache
+ *
+ * @cache pointer to the PageCache struct
+ * @stats: array of PAGE_CACHE_WAYS entries the counters are added to
+ */
+void cache_get_way_stats(const PageCache *cache, PageCacheWayStats *stats);
+
 #endif
@@ -26,6 +26,10 @@
 #include "sysemu/sysemu.h"
 #include "sysemu/balloon.h"
 #include "qemu/error-report.h"
+#include "qemu/bitmap.h"
+#include "qemu/host-utils.h"
+#include "qemu/timer.h"
+#include "qom/cpu.h"
 #include "trace.h"
 
 /* Arbitrary limit on size of each discard command,
@@ -45,6 +49,102 @@ struct PostcopyDiscardState {
     unsigned int nsentcmds;
 };
 
+/* Userfaults read from the kernel at once */
+#define POSTCOPY_FAULT_BATCH 64
+
+/*
+ * Fault latency histogram: bucket 0 counts the faults served in less
+ * than 2us, bucket i those served in [2^i, 2^(i+1)) us and the last
+ * bucket everything slower.
+ */
+#define POSTCOPY_FAULT_LATENCY_BUCKETS 24
+
+/* Protected by MigrationIncomingState's postcopy_fault_lock */
+struct PostcopyFaultStats {
+    /*
+     * Host page -> time its first fault was read, for pages requested
+     * from the source and not placed yet.  Only exists while the fault
+     * thread runs.
+     */
+    GHashTable *inflight;
+    /*
+     * Host pages placed so far, by the ram_addr of their first target
+     * page; a fault read after its page was placed is not in flight.
+     * Lives as long as inflight.
+     */
+    unsigned long *placed;
+    uint64_t faults;
+    uint64_t duplicates;
+    uint64_t requests;
+    uint64_t prefetch_pages;
+    uint64_t latency[POSTCOPY_FAULT_LATENCY_BUCKETS];
+
+    /*
+     * vCPU blocktime, only tracked with the postcopy-blocktime
+     * capability when userfaultfd reports the faulting thread.
+     * A vCPU is blocked from its fault until the page it faulted on
+     * is placed; vcpu_fault_time is 0 while it runs.  All times in ns.
+     */
+    int nr_vcpus;
+    int vcpus_blocked;
+    int64_t *vcpu_fault_time;
+    void **vcpu_fault_host;
+    uint64_t *vcpu_blocktime;
+    /* When the last running vCPU blocked */
+    int64_t all_blocked_since;
+    uint64_t total_blocktime;
+};
+
+PostcopyFaultInfo *postcopy_fault_info(MigrationIncomingState *mis)
+{
+    PostcopyFaultStats *stats;
+    PostcopyFaultInfo *info = NULL;
+    PostcopyFaultLatencyBucketList **tail;
+    int i;
+
+    qemu_mutex_lock(&mis->postcopy_fault_lock);
+    stats = mis->postcopy_fault_stats;
+    if (!stats) {
+        goto out;
+    }
+    info = g_new0(PostcopyFaultInfo, 1);
+    info->faults = stats->faults;
+    info->duplicates = stats->duplicates;
+    info->requests = stats->requests;
+    info->prefetch_pages = stats->prefetch_pages;
+    tail = &info->latency;
+    for (i = 0; i < POSTCOPY_FAULT_LATENCY_BUCKETS; i++) {
+        PostcopyFaultLatencyBucketList *entry;
+
+        if (!stats->latency[i]) {
+            continue;
+        }
+        entry = g_new0(PostcopyFaultLatencyBucketList, 1);
+        entry->value = g_new0(PostcopyFaultLatencyBucket, 1);
+        entry->value->min_us = i ? 1ULL << i : 0;
+        entry->value->count = stats->latency[i];
+        *tail = entry;
+        tail = &entry->next;
+    }
+    if (stats->nr_vcpus) {
+        intList **vtail = &info->vcpu_blocktime;
+
+        info->has_blocktime = true;
+        info->blocktime = stats->total_blocktime / SCALE_MS;
+        info->has_vcpu_blocktime = true;
+        for (i = 0; i < stats->nr_vcpus; i++) {
+            intList *entry = g_new0(intList, 1);
+
+            entry->value = stats->vcpu_blocktime[i] / SCALE_MS;
+            *vtail = entry;
+            vtail = &entry->next;
+        }
+    }
+out:
+    qemu_mutex_unlock(&mis->postcopy_fault_lock);
+    return info;
+}
+
 /* Postcopy needs to detect accesses to pages that haven't yet been copied
  * across, and efficiently map new pages in, the techniques for doing this
  * are target OS specific.
@@ -61,13 +161,340 @@ struct PostcopyDiscardState {
 #include <sys/eventfd.h>
 #include <linux/userfaultfd.h>
 
-static bool ufd_version_check(int ufd)
+typedef struct PostcopyFaultRequest {
+    RAMBlock *rb;
+    ram_addr_t offset;
+    size_t len;
+} PostcopyFaultRequest;
+
+static void postcopy_fault_stats_free(PostcopyFaultStats *stats)
+{
+    if (!stats) {
+        return;
+    }
+    g_free(stats->placed);
+    g_free(stats->vcpu_fault_time);
+    g_free(stats->vcpu_fault_host);
+    g_free(stats->vcpu_blocktime);
+    g_free(stats);
+}
+
+static int ram_block_end(const char *block_name, void *host_addr,
+                         ram_addr_t offset, ram_addr_t length, void *opaque)
+{
+    ram_addr_t *end = opaque;
+
+    *end = MAX(*end, offset + length);
+    return 0;
+}
+
+/* @blocktime: track the vCPU blocktime, the faults carry a thread id */
+static void postcopy_fault_stats_start(MigrationIncomingState *mis,
+                                       bool blocktime)
+{
+    PostcopyFaultStats *stats = g_new0(PostcopyFaultStats, 1);
+    ram_addr_t ram_end = 0;
+
+    stats->inflight = g_hash_table_new_full(g_direct_hash, g_direct_equal,
+                                            NULL, g_free);
+    qemu_ram_foreach_block(ram_block_end, &ram_end);
+    stats->placed = bitmap_new(ram_end / qemu_target_page_size());
+    if (blocktime) {
+        stats->nr_vcpus = smp_cpus;
+        stats->vcpu_fault_time = g_new0(int64_t, smp_cpus);
+        stats->vcpu_fault_host = g_new0(void *, smp_cpus);
+        stats->vcpu_blocktime = g_new0(uint64_t, smp_cpus);
+    }
+
+    qemu_mutex_lock(&mis->postcopy_fault_lock);
+    postcopy_fault_stats_free(mis->postcopy_fault_stats);
+    mis->postcopy_fault_stats = stats;
+    qemu_mutex_unlock(&mis->postcopy_fault_lock);
+}
+
+/* Map the thread id of a fault to a vCPU index, or -1 */
+static int postcopy_fault_vcpu(uint32_t ptid)
+{
+    CPUState *cpu;
+
+    if (!ptid) {
+        return -1;
+    }
+    CPU_FOREACH(cpu) {
+        if (cpu->thread_id == ptid) {
+            return cpu->cpu_index;
+        }
+    }
+    return -1;
+}
+
+static void postcopy_blocktime_end(PostcopyFaultStats *stats, int vcpu,
+                                   int64_t now)
+{
+    if (stats->vcpus_blocked == stats->nr_vcpus) {
+        stats->total_blocktime += now - stats->all_blocked_since;
+    }
+    stats->vcpu_blocktime[vcpu] += now - stats->vcpu_fault_time[vcpu];
+    stats->vcpu_fault_time[vcpu] = 0;
+    stats->vcpu_fault_host[vcpu] = NULL;
+    stats->vcpus_blocked--;
+}
+
+static void postcopy_blocktime_begin(PostcopyFaultStats *stats, int vcpu,
+                                     void *host, int64_t now)
+{
+    if (stats->vcpu_fault_time[vcpu]) {
+        /*
+         * A blocked vCPU does not fault again, so its previous wake up
+         * went unnoticed; it ran again at the latest when it faulted now.
+         */
+        postcopy_blocktime_end(stats, vcpu, now);
+    }
+    stats->vcpu_fault_time[vcpu] = now;
+    stats->vcpu_fault_host[vcpu] = host;
+    if (++stats->vcpus_blocked == stats->nr_vcpus) {
+        stats->all_blocked_since = now;
+    }
+}
+
+static void postcopy_fault_stats_stop(MigrationIncomingState *mis)
+{
+    PostcopyFaultStats *stats;
+    int64_t now = qemu_clock_get_ns(QEMU_CLOCK_REALTIME);
+    int i;
+
+    qemu_mutex_lock(&mis->postcopy_fault_lock);
+    stats = mis->postcopy_fault_stats;
+    if (stats) {
+        g_hash_table_destroy(stats->inflight);
+        stats->inflight = NULL;
+        g_free(stats->placed);
+        stats->placed = NULL;
+
+        /* Pages that never came no longer block anything */
+        for (i = 0; stats->vcpus_blocked && i < stats->nr_vcpus; i++) {
+            if (stats->vcpu_fault_time[i]) {
+                postcopy_blocktime_end(stats, i, now);
+            }
+        }
+    }
+    qemu_mutex_unlock(&mis->postcopy_fault_lock);
+}
+
+static unsigned long postcopy_fault_page_index(void *host)
+{
+    return qemu_ram_addr_from_host(host) / qemu_target_page_size();
+}
+
+/*
+ * Account for a fault by thread @ptid (0 if unknown) on the host page
+ * at @host.  Returns false if the page has already been requested and
+ * is still on its way, or has been placed since the fault.
+ */
+static bool postcopy_fault_record(MigrationIncomingState *mis, void *host,
+                                  uint32_t ptid, int64_t now)
+{
+    PostcopyFaultStats *stats;
+    int64_t *fault_time;
+    bool first = true;
+    int vcpu;
+
+    qemu_mutex_lock(&mis->postcopy_fault_lock);
+    stats = mis->postcopy_fault_stats;
+    stats->faults++;
+    if (test_bit(postcopy_fault_page_index(host), stats->placed)) {
+        /* Placing the page already woke the vCPU up */
+        stats->duplicates++;
+        qemu_mutex_unlock(&mis->postcopy_fault_lock);
+        return false;
+    }
+    if (stats->nr_vcpus) {
+        vcpu = postcopy_fault_vcpu(ptid);
+        if (vcpu >= 0 && vcpu < stats->nr_vcpus) {
+            postcopy_blocktime_begin(stats, vcpu, host, now);
+        }
+    }
+    if (g_hash_table_contains(stats->inflight, host)) {
+        stats->duplicates++;
+        first = false;
+    } else {
+        fault_time = g_new(int64_t, 1);
+        *fault_time = now;
+        g_hash_table_insert(stats->inflight, host, fault_time);
+    }
+    qemu_mutex_unlock(&mis->postcopy_fault_lock);
+    return first;
+}
+
+/* Called once the host page at @host has been placed */
+static void postcopy_fault_page_placed(MigrationIncomingState *mis,
+                                       void *host)
+{
+    PostcopyFaultStats *stats;
+    int64_t *fault_time;
+    int64_t now;
+    uint64_t us;
+    int bucket, i;
+
+    qemu_mutex_lock(&mis->postcopy_fault_lock);
+    stats = mis->postcopy_fault_stats;
+    if (stats && stats->inflight) {
+        set_bit(postcopy_fault_page_index(host), stats->placed);
+        fault_time = g_hash_table_lookup(stats->inflight, host);
+        if (fault_time) {
+            now = qemu_clock_get_ns(QEMU_CLOCK_REALTIME);
+            us = (now - *fault_time) / SCALE_US;
+            bucket = us < 2 ? 0 : 63 - clz64(us);
+            stats->latency[MIN(bucket, POSTCOPY_FAULT_LATENCY_BUCKETS - 1)]++;
+            g_hash_table_remove(stats->inflight, host);
+
+            /* The vCPUs waiting on the page are woken up now */
+            for (i = 0; stats->vcpus_blocked && i < stats->nr_vcpus; i++) {
+                if (stats->vcpu_fault_host[i] == host) {
+                    postcopy_blocktime_end(stats, i, now);
+                }
+            }
+        }
+    }
+    qemu_mutex_unlock(&mis->postcopy_fault_lock);
+}
+
+static int postcopy_fault_request_cmp(const void *a, const void *b)
+{
+    const PostcopyFaultRequest *ra = a, *rb = b;
+
+    if (ra->rb != rb->rb) {
+        return (uintptr_t)ra->rb < (uintptr_t)rb->rb ? -1 : 1;
+    }
+    if (ra->offset != rb->offset) {
+        return ra->offset < rb->offset ? -1 : 1;
+    }
+    return 0;
+}
+
+static void postcopy_fault_send_range(MigrationIncomingState *mis,
+                                      RAMBlock *rb, ram_addr_t start,
+                                      ram_addr_t end, RAMBlock **last_rb)
+{
+    trace_postcopy_ram_fault_thread_send(qemu_ram_get_idstr(rb), start,
+                                         end - start);
+    /* Only name the RAMBlock when it changes, to save some space */
+    migrate_send_rp_req_pages(mis, rb != *last_rb ? qemu_ram_get_idstr(rb)
+                                                   : NULL,
+                              start, end - start);
+    *last_rb = rb;
+}
+
+/*
+ * Send the requests for a batch of faults to the source, merging the
+ * ones on adjacent host pages and extending each range by
+ * @prefetch host pages.
+ */
+static void postcopy_fault_send_requests(MigrationIncomingState *mis,
+                                         PostcopyFaultRequest *reqs,
+                                         unsigned int nr, unsigned int prefetch,
+                                         RAMBlock **last_rb)
+{
+    RAMBlock *rb = NULL;
+    ram_addr_t start = 0, end = 0, faulted = 0;
+    uint64_t requests = 0, prefetch_bytes = 0;
+    unsigned int i;
+
+    qsort(reqs, nr, sizeof(*reqs), postcopy_fault_request_cmp);
+
+    for (i = 0; i < nr; i++) {
+        PostcopyFaultRequest *req = &reqs[i];
+        ram_addr_t req_end = MIN(req->offset + req->len * (1 + prefetch),
+                                 qemu_ram_get_used_length(req->rb));
+
+        if (req->rb == rb && req->offset <= end) {
+            /* Adjacent to or inside the current range */
+            faulted += req->len;
+            end = MAX(end, req_end);
+            continue;
+        }
+        if (rb) {
+            postcopy_fault_send_range(mis, rb, start, end, last_rb);
+            prefetch_bytes += end - start - faulted;
+            requests++;
+        }
+        rb = req->rb;
+        start = req->offset;
+        end = req_end;
+        faulted = req->len;
+    }
+    if (rb) {
+        postcopy_fault_send_range(mis, rb, start, end, last_rb);
+        prefetch_bytes += end - start - faulted;
+        requests++;
+    }
+
+    qemu_mutex_lock(&mis->postcopy_fault_lock);
+    mis->postcopy_fault_stats->requests += requests;
+    mis->postcopy_fault_stats->prefetch_pages +=
+        prefetch_bytes / qemu_target_page_size();
+    qemu_mutex_unlock(&mis->postcopy_fault_lock);
+}
+
+/*
+ * Lazy restore: rather than asking the source, read the faulting pages
+ * and @prefetch host pages after each of them from the migration file.
+ */
+static int postcopy_fault_load_requests(MigrationIncomingState *mis,
+                                        PostcopyFaultRequest *reqs,
+                                        unsigned int nr, unsigned int prefetch)
+{
+    unsigned int i;
+    int ret;
+
+    for (i = 0; i < nr; i++) {
+        PostcopyFaultRequest *req = &reqs[i];
+        ram_addr_t req_end = MIN(req->offset + req->len * (1 + prefetch),
+                                 qemu_ram_get_used_length(req->rb));
+
+        ret = ram_lazy_restore_load(req->rb, req->offset,
+                                    req_end - req->offset);
+        if (ret < 0) {
+            return ret;
+        }
+    }
+
+    qemu_mutex_lock(&mis->postcopy_fault_lock);
+    mis->postcopy_fault_stats->requests += nr;
+    qemu_mutex_unlock(&mis->postcopy_fault_lock);
+    return 0;
+}
+
+/*
+ * Features the kernel's userfaultfd supports.  UFFDIO_API can only be
+ * issued once on a file descriptor, so this uses a throw-away one.
+ */
+static uint64_t ufd_host_features(void)
 {
     struct uffdio_api api_struct;
-    uint64_t ioctl_mask;
+    int ufd;
 
+    ufd = syscall(__NR_userfaultfd, O_CLOEXEC);
+    if (ufd == -1) {
+        return 0;
+    }
     api_struct.api = UFFD_API;
     api_struct.features = 0;
+    if (ioctl(ufd, UFFDIO_API, &api_struct)) {
+        api_struct.features = 0;
+    }
+    close(ufd);
+    return api_struct.features;
+}
+
+/* @features: optional features to enable on @ufd */
+static bool ufd_version_check(int ufd, uint64_t features)
+{
+    struct uffdio_api api_struct;
+    uint64_t ioctl_mask;
+
+    api_struct.api = UFFD_API;
+    api_struct.features = features;
     if (ioctl(ufd, UFFDIO_API, &api_struct)) {
         error_report("postcopy_ram_supported_by_host: UFFDIO_API failed: %s",
                      strerror(errno));
@@ -147,7 +574,7 @@ bool postcopy_ram_supported_by_host(void)
     }
 
     /* Version and features check */
-    if (!ufd_version_check(ufd)) {
+    if (!ufd_version_check(ufd, 0)) {
         goto out;
     }
 
@@ -288,12 +715,11 @@ int postcopy_ram_incoming_init(MigrationIncomingState *mis, size_t ram_pages)
 }
 
 /*
- * At the end of a migration where postcopy_ram_incoming_init was called.
+ * Stop the fault thread and let RAM be accessed normally again, undoing
+ * postcopy_ram_enable_notify.
  */
-int postcopy_ram_incoming_cleanup(MigrationIncomingState *mis)
+int postcopy_ram_disable_notify(MigrationIncomingState *mis)
 {
-    trace_postcopy_ram_incoming_cleanup_entry();
-
     if (mis->have_fault_thread) {
         uint64_t tmp64;
 
@@ -317,9 +743,23 @@ int postcopy_ram_incoming_cleanup(MigrationIncomingState *mis)
         close(mis->userfault_fd);
         close(mis->userfault_quit_fd);
         mis->have_fault_thread = false;
+        postcopy_fault_stats_stop(mis);
     }
 
     qemu_balloon_inhibit(false);
+    return 0;
+}
+
+/*
+ * At the end of a migration where postcopy_ram_incoming_init was called.
+ */
+int postcopy_ram_incoming_cleanup(MigrationIncomingState *mis)
+{
+    trace_postcopy_ram_incoming_cleanup_entry();
+
+    if (postcopy_ram_disable_notify(mis)) {
+        return -1;
+    }
 
     if (enable_mlock) {
         if (os_mlock() < 0) {
@@ -414,11 +854,17 @@ static int ram_block_enable_notify(const char *block_name, void *host_addr,
 
 /*
  * Handle faults detected by the USERFAULT markings
+ *
+ * Each wakeup drains all the pending userfaults before sending the page
+ * requests, so that faults from many vCPUs cost a few requests rather
+ * than one round trip each.
  */
 static void *postcopy_ram_fault_thread(void *opaque)
 {
     MigrationIncomingState *mis = opaque;
-    struct uffd_msg msg;
+    struct uffd_msg msgs[POSTCOPY_FAULT_BATCH];
+    PostcopyFaultRequest reqs[POSTCOPY_FAULT_BATCH];
+    unsigned int prefetch = migrate_postcopy_prefetch_pages();
     int ret;
     RAMBlock *rb = NULL;
     RAMBlock *last_rb = NULL; /* last RAMBlock we sent part of */
@@ -429,6 +875,8 @@ static void *postcopy_ram_fault_thread(void *opaque)
     while (true) {
         ram_addr_t rb_offset;
         struct pollfd pfd[2];
+        unsigned int nr_reqs = 0, nr_msgs, i;
+        int64_t now;
 
         /*
          * We're mainly waiting for the kernel to give us a faulting HVA,
@@ -452,65 +900,107 @@ static void *postcopy_ram_fault_thread(void *opaque)
             break;
         }
 
-        ret = read(mis->userfault_fd, &msg, sizeof(msg));
-        if (ret != sizeof(msg)) {
-            if (errno == EAGAIN) {
-                /*
-                 * if a wake up happens on the other thread just after
-                 * the poll, there is nothing to read.
-                 */
-                continue;
-            }
+        /* The fd is non-blocking, read until the kernel has nothing left */
+        while (nr_reqs < POSTCOPY_FAULT_BATCH) {
+            ret = read(mis->userfault_fd, msgs,
+                       (POSTCOPY_FAULT_BATCH - nr_reqs) * sizeof(msgs[0]));
             if (ret < 0) {
+                if (errno == EAGAIN) {
+                    /*
+                     * Either everything has been read, or a wake up
+                     * happened on the other thread just after the poll
+                     * and there was nothing to read.
+                     */
+                    break;
+                }
                 error_report("%s: Failed to read full userfault message: %s",
                              __func__, strerror(errno));
-                break;
-            } else {
-                error_report("%s: Read %d bytes from userfaultfd expected %zd",
-                             __func__, ret, sizeof(msg));
-                break; /* Lost alignment, don't know what we'd read next */
+                goto out;
             }
-        }
-        if (msg.event != UFFD_EVENT_PAGEFAULT) {
-            error_report("%s: Read unexpected event %ud from userfaultfd",
-                         __func__, msg.event);
-            continue; /* It's not a page fault, shouldn't happen */
-        }
+            if (ret == 0 || ret % sizeof(msgs[0])) {
+                error_report("%s: Read %d bytes from userfaultfd expected "
+                             "a multiple of %zd", __func__, ret,
+                             sizeof(msgs[0]));
+                goto out; /* Lost alignment, don't know what we'd read next */
+            }
+            nr_msgs = ret / sizeof(msgs[0]);
+            now = qemu_clock_get_ns(QEMU_CLOCK_REALTIME);
+
+            for (i = 0; i < nr_msgs; i++) {
+                struct uffd_msg *msg = &msgs[i];
+                uint32_t ptid;
+                size_t pagesize;
+                void *host;
+
+                if (msg->event != UFFD_EVENT_PAGEFAULT) {
+                    error_report("%s: Read unexpected event %ud from "
+                                 "userfaultfd", __func__, msg->event);
+                    continue; /* It's not a page fault, shouldn't happen */
+                }
+
+                rb = qemu_ram_block_from_host(
+                         (void *)(uintptr_t)msg->arg.pagefault.address,
+                         true, &rb_offset);
+                if (!rb) {
+                    error_report("postcopy_ram_fault_thread: Fault outside "
+                                 "guest: %" PRIx64,
+                                 (uint64_t)msg->arg.pagefault.address);
+                    goto out;
+                }
+
+                pagesize = qemu_ram_pagesize(rb);
+                rb_offset &= ~(pagesize - 1);
+                host = (void *)(uintptr_t)(msg->arg.pagefault.address &
+                                           ~(uint64_t)(pagesize - 1));
+                /* 0 unless UFFD_FEATURE_THREAD_ID was enabled */
+                ptid = msg->arg.pagefault.feat.ptid;
+                trace_postcopy_ram_fault_thread_request(
+                    msg->arg.pagefault.address, qemu_ram_get_idstr(rb),
+                    rb_offset, ptid);
 
-        rb = qemu_ram_block_from_host(
-                 (void *)(uintptr_t)msg.arg.pagefault.address,
-                 true, &rb_offset);
-        if (!rb) {
-            error_report("postcopy_ram_fault_thread: Fault outside guest: %"
-                         PRIx64, (uint64_t)msg.arg.pagefault.address);
-            break;
+                /*
+                 * Request one of our host page sizes (which is >= TPS),
+                 * unless another vCPU already asked for it.
+                 */
+                if (!postcopy_fault_record(mis, host, ptid, now)) {
+                    continue;
+                }
+                reqs[nr_reqs].rb = rb;
+                reqs[nr_reqs].offset = rb_offset;
+                reqs[nr_reqs].len = pagesize;
+                nr_reqs++;
+            }
         }
 
-        rb_offset &= ~(qemu_ram_pagesize(rb) - 1);
-        trace_postcopy_ram_fault_thread_request(msg.arg.pagefault.address,
-                                                qemu_ram_get_idstr(rb),
-                                                rb_offset);
-
-        /*
-         * Send the request to the source - we want to request one
-         * of our host page sizes (which is >= TPS)
-         */
-        if (rb != last_rb) {
-            last_rb = rb;
-            migrate_send_rp_req_pages(mis, qemu_ram_get_idstr(rb),
-                                     rb_offset, qemu_ram_pagesize(rb));
-        } else {
-            /* Save some space */
-            migrate_send_rp_req_pages(mis, NULL,
-                                     rb_offset, qemu_ram_pagesize(rb));
+        if (nr_reqs && mis->lazy_restore) {
+            ret = postcopy_fault_load_requests(mis, reqs, nr_reqs, prefetch);
+            if (ret < 0) {
+                error_report("%s: Failed to load pages: %s", __func__,
+                             strerror(-ret));
+                exit(EXIT_FAILURE);
+            }
+        } else if (nr_reqs) {
+            postcopy_fault_send_requests(mis, reqs, nr_reqs, prefetch,
+                                         &last_rb);
         }
     }
+out:
     trace_postcopy_ram_fault_thread_exit();
     return NULL;
 }
 
 int postcopy_ram_enable_notify(MigrationIncomingState *mis)
 {
+    uint64_t features = 0;
+
+    if (migrate_postcopy_blocktime()) {
+        features = ufd_host_features() & UFFD_FEATURE_THREAD_ID;
+        if (!features) {
+            warn_report("postcopy-blocktime: userfaultfd does not report "
+                        "the faulting thread, vCPU blocktime not available");
+        }
+    }
+
     /* Open the fd for the kernel to give us userfaults */
     mis->userfault_fd = syscall(__NR_userfaultfd, O_CLOEXEC | O_NONBLOCK);
     if (mis->userfault_fd == -1) {
@@ -523,7 +1013,7 @@ int postcopy_ram_enable_notify(MigrationIncomingState *mis)
      * Although the host check already tested the API, we need to
      * do the check again as an ABI handshake on the new fd.
      */
-    if (!ufd_version_check(mis->userfault_fd)) {
+    if (!ufd_version_check(mis->userfault_fd, features)) {
         return -1;
     }
 
@@ -536,6 +1026,7 @@ int postcopy_ram_enable_notify(MigrationIncomingState *mis)
         return -1;
     }
 
+    postcopy_fault_stats_start(mis, features != 0);
     qemu_sem_init(&mis->fault_thread_sem, 0);
     qemu_thread_create(&mis->fault_thread, "postcopy/fault",
                        postcopy_ram_fault_thread, mis, QEMU_THREAD_JOINABLE);
@@ -559,6 +1050,26 @@ int postcopy_ram_enable_notify(MigrationIncomingState *mis)
     return 0;
 }
 
+/*
+ * Empty RAM and start handling userfaults on it, for a lazy restore
+ * from a file that provides the pages through ram_lazy_restore_load.
+ */
+int postcopy_ram_lazy_restore_init(MigrationIncomingState *mis)
+{
+    if (qemu_ram_foreach_block(nhp_range, mis) ||
+        qemu_ram_foreach_block(init_range, NULL)) {
+        return -1;
+    }
+
+    mis->lazy_restore = true;
+    if (postcopy_ram_enable_notify(mis)) {
+        postcopy_ram_disable_notify(mis);
+        mis->lazy_restore = false;
+        return -1;
+    }
+    return 0;
+}
+
 /*
  * Place a host page (from) at (host) atomically
  * returns 0 on success
@@ -587,6 +1098,7 @@ int postcopy_place_page(MigrationIncomingState *mis, void *host, void *from,
     }
 
     trace_postcopy_place_page(host);
+    postcopy_fault_page_placed(mis, host);
     return 0;
 }
 
@@ -612,6 +1124,7 @@ int postcopy_place_page_zero(MigrationIncomingState *mis, void *host,
 
             return -e;
         }
+        postcopy_fault_page_placed(mis, host);
     } else {
         /* The kernel can't use UFFDIO_ZEROPAGE for hugepages */
         if (!mis->postcopy_tmp_zero_page) {
@@ -679,6 +1192,18 @@ int postcopy_ram_incoming_cleanup(MigrationIncomingState *mis)
     return -1;
 }
 
+int postcopy_ram_disable_notify(MigrationIncomingState *mis)
+{
+    assert(0);
+    return -1;
+}
+
+int postcopy_ram_lazy_restore_init(MigrationIncomingState *mis)
+{
+    error_report("%s: No OS support", __func__);
+    return -1;
+}
+
 int postcopy_ram_prepare_discard(MigrationIncomingState *mis)
 {
     assert(0);
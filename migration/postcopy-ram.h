@@ -34,6 +34,17 @@ int postcopy_ram_incoming_init(MigrationIncomingState *mis, size_t ram_pages);
  */
 int postcopy_ram_incoming_cleanup(MigrationIncomingState *mis);
 
+/*
+ * Stop handling userfaults, undoing postcopy_ram_enable_notify.
+ */
+int postcopy_ram_disable_notify(MigrationIncomingState *mis);
+
+/*
+ * Empty RAM and start handling its userfaults from the migration file
+ * rather than from the source, for a lazy restore.
+ */
+int postcopy_ram_lazy_restore_init(MigrationIncomingState *mis);
+
 /*
  * Userfault requires us to mark RAM as NOHUGEPAGE prior to discard
  * however leaving it until after precopy means that most of the precopy
@@ -110,6 +121,12 @@ typedef enum {
  */
 void *postcopy_get_tmp_page(MigrationIncomingState *mis);
 
+/*
+ * Page fault statistics of the current or last postcopy migration on
+ * the destination, NULL if postcopy never started
+ */
+PostcopyFaultInfo *postcopy_fault_info(MigrationIncomingState *mis);
+
 PostcopyState postcopy_state_get(void);
 /* Set the state and return the old state */
 PostcopyState postcopy_state_set(PostcopyState new_state);
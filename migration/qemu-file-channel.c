@@ -30,12 +30,11 @@
 #include "qemu/iov.h"
 
 
-static ssize_t channel_writev_buffer(void *opaque,
-                                     struct iovec *iov,
-                                     int iovcnt,
-                                     int64_t pos)
+static ssize_t channel_writev(QIOChannel *ioc,
+                              struct iovec *iov,
+                              int iovcnt,
+                              int flags)
 {
-    QIOChannel *ioc = QIO_CHANNEL(opaque);
     ssize_t done = 0;
     struct iovec *local_iov = g_new(struct iovec, iovcnt);
     struct iovec *local_iov_head = local_iov;
@@ -47,7 +46,8 @@ static ssize_t channel_writev_buffer(void *opaque,
 
     while (nlocal_iov > 0) {
         ssize_t len;
-        len = qio_channel_writev(ioc, local_iov, nlocal_iov, NULL);
+        len = qio_channel_writev_full(ioc, local_iov, nlocal_iov,
+                                      NULL, 0, flags, NULL);
         if (len == QIO_CHANNEL_ERR_BLOCK) {
             qio_channel_wait(ioc, G_IO_OUT);
             continue;
@@ -68,6 +68,39 @@ static ssize_t channel_writev_buffer(void *opaque,
 }
 
 
+static ssize_t channel_writev_buffer(void *opaque,
+                                     struct iovec *iov,
+                                     int iovcnt,
+                                     int64_t pos)
+{
+    return channel_writev(QIO_CHANNEL(opaque), iov, iovcnt, 0);
+}
+
+
+static ssize_t channel_writev_zero_copy(void *opaque,
+                                        struct iovec *iov,
+                                        int iovcnt,
+                                        int64_t pos)
+{
+    return channel_writev(QIO_CHANNEL(opaque), iov, iovcnt,
+                          QIO_CHANNEL_WRITE_FLAG_ZERO_COPY);
+}
+
+
+static int channel_flush_zero_copy(void *opaque)
+{
+    QIOChannel *ioc = QIO_CHANNEL(opaque);
+    int ret;
+
+    ret = qio_channel_flush(ioc, NULL);
+    if (ret < 0) {
+        /* XXX handle Error objects */
+        return -EIO;
+    }
+    return ret;
+}
+
+
 static ssize_t channel_get_buffer(void *opaque,
                                   uint8_t *buf,
                                   int64_t pos,
@@ -92,6 +125,49 @@ static ssize_t channel_get_buffer(void *opaque,
 }
 
 
+static ssize_t channel_pwrite_buffer(void *opaque,
+                                     const uint8_t *buf,
+                                     size_t size,
+                                     int64_t pos)
+{
+    QIOChannel *ioc = QIO_CHANNEL(opaque);
+
+    if (qio_channel_pwrite(ioc, (const char *)buf, size, pos, NULL) < 0) {
+        /* XXX handle Error * object */
+        return -EIO;
+    }
+    return size;
+}
+
+
+static ssize_t channel_pread_buffer(void *opaque,
+                                    uint8_t *buf,
+                                    size_t size,
+                                    int64_t pos)
+{
+    QIOChannel *ioc = QIO_CHANNEL(opaque);
+
+    if (qio_channel_pread(ioc, (char *)buf, size, pos, NULL) < 0) {
+        /* XXX handle Error * object */
+        return -EIO;
+    }
+    return size;
+}
+
+
+static int channel_seek(void *opaque,
+                        int64_t pos)
+{
+    QIOChannel *ioc = QIO_CHANNEL(opaque);
+
+    if (qio_channel_io_seek(ioc, pos, SEEK_SET, NULL) < 0) {
+        /* XXX handle Error * object */
+        return -EIO;
+    }
+    return 0;
+}
+
+
 static int channel_close(void *opaque)
 {
     QIOChannel *ioc = QIO_CHANNEL(opaque);
@@ -160,6 +236,17 @@ static const QEMUFileOps channel_input_ops = {
 };
 
 
+static const QEMUFileOps channel_input_seekable_ops = {
+    .get_buffer = channel_get_buffer,
+    .close = channel_close,
+    .shut_down = channel_shutdown,
+    .set_blocking = channel_set_blocking,
+    .get_return_path = channel_get_input_return_path,
+    .pread_buffer = channel_pread_buffer,
+    .seek = channel_seek,
+};
+
+
 static const QEMUFileOps channel_output_ops = {
     .writev_buffer = channel_writev_buffer,
     .close = channel_close,
@@ -169,14 +256,45 @@ static const QEMUFileOps channel_output_ops = {
 };
 
 
+static const QEMUFileOps channel_output_seekable_ops = {
+    .writev_buffer = channel_writev_buffer,
+    .close = channel_close,
+    .shut_down = channel_shutdown,
+    .set_blocking = channel_set_blocking,
+    .get_return_path = channel_get_output_return_path,
+    .pwrite_buffer = channel_pwrite_buffer,
+    .seek = channel_seek,
+};
+
+
+static const QEMUFileOps channel_output_zero_copy_ops = {
+    .writev_buffer = channel_writev_buffer,
+    .close = channel_close,
+    .shut_down = channel_shutdown,
+    .set_blocking = channel_set_blocking,
+    .get_return_path = channel_get_output_return_path,
+    .writev_zero_copy = channel_writev_zero_copy,
+    .flush_zero_copy = channel_flush_zero_copy,
+};
+
+
 QEMUFile *qemu_fopen_channel_input(QIOChannel *ioc)
 {
     object_ref(OBJECT(ioc));
+    if (qio_channel_has_feature(ioc, QIO_CHANNEL_FEATURE_SEEKABLE)) {
+        return qemu_fopen_ops(ioc, &channel_input_seekable_ops);
+    }
     return qemu_fopen_ops(ioc, &channel_input_ops);
 }
 
 QEMUFile *qemu_fopen_channel_output(QIOChannel *ioc)
 {
     object_ref(OBJECT(ioc));
+    if (qio_channel_has_feature(ioc, QIO_CHANNEL_FEATURE_WRITE_ZERO_COPY)) {
+        return qemu_fopen_ops(ioc, &channel_output_zero_copy_ops);
+    }
+    if (qio_channel_has_feature(ioc, QIO_CHANNEL_FEATURE_SEEKABLE)) {
+        return qemu_fopen_ops(ioc, &channel_output_seekable_ops);
+    }
     return qemu_fopen_ops(ioc, &channel_output_ops);
 }
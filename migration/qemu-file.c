@@ -22,7 +22,6 @@
  * THE SOFTWARE.
  */
 #include "qemu/osdep.h"
-#include <zlib.h>
 #include "qemu-common.h"
 #include "qemu/error-report.h"
 #include "qemu/iov.h"
@@ -50,6 +49,15 @@ struct QEMUFile {
     DECLARE_BITMAP(may_free, MAX_IOV_SIZE);
     struct iovec iov[MAX_IOV_SIZE];
     unsigned int iovcnt;
+    /* iov references memory queued by qemu_put_buffer_async() */
+    bool iov_async;
+
+    /* Send iovs with async buffers through ops->writev_zero_copy */
+    bool zero_copy;
+    /* Zero copy writes may still reference buf and the async buffers */
+    bool zero_copy_pending;
+    /* may_free ranges to release once the zero copy writes complete */
+    GArray *release_pending;
 
     int last_error;
 };
@@ -131,6 +139,19 @@ bool qemu_file_is_writable(QEMUFile *f)
     return f->ops->writev_buffer;
 }
 
+static void qemu_release_ram_range(QEMUFile *f, struct iovec *iov)
+{
+    /* The kernel may not have read the pages yet */
+    if (f->zero_copy_pending) {
+        g_array_append_val(f->release_pending, *iov);
+        return;
+    }
+    if (qemu_madvise(iov->iov_base, iov->iov_len, QEMU_MADV_DONTNEED) < 0) {
+        error_report("migrate: madvise DONTNEED failed %p %zd: %s",
+                     iov->iov_base, iov->iov_len, strerror(errno));
+    }
+}
+
 static void qemu_iovec_release_ram(QEMUFile *f)
 {
     struct iovec iov;
@@ -143,9 +164,9 @@ static void qemu_iovec_release_ram(QEMUFile *f)
     }
     iov = f->iov[idx];
 
-    /* The madvise() in the loop is called for iov within a continuous range and
-     * then reinitialize the iov. And in the end, madvise() is called for the
-     * last iov.
+    /* The range is released in the loop for iov within a continuous range
+     * and then reinitialize the iov. And in the end, the last iov is
+     * released.
      */
     while ((idx = find_next_bit(f->may_free, f->iovcnt, idx + 1)) < f->iovcnt) {
         /* check for adjacent buffer and coalesce them */
@@ -153,19 +174,73 @@ static void qemu_iovec_release_ram(QEMUFile *f)
             iov.iov_len += f->iov[idx].iov_len;
             continue;
         }
-        if (qemu_madvise(iov.iov_base, iov.iov_len, QEMU_MADV_DONTNEED) < 0) {
-            error_report("migrate: madvise DONTNEED failed %p %zd: %s",
-                         iov.iov_base, iov.iov_len, strerror(errno));
-        }
+        qemu_release_ram_range(f, &iov);
         iov = f->iov[idx];
     }
-    if (qemu_madvise(iov.iov_base, iov.iov_len, QEMU_MADV_DONTNEED) < 0) {
-            error_report("migrate: madvise DONTNEED failed %p %zd: %s",
-                         iov.iov_base, iov.iov_len, strerror(errno));
-    }
+    qemu_release_ram_range(f, &iov);
     memset(f->may_free, 0, sizeof(f->may_free));
 }
 
+/**
+ * Waits for the zero copy writes issued so far
+ *
+ * Afterwards buf may be reused and the RAM ranges whose release was
+ * deferred are released.  Returns negative errno on error, 1 if the
+ * backend fell back to copying some of the data, 0 otherwise.
+ */
+int qemu_file_flush_zero_copy(QEMUFile *f)
+{
+    int ret = 0;
+    guint i;
+
+    if (!f->zero_copy_pending) {
+        return 0;
+    }
+
+    /* A broken stream won't deliver completions, nothing is sent anyway */
+    if (!f->last_error) {
+        ret = f->ops->flush_zero_copy(f->opaque);
+        trace_qemu_file_flush_zero_copy(ret);
+        if (ret < 0) {
+            qemu_file_set_error(f, ret);
+        }
+    }
+    f->zero_copy_pending = false;
+
+    for (i = 0; i < f->release_pending->len; i++) {
+        qemu_release_ram_range(f, &g_array_index(f->release_pending,
+                                                 struct iovec, i));
+    }
+    g_array_set_size(f->release_pending, 0);
+
+    return ret;
+}
+
+/**
+ * Sends the buffers queued with qemu_put_buffer_async() without copying
+ *
+ * The buffers must then stay unmodified until qemu_file_flush_zero_copy()
+ * or qemu_fclose(), which holds for guest RAM since a page written to in
+ * the meantime is dirty and sent again.  Returns -ENOTSUP if the backend
+ * cannot send without copying.
+ */
+int qemu_file_set_zero_copy(QEMUFile *f, bool enable)
+{
+    if (enable && !f->ops->writev_zero_copy) {
+        return -ENOTSUP;
+    }
+
+    if (enable && !f->release_pending) {
+        f->release_pending = g_array_new(FALSE, FALSE, sizeof(struct iovec));
+    }
+    if (!enable) {
+        qemu_fflush(f);
+        qemu_file_flush_zero_copy(f);
+    }
+    f->zero_copy = enable;
+    return 0;
+}
+
 /**
  * Flushes QEMUFile buffer
  *
@@ -184,7 +259,13 @@ void qemu_fflush(QEMUFile *f)
 
     if (f->iovcnt > 0) {
         expect = iov_size(f->iov, f->iovcnt);
-        ret = f->ops->writev_buffer(f->opaque, f->iov, f->iovcnt, f->pos);
+        if (f->zero_copy && f->iov_async) {
+            ret = f->ops->writev_zero_copy(f->opaque, f->iov, f->iovcnt,
+                                           f->pos);
+            f->zero_copy_pending = true;
+        } else {
+            ret = f->ops->writev_buffer(f->opaque, f->iov, f->iovcnt, f->pos);
+        }
 
         qemu_iovec_release_ram(f);
     }
@@ -198,8 +279,97 @@ void qemu_fflush(QEMUFile *f)
     if (ret != expect) {
         qemu_file_set_error(f, ret < 0 ? ret : -EIO);
     }
-    f->buf_index = 0;
     f->iovcnt = 0;
+    f->iov_async = false;
+
+    /*
+     * Zero copy writes may still reference buf, so keep appending behind
+     * the data they sent and only start over once they have completed.
+     * Half of the buffer is kept free for callers flushing to make room.
+     */
+    if (f->zero_copy_pending) {
+        if (f->buf_index < IO_BUF_SIZE / 2) {
+            return;
+        }
+        qemu_file_flush_zero_copy(f);
+    }
+    f->buf_index = 0;
+}
+
+bool qemu_file_is_seekable(QEMUFile *f)
+{
+    return f->ops->seek != NULL;
+}
+
+/*
+ * Write @buf at @pos in the backend, bypassing the buffer and the position
+ * of the stream.  The data counts towards the rate limit.
+ *
+ * Returns negative errno on error, also recorded in @f, 0 on success.
+ */
+int qemu_put_buffer_at(QEMUFile *f, const uint8_t *buf, size_t size,
+                       int64_t pos)
+{
+    ssize_t ret;
+
+    if (f->last_error) {
+        return f->last_error;
+    }
+
+    ret = f->ops->pwrite_buffer(f->opaque, buf, size, pos);
+    if (ret < 0) {
+        qemu_file_set_error(f, ret);
+        return ret;
+    }
+    f->bytes_xfer += size;
+    return 0;
+}
+
+/*
+ * Fill @buf with the data at @pos in the backend, bypassing the buffer and
+ * the position of the stream.  Several threads may read at once.
+ *
+ * Returns negative errno on error, also recorded in @f, 0 on success.
+ */
+int qemu_get_buffer_at(QEMUFile *f, uint8_t *buf, size_t size, int64_t pos)
+{
+    ssize_t ret;
+
+    ret = f->ops->pread_buffer(f->opaque, buf, size, pos);
+    if (ret < 0) {
+        qemu_file_set_error(f, ret);
+        return ret;
+    }
+    return 0;
+}
+
+/*
+ * Continue the stream at @pos of a seekable backend.  Pending writes are
+ * flushed, and buffered input is dropped.
+ *
+ * Returns negative errno on error, also recorded in @f, 0 on success.
+ */
+int qemu_file_set_offset(QEMUFile *f, int64_t pos)
+{
+    int ret;
+
+    if (qemu_file_is_writable(f)) {
+        qemu_fflush(f);
+    } else {
+        f->buf_index = 0;
+        f->buf_size = 0;
+    }
+    if (f->last_error) {
+        return f->last_error;
+    }
+
+    ret = f->ops->seek(f->opaque, pos);
+    if (ret < 0) {
+        qemu_file_set_error(f, ret);
+        return ret;
+    }
+    f->pos = pos;
+    return 0;
 }
 
 void ram_control_before_iterate(QEMUFile *f, uint64_t flags)
@@ -309,6 +479,16 @@ void qemu_update_position(QEMUFile *f, size_t size)
     f->pos += size;
 }
 
+/*
+ * Account data sent on behalf of this file through another channel, so
+ * that both qemu_ftell() and the rate limit take it into account.
+ */
+void qemu_file_credit_transfer(QEMUFile *f, size_t size)
+{
+    f->pos += size;
+    f->bytes_xfer += size;
+}
+
 /** Closes the file
  *
  * Returns negative error value if any error happened on previous operations or
@@ -321,6 +501,7 @@ int qemu_fclose(QEMUFile *f)
 {
     int ret;
     qemu_fflush(f);
+    qemu_file_flush_zero_copy(f);
     ret = qemu_file_get_error(f);
 
     if (f->ops->close) {
@@ -335,6 +516,9 @@ int qemu_fclose(QEMUFile *f)
     if (f->last_error) {
         ret = f->last_error;
     }
+    if (f->release_pending) {
+        g_array_free(f->release_pending, TRUE);
+    }
     g_free(f);
     trace_qemu_file_fclose();
     return ret;
@@ -370,6 +554,7 @@ void qemu_put_buffer_async(QEMUFile *f, const uint8_t *buf, size_t size,
     }
 
     f->bytes_xfer += size;
+    f->iov_async = true;
     add_to_iovec(f, buf, size, may_free);
 }
 
@@ -573,6 +758,11 @@ int64_t qemu_ftell_fast(QEMUFile *f)
     int64_t ret = f->pos;
     int i;
 
+    if (!qemu_file_is_writable(f)) {
+        /* Data read ahead into the buffer has not been consumed yet */
+        return ret - (f->buf_size - f->buf_index);
+    }
+
     for (i = 0; i < f->iovcnt; i++) {
         ret += f->iov[i].iov_len;
     }
@@ -658,64 +848,6 @@ uint64_t qemu_get_be64(QEMUFile *f)
     return v;
 }
 
-/* Compress size bytes of data start at p with specific compression
- * level and store the compressed data to the buffer of f.
- *
- * When f is not writable, return -1 if f has no space to save the
- * compressed data.
- * When f is wirtable and it has no space to save the compressed data,
- * do fflush first, if f still has no space to save the compressed
- * data, return -1.
- */
-
-ssize_t qemu_put_compression_data(QEMUFile *f, const uint8_t *p, size_t size,
-                                  int level)
-{
-    ssize_t blen = IO_BUF_SIZE - f->buf_index - sizeof(int32_t);
-
-    if (blen < compressBound(size)) {
-        if (!qemu_file_is_writable(f)) {
-            return -1;
-        }
-        qemu_fflush(f);
-        blen = IO_BUF_SIZE - sizeof(int32_t);
-        if (blen < compressBound(size)) {
-            return -1;
-        }
-    }
-    if (compress2(f->buf + f->buf_index + sizeof(int32_t), (uLongf *)&blen,
-                  (Bytef *)p, size, level) != Z_OK) {
-        error_report("Compress Failed!");
-        return 0;
-    }
-    qemu_put_be32(f, blen);
-    if (f->ops->writev_buffer) {
-        add_to_iovec(f, f->buf + f->buf_index, blen, false);
-    }
-    f->buf_index += blen;
-    if (f->buf_index == IO_BUF_SIZE) {
-        qemu_fflush(f);
-    }
-    return blen + sizeof(int32_t);
-}
-
-/* Put the data in the buffer of f_src to the buffer of f_des, and
- * then reset the buf_index of f_src to 0.
- */
-
-int qemu_put_qemu_file(QEMUFile *f_des, QEMUFile *f_src)
-{
-    int len = 0;
-
-    if (f_src->buf_index > 0) {
-        len = f_src->buf_index;
-        qemu_put_buffer(f_des, f_src->buf, f_src->buf_index);
-        f_src->buf_index = 0;
-        f_src->iovcnt = 0;
-    }
-    return len;
-}
-
 /*
  * Get a string whose length is determined by a single preceding byte
  * A preallocated 256 byte buffer must be passed in.
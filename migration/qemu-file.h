@@ -56,6 +56,30 @@ typedef int (QEMUFileSetBlocking)(void *opaque, bool enabled);
 typedef ssize_t (QEMUFileWritevBufferFunc)(void *opaque, struct iovec *iov,
                                            int iovcnt, int64_t pos);
 
+/*
+ * Wait until everything written by the writev_zero_copy handler has left
+ * the host, so that the memory it referenced may be modified again.
+ * Returns negative errno on error, 1 if the backend had to fall back to
+ * copying some of the data, 0 otherwise.
+ */
+typedef int (QEMUFileFlushZeroCopyFunc)(void *opaque);
+
+/*
+ * Write or read data at an absolute position of a random access backend,
+ * leaving the position of the stream alone.  The handler must transfer
+ * all of the data or return a negative errno value.
+ */
+typedef ssize_t (QEMUFilePwriteFunc)(void *opaque, const uint8_t *buf,
+                                     size_t size, int64_t pos);
+typedef ssize_t (QEMUFilePreadFunc)(void *opaque, uint8_t *buf,
+                                    size_t size, int64_t pos);
+
+/*
+ * Move the stream of a random access backend to @pos.
+ * Returns negative errno on error, 0 on success.
+ */
+typedef int (QEMUFileSeekFunc)(void *opaque, int64_t pos);
+
 /*
  * This function provides hooks around different
  * stages of RAM migration.
@@ -104,6 +128,13 @@ typedef struct QEMUFileOps {
     QEMUFileWritevBufferFunc *writev_buffer;
     QEMURetPathFunc *get_return_path;
     QEMUFileShutdownFunc *shut_down;
+    /* Like writev_buffer, but the data is referenced rather than copied */
+    QEMUFileWritevBufferFunc *writev_zero_copy;
+    QEMUFileFlushZeroCopyFunc *flush_zero_copy;
+    /* Only provided by random access backends, see qemu_file_is_seekable */
+    QEMUFilePwriteFunc *pwrite_buffer;
+    QEMUFilePreadFunc *pread_buffer;
+    QEMUFileSeekFunc *seek;
 } QEMUFileOps;
 
 typedef struct QEMUFileHooks {
@@ -132,9 +163,6 @@ bool qemu_file_is_writable(QEMUFile *f);
 
 size_t qemu_peek_buffer(QEMUFile *f, uint8_t **buf, size_t size, size_t offset);
 size_t qemu_get_buffer_in_place(QEMUFile *f, uint8_t **buf, size_t size);
-ssize_t qemu_put_compression_data(QEMUFile *f, const uint8_t *p, size_t size,
-                                  int level);
-int qemu_put_qemu_file(QEMUFile *f_des, QEMUFile *f_src);
 
 /*
  * Note that you can only peek continuous bytes from where the current pointer
@@ -144,6 +172,7 @@ int qemu_put_qemu_file(QEMUFile *f_des, QEMUFile *f_src);
 int qemu_peek_byte(QEMUFile *f, int offset);
 void qemu_file_skip(QEMUFile *f, int size);
 void qemu_update_position(QEMUFile *f, size_t size);
+void qemu_file_credit_transfer(QEMUFile *f, size_t size);
 void qemu_file_reset_rate_limit(QEMUFile *f);
 void qemu_file_set_rate_limit(QEMUFile *f, int64_t new_rate);
 int64_t qemu_file_get_rate_limit(QEMUFile *f);
@@ -153,6 +182,13 @@ int qemu_file_shutdown(QEMUFile *f);
 QEMUFile *qemu_file_get_return_path(QEMUFile *f);
 void qemu_fflush(QEMUFile *f);
 void qemu_file_set_blocking(QEMUFile *f, bool block);
+int qemu_file_set_zero_copy(QEMUFile *f, bool enable);
+int qemu_file_flush_zero_copy(QEMUFile *f);
+bool qemu_file_is_seekable(QEMUFile *f);
+int qemu_put_buffer_at(QEMUFile *f, const uint8_t *buf, size_t size,
+                       int64_t pos);
+int qemu_get_buffer_at(QEMUFile *f, uint8_t *buf, size_t size, int64_t pos);
+int qemu_file_set_offset(QEMUFile *f, int64_t pos);
 
 size_t qemu_get_counted_string(QEMUFile *f, char buf[256]);
 
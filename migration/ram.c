@@ -26,13 +26,14 @@
  * THE SOFTWARE.
  */
 #include "qemu/osdep.h"
+#include <math.h>
 #include "cpu.h"
-#include <zlib.h>
 #include "qapi-event.h"
 #include "qemu/cutils.h"
 #include "qemu/bitops.h"
 #include "qemu/bitmap.h"
 #include "qemu/main-loop.h"
+#include "sysemu/sysemu.h"
 #include "xbzrle.h"
 #include "ram.h"
 #include "migration.h"
@@ -47,6 +48,10 @@
 #include "qemu/rcu_queue.h"
 #include "migration/colo.h"
 #include "sysemu/balloon.h"
+#include "qemu-file-channel.h"
+#include "socket.h"
+#include "compress.h"
+#include "crypto/hash.h"
 
 /***********************************************************/
 /* ram save/restore */
@@ -57,7 +62,8 @@
  * RAM_SSAVE_FLAG_COMPRESS_PAGE just rename it.
  */
 
-#define RAM_SAVE_FLAG_FULL     0x01 /* Obsolete, not used anymore */
+/* 0x01 was RAM_SAVE_FLAG_FULL, which has not been sent since 2009 */
+#define RAM_SAVE_FLAG_DEDUP    0x01
 #define RAM_SAVE_FLAG_ZERO     0x02
 #define RAM_SAVE_FLAG_MEM_SIZE 0x04
 #define RAM_SAVE_FLAG_PAGE     0x08
@@ -66,6 +72,7 @@
 #define RAM_SAVE_FLAG_XBZRLE   0x40
 /* 0x80 is reserved in migration.h start with 0x100 next */
 #define RAM_SAVE_FLAG_COMPRESS_PAGE    0x100
+#define RAM_SAVE_FLAG_MULTIFD_SYNC     0x200
 
 static inline bool is_zero_range(uint8_t *p, uint64_t size)
 {
@@ -81,7 +88,10 @@ static struct {
     uint8_t *encoded_buf;
     /* buffer for storing page content */
     uint8_t *current_buf;
-    /* Cache for XBZRLE, Protected by lock. */
+    /*
+     * Cache for XBZRLE.  Replaced under lock, and read by the migration
+     * thread within an RCU critical section without taking the lock.
+     */
     PageCache *cache;
     QemuMutex lock;
     /* it will store a page full of zeros */
@@ -102,13 +112,94 @@ static void XBZRLE_cache_unlock(void)
         qemu_mutex_unlock(&XBZRLE.lock);
 }
 
+/*
+ * PageCache is opaque here, which atomic_rcu_read() can't cope with.
+ * Called within an RCU critical section.
+ */
+static PageCache *xbzrle_cache_rcu_read(void)
+{
+    PageCache *cache;
+
+    atomic_rcu_read__nocheck(&XBZRLE.cache, &cache);
+    return cache;
+}
+
+/* Per-way statistics of the XBZRLE caches that have been freed */
+static PageCacheWayStats xbzrle_way_counters[PAGE_CACHE_WAYS];
+
+typedef struct XBZRLERetiredCache {
+    struct rcu_head rcu;
+    PageCache *cache;
+} XBZRLERetiredCache;
+
+static void xbzrle_cache_free_rcu(XBZRLERetiredCache *retired)
+{
+    cache_fini(retired->cache);
+    g_free(retired);
+}
+
+/*
+ * Replace the XBZRLE cache with @new_cache and free the old one once
+ * no reader can still be using it.  Called with XBZRLE.lock held.
+ */
+static void xbzrle_cache_replace(PageCache *new_cache)
+{
+    XBZRLERetiredCache *retired;
+
+    if (XBZRLE.cache) {
+        retired = g_new0(XBZRLERetiredCache, 1);
+        retired->cache = XBZRLE.cache;
+        atomic_rcu_set(&XBZRLE.cache, new_cache);
+        /* hits of a reader still using the old cache are not accounted */
+        cache_get_way_stats(retired->cache, xbzrle_way_counters);
+        call_rcu(retired, xbzrle_cache_free_rcu, rcu);
+    } else {
+        atomic_rcu_set(&XBZRLE.cache, new_cache);
+    }
+}
+
+/**
+ * xbzrle_cache_way_stats: per-way statistics of the XBZRLE cache
+ *
+ * Returns a list of the hit, miss and eviction counters of each way,
+ * including those of caches that have been freed since.
+ */
+XBZRLECacheWayStatsList *xbzrle_cache_way_stats(void)
+{
+    PageCacheWayStats stats[PAGE_CACHE_WAYS];
+    XBZRLECacheWayStatsList *head = NULL, **tail = &head;
+    PageCache *cache;
+    int i;
+
+    memcpy(stats, xbzrle_way_counters, sizeof(stats));
+    rcu_read_lock();
+    cache = xbzrle_cache_rcu_read();
+    if (cache) {
+        cache_get_way_stats(cache, stats);
+    }
+    rcu_read_unlock();
+
+    for (i = 0; i < PAGE_CACHE_WAYS; i++) {
+        XBZRLECacheWayStatsList *entry = g_new0(XBZRLECacheWayStatsList, 1);
+
+        entry->value = g_new0(XBZRLECacheWayStats, 1);
+        entry->value->way = i;
+        entry->value->hits = stats[i].hits;
+        entry->value->misses = stats[i].misses;
+        entry->value->evictions = stats[i].evictions;
+        *tail = entry;
+        tail = &entry->next;
+    }
+    return head;
+}
+
 /**
  * xbzrle_cache_resize: resize the xbzrle cache
  *
  * This function is called from qmp_migrate_set_cache_size in main
- * thread, possibly while a migration is in progress.  A running
- * migration may be using the cache and might finish during this call,
- * hence changes to the cache are protected by XBZRLE.lock().
+ * thread, possibly while a migration is in progress.  Replacing the
+ * cache is serialized by XBZRLE.lock(); a running migration keeps
+ * using the old cache until its current RCU critical section ends.
  *
  * Returns the new_size or negative in case of error.
  *
@@ -137,8 +228,7 @@ int64_t xbzrle_cache_resize(int64_t new_size)
             goto out;
         }
 
-        cache_fini(XBZRLE.cache);
-        XBZRLE.cache = new_cache;
+        xbzrle_cache_replace(new_cache);
     }
 
 out_new_size:
@@ -193,7 +283,7 @@ struct RAMState {
     uint64_t migration_dirty_pages;
     /* The feature, skip transfering of free pages, is supported */
     bool free_page_support;
-    /* Skip the transfer of free pages in the bulk stage */
+    /* Free page hints are no longer applied to the bitmap */
     bool free_page_done;
     /* protects modification of the bitmap */
     QemuMutex bitmap_mutex;
@@ -202,6 +292,30 @@ struct RAMState {
     /* Queue of outstanding page requests from the destination */
     QemuMutex src_page_req_mutex;
     QSIMPLEQ_HEAD(src_page_requests, RAMSrcPageRequest) src_page_requests;
+    /* dirty_sync_count when the multifd channels were last synced */
+    uint64_t multifd_sync_count;
+    /* Helper threads for migration_bitmap_sync(), or NULL */
+    struct DirtySyncPool *dirty_sync_pool;
+    /* Convergence model, updated at the end of each bitmap sync period */
+    bool conv_valid;
+    /* smoothed transfer rate in bytes/s */
+    double conv_bandwidth;
+    /* smoothed dirty rate in bytes/s the guest would have unthrottled */
+    double conv_guest_rate;
+    /* x-mapped-ram: contiguous pages not written to the file yet */
+    uint8_t *mapped_run_host;
+    int64_t mapped_run_pos;
+    size_t mapped_run_len;
+    /* x-defer-hot-pages: leave the hot words of the bitmap for later */
+    bool defer_hot;
+    /* The current search skipped a hot page */
+    bool hot_skipped;
+    /* dirty_sync_count when nothing but hot pages was left to send */
+    uint64_t hot_only_sync;
+    /* x-dedup-pages: digest -> RAMBlock of a page the destination holds */
+    GHashTable *dedup_index;
+    /* x-dedup-pages: stable copy of the page being hashed and sent */
+    uint8_t *dedup_buf;
 };
 typedef struct RAMState RAMState;
 
@@ -225,197 +339,1413 @@ struct PageSearchStatus {
 };
 typedef struct PageSearchStatus PageSearchStatus;
 
-struct CompressParam {
-    bool done;
-    bool quit;
-    QEMUFile *file;
-    QemuMutex mutex;
-    QemuCond cond;
-    RAMBlock *block;
-    ram_addr_t offset;
+/* Pages of the same RAMBlock handed to a (de)compression thread at once */
+#define COMPRESS_BATCH_PAGES 16
+/* Jobs in flight per thread, so that the threads keep working while the
+ * migration thread writes out the output of the jobs that are done.
+ */
+#define COMPRESS_JOBS_PER_THREAD 2
+/* Size of the header written before each compressed page */
+#define COMPRESS_PAGE_HDR_SIZE (sizeof(uint64_t) + sizeof(uint32_t))
+
+enum {
+    COMPRESS_JOB_FREE,
+    COMPRESS_JOB_SUBMITTED,
+    COMPRESS_JOB_DONE,
 };
-typedef struct CompressParam CompressParam;
 
-struct DecompressParam {
-    bool done;
+typedef struct CompressJob {
+    int state;
+    unsigned int nr_pages;
+    /* Save side: pages of @block to compress */
+    RAMBlock *block;
+    ram_addr_t offset[COMPRESS_BATCH_PAGES];
+    /* Load side: where the compressed pages stored in @buf go */
+    void *host[COMPRESS_BATCH_PAGES];
+    uint32_t len[COMPRESS_BATCH_PAGES];
+    /* Save side: the page records to send; load side: the received data */
+    uint8_t *buf;
+    size_t used;
+    int ret;
+} CompressJob;
+
+typedef struct CompressRing CompressRing;
+
+typedef struct CompressWorker {
+    CompressRing *ring;
+    CompressContext *ctx;
+    QemuThread thread;
+    /* Save side: stable copy of the page being compressed */
+    uint8_t *page;
+} CompressWorker;
+
+/*
+ * Ring of jobs between one producer (the migration thread, or the
+ * incoming thread on the load side) and the (de)compression threads.
+ *
+ * The producer fills the slot at @head, publishes it by marking it
+ * SUBMITTED and posts @submitted once; every post lets one worker claim
+ * the next slot by atomically incrementing @claim, so the workers never
+ * take a lock.  Workers mark their slot DONE and set @completed.  The
+ * producer retires jobs in submission order from @tail, which keeps the
+ * compressed pages in the stream in the order they were queued.
+ *
+ * @head, @tail and @filling are only accessed by the producer.
+ */
+struct CompressRing {
+    const char *name;
+    CompressJob *jobs;
+    unsigned int nr_jobs;
+    unsigned int head;
+    unsigned int tail;
+    unsigned int claim;
+    bool filling;
     bool quit;
-    QemuMutex mutex;
-    QemuCond cond;
-    void *des;
-    uint8_t *compbuf;
-    int len;
+    QemuSemaphore submitted;
+    QemuEvent completed;
+    CompressWorker *workers;
+    unsigned int nr_workers;
+    /* Worst case size of one compressed page */
+    size_t page_bound;
+    /* Run by the workers on each job */
+    void (*process)(CompressWorker *worker, CompressJob *job);
+    /* Run by the producer on each job that is done, may be NULL */
+    void (*retire)(void *opaque, CompressJob *job);
+    void *opaque;
+    /* Load side: first error of the workers, set atomically */
+    int ret;
 };
-typedef struct DecompressParam DecompressParam;
 
-static CompressParam *comp_param;
-static QemuThread *compress_threads;
-/* comp_done_cond is used to wake up the migration thread when
- * one of the compression threads has finished the compression.
- * comp_done_lock is used to co-work with comp_done_cond.
- */
-static QemuMutex comp_done_lock;
-static QemuCond comp_done_cond;
-/* The empty QEMUFileOps will be used by file in CompressParam */
-static const QEMUFileOps empty_ops = { };
+static CompressRing compress_ring;
+/* Used by the migration thread for the first page of each block */
+static CompressContext *compress_main_ctx;
+static uint8_t *compress_main_buf;
+static uint8_t *compress_main_page;
 
-static DecompressParam *decomp_param;
-static QemuThread *decompress_threads;
-static QemuMutex decomp_done_lock;
-static QemuCond decomp_done_cond;
+static CompressRing decompress_ring;
 
-static int do_compress_ram_page(QEMUFile *f, RAMBlock *block,
-                                ram_addr_t offset);
+static void do_compress_job(CompressWorker *worker, CompressJob *job);
+static void compress_job_retire(void *opaque, CompressJob *job);
 
-static void *do_data_compress(void *opaque)
+static void *compress_worker_thread(void *opaque)
 {
-    CompressParam *param = opaque;
-    RAMBlock *block;
-    ram_addr_t offset;
+    CompressWorker *worker = opaque;
+    CompressRing *ring = worker->ring;
+    CompressJob *job;
+
+    while (true) {
+        qemu_sem_wait(&ring->submitted);
+        if (atomic_read(&ring->quit)) {
+            break;
+        }
+        job = &ring->jobs[atomic_fetch_inc(&ring->claim) % ring->nr_jobs];
+        assert(atomic_mb_read(&job->state) == COMPRESS_JOB_SUBMITTED);
+        ring->process(worker, job);
+        atomic_mb_set(&job->state, COMPRESS_JOB_DONE);
+        qemu_event_set(&ring->completed);
+    }
 
-    qemu_mutex_lock(&param->mutex);
-    while (!param->quit) {
-        if (param->block) {
-            block = param->block;
-            offset = param->offset;
-            param->block = NULL;
-            qemu_mutex_unlock(&param->mutex);
+    return NULL;
+}
 
-            do_compress_ram_page(param->file, block, offset);
+static void compress_ring_cleanup(CompressRing *ring)
+{
+    unsigned int i;
 
-            qemu_mutex_lock(&comp_done_lock);
-            param->done = true;
-            qemu_cond_signal(&comp_done_cond);
-            qemu_mutex_unlock(&comp_done_lock);
+    if (!ring->workers) {
+        return;
+    }
+    atomic_set(&ring->quit, true);
+    for (i = 0; i < ring->nr_workers; i++) {
+        qemu_sem_post(&ring->submitted);
+    }
+    for (i = 0; i < ring->nr_workers; i++) {
+        if (ring->workers[i].ring) {
+            qemu_thread_join(&ring->workers[i].thread);
+        }
+        compress_context_free(ring->workers[i].ctx);
+        g_free(ring->workers[i].page);
+    }
+    for (i = 0; i < ring->nr_jobs; i++) {
+        g_free(ring->jobs[i].buf);
+    }
+    qemu_sem_destroy(&ring->submitted);
+    qemu_event_destroy(&ring->completed);
+    g_free(ring->workers);
+    g_free(ring->jobs);
+    memset(ring, 0, sizeof(*ring));
+}
 
-            qemu_mutex_lock(&param->mutex);
-        } else {
-            qemu_cond_wait(&param->cond, &param->mutex);
+/*
+ * compress_ring_init: start @nr_workers threads processing the jobs of
+ * @ring with @process
+ *
+ * Returns 0 for success or -1 if a compression context could not be
+ * set up, in which case @errp is set.
+ */
+static int compress_ring_init(CompressRing *ring, const char *name,
+                              unsigned int nr_workers, bool decompress,
+                              void (*process)(CompressWorker *, CompressJob *),
+                              void (*retire)(void *, CompressJob *),
+                              void *opaque, Error **errp)
+{
+    MigrationCompressMethod method = migrate_compress_method();
+    size_t buf_size;
+    unsigned int i;
+
+    memset(ring, 0, sizeof(*ring));
+    ring->name = name;
+    ring->nr_workers = nr_workers;
+    /* A power of two, so that the indexes can wrap around */
+    ring->nr_jobs = pow2ceil(nr_workers * COMPRESS_JOBS_PER_THREAD);
+    ring->page_bound = compress_bound(method, TARGET_PAGE_SIZE);
+    ring->process = process;
+    ring->retire = retire;
+    ring->opaque = opaque;
+    qemu_sem_init(&ring->submitted, 0);
+    qemu_event_init(&ring->completed, false);
+
+    buf_size = COMPRESS_BATCH_PAGES * ring->page_bound;
+    if (!decompress) {
+        buf_size += COMPRESS_BATCH_PAGES * COMPRESS_PAGE_HDR_SIZE;
+    }
+    ring->jobs = g_new0(CompressJob, ring->nr_jobs);
+    for (i = 0; i < ring->nr_jobs; i++) {
+        ring->jobs[i].buf = g_malloc(buf_size);
+    }
+
+    ring->workers = g_new0(CompressWorker, nr_workers);
+    for (i = 0; i < nr_workers; i++) {
+        ring->workers[i].ctx = compress_context_new(method,
+                                                    migrate_compress_level(),
+                                                    decompress, errp);
+        if (!ring->workers[i].ctx) {
+            compress_ring_cleanup(ring);
+            return -1;
         }
+        if (!decompress) {
+            ring->workers[i].page = g_malloc(TARGET_PAGE_SIZE);
+        }
+    }
+    for (i = 0; i < nr_workers; i++) {
+        ring->workers[i].ring = ring;
+        qemu_thread_create(&ring->workers[i].thread, name,
+                           compress_worker_thread, &ring->workers[i],
+                           QEMU_THREAD_JOINABLE);
     }
-    qemu_mutex_unlock(&param->mutex);
+    return 0;
+}
 
-    return NULL;
+/*
+ * compress_ring_retire: retire the oldest job that was submitted
+ *
+ * Returns true if a job was retired, false if there was none or, when
+ * @wait is false, if it is not done yet.
+ */
+static bool compress_ring_retire(CompressRing *ring, bool wait)
+{
+    CompressJob *job;
+
+    if (ring->tail == ring->head) {
+        return false;
+    }
+    job = &ring->jobs[ring->tail % ring->nr_jobs];
+    while (atomic_mb_read(&job->state) != COMPRESS_JOB_DONE) {
+        if (!wait) {
+            return false;
+        }
+        qemu_event_reset(&ring->completed);
+        if (atomic_mb_read(&job->state) == COMPRESS_JOB_DONE) {
+            break;
+        }
+        qemu_event_wait(&ring->completed);
+    }
+    if (ring->retire) {
+        ring->retire(ring->opaque, job);
+    }
+    atomic_set(&job->state, COMPRESS_JOB_FREE);
+    ring->tail++;
+    return true;
 }
 
-static inline void terminate_compression_threads(void)
+/* Returns the job being filled, waiting for a free slot if needed */
+static CompressJob *compress_ring_get_job(CompressRing *ring)
 {
-    int idx, thread_count;
+    CompressJob *job = &ring->jobs[ring->head % ring->nr_jobs];
 
-    thread_count = migrate_compress_threads();
+    if (!ring->filling) {
+        while (ring->head - ring->tail >= ring->nr_jobs) {
+            compress_ring_retire(ring, true);
+        }
+        job->nr_pages = 0;
+        job->block = NULL;
+        job->used = 0;
+        job->ret = 0;
+        ring->filling = true;
+    }
+    return job;
+}
+
+static void compress_ring_submit(CompressRing *ring)
+{
+    CompressJob *job = &ring->jobs[ring->head % ring->nr_jobs];
 
-    for (idx = 0; idx < thread_count; idx++) {
-        qemu_mutex_lock(&comp_param[idx].mutex);
-        comp_param[idx].quit = true;
-        qemu_cond_signal(&comp_param[idx].cond);
-        qemu_mutex_unlock(&comp_param[idx].mutex);
+    if (!ring->filling) {
+        return;
     }
+    trace_compress_ring_submit(ring->name, ring->head, job->nr_pages);
+    ring->filling = false;
+    atomic_mb_set(&job->state, COMPRESS_JOB_SUBMITTED);
+    ring->head++;
+    qemu_sem_post(&ring->submitted);
 }
 
-static void compress_threads_save_cleanup(void)
+/* Submit the job being filled and wait until all jobs are retired */
+static void compress_ring_flush(CompressRing *ring)
 {
-    int i, thread_count;
+    compress_ring_submit(ring);
+    while (compress_ring_retire(ring, true)) {
+        /* nothing */
+    }
+}
 
+static void compress_threads_save_cleanup(void)
+{
     if (!migrate_use_compression()) {
         return;
     }
-    terminate_compression_threads();
-    thread_count = migrate_compress_threads();
-    for (i = 0; i < thread_count; i++) {
-        qemu_thread_join(compress_threads + i);
-        qemu_fclose(comp_param[i].file);
-        qemu_mutex_destroy(&comp_param[i].mutex);
-        qemu_cond_destroy(&comp_param[i].cond);
-    }
-    qemu_mutex_destroy(&comp_done_lock);
-    qemu_cond_destroy(&comp_done_cond);
-    g_free(compress_threads);
-    g_free(comp_param);
-    compress_threads = NULL;
-    comp_param = NULL;
+    compress_ring_cleanup(&compress_ring);
+    compress_context_free(compress_main_ctx);
+    g_free(compress_main_buf);
+    g_free(compress_main_page);
+    compress_main_ctx = NULL;
+    compress_main_buf = NULL;
+    compress_main_page = NULL;
 }
 
-static void compress_threads_save_setup(void)
+static int compress_threads_save_setup(RAMState *rs)
 {
-    int i, thread_count;
+    Error *local_err = NULL;
 
     if (!migrate_use_compression()) {
-        return;
+        return 0;
     }
-    thread_count = migrate_compress_threads();
-    compress_threads = g_new0(QemuThread, thread_count);
-    comp_param = g_new0(CompressParam, thread_count);
-    qemu_cond_init(&comp_done_cond);
-    qemu_mutex_init(&comp_done_lock);
-    for (i = 0; i < thread_count; i++) {
-        /* comp_param[i].file is just used as a dummy buffer to save data,
-         * set its ops to empty.
-         */
-        comp_param[i].file = qemu_fopen_ops(NULL, &empty_ops);
-        comp_param[i].done = true;
-        comp_param[i].quit = false;
-        qemu_mutex_init(&comp_param[i].mutex);
-        qemu_cond_init(&comp_param[i].cond);
-        qemu_thread_create(compress_threads + i, "compress",
-                           do_data_compress, comp_param + i,
-                           QEMU_THREAD_JOINABLE);
+    if (compress_ring_init(&compress_ring, "compress",
+                           migrate_compress_threads(), false,
+                           do_compress_job, compress_job_retire, rs,
+                           &local_err) < 0) {
+        goto err;
+    }
+    compress_main_ctx = compress_context_new(migrate_compress_method(),
+                                             migrate_compress_level(),
+                                             false, &local_err);
+    if (!compress_main_ctx) {
+        goto err;
+    }
+    compress_main_buf = g_malloc(compress_ring.page_bound);
+    compress_main_page = g_malloc(TARGET_PAGE_SIZE);
+    return 0;
+
+err:
+    error_report_err(local_err);
+    compress_threads_save_cleanup();
+    return -1;
+}
+
+/* Multiple fd's */
+
+#define MULTIFD_MAGIC 0x11223344U
+#define MULTIFD_VERSION 1
+
+/* The packet ends a dirty bitmap round, wait for the main thread */
+#define MULTIFD_FLAG_SYNC (1 << 0)
+
+/* Sanity limit for the number of pages in one packet */
+#define MULTIFD_MAX_PAGES 10000
+
+typedef struct {
+    /* number of used pages */
+    uint32_t used;
+    /* number of allocated pages */
+    uint32_t allocated;
+    /* global number of generated multifd packets */
+    uint64_t packet_num;
+    /* offset of each page inside the block */
+    ram_addr_t *offset;
+    /* block all the pages belong to */
+    RAMBlock *block;
+} MultiFDPages_t;
+
+typedef struct {
+    /* this fields are not changed once the thread is created */
+    /* channel number */
+    uint8_t id;
+    /* channel thread name */
+    char *name;
+    /* channel thread id */
+    QemuThread thread;
+    /* communication channel */
+    QIOChannel *c;
+    /* buffered output for the channel, only used by the thread */
+    QEMUFile *file;
+    /* sem where to wait for more work */
+    QemuSemaphore sem;
+    /* this mutex protects the following parameters */
+    QemuMutex mutex;
+    /* is this channel thread running */
+    bool running;
+    /* should this thread finish */
+    bool quit;
+    /* thread has work to do */
+    bool pending_job;
+    /* flags sent with the next packet */
+    uint32_t flags;
+    /* array of pages to sent */
+    MultiFDPages_t *pages;
+    /* packets sent through this channel */
+    uint64_t num_packets;
+} MultiFDSendParams;
+
+typedef struct {
+    /* this fields are not changed once the thread is created */
+    /* channel number */
+    uint8_t id;
+    /* channel thread name */
+    char *name;
+    /* channel thread id */
+    QemuThread thread;
+    /* communication channel */
+    QIOChannel *c;
+    /* buffered input for the channel, only used by the thread */
+    QEMUFile *file;
+    /* the main thread releases us with this after a sync packet */
+    QemuSemaphore sem_sync;
+    /* is this channel thread running */
+    bool running;
+    /* set by the main thread when the channel should finish */
+    bool quit;
+    /* offsets of the packet being received */
+    ram_addr_t *offset;
+    uint32_t allocated;
+    /* packets received through this channel */
+    uint64_t num_packets;
+} MultiFDRecvParams;
+
+static MultiFDPages_t *multifd_pages_init(size_t size)
+{
+    MultiFDPages_t *pages = g_new0(MultiFDPages_t, 1);
+
+    pages->allocated = size;
+    pages->offset = g_new0(ram_addr_t, size);
+
+    return pages;
+}
+
+static void multifd_pages_clear(MultiFDPages_t *pages)
+{
+    pages->used = 0;
+    pages->allocated = 0;
+    pages->packet_num = 0;
+    pages->block = NULL;
+    g_free(pages->offset);
+    pages->offset = NULL;
+    g_free(pages);
+}
+
+/**
+ * multifd_packet_size: number of bytes a packet takes on the wire
+ *
+ * @pages: pages that go in the packet
+ */
+static size_t multifd_packet_size(MultiFDPages_t *pages)
+{
+    /* flags, used, packet_num */
+    size_t size = 4 + 4 + 8;
+
+    if (pages->used) {
+        size += 1 + strlen(pages->block->idstr);
+        size += pages->used * (8 + TARGET_PAGE_SIZE);
+    }
+    return size;
+}
+
+struct {
+    MultiFDSendParams *params;
+    /* number of created threads */
+    int count;
+    /* array of pages to sent */
+    MultiFDPages_t *pages;
+    /* posted by each channel that is ready to take a new job */
+    QemuSemaphore channels_ready;
+    /* posted once for each channel when its connection finished */
+    QemuSemaphore channels_created;
+    /* global number of generated multifd packets */
+    uint64_t packet_num;
+    /* set when one of the channels failed */
+    int error;
+} *multifd_send_state;
+
+static void multifd_send_terminate_threads(void)
+{
+    int i;
+
+    for (i = 0; i < migrate_multifd_channels(); i++) {
+        MultiFDSendParams *p = &multifd_send_state->params[i];
+
+        qemu_mutex_lock(&p->mutex);
+        p->quit = true;
+        qemu_mutex_unlock(&p->mutex);
+        qemu_sem_post(&p->sem);
     }
 }
 
 /**
- * save_page_header: write page header to wire
+ * multifd_send_set_error: mark the multifd channels as failed
  *
- * If this is the 1st block, it also writes the block identification
+ * Wakes the migration thread if it is waiting for a free channel, it
+ * will notice the error and fail the migration.
+ */
+static void multifd_send_set_error(void)
+{
+    int i;
+
+    atomic_set(&multifd_send_state->error, 1);
+    for (i = 0; i < migrate_multifd_channels(); i++) {
+        qemu_sem_post(&multifd_send_state->channels_ready);
+    }
+}
+
+void multifd_save_cleanup(void)
+{
+    int i;
+
+    if (!migrate_use_multifd() || !multifd_send_state) {
+        return;
+    }
+    multifd_send_terminate_threads();
+    for (i = 0; i < migrate_multifd_channels(); i++) {
+        MultiFDSendParams *p = &multifd_send_state->params[i];
+
+        if (p->running) {
+            /* Don't let a stuck destination block the join */
+            qio_channel_shutdown(p->c, QIO_CHANNEL_SHUTDOWN_BOTH, NULL);
+            qemu_thread_join(&p->thread);
+            p->running = false;
+        }
+        if (p->file) {
+            qemu_fclose(p->file);
+            p->file = NULL;
+        }
+        if (p->c) {
+            socket_send_channel_destroy(p->c);
+            p->c = NULL;
+        }
+        qemu_mutex_destroy(&p->mutex);
+        qemu_sem_destroy(&p->sem);
+        g_free(p->name);
+        p->name = NULL;
+        multifd_pages_clear(p->pages);
+        p->pages = NULL;
+    }
+    qemu_sem_destroy(&multifd_send_state->channels_ready);
+    qemu_sem_destroy(&multifd_send_state->channels_created);
+    g_free(multifd_send_state->params);
+    multifd_send_state->params = NULL;
+    multifd_pages_clear(multifd_send_state->pages);
+    multifd_send_state->pages = NULL;
+    g_free(multifd_send_state);
+    multifd_send_state = NULL;
+}
+
+/**
+ * multifd_send_packet: write one packet to the channel
  *
- * Returns the number of bytes written
+ * Returns 0 for success or negative error code
  *
- * @f: QEMUFile where to send the data
- * @block: block that contains the page we want to send
- * @offset: offset inside the block for the page
- *          in the lower bits, it contains flags
+ * @p: channel the packet is sent on
+ * @flags: MULTIFD_FLAG_* bits for the packet
  */
-static size_t save_page_header(RAMState *rs, QEMUFile *f,  RAMBlock *block,
-                               ram_addr_t offset)
+static int multifd_send_packet(MultiFDSendParams *p, uint32_t flags)
 {
-    size_t size, len;
+    MultiFDPages_t *pages = p->pages;
+    QEMUFile *f = p->file;
+    uint32_t i;
 
-    if (block == rs->last_sent_block) {
-        offset |= RAM_SAVE_FLAG_CONTINUE;
-    }
-    qemu_put_be64(f, offset);
-    size = 8;
+    qemu_put_be32(f, flags);
+    qemu_put_be32(f, pages->used);
+    qemu_put_be64(f, pages->packet_num);
+
+    if (pages->used) {
+        size_t len = strlen(pages->block->idstr);
 
-    if (!(offset & RAM_SAVE_FLAG_CONTINUE)) {
-        len = strlen(block->idstr);
         qemu_put_byte(f, len);
-        qemu_put_buffer(f, (uint8_t *)block->idstr, len);
-        size += 1 + len;
-        rs->last_sent_block = block;
+        qemu_put_buffer(f, (uint8_t *)pages->block->idstr, len);
+        for (i = 0; i < pages->used; i++) {
+            qemu_put_be64(f, pages->offset[i]);
+        }
+        for (i = 0; i < pages->used; i++) {
+            qemu_put_buffer_async(f, pages->block->host + pages->offset[i],
+                                  TARGET_PAGE_SIZE, false);
+        }
     }
-    return size;
+    qemu_fflush(f);
+    p->num_packets++;
+
+    return qemu_file_get_error(f);
+}
+
+static void *multifd_send_thread(void *opaque)
+{
+    MultiFDSendParams *p = opaque;
+    int ret = 0;
+
+    rcu_register_thread();
+
+    qemu_put_be32(p->file, MULTIFD_MAGIC);
+    qemu_put_be32(p->file, MULTIFD_VERSION);
+    qemu_put_byte(p->file, p->id);
+    qemu_fflush(p->file);
+    ret = qemu_file_get_error(p->file);
+    if (ret) {
+        goto out;
+    }
+    qemu_sem_post(&multifd_send_state->channels_ready);
+
+    while (true) {
+        qemu_sem_wait(&p->sem);
+        qemu_mutex_lock(&p->mutex);
+        if (p->pending_job) {
+            uint32_t flags = p->flags;
+
+            p->flags = 0;
+            qemu_mutex_unlock(&p->mutex);
+
+            rcu_read_lock();
+            ret = multifd_send_packet(p, flags);
+            rcu_read_unlock();
+            trace_multifd_send(p->id, p->pages->packet_num, p->pages->used,
+                               flags);
+
+            qemu_mutex_lock(&p->mutex);
+            p->pages->used = 0;
+            p->pages->block = NULL;
+            p->pending_job = false;
+            qemu_mutex_unlock(&p->mutex);
+
+            if (ret) {
+                break;
+            }
+            qemu_sem_post(&multifd_send_state->channels_ready);
+        } else if (p->quit) {
+            qemu_mutex_unlock(&p->mutex);
+            break;
+        } else {
+            qemu_mutex_unlock(&p->mutex);
+            /* sometimes there are spurious wakeups */
+        }
+    }
+
+out:
+    if (ret) {
+        error_report("multifd channel %d: failed to send data: %s",
+                     p->id, strerror(-ret));
+        multifd_send_set_error();
+    }
+    trace_multifd_send_thread_end(p->id, p->num_packets);
+    rcu_unregister_thread();
+
+    return NULL;
+}
+
+static void multifd_new_send_channel_async(QIOTask *task, gpointer opaque)
+{
+    QIOChannel *sioc = QIO_CHANNEL(qio_task_get_source(task));
+    MultiFDSendParams *p;
+    Error *local_err = NULL;
+    int id = GPOINTER_TO_INT(opaque);
+
+    if (!multifd_send_state) {
+        /* Migration was cancelled before the channel was connected */
+        object_unref(OBJECT(sioc));
+        return;
+    }
+    p = &multifd_send_state->params[id];
+
+    if (qio_task_propagate_error(task, &local_err)) {
+        error_report("multifd channel %d: %s", id,
+                     error_get_pretty(local_err));
+        error_free(local_err);
+        object_unref(OBJECT(sioc));
+        multifd_send_set_error();
+        qemu_sem_post(&multifd_send_state->channels_created);
+        return;
+    }
+
+    p->c = sioc;
+    p->file = qemu_fopen_channel_output(sioc);
+    qemu_file_set_blocking(p->file, true);
+    if (migrate_use_zero_copy_send() &&
+        qemu_file_set_zero_copy(p->file, true) < 0) {
+        error_report("multifd channel %d: zero copy send not available", id);
+        multifd_send_set_error();
+        qemu_sem_post(&multifd_send_state->channels_created);
+        return;
+    }
+    p->running = true;
+    qemu_thread_create(&p->thread, p->name, multifd_send_thread, p,
+                       QEMU_THREAD_JOINABLE);
+    multifd_send_state->count++;
+    qemu_sem_post(&multifd_send_state->channels_created);
 }
 
 /**
- * mig_throttle_guest_down: throotle down the guest
+ * multifd_send_wait_connected: wait for the multifd connections
  *
- * Reduce amount of guest cpu execution to hopefully slow down memory
- * writes. If guest dirty memory rate is reduced below the rate at
- * which we can transfer pages to the destination then we should be
- * able to complete migration. Some workloads dirty memory way too
- * fast and will not effectively converge, even with auto-converge.
+ * The channels are connected from the main loop, so this must be
+ * called without the iothread lock before any page is queued.
+ *
+ * Returns 0 when all the channels are connected, -1 otherwise
  */
-static void mig_throttle_guest_down(void)
+int multifd_send_wait_connected(void)
+{
+    int i;
+
+    if (!migrate_use_multifd()) {
+        return 0;
+    }
+    for (i = 0; i < migrate_multifd_channels(); i++) {
+        qemu_sem_wait(&multifd_send_state->channels_created);
+    }
+    if (atomic_read(&multifd_send_state->error)) {
+        return -1;
+    }
+    return 0;
+}
+
+int multifd_save_setup(void)
+{
+    int thread_count;
+    uint32_t page_count = migrate_multifd_page_count();
+    int i;
+
+    if (!migrate_use_multifd()) {
+        return 0;
+    }
+    thread_count = migrate_multifd_channels();
+    multifd_send_state = g_malloc0(sizeof(*multifd_send_state));
+    multifd_send_state->params = g_new0(MultiFDSendParams, thread_count);
+    multifd_send_state->count = 0;
+    multifd_send_state->pages = multifd_pages_init(page_count);
+    qemu_sem_init(&multifd_send_state->channels_ready, 0);
+    qemu_sem_init(&multifd_send_state->channels_created, 0);
+
+    for (i = 0; i < thread_count; i++) {
+        MultiFDSendParams *p = &multifd_send_state->params[i];
+
+        qemu_mutex_init(&p->mutex);
+        qemu_sem_init(&p->sem, 0);
+        p->quit = false;
+        p->pending_job = false;
+        p->id = i;
+        p->pages = multifd_pages_init(page_count);
+        p->name = g_strdup_printf("multifdsend_%d", i);
+    }
+    for (i = 0; i < thread_count; i++) {
+        if (socket_send_channel_create(multifd_new_send_channel_async,
+                                       GINT_TO_POINTER(i)) < 0) {
+            error_report("multifd is only supported for tcp: and unix: "
+                         "migration");
+            multifd_save_cleanup();
+            return -1;
+        }
+    }
+
+    return 0;
+}
+
+/**
+ * multifd_send_pages: hand the queued pages to the next free channel
+ *
+ * Returns 0 for success or -1 if the multifd channels failed
+ *
+ * Accounts the bytes in @f so that rate limiting and the bandwidth
+ * calculation of the migration thread cover the multifd channels.
+ *
+ * @f: main migration stream
+ * @flags: MULTIFD_FLAG_* bits for the packet
+ */
+static int multifd_send_pages(QEMUFile *f, uint32_t flags)
+{
+    int i;
+    static int next_channel;
+    MultiFDSendParams *p = NULL;
+    MultiFDPages_t *pages = multifd_send_state->pages;
+    size_t size;
+
+    qemu_sem_wait(&multifd_send_state->channels_ready);
+    if (atomic_read(&multifd_send_state->error)) {
+        return -1;
+    }
+    for (i = next_channel;; i = (i + 1) % migrate_multifd_channels()) {
+        p = &multifd_send_state->params[i];
+
+        qemu_mutex_lock(&p->mutex);
+        if (p->running && !p->pending_job) {
+            p->pending_job = true;
+            next_channel = (i + 1) % migrate_multifd_channels();
+            break;
+        }
+        qemu_mutex_unlock(&p->mutex);
+    }
+
+    pages->packet_num = multifd_send_state->packet_num++;
+    size = multifd_packet_size(pages);
+    multifd_send_state->pages = p->pages;
+    p->pages = pages;
+    p->flags = flags;
+    qemu_mutex_unlock(&p->mutex);
+    qemu_sem_post(&p->sem);
+
+    qemu_file_credit_transfer(f, size);
+    ram_counters.transferred += size;
+    ram_counters.multifd_bytes += size;
+
+    return 0;
+}
+
+/**
+ * multifd_queue_page: queue a page to be sent on the multifd channels
+ *
+ * Returns 0 for success or -1 if the multifd channels failed
+ *
+ * @rs: current RAM state
+ * @block: block that contains the page
+ * @offset: offset inside the block for the page
+ */
+static int multifd_queue_page(RAMState *rs, RAMBlock *block,
+                              ram_addr_t offset)
+{
+    MultiFDPages_t *pages = multifd_send_state->pages;
+
+    if (pages->used && pages->block != block) {
+        /* one packet only carries pages of a single block */
+        if (multifd_send_pages(rs->f, 0) < 0) {
+            return -1;
+        }
+        pages = multifd_send_state->pages;
+    }
+
+    pages->block = block;
+    pages->offset[pages->used++] = offset;
+
+    if (pages->used == pages->allocated) {
+        return multifd_send_pages(rs->f, 0);
+    }
+
+    return 0;
+}
+
+/**
+ * multifd_wait_idle: wait until every channel has flushed its job
+ *
+ * Returns 0 for success or -1 if the multifd channels failed
+ */
+static int multifd_wait_idle(void)
+{
+    int i;
+
+    for (i = 0; i < migrate_multifd_channels(); i++) {
+        qemu_sem_wait(&multifd_send_state->channels_ready);
+    }
+    if (atomic_read(&multifd_send_state->error)) {
+        return -1;
+    }
+    return 0;
+}
+
+/**
+ * multifd_send_sync_main: end a dirty bitmap round on all the channels
+ *
+ * Flushes the queued pages, sends a sync packet on every channel and
+ * writes RAM_SAVE_FLAG_MULTIFD_SYNC on the main stream.  The
+ * destination does not process the main stream past the flag until
+ * all the pages sent before it on every channel have been loaded, so
+ * a page resent in the next round can't be overtaken by a stale copy.
+ *
+ * Returns 0 for success or -1 if the multifd channels failed
+ *
+ * @rs: current RAM state
+ */
+static int multifd_send_sync_main(RAMState *rs)
+{
+    int i;
+
+    if (!migrate_use_multifd()) {
+        return 0;
+    }
+    if (multifd_send_state->pages->used &&
+        multifd_send_pages(rs->f, 0) < 0) {
+        goto err;
+    }
+    if (multifd_wait_idle() < 0) {
+        goto err;
+    }
+    for (i = 0; i < migrate_multifd_channels(); i++) {
+        MultiFDSendParams *p = &multifd_send_state->params[i];
+
+        qemu_mutex_lock(&p->mutex);
+        p->pages->packet_num = multifd_send_state->packet_num++;
+        ram_counters.transferred += multifd_packet_size(p->pages);
+        ram_counters.multifd_bytes += multifd_packet_size(p->pages);
+        p->flags = MULTIFD_FLAG_SYNC;
+        p->pending_job = true;
+        qemu_mutex_unlock(&p->mutex);
+        qemu_sem_post(&p->sem);
+    }
+    rs->multifd_sync_count = ram_counters.dirty_sync_count;
+    qemu_put_be64(rs->f, RAM_SAVE_FLAG_MULTIFD_SYNC);
+    /*
+     * The destination channels stop until they see the flag, don't let
+     * it sit in the buffer while we wait for them.
+     */
+    qemu_fflush(rs->f);
+    ram_counters.transferred += 8;
+    trace_multifd_send_sync_main(multifd_send_state->packet_num);
+
+    return 0;
+
+err:
+    qemu_file_set_error(rs->f, -EIO);
+    return -1;
+}
+
+/**
+ * multifd_send_flush: wait until the channels have sent all their data
+ *
+ * Returns 0 for success or -1 if the multifd channels failed
+ */
+static int multifd_send_flush(void)
+{
+    int i;
+
+    if (multifd_wait_idle() < 0) {
+        return -1;
+    }
+    for (i = 0; i < migrate_multifd_channels(); i++) {
+        qemu_sem_post(&multifd_send_state->channels_ready);
+    }
+    return 0;
+}
+
+/**
+ * multifd_send_sync_round: sync the channels if the bitmap was synced
+ *
+ * Pages can only be sent twice if the dirty bitmap has been synced in
+ * between, so a sync marker is only needed once per bitmap round.
+ *
+ * @rs: current RAM state
+ */
+static int multifd_send_sync_round(RAMState *rs)
+{
+    if (!migrate_use_multifd() ||
+        rs->multifd_sync_count == ram_counters.dirty_sync_count) {
+        return 0;
+    }
+    return multifd_send_sync_main(rs);
+}
+
+struct {
+    MultiFDRecvParams *params;
+    /* number of created threads */
+    int count;
+    /* posted by each channel when it receives a sync packet */
+    QemuSemaphore sem_sync;
+    /* set when one of the channels failed */
+    int error;
+} *multifd_recv_state;
+
+static void multifd_recv_terminate_threads(void)
+{
+    int i;
+
+    for (i = 0; i < migrate_multifd_channels(); i++) {
+        MultiFDRecvParams *p = &multifd_recv_state->params[i];
+
+        if (p->running) {
+            atomic_set(&p->quit, true);
+            qio_channel_shutdown(p->c, QIO_CHANNEL_SHUTDOWN_BOTH, NULL);
+            qemu_sem_post(&p->sem_sync);
+        }
+    }
+}
+
+void multifd_load_cleanup(void)
+{
+    int i;
+
+    if (!migrate_use_multifd() || !multifd_recv_state) {
+        return;
+    }
+    multifd_recv_terminate_threads();
+    for (i = 0; i < migrate_multifd_channels(); i++) {
+        MultiFDRecvParams *p = &multifd_recv_state->params[i];
+
+        if (p->running) {
+            qemu_thread_join(&p->thread);
+            p->running = false;
+        }
+        if (p->file) {
+            qemu_fclose(p->file);
+            p->file = NULL;
+        }
+        if (p->c) {
+            object_unref(OBJECT(p->c));
+            p->c = NULL;
+        }
+        qemu_sem_destroy(&p->sem_sync);
+        g_free(p->name);
+        p->name = NULL;
+        g_free(p->offset);
+        p->offset = NULL;
+    }
+    qemu_sem_destroy(&multifd_recv_state->sem_sync);
+    g_free(multifd_recv_state->params);
+    multifd_recv_state->params = NULL;
+    g_free(multifd_recv_state);
+    multifd_recv_state = NULL;
+}
+
+/**
+ * multifd_recv_packet: read one packet from the channel
+ *
+ * Returns 0 for success or negative error code
+ *
+ * @p: channel we are receiving from
+ * @flags: filled with the MULTIFD_FLAG_* bits of the packet
+ */
+static int multifd_recv_packet(MultiFDRecvParams *p, uint32_t *flags)
+{
+    QEMUFile *f = p->file;
+    RAMBlock *block;
+    uint32_t used, i;
+    uint64_t packet_num;
+    char id[256];
+    int len, ret;
+
+    *flags = qemu_get_be32(f);
+    used = qemu_get_be32(f);
+    packet_num = qemu_get_be64(f);
+    ret = qemu_file_get_error(f);
+    if (ret) {
+        return ret;
+    }
+    trace_multifd_recv(p->id, packet_num, used, *flags);
+    p->num_packets++;
+
+    if (!used) {
+        return 0;
+    }
+    if (used > MULTIFD_MAX_PAGES) {
+        error_report("multifd channel %d: packet with %u pages, max is %d",
+                     p->id, used, MULTIFD_MAX_PAGES);
+        return -EINVAL;
+    }
+    if (used > p->allocated) {
+        p->offset = g_renew(ram_addr_t, p->offset, used);
+        p->allocated = used;
+    }
+
+    len = qemu_get_byte(f);
+    qemu_get_buffer(f, (uint8_t *)id, len);
+    id[len] = 0;
+    block = qemu_ram_block_by_name(id);
+    if (!block) {
+        error_report("multifd channel %d: unknown ramblock \"%s\"",
+                     p->id, id);
+        return -EINVAL;
+    }
+
+    for (i = 0; i < used; i++) {
+        ram_addr_t offset = qemu_get_be64(f);
+
+        if (!offset_in_ramblock(block, offset) ||
+            (offset & ~TARGET_PAGE_MASK)) {
+            error_report("multifd channel %d: illegal RAM offset "
+                         RAM_ADDR_FMT " in %s", p->id, offset, id);
+            return -EINVAL;
+        }
+        p->offset[i] = offset;
+    }
+    for (i = 0; i < used; i++) {
+        qemu_get_buffer(f, block->host + p->offset[i], TARGET_PAGE_SIZE);
+    }
+
+    return qemu_file_get_error(f);
+}
+
+static void *multifd_recv_thread(void *opaque)
+{
+    MultiFDRecvParams *p = opaque;
+    uint32_t flags;
+    int ret;
+
+    rcu_register_thread();
+
+    while (true) {
+        rcu_read_lock();
+        ret = multifd_recv_packet(p, &flags);
+        rcu_read_unlock();
+        if (ret) {
+            break;
+        }
+        if (flags & MULTIFD_FLAG_SYNC) {
+            qemu_sem_post(&multifd_recv_state->sem_sync);
+            qemu_sem_wait(&p->sem_sync);
+        }
+        if (atomic_read(&p->quit)) {
+            break;
+        }
+    }
+
+    if (ret && !atomic_read(&p->quit)) {
+        /*
+         * The source closes the channels once it is done, that is only
+         * an error if the main thread still waits for us.
+         */
+        atomic_set(&multifd_recv_state->error, 1);
+        qemu_sem_post(&multifd_recv_state->sem_sync);
+    }
+    trace_multifd_recv_thread_end(p->id, p->num_packets);
+    rcu_unregister_thread();
+
+    return NULL;
+}
+
+int multifd_load_setup(void)
+{
+    int thread_count;
+    int i;
+
+    if (!migrate_use_multifd()) {
+        return 0;
+    }
+    thread_count = migrate_multifd_channels();
+    multifd_recv_state = g_malloc0(sizeof(*multifd_recv_state));
+    multifd_recv_state->params = g_new0(MultiFDRecvParams, thread_count);
+    multifd_recv_state->count = 0;
+    qemu_sem_init(&multifd_recv_state->sem_sync, 0);
+
+    for (i = 0; i < thread_count; i++) {
+        MultiFDRecvParams *p = &multifd_recv_state->params[i];
+
+        qemu_sem_init(&p->sem_sync, 0);
+        p->quit = false;
+        p->id = i;
+        p->name = g_strdup_printf("multifdrecv_%d", i);
+    }
+    return 0;
+}
+
+bool multifd_recv_all_channels_created(void)
+{
+    int thread_count = migrate_multifd_channels();
+
+    if (!migrate_use_multifd()) {
+        return true;
+    }
+
+    return multifd_recv_state &&
+           thread_count == atomic_read(&multifd_recv_state->count);
+}
+
+void multifd_recv_new_channel(QIOChannel *ioc)
+{
+    MultiFDRecvParams *p;
+    QEMUFile *f;
+    uint32_t magic, version;
+    int id;
+
+    if (!migrate_use_multifd() || !multifd_recv_state) {
+        error_report("unexpected migration channel, is x-multifd enabled "
+                     "on the destination?");
+        return;
+    }
+
+    f = qemu_fopen_channel_input(ioc);
+    magic = qemu_get_be32(f);
+    version = qemu_get_be32(f);
+    id = qemu_get_byte(f);
+    if (qemu_file_get_error(f) || magic != MULTIFD_MAGIC ||
+        version != MULTIFD_VERSION) {
+        error_report("multifd: bad channel header (magic 0x%x version %u)",
+                     magic, version);
+        qemu_fclose(f);
+        return;
+    }
+    if (id >= migrate_multifd_channels() ||
+        multifd_recv_state->params[id].running) {
+        error_report("multifd: invalid or duplicate channel %d", id);
+        qemu_fclose(f);
+        return;
+    }
+
+    p = &multifd_recv_state->params[id];
+    object_ref(OBJECT(ioc));
+    p->c = ioc;
+    p->file = f;
+    p->running = true;
+    qemu_thread_create(&p->thread, p->name, multifd_recv_thread, p,
+                       QEMU_THREAD_JOINABLE);
+    atomic_inc(&multifd_recv_state->count);
+}
+
+/**
+ * multifd_recv_sync_main: wait for the end of a round on all channels
+ *
+ * Returns 0 for success or -1 if one of the channels failed
+ *
+ * Called when RAM_SAVE_FLAG_MULTIFD_SYNC is found on the main stream;
+ * returns once every channel has loaded all the pages sent before its
+ * sync packet, and lets the channels continue with the next round.
+ */
+static int multifd_recv_sync_main(void)
+{
+    int i;
+
+    if (!migrate_use_multifd() || !multifd_recv_state) {
+        error_report("multifd sync received without multifd channels");
+        return -1;
+    }
+    for (i = 0; i < migrate_multifd_channels(); i++) {
+        qemu_sem_wait(&multifd_recv_state->sem_sync);
+    }
+    if (atomic_read(&multifd_recv_state->error)) {
+        error_report("multifd: a receive channel failed");
+        return -1;
+    }
+    for (i = 0; i < migrate_multifd_channels(); i++) {
+        qemu_sem_post(&multifd_recv_state->params[i].sem_sync);
+    }
+    trace_multifd_recv_sync_main();
+
+    return 0;
+}
+
+/**
+ * save_page_header: write page header to wire
+ *
+ * If this is the 1st block, it also writes the block identification
+ *
+ * Returns the number of bytes written
+ *
+ * @f: QEMUFile where to send the data
+ * @block: block that contains the page we want to send
+ * @offset: offset inside the block for the page
+ *          in the lower bits, it contains flags
+ */
+static size_t save_page_header(RAMState *rs, QEMUFile *f,  RAMBlock *block,
+                               ram_addr_t offset)
+{
+    size_t size, len;
+
+    if (block == rs->last_sent_block) {
+        offset |= RAM_SAVE_FLAG_CONTINUE;
+    }
+    qemu_put_be64(f, offset);
+    size = 8;
+
+    if (!(offset & RAM_SAVE_FLAG_CONTINUE)) {
+        len = strlen(block->idstr);
+        qemu_put_byte(f, len);
+        qemu_put_buffer(f, (uint8_t *)block->idstr, len);
+        size += 1 + len;
+        rs->last_sent_block = block;
+    }
+    return size;
+}
+
+/**
+ * mig_throttle_guest_down: throotle down the guest
+ *
+ * Reduce amount of guest cpu execution to hopefully slow down memory
+ * writes. If guest dirty memory rate is reduced below the rate at
+ * which we can transfer pages to the destination then we should be
+ * able to complete migration. Some workloads dirty memory way too
+ * fast and will not effectively converge, even with auto-converge.
+ */
+static void mig_throttle_guest_down(void)
+{
+    MigrationState *s = migrate_get_current();
+    uint64_t pct_initial = s->parameters.cpu_throttle_initial;
+    uint64_t pct_icrement = s->parameters.cpu_throttle_increment;
+
+    /* We have not started throttling yet. Let's start it. */
+    if (!cpu_throttle_active()) {
+        cpu_throttle_set(pct_initial);
+    } else {
+        /* Throttling already on, just increase the rate */
+        cpu_throttle_set(cpu_throttle_get_percentage() + pct_icrement);
+    }
+}
+
+/* Weight of the newest period in the smoothed convergence rates */
+#define CONVERGE_EWMA_WEIGHT 0.5
+/* Number of iterations the predictive throttle tries to converge within */
+#define CONVERGE_ITERATIONS 4
+/* Highest throttle cpu_throttle_set() accepts */
+#define CONVERGE_THROTTLE_MAX 99
+
+static double ram_throttle_running_fraction(void)
+{
+    if (!cpu_throttle_active()) {
+        return 1.0;
+    }
+    return 1.0 - cpu_throttle_get_percentage() / 100.0;
+}
+
+/**
+ * ram_convergence_update: feed one bitmap sync period into the model
+ *
+ * @rs: current RAM state
+ * @period_ms: length of the period
+ * @bytes_xfer: bytes sent during the period
+ *
+ * The dirty rate is scaled by the throttle that was in effect during the
+ * period, so that the model keeps describing the guest rather than the
+ * throttle when the latter changes.
+ */
+static void ram_convergence_update(RAMState *rs, int64_t period_ms,
+                                   uint64_t bytes_xfer)
+{
+    double bandwidth = bytes_xfer * 1000.0 / period_ms;
+    double guest_rate = rs->num_dirty_pages_period * TARGET_PAGE_SIZE *
+                        1000.0 / period_ms / ram_throttle_running_fraction();
+
+    if (!bytes_xfer) {
+        /* Nothing was sent, there is no bandwidth to learn from */
+        return;
+    }
+    if (!rs->conv_valid) {
+        rs->conv_bandwidth = bandwidth;
+        rs->conv_guest_rate = guest_rate;
+        rs->conv_valid = true;
+        return;
+    }
+    rs->conv_bandwidth += CONVERGE_EWMA_WEIGHT *
+                          (bandwidth - rs->conv_bandwidth);
+    rs->conv_guest_rate += CONVERGE_EWMA_WEIGHT *
+                           (guest_rate - rs->conv_guest_rate);
+}
+
+/**
+ * ram_convergence_predict: predict the rest of the migration
+ *
+ * Returns true if the migration converges at the current throttle.
+ *
+ * @rs: current RAM state
+ * @remaining_ms: time until the remaining data fits into the downtime
+ *                limit, only set when converging
+ * @downtime_ms: expected downtime of the final stop-and-copy phase
+ *
+ * Every iteration resends what the guest dirtied while the previous one
+ * was sent, so the remaining data shrinks geometrically by the ratio of
+ * dirty rate to bandwidth.
+ */
+static bool ram_convergence_predict(RAMState *rs, int64_t *remaining_ms,
+                                    int64_t *downtime_ms)
+{
+    MigrationState *s = migrate_get_current();
+    double bandwidth = rs->conv_bandwidth;
+    double remaining = ram_bytes_remaining();
+    double threshold = bandwidth * s->parameters.downtime_limit / 1000;
+    double ratio = rs->conv_guest_rate * ram_throttle_running_fraction() /
+                   bandwidth;
+    double iterations;
+
+    if (remaining <= threshold) {
+        *remaining_ms = 0;
+        *downtime_ms = remaining * 1000 / bandwidth;
+        return true;
+    }
+    if (ratio >= 1) {
+        /* The remaining data never shrinks */
+        *downtime_ms = remaining * 1000 / bandwidth;
+        return false;
+    }
+    iterations = ratio > 0 ? ceil(log(threshold / remaining) / log(ratio)) : 1;
+    *remaining_ms = remaining * 1000 / bandwidth *
+                    (1 - pow(ratio, iterations)) / (1 - ratio);
+    *downtime_ms = remaining * pow(ratio, iterations) * 1000 / bandwidth;
+    return true;
+}
+
+/**
+ * mig_throttle_predictive: pick the throttle from the convergence model
+ *
+ * @rs: current RAM state
+ *
+ * Computes the throttle that makes the remaining data drop below what
+ * can be sent within the downtime limit in CONVERGE_ITERATIONS
+ * iterations, and moves halfway towards it.  Raising the throttle is
+ * limited to cpu-throttle-increment per period; once the guest dirties
+ * slowly enough the throttle is lowered again.
+ */
+static void mig_throttle_predictive(RAMState *rs)
+{
+    MigrationState *s = migrate_get_current();
+    double bandwidth = rs->conv_bandwidth;
+    double remaining = ram_bytes_remaining();
+    double threshold = bandwidth * s->parameters.downtime_limit / 1000;
+    int pct = cpu_throttle_active() ? cpu_throttle_get_percentage() : 0;
+    double target = 0;
+    int target_pct, next;
+
+    if (remaining > threshold && rs->conv_guest_rate > 0) {
+        double ratio = pow(threshold / remaining, 1.0 / CONVERGE_ITERATIONS);
+
+        target = 100 * (1 - ratio * bandwidth / rs->conv_guest_rate);
+    }
+    target_pct = MIN(MAX(lround(target), 0), CONVERGE_THROTTLE_MAX);
+
+    if (target_pct > pct) {
+        next = pct + MIN((target_pct - pct + 1) / 2,
+                         s->parameters.cpu_throttle_increment);
+    } else {
+        next = pct - (pct - target_pct) / 2;
+    }
+
+    trace_migration_throttle_predictive((uint64_t)bandwidth,
+                                        (uint64_t)rs->conv_guest_rate,
+                                        target_pct, next);
+    if (next == pct) {
+        return;
+    }
+    if (next > 0) {
+        cpu_throttle_set(next);
+    } else {
+        cpu_throttle_stop();
+    }
+}
+
+MigrationConvergenceInfo *ram_convergence_info(void)
 {
-    MigrationState *s = migrate_get_current();
-    uint64_t pct_initial = s->parameters.cpu_throttle_initial;
-    uint64_t pct_icrement = s->parameters.cpu_throttle_increment;
+    RAMState *rs = ram_state;
+    MigrationConvergenceInfo *info;
+    int64_t remaining_ms = 0, downtime_ms;
 
-    /* We have not started throttling yet. Let's start it. */
-    if (!cpu_throttle_active()) {
-        cpu_throttle_set(pct_initial);
-    } else {
-        /* Throttling already on, just increase the rate */
-        cpu_throttle_set(cpu_throttle_get_percentage() + pct_icrement);
+    if (!rs || !rs->conv_valid) {
+        return NULL;
     }
+
+    info = g_new0(MigrationConvergenceInfo, 1);
+    info->bandwidth = rs->conv_bandwidth;
+    info->dirty_rate = rs->conv_guest_rate * ram_throttle_running_fraction();
+    info->converging = ram_convergence_predict(rs, &remaining_ms,
+                                               &downtime_ms);
+    info->has_remaining_time = info->converging;
+    info->remaining_time = remaining_ms;
+    info->expected_downtime = downtime_ms;
+    return info;
 }
 
 /**
@@ -438,8 +1768,8 @@ static void xbzrle_cache_zero_page(RAMState *rs, ram_addr_t current_addr)
 
     /* We don't care if this fails to allocate a new cache page
      * as long as it updated an old one */
-    cache_insert(XBZRLE.cache, current_addr, XBZRLE.zero_target_page,
-                 ram_counters.dirty_sync_count);
+    cache_insert(xbzrle_cache_rcu_read(), current_addr,
+                 XBZRLE.zero_target_page, ram_counters.dirty_sync_count);
 }
 
 #define ENCODING_FLAG_XBZRLE 0x1
@@ -464,24 +1794,26 @@ static int save_xbzrle_page(RAMState *rs, uint8_t **current_data,
 {
     int encoded_len = 0, bytes_xbzrle;
     uint8_t *prev_cached_page;
+    /* the same cache must be used for the whole page */
+    PageCache *cache = xbzrle_cache_rcu_read();
 
-    if (!cache_is_cached(XBZRLE.cache, current_addr,
+    if (!cache_is_cached(cache, current_addr,
                          ram_counters.dirty_sync_count)) {
         xbzrle_counters.cache_miss++;
         if (!last_stage) {
-            if (cache_insert(XBZRLE.cache, current_addr, *current_data,
+            if (cache_insert(cache, current_addr, *current_data,
                              ram_counters.dirty_sync_count) == -1) {
                 return -1;
             } else {
                 /* update *current_data when the page has been
                    inserted into cache */
-                *current_data = get_cached_data(XBZRLE.cache, current_addr);
+                *current_data = get_cached_data(cache, current_addr);
             }
         }
         return -1;
     }
 
-    prev_cached_page = get_cached_data(XBZRLE.cache, current_addr);
+    prev_cached_page = get_cached_data(cache, current_addr);
 
     /* save current buffer into memory */
     memcpy(XBZRLE.current_buf, *current_data, TARGET_PAGE_SIZE);
@@ -523,6 +1855,25 @@ static int save_xbzrle_page(RAMState *rs, uint8_t **current_data,
     return 1;
 }
 
+/**
+ * ramblock_is_ignored: check whether the contents of a RAMBlock are left
+ *                      out of the migration stream
+ *
+ * With x-ignore-shared, blocks mapped shared are expected to be mapped by
+ * the destination from the same backing file, so they need not be copied.
+ *
+ * @block: RAMBlock to check
+ */
+static bool ramblock_is_ignored(RAMBlock *block)
+{
+    return migrate_ignore_shared() && qemu_ram_is_shared(block);
+}
+
+/* Should be holding either ram_list.mutex, or the RCU lock. */
+#define RAMBLOCK_FOREACH_NOT_IGNORED(block)  \
+    RAMBLOCK_FOREACH(block)                  \
+        if (ramblock_is_ignored(block)) {} else
+
 /**
  * migration_bitmap_find_dirty: find the next dirty page from start
  *
@@ -541,13 +1892,39 @@ unsigned long migration_bitmap_find_dirty(RAMState *rs, RAMBlock *rb,
     unsigned long size = rb->used_length >> TARGET_PAGE_BITS;
     unsigned long *bitmap = rb->bmap;
     unsigned long next;
+    bool bulk = rs->ram_bulk_stage && !rs->free_page_support;
 
-    if (rs->ram_bulk_stage && start > 0 && !rs->free_page_support) {
+    if (ramblock_is_ignored(rb)) {
+        /* There is no dirty bitmap, move on to the next block */
+        return size;
+    }
+
+    if (bulk && start > 0) {
         next = start + 1;
     } else {
         next = find_next_bit(bitmap, size, start);
     }
 
+    if (rs->defer_hot &&
+        rs->hot_only_sync != ram_counters.dirty_sync_count) {
+        /* Skip whole host pages, so that they are still sent in one go */
+        unsigned long skip = MAX(BITS_PER_LONG,
+                                 rb->page_size >> TARGET_PAGE_BITS);
+
+        while (next < size && ramblock_page_is_hot(rb, next)) {
+            unsigned long end = MIN(QEMU_ALIGN_UP(next + 1, skip), size);
+
+            rs->hot_skipped = true;
+            bitmap_set(rb->hot_skipmap, BIT_WORD(next),
+                       BIT_WORD(end - 1) - BIT_WORD(next) + 1);
+            next = end;
+            if (!bulk && next < size) {
+                next = find_next_bit(bitmap, size, next);
+            }
+        }
+        next = MIN(next, size);
+    }
+
     return next;
 }
 
@@ -555,22 +1932,218 @@ static inline bool migration_bitmap_clear_dirty(RAMState *rs,
                                                 RAMBlock *rb,
                                                 unsigned long page)
 {
+    /*
+     * Only free page hints change the bitmap behind our back, and only
+     * while the hint window is open.  The window is opened and closed by
+     * this thread, so reading free_page_done needs no lock.
+     */
+    bool hinting = !rs->free_page_done;
     bool ret;
 
+    if (hinting) {
+        qemu_mutex_lock(&rs->bitmap_mutex);
+    }
     ret = test_and_clear_bit(page, rb->bmap);
 
     if (ret) {
         rs->migration_dirty_pages--;
     }
+    if (hinting) {
+        qemu_mutex_unlock(&rs->bitmap_mutex);
+    }
     return ret;
 }
 
 static void migration_bitmap_sync_range(RAMState *rs, RAMBlock *rb,
-                                        ram_addr_t start, ram_addr_t length)
+                                        ram_addr_t start, ram_addr_t length,
+                                        uint64_t *hot_redirty)
 {
     rs->migration_dirty_pages +=
         cpu_physical_memory_sync_dirty_bitmap(rb, start, length,
-                                              &rs->num_dirty_pages_period);
+                                              &rs->num_dirty_pages_period,
+                                              hot_redirty);
+    if (rb->hot_skipmap && length) {
+        unsigned long first = BIT_WORD(start >> TARGET_PAGE_BITS);
+        unsigned long last = BIT_WORD((start + length - 1) >> TARGET_PAGE_BITS);
+
+        bitmap_clear(rb->hot_skipmap, first, last - first + 1);
+    }
+}
+
+/*
+ * Target pages of a RAMBlock synced by one job of the dirty sync pool.
+ * A multiple of BITS_PER_LONG * BITS_PER_LONG, so that two jobs never
+ * share a word of the migration bitmap or of the hot skip map.
+ */
+#define DIRTY_SYNC_JOB_PAGES (256 * 1024)
+
+typedef struct DirtySyncJob {
+    RAMBlock *block;
+    ram_addr_t start;
+    ram_addr_t length;
+} DirtySyncJob;
+
+typedef struct DirtySyncWorker {
+    struct DirtySyncPool *pool;
+    QemuThread thread;
+    /* Results of the current sync */
+    uint64_t num_dirty;
+    uint64_t real_dirty;
+    uint64_t hot_redirty;
+} DirtySyncWorker;
+
+/*
+ * The migration thread splits the RAMBlocks into jobs and works on them
+ * together with the helper threads, each one claiming the next job.
+ */
+typedef struct DirtySyncPool {
+    int nr_threads;
+    /* nr_threads helpers, then the migration thread */
+    DirtySyncWorker *workers;
+    QemuSemaphore start;
+    QemuSemaphore done;
+    bool quit;
+    DirtySyncJob *jobs;
+    unsigned int nr_jobs;
+    unsigned int jobs_size;
+    unsigned int next_job;
+} DirtySyncPool;
+
+static void dirty_sync_run_jobs(DirtySyncPool *pool, DirtySyncWorker *worker)
+{
+    unsigned int i;
+
+    worker->num_dirty = 0;
+    worker->real_dirty = 0;
+    worker->hot_redirty = 0;
+    while ((i = atomic_fetch_inc(&pool->next_job)) < pool->nr_jobs) {
+        DirtySyncJob *job = &pool->jobs[i];
+
+        worker->num_dirty +=
+            cpu_physical_memory_sync_dirty_bitmap(job->block, job->start,
+                                                  job->length,
+                                                  &worker->real_dirty,
+                                                  &worker->hot_redirty);
+    }
+}
+
+static void *dirty_sync_thread(void *opaque)
+{
+    DirtySyncWorker *worker = opaque;
+    DirtySyncPool *pool = worker->pool;
+
+    rcu_register_thread();
+    while (true) {
+        qemu_sem_wait(&pool->start);
+        if (atomic_read(&pool->quit)) {
+            break;
+        }
+        dirty_sync_run_jobs(pool, worker);
+        qemu_sem_post(&pool->done);
+    }
+    rcu_unregister_thread();
+    return NULL;
+}
+
+static DirtySyncPool *dirty_sync_pool_new(int nr_threads)
+{
+    DirtySyncPool *pool = g_new0(DirtySyncPool, 1);
+    int i;
+
+    pool->nr_threads = nr_threads;
+    pool->workers = g_new0(DirtySyncWorker, nr_threads + 1);
+    qemu_sem_init(&pool->start, 0);
+    qemu_sem_init(&pool->done, 0);
+    for (i = 0; i <= nr_threads; i++) {
+        pool->workers[i].pool = pool;
+    }
+    for (i = 0; i < nr_threads; i++) {
+        qemu_thread_create(&pool->workers[i].thread, "dirtysync",
+                           dirty_sync_thread, &pool->workers[i],
+                           QEMU_THREAD_JOINABLE);
+    }
+    return pool;
+}
+
+static void dirty_sync_pool_free(DirtySyncPool *pool)
+{
+    int i;
+
+    if (!pool) {
+        return;
+    }
+    atomic_set(&pool->quit, true);
+    for (i = 0; i < pool->nr_threads; i++) {
+        qemu_sem_post(&pool->start);
+    }
+    for (i = 0; i < pool->nr_threads; i++) {
+        qemu_thread_join(&pool->workers[i].thread);
+    }
+    qemu_sem_destroy(&pool->start);
+    qemu_sem_destroy(&pool->done);
+    g_free(pool->workers);
+    g_free(pool->jobs);
+    g_free(pool);
+}
+
+static void dirty_sync_pool_add_job(DirtySyncPool *pool, RAMBlock *block,
+                                    ram_addr_t start, ram_addr_t length)
+{
+    if (pool->nr_jobs == pool->jobs_size) {
+        pool->jobs_size = MAX(pool->jobs_size * 2, 16);
+        pool->jobs = g_renew(DirtySyncJob, pool->jobs, pool->jobs_size);
+    }
+    pool->jobs[pool->nr_jobs].block = block;
+    pool->jobs[pool->nr_jobs].start = start;
+    pool->jobs[pool->nr_jobs].length = length;
+    pool->nr_jobs++;
+}
+
+/*
+ * Sync the dirty bitmap of all RAMBlocks with the help of @pool.
+ * Called with the bitmap mutex and the RCU read lock held.
+ */
+static void migration_bitmap_sync_parallel(RAMState *rs, DirtySyncPool *pool,
+                                           uint64_t *hot_redirty)
+{
+    ram_addr_t job_size = (ram_addr_t)DIRTY_SYNC_JOB_PAGES << TARGET_PAGE_BITS;
+    RAMBlock *block;
+    int i;
+
+    pool->nr_jobs = 0;
+    RAMBLOCK_FOREACH_NOT_IGNORED(block) {
+        ram_addr_t start;
+
+        for (start = 0; start < block->used_length; start += job_size) {
+            dirty_sync_pool_add_job(pool, block, start,
+                                    MIN(job_size, block->used_length - start));
+        }
+    }
+    if (pool->nr_jobs < 2) {
+        /* Not worth waking up the helpers */
+        for (i = 0; i < pool->nr_jobs; i++) {
+            migration_bitmap_sync_range(rs, pool->jobs[i].block,
+                                        pool->jobs[i].start,
+                                        pool->jobs[i].length, hot_redirty);
+        }
+        return;
+    }
+
+    trace_migration_bitmap_sync_parallel(pool->nr_jobs, pool->nr_threads);
+    atomic_set(&pool->next_job, 0);
+    for (i = 0; i < pool->nr_threads; i++) {
+        qemu_sem_post(&pool->start);
+    }
+    dirty_sync_run_jobs(pool, &pool->workers[pool->nr_threads]);
+    for (i = 0; i < pool->nr_threads; i++) {
+        qemu_sem_wait(&pool->done);
+    }
+
+    for (i = 0; i <= pool->nr_threads; i++) {
+        rs->migration_dirty_pages += pool->workers[i].num_dirty;
+        rs->num_dirty_pages_period += pool->workers[i].real_dirty;
+        *hot_redirty += pool->workers[i].hot_redirty;
+    }
 }
 
 /**
@@ -597,10 +2170,15 @@ uint64_t ram_pagesize_summary(void)
 static void migration_bitmap_sync(RAMState *rs)
 {
     RAMBlock *block;
-    int64_t end_time;
+    int64_t start_us, end_time;
     uint64_t bytes_xfer_now;
+    uint64_t hot_redirty = 0;
+    bool free_page_hint_stop, hot_deferred;
 
+    /* Whether hot pages were left for later since the previous sync */
+    hot_deferred = rs->hot_only_sync != ram_counters.dirty_sync_count;
     ram_counters.dirty_sync_count++;
+    start_us = qemu_clock_get_us(QEMU_CLOCK_REALTIME);
 
     if (!rs->time_last_bitmap_sync) {
         rs->time_last_bitmap_sync = qemu_clock_get_ms(QEMU_CLOCK_REALTIME);
@@ -610,13 +2188,44 @@ static void migration_bitmap_sync(RAMState *rs)
     memory_global_dirty_log_sync();
 
     qemu_mutex_lock(&rs->bitmap_mutex);
+    /*
+     * A hint that arrives after this sync may describe a page the guest
+     * has reused since, and the dirty bit recording that is about to be
+     * consumed; close the hint window before syncing.
+     */
+    free_page_hint_stop = rs->free_page_support && !rs->free_page_done;
+    rs->free_page_done = true;
     rcu_read_lock();
-    RAMBLOCK_FOREACH(block) {
-        migration_bitmap_sync_range(rs, block, 0, block->used_length);
+    if (rs->dirty_sync_pool) {
+        migration_bitmap_sync_parallel(rs, rs->dirty_sync_pool, &hot_redirty);
+    } else {
+        RAMBLOCK_FOREACH_NOT_IGNORED(block) {
+            migration_bitmap_sync_range(rs, block, 0, block->used_length,
+                                        &hot_redirty);
+        }
     }
     rcu_read_unlock();
     qemu_mutex_unlock(&rs->bitmap_mutex);
 
+    /*
+     * Pages passed over as hot and dirtied again before their turn came
+     * would have been sent once more had they not been deferred.
+     */
+    if (hot_deferred && hot_redirty) {
+        ram_counters.avoided_resend_bytes += hot_redirty * TARGET_PAGE_SIZE;
+        trace_migration_bitmap_sync_hot(hot_redirty);
+    }
+
+    ram_counters.dirty_sync_time =
+        qemu_clock_get_us(QEMU_CLOCK_REALTIME) - start_us;
+    ram_counters.dirty_sync_time_max = MAX(ram_counters.dirty_sync_time_max,
+                                           ram_counters.dirty_sync_time);
+
+    if (free_page_hint_stop) {
+        trace_migration_free_page_hint_stop(ram_counters.dirty_sync_count);
+        balloon_free_page_stop();
+    }
+
     trace_migration_bitmap_sync_end(rs->num_dirty_pages_period);
 
     end_time = qemu_clock_get_ms(QEMU_CLOCK_REALTIME);
@@ -627,8 +2236,16 @@ static void migration_bitmap_sync(RAMState *rs)
         ram_counters.dirty_pages_rate = rs->num_dirty_pages_period * 1000
             / (end_time - rs->time_last_bitmap_sync);
         bytes_xfer_now = ram_counters.transferred;
-
-        if (migrate_auto_converge()) {
+        ram_convergence_update(rs, end_time - rs->time_last_bitmap_sync,
+                               bytes_xfer_now - rs->bytes_xfer_prev);
+
+        if (migrate_auto_converge() &&
+            migrate_cpu_throttle_policy() ==
+            MIGRATION_THROTTLE_POLICY_PREDICTIVE) {
+            if (rs->conv_valid) {
+                mig_throttle_predictive(rs);
+            }
+        } else if (migrate_auto_converge()) {
             /* The following detection logic can be refined later. For now:
                Check to see if the dirtied bytes is 50% more than the approx.
                amount of bytes that just got transferred since the last time we
@@ -692,6 +2309,119 @@ static int save_zero_page(RAMState *rs, RAMBlock *block, ram_addr_t offset,
     return pages;
 }
 
+/*
+ * Page deduplication
+ *
+ * The destination does not touch its RAM during precopy, so every page
+ * there holds exactly what we last sent for it.  We keep a truncated
+ * SHA-256 of that content for each page (block->dedup_digest, all zero
+ * for "unknown") and an index from digest to one page holding it.  The
+ * index keys point into the dedup_digest arrays and the values are the
+ * owning RAMBlock, so the page number falls out of the key address.
+ */
+#define DEDUP_DIGEST_LEN 16
+
+static guint dedup_digest_hash(gconstpointer key)
+{
+    return ldl_he_p(key);
+}
+
+static gboolean dedup_digest_equal(gconstpointer a, gconstpointer b)
+{
+    return !memcmp(a, b, DEDUP_DIGEST_LEN);
+}
+
+static inline uint8_t *dedup_digest(RAMBlock *block, unsigned long page)
+{
+    return block->dedup_digest + page * DEDUP_DIGEST_LEN;
+}
+
+/* @page is about to hold something else: forget what it held */
+static void dedup_forget_page(RAMState *rs, RAMBlock *block,
+                              unsigned long page)
+{
+    uint8_t *d = dedup_digest(block, page);
+    gpointer key;
+
+    if (buffer_is_zero(d, DEDUP_DIGEST_LEN)) {
+        return;
+    }
+    if (g_hash_table_lookup_extended(rs->dedup_index, d, &key, NULL) &&
+        key == d) {
+        g_hash_table_remove(rs->dedup_index, d);
+    }
+    memset(d, 0, DEDUP_DIGEST_LEN);
+}
+
+/**
+ * save_dedup_page: avoid sending a page whose content the destination has
+ *
+ * Returns the number of pages written (0 if the destination page already
+ * holds that content), or -1 if the page has to be sent in full.  In
+ * that case the page is recorded as holding the new content and
+ * *current_data is pointed at a private copy of it: the guest may still
+ * be writing to the page, and the digest must describe exactly the bytes
+ * that go on the wire, so the caller has to send that copy synchronously.
+ *
+ * @rs: current RAM state
+ * @current_data: pointer to the address of the page contents
+ * @block: block that contains the page we want to send
+ * @offset: offset inside the block for the page
+ */
+static int save_dedup_page(RAMState *rs, uint8_t **current_data,
+                           RAMBlock *block, ram_addr_t offset)
+{
+    unsigned long page = offset >> TARGET_PAGE_BITS;
+    uint8_t *d = dedup_digest(block, page);
+    uint8_t hash[32], *result = hash;
+    size_t resultlen = sizeof(hash);
+    gpointer key, value;
+    RAMBlock *ref_block;
+    ram_addr_t ref_offset;
+    size_t len;
+
+    memcpy(rs->dedup_buf, *current_data, TARGET_PAGE_SIZE);
+    *current_data = rs->dedup_buf;
+
+    if (qcrypto_hash_bytes(QCRYPTO_HASH_ALG_SHA256,
+                           (const char *)rs->dedup_buf, TARGET_PAGE_SIZE,
+                           &result, &resultlen, NULL) < 0) {
+        dedup_forget_page(rs, block, page);
+        return -1;
+    }
+
+    if (!memcmp(d, hash, DEDUP_DIGEST_LEN)) {
+        /* Dirtied, but rewritten with what the destination has already */
+        ram_counters.dedup_pages++;
+        return 0;
+    }
+
+    dedup_forget_page(rs, block, page);
+    memcpy(d, hash, DEDUP_DIGEST_LEN);
+    if (!g_hash_table_lookup_extended(rs->dedup_index, d, &key, &value)) {
+        /* New content, sent in full and found here from now on */
+        g_hash_table_insert(rs->dedup_index, d, block);
+        return -1;
+    }
+
+    ref_block = value;
+    ref_offset = (ram_addr_t)(((uint8_t *)key - ref_block->dedup_digest) /
+                              DEDUP_DIGEST_LEN) << TARGET_PAGE_BITS;
+    trace_save_dedup_page(block->idstr, (uint64_t)offset, ref_block->idstr,
+                          (uint64_t)ref_offset);
+
+    ram_counters.transferred +=
+        save_page_header(rs, rs->f, block, offset | RAM_SAVE_FLAG_DEDUP);
+    len = strlen(ref_block->idstr);
+    qemu_put_byte(rs->f, len);
+    qemu_put_buffer(rs->f, (uint8_t *)ref_block->idstr, len);
+    qemu_put_be64(rs->f, ref_offset);
+    ram_counters.transferred += 1 + len + 8;
+    ram_counters.dedup_pages++;
+
+    return 1;
+}
+
 static void ram_release_pages(const char *rbname, uint64_t offset, int pages)
 {
     if (!migrate_release_ram() || !migration_in_postcopy()) {
@@ -737,11 +2467,12 @@ static int ram_save_page(RAMState *rs, PageSearchStatus *pss, bool last_stage)
         pages = 1;
     }
 
-    XBZRLE_cache_lock();
-
     current_addr = block->offset + offset;
 
     if (ret != RAM_SAVE_CONTROL_NOT_SUPP) {
+        if (rs->dedup_index) {
+            dedup_forget_page(rs, block, pss->page);
+        }
         if (ret != RAM_SAVE_CONTROL_DELAYED) {
             if (bytes_xmit > 0) {
                 ram_counters.normal++;
@@ -757,6 +2488,12 @@ static int ram_save_page(RAMState *rs, PageSearchStatus *pss, bool last_stage)
              */
             xbzrle_cache_zero_page(rs, current_addr);
             ram_release_pages(block->idstr, offset, pages);
+            if (rs->dedup_index) {
+                dedup_forget_page(rs, block, pss->page);
+            }
+        } else if (rs->dedup_index) {
+            pages = save_dedup_page(rs, &p, block, offset);
+            send_async = false;
         } else if (!rs->ram_bulk_stage &&
                    !migration_in_postcopy() && migrate_use_xbzrle()) {
             pages = save_xbzrle_page(rs, &p, current_addr, block,
@@ -786,99 +2523,260 @@ static int ram_save_page(RAMState *rs, PageSearchStatus *pss, bool last_stage)
         ram_counters.normal++;
     }
 
-    XBZRLE_cache_unlock();
+    return pages;
+}
+
+/* Version of the per-block header written with x-mapped-ram */
+#define MAPPED_RAM_VERSION 1
+#define MAPPED_RAM_HEADER_SIZE (4 + 3 * 8)
+/* The pages of each block start at this alignment in the file */
+#define MAPPED_RAM_ALIGN (1 << 20)
+/* Largest run of pages written or read at once */
+#define MAPPED_RAM_RUN_MAX (1 << 20)
+/* The file bitmap is little endian and padded to 64 bits */
+#define MAPPED_RAM_BITMAP_BITS(pages) ROUND_UP(pages, 64)
+#define MAPPED_RAM_BITMAP_SIZE(pages) (MAPPED_RAM_BITMAP_BITS(pages) / 8)
+
+/*
+ * Convert a bitmap of @nbits bits between host and file layout, in place.
+ * @nbits must be a multiple of 64.
+ */
+static void mapped_ram_bitmap_le(unsigned long *bitmap, unsigned long nbits)
+{
+    unsigned long i;
+
+    for (i = 0; i < BITS_TO_LONGS(nbits); i++) {
+        bitmap[i] = leul_to_cpu(bitmap[i]);
+    }
+}
+
+/**
+ * mapped_ram_save_setup_block: lay out the file area of a RAMBlock
+ *
+ * With x-mapped-ram, the stream carries a header for each block giving
+ * where its page bitmap and its pages are in the file.  Page N of the
+ * block is always written at the same offset, pages_offset + N *
+ * TARGET_PAGE_SIZE, so that a page sent again overwrites its previous
+ * copy; the bitmap telling which pages are present is written once
+ * migration completes.  The stream itself continues after the pages.
+ *
+ * @f: QEMUFile where to send the data
+ * @block: RAMBlock to lay out
+ */
+static void mapped_ram_save_setup_block(QEMUFile *f, RAMBlock *block)
+{
+    unsigned long pages = block->used_length >> TARGET_PAGE_BITS;
+    int64_t header_end = qemu_ftell(f) + MAPPED_RAM_HEADER_SIZE;
+
+    block->file_bmap = bitmap_new(MAPPED_RAM_BITMAP_BITS(pages));
+    block->bitmap_offset = header_end;
+    block->pages_offset = ROUND_UP(header_end + MAPPED_RAM_BITMAP_SIZE(pages),
+                                   MAPPED_RAM_ALIGN);
+
+    qemu_put_be32(f, MAPPED_RAM_VERSION);
+    qemu_put_be64(f, TARGET_PAGE_SIZE);
+    qemu_put_be64(f, block->bitmap_offset);
+    qemu_put_be64(f, block->pages_offset);
+    qemu_file_set_offset(f, block->pages_offset + block->used_length);
+}
+
+/**
+ * mapped_ram_flush: write out the pages gathered by mapped_ram_save_page()
+ *
+ * Errors are recorded in the migration stream.
+ *
+ * @rs: current RAM state
+ */
+static void mapped_ram_flush(RAMState *rs)
+{
+    if (!rs->mapped_run_len) {
+        return;
+    }
+    qemu_put_buffer_at(rs->f, rs->mapped_run_host, rs->mapped_run_len,
+                       rs->mapped_run_pos);
+    rs->mapped_run_len = 0;
+}
+
+/**
+ * mapped_ram_save_page: write a page at its place in the file
+ *
+ * Zero pages are not written, mapped_ram_load_block() leaves them zero.
+ * Contiguous pages are gathered and written at once.
+ *
+ * Returns the number of pages written.
+ *
+ * @rs: current RAM state
+ * @pss: data about the page we want to send
+ */
+static int mapped_ram_save_page(RAMState *rs, PageSearchStatus *pss)
+{
+    RAMBlock *block = pss->block;
+    ram_addr_t offset = pss->page << TARGET_PAGE_BITS;
+    uint8_t *p = block->host + offset;
+    int64_t pos = block->pages_offset + offset;
+
+    if (is_zero_range(p, TARGET_PAGE_SIZE)) {
+        /* Any copy written earlier is stale now */
+        clear_bit(pss->page, block->file_bmap);
+        ram_counters.duplicate++;
+        return 1;
+    }
+
+    if (rs->mapped_run_len &&
+        (pos != rs->mapped_run_pos + rs->mapped_run_len ||
+         p != rs->mapped_run_host + rs->mapped_run_len ||
+         rs->mapped_run_len >= MAPPED_RAM_RUN_MAX)) {
+        mapped_ram_flush(rs);
+    }
+    if (!rs->mapped_run_len) {
+        rs->mapped_run_host = p;
+        rs->mapped_run_pos = pos;
+    }
+    rs->mapped_run_len += TARGET_PAGE_SIZE;
+
+    set_bit(pss->page, block->file_bmap);
+    ram_counters.normal++;
+    ram_counters.transferred += TARGET_PAGE_SIZE;
+    return 1;
+}
+
+/**
+ * mapped_ram_save_bitmaps: write which pages the file holds for each block
+ *
+ * @f: QEMUFile where to send the data
+ */
+static void mapped_ram_save_bitmaps(QEMUFile *f)
+{
+    RAMBlock *block;
+
+    RAMBLOCK_FOREACH_NOT_IGNORED(block) {
+        unsigned long pages = block->used_length >> TARGET_PAGE_BITS;
+        unsigned long *bitmap;
+
+        if (!block->file_bmap) {
+            continue;
+        }
+        bitmap = g_memdup(block->file_bmap, MAPPED_RAM_BITMAP_SIZE(pages));
+        mapped_ram_bitmap_le(bitmap, MAPPED_RAM_BITMAP_BITS(pages));
+        qemu_put_buffer_at(f, (uint8_t *)bitmap, MAPPED_RAM_BITMAP_SIZE(pages),
+                           block->bitmap_offset);
+        g_free(bitmap);
+    }
+}
+
+/**
+ * ram_save_multifd_page: send the given page through the multifd channels
+ *
+ * Zero pages still go through the main stream, everything else is
+ * queued for the multifd channels.
+ *
+ * Returns the number of pages written or negative on error
+ *
+ * @rs: current RAM state
+ * @pss: data about the page we want to send
+ * @last_stage: if we are at the completion stage
+ */
+static int ram_save_multifd_page(RAMState *rs, PageSearchStatus *pss,
+                                 bool last_stage)
+{
+    int pages;
+    uint8_t *p;
+    RAMBlock *block = pss->block;
+    ram_addr_t offset = pss->page << TARGET_PAGE_BITS;
+
+    p = block->host + offset;
+    trace_ram_save_page(block->idstr, (uint64_t)offset, p);
+
+    pages = save_zero_page(rs, block, offset, p);
+    if (pages == -1) {
+        if (multifd_queue_page(rs, block, offset) < 0) {
+            qemu_file_set_error(rs->f, -EIO);
+            return -1;
+        }
+        pages = 1;
+        ram_counters.normal++;
+    }
 
     return pages;
 }
 
-static int do_compress_ram_page(QEMUFile *f, RAMBlock *block,
-                                ram_addr_t offset)
+/*
+ * do_compress_job: compress the pages of a job into page records
+ *
+ * Runs in a compression thread.  The first page of each block is sent
+ * by the migration thread, so all records carry RAM_SAVE_FLAG_CONTINUE.
+ */
+static void do_compress_job(CompressWorker *worker, CompressJob *job)
+{
+    RAMBlock *block = job->block;
+    unsigned int i;
+    ssize_t blen;
+
+    for (i = 0; i < job->nr_pages; i++) {
+        uint8_t *rec = job->buf + job->used;
+        ram_addr_t offset = job->offset[i];
+
+        stq_be_p(rec, offset | RAM_SAVE_FLAG_COMPRESS_PAGE |
+                 RAM_SAVE_FLAG_CONTINUE);
+        /*
+         * The guest may write to the page meanwhile; compressing it in
+         * place could then produce data the destination can't decode.
+         */
+        memcpy(worker->page, block->host + offset, TARGET_PAGE_SIZE);
+        blen = compress_buffer(worker->ctx, rec + COMPRESS_PAGE_HDR_SIZE,
+                               worker->ring->page_bound,
+                               worker->page, TARGET_PAGE_SIZE);
+        if (blen < 0) {
+            job->ret = -EIO;
+            return;
+        }
+        stl_be_p(rec + sizeof(uint64_t), blen);
+        job->used += COMPRESS_PAGE_HDR_SIZE + blen;
+        ram_release_pages(block->idstr, offset, 1);
+    }
+}
+
+/* Send the page records of a job, in the migration thread */
+static void compress_job_retire(void *opaque, CompressJob *job)
 {
-    RAMState *rs = ram_state;
-    int bytes_sent, blen;
-    uint8_t *p = block->host + (offset & TARGET_PAGE_MASK);
-
-    bytes_sent = save_page_header(rs, f, block, offset |
-                                  RAM_SAVE_FLAG_COMPRESS_PAGE);
-    blen = qemu_put_compression_data(f, p, TARGET_PAGE_SIZE,
-                                     migrate_compress_level());
-    if (blen < 0) {
-        bytes_sent = 0;
-        qemu_file_set_error(migrate_get_current()->to_dst_file, blen);
+    RAMState *rs = opaque;
+
+    if (job->ret < 0) {
+        qemu_file_set_error(rs->f, job->ret);
         error_report("compressed data failed!");
-    } else {
-        bytes_sent += blen;
-        ram_release_pages(block->idstr, offset & TARGET_PAGE_MASK, 1);
+        return;
     }
-
-    return bytes_sent;
+    qemu_put_buffer(rs->f, job->buf, job->used);
+    ram_counters.transferred += job->used;
 }
 
 static void flush_compressed_data(RAMState *rs)
 {
-    int idx, len, thread_count;
-
     if (!migrate_use_compression()) {
         return;
     }
-    thread_count = migrate_compress_threads();
-
-    qemu_mutex_lock(&comp_done_lock);
-    for (idx = 0; idx < thread_count; idx++) {
-        while (!comp_param[idx].done) {
-            qemu_cond_wait(&comp_done_cond, &comp_done_lock);
-        }
-    }
-    qemu_mutex_unlock(&comp_done_lock);
-
-    for (idx = 0; idx < thread_count; idx++) {
-        qemu_mutex_lock(&comp_param[idx].mutex);
-        if (!comp_param[idx].quit) {
-            len = qemu_put_qemu_file(rs->f, comp_param[idx].file);
-            ram_counters.transferred += len;
-        }
-        qemu_mutex_unlock(&comp_param[idx].mutex);
-    }
-}
-
-static inline void set_compress_params(CompressParam *param, RAMBlock *block,
-                                       ram_addr_t offset)
-{
-    param->block = block;
-    param->offset = offset;
+    compress_ring_flush(&compress_ring);
 }
 
 static int compress_page_with_multi_thread(RAMState *rs, RAMBlock *block,
                                            ram_addr_t offset)
 {
-    int idx, thread_count, bytes_xmit = -1, pages = -1;
-
-    thread_count = migrate_compress_threads();
-    qemu_mutex_lock(&comp_done_lock);
-    while (true) {
-        for (idx = 0; idx < thread_count; idx++) {
-            if (comp_param[idx].done) {
-                comp_param[idx].done = false;
-                bytes_xmit = qemu_put_qemu_file(rs->f, comp_param[idx].file);
-                qemu_mutex_lock(&comp_param[idx].mutex);
-                set_compress_params(&comp_param[idx], block, offset);
-                qemu_cond_signal(&comp_param[idx].cond);
-                qemu_mutex_unlock(&comp_param[idx].mutex);
-                pages = 1;
-                ram_counters.normal++;
-                ram_counters.transferred += bytes_xmit;
-                break;
-            }
-        }
-        if (pages > 0) {
-            break;
-        } else {
-            qemu_cond_wait(&comp_done_cond, &comp_done_lock);
-        }
+    CompressJob *job = compress_ring_get_job(&compress_ring);
+
+    /* Callers flush the ring when they move on to another block */
+    assert(!job->block || job->block == block);
+    job->block = block;
+    job->offset[job->nr_pages++] = offset;
+    if (job->nr_pages == COMPRESS_BATCH_PAGES) {
+        compress_ring_submit(&compress_ring);
+    }
+    /* Send out whatever is ready without waiting for the rest */
+    while (compress_ring_retire(&compress_ring, false)) {
+        /* nothing */
     }
-    qemu_mutex_unlock(&comp_done_lock);
+    ram_counters.normal++;
 
-    return pages;
+    return 1;
 }
 
 /**
@@ -897,7 +2795,8 @@ static int ram_save_compressed_page(RAMState *rs, PageSearchStatus *pss,
     int pages = -1;
     uint64_t bytes_xmit = 0;
     uint8_t *p;
-    int ret, blen;
+    int ret;
+    ssize_t blen;
     RAMBlock *block = pss->block;
     ram_addr_t offset = pss->page << TARGET_PAGE_BITS;
 
@@ -931,14 +2830,18 @@ static int ram_save_compressed_page(RAMState *rs, PageSearchStatus *pss,
                 /* Make sure the first page is sent out before other pages */
                 bytes_xmit = save_page_header(rs, rs->f, block, offset |
                                               RAM_SAVE_FLAG_COMPRESS_PAGE);
-                blen = qemu_put_compression_data(rs->f, p, TARGET_PAGE_SIZE,
-                                                 migrate_compress_level());
-                if (blen > 0) {
-                    ram_counters.transferred += bytes_xmit + blen;
+                memcpy(compress_main_page, p, TARGET_PAGE_SIZE);
+                blen = compress_buffer(compress_main_ctx, compress_main_buf,
+                                       compress_ring.page_bound,
+                                       compress_main_page, TARGET_PAGE_SIZE);
+                if (blen >= 0) {
+                    qemu_put_be32(rs->f, blen);
+                    qemu_put_buffer(rs->f, compress_main_buf, blen);
+                    ram_counters.transferred += bytes_xmit + 4 + blen;
                     ram_counters.normal++;
                     pages = 1;
                 } else {
-                    qemu_file_set_error(rs->f, blen);
+                    qemu_file_set_error(rs->f, -EIO);
                     error_report("compressed data failed!");
                 }
             }
@@ -977,6 +2880,15 @@ static bool find_dirty_block(RAMState *rs, PageSearchStatus *pss, bool *again)
          * We've been once around the RAM and haven't found anything.
          * Give up.
          */
+        if (rs->hot_skipped) {
+            /*
+             * Only hot pages are left.  They go in the next search unless
+             * the bitmap is synced before, so that the migration still
+             * makes progress when they do not fit in the downtime.
+             */
+            rs->hot_only_sync = ram_counters.dirty_sync_count;
+            trace_find_dirty_block_hot_only(rs->hot_only_sync);
+        }
         *again = false;
         return false;
     }
@@ -1216,9 +3128,13 @@ static int ram_save_target_page(RAMState *rs, PageSearchStatus *pss,
          * round of migration even if compression is enabled. In theory,
          * xbzrle can do better than compression.
          */
-        if (migrate_use_compression() &&
+        if (migrate_mapped_ram()) {
+            res = mapped_ram_save_page(rs, pss);
+        } else if (migrate_use_compression() &&
             (rs->ram_bulk_stage || !migrate_use_xbzrle())) {
             res = ram_save_compressed_page(rs, pss, last_stage);
+        } else if (migrate_use_multifd()) {
+            res = ram_save_multifd_page(rs, pss, last_stage);
         } else {
             res = ram_save_page(rs, pss, last_stage);
         }
@@ -1303,6 +3219,7 @@ static int ram_find_and_save_block(RAMState *rs, bool last_stage)
     pss.block = rs->last_seen_block;
     pss.page = rs->last_page;
     pss.complete_round = false;
+    rs->hot_skipped = false;
 
     if (!pss.block) {
         pss.block = QLIST_FIRST_RCU(&ram_list.blocks);
@@ -1341,19 +3258,26 @@ void acct_update_position(QEMUFile *f, size_t size, bool zero)
     }
 }
 
-uint64_t ram_bytes_total(void)
+static uint64_t ram_bytes_total_common(bool count_ignored)
 {
     RAMBlock *block;
     uint64_t total = 0;
 
     rcu_read_lock();
     RAMBLOCK_FOREACH(block) {
-        total += block->used_length;
+        if (count_ignored || !ramblock_is_ignored(block)) {
+            total += block->used_length;
+        }
     }
     rcu_read_unlock();
     return total;
 }
 
+uint64_t ram_bytes_total(void)
+{
+    return ram_bytes_total_common(true);
+}
+
 static void xbzrle_load_setup(void)
 {
     XBZRLE.decoded_buf = g_malloc(TARGET_PAGE_SIZE);
@@ -1375,20 +3299,34 @@ static void ram_save_cleanup(void *opaque)
      */
     memory_global_dirty_log_stop();
 
+    if ((*rsp)->free_page_support && !(*rsp)->free_page_done) {
+        qemu_mutex_lock(&(*rsp)->bitmap_mutex);
+        (*rsp)->free_page_done = true;
+        qemu_mutex_unlock(&(*rsp)->bitmap_mutex);
+        balloon_free_page_stop();
+    }
+
     QLIST_FOREACH_RCU(block, &ram_list.blocks, next) {
         g_free(block->bmap);
         block->bmap = NULL;
         g_free(block->unsentmap);
         block->unsentmap = NULL;
+        g_free(block->file_bmap);
+        block->file_bmap = NULL;
+        g_free(block->dirty_heat);
+        block->dirty_heat = NULL;
+        g_free(block->hot_skipmap);
+        block->hot_skipmap = NULL;
+        g_free(block->dedup_digest);
+        block->dedup_digest = NULL;
     }
 
     XBZRLE_cache_lock();
     if (XBZRLE.cache) {
-        cache_fini(XBZRLE.cache);
+        xbzrle_cache_replace(NULL);
         g_free(XBZRLE.encoded_buf);
         g_free(XBZRLE.current_buf);
         g_free(XBZRLE.zero_target_page);
-        XBZRLE.cache = NULL;
         XBZRLE.encoded_buf = NULL;
         XBZRLE.current_buf = NULL;
         XBZRLE.zero_target_page = NULL;
@@ -1396,6 +3334,11 @@ static void ram_save_cleanup(void *opaque)
     XBZRLE_cache_unlock();
     migration_page_queue_free(*rsp);
     compress_threads_save_cleanup();
+    dirty_sync_pool_free((*rsp)->dirty_sync_pool);
+    if ((*rsp)->dedup_index) {
+        g_hash_table_destroy((*rsp)->dedup_index);
+        g_free((*rsp)->dedup_buf);
+    }
     g_free(*rsp);
     *rsp = NULL;
 }
@@ -1407,8 +3350,6 @@ static void ram_state_reset(RAMState *rs)
     rs->last_page = 0;
     rs->last_version = ram_list.version;
     rs->ram_bulk_stage = true;
-    rs->free_page_support = balloon_free_page_support();
-    rs->free_page_done = false;
 }
 
 #define MAX_WAIT 50 /* ms, half buffered_file limit */
@@ -1815,13 +3756,19 @@ static int ram_state_init(RAMState **rsp)
     qemu_mutex_init(&(*rsp)->bitmap_mutex);
     qemu_mutex_init(&(*rsp)->src_page_req_mutex);
     QSIMPLEQ_INIT(&(*rsp)->src_page_requests);
+    ram_counters.dirty_sync_time = 0;
+    ram_counters.dirty_sync_time_max = 0;
+    ram_counters.avoided_resend_bytes = 0;
+    ram_counters.dedup_pages = 0;
 
     if (migrate_use_xbzrle()) {
         XBZRLE_cache_lock();
         XBZRLE.zero_target_page = g_malloc0(TARGET_PAGE_SIZE);
-        XBZRLE.cache = cache_init(migrate_xbzrle_cache_size() /
+        memset(xbzrle_way_counters, 0, sizeof(xbzrle_way_counters));
+        atomic_rcu_set(&XBZRLE.cache,
+                       cache_init(migrate_xbzrle_cache_size() /
                                   TARGET_PAGE_SIZE,
-                                  TARGET_PAGE_SIZE);
+                                  TARGET_PAGE_SIZE));
         if (!XBZRLE.cache) {
             XBZRLE_cache_unlock();
             error_report("Error creating cache");
@@ -1851,44 +3798,75 @@ static int ram_state_init(RAMState **rsp)
         }
     }
 
+    if (migrate_dirty_sync_threads()) {
+        (*rsp)->dirty_sync_pool =
+            dirty_sync_pool_new(migrate_dirty_sync_threads());
+    }
+    if (migrate_dedup_pages()) {
+        (*rsp)->dedup_index = g_hash_table_new(dedup_digest_hash,
+                                               dedup_digest_equal);
+        (*rsp)->dedup_buf = g_malloc(TARGET_PAGE_SIZE);
+    }
+
     /* For memory_global_dirty_log_start below.  */
     qemu_mutex_lock_iothread();
 
     qemu_mutex_lock_ramlist();
     rcu_read_lock();
     ram_state_reset(*rsp);
+    (*rsp)->free_page_support = balloon_free_page_support();
+    /* Hints are only taken once the initial sync below has been done */
+    (*rsp)->free_page_done = true;
 
     /* Skip setting bitmap if there is no RAM */
     if (ram_bytes_total()) {
         RAMBlock *block;
 
-        QLIST_FOREACH_RCU(block, &ram_list.blocks, next) {
+        RAMBLOCK_FOREACH_NOT_IGNORED(block) {
             unsigned long pages = block->max_length >> TARGET_PAGE_BITS;
 
             block->bmap = bitmap_new(pages);
-            if ((*rsp)->free_page_support) {
-                bitmap_set(block->bmap, 1, pages);
-            } else {
-                bitmap_set(block->bmap, 0, pages);
-            }
+            bitmap_set(block->bmap, 0, pages);
             if (migrate_postcopy_ram()) {
                 block->unsentmap = bitmap_new(pages);
                 bitmap_set(block->unsentmap, 0, pages);
             }
+            if (migrate_defer_hot_pages()) {
+                block->dirty_heat = g_new0(uint8_t, BITS_TO_LONGS(pages));
+                block->hot_skipmap = bitmap_new(BITS_TO_LONGS(pages));
+            }
+            if (migrate_dedup_pages()) {
+                block->dedup_digest = g_new0(uint8_t,
+                                             pages * DEDUP_DIGEST_LEN);
+            }
         }
     }
 
     /*
      * Count the total number of pages used by ram blocks not including any
-     * gaps due to alignment or unplugs.
+     * gaps due to alignment or unplugs, nor blocks that are not migrated.
      */
-    (*rsp)->migration_dirty_pages = ram_bytes_total() >> TARGET_PAGE_BITS;
+    (*rsp)->migration_dirty_pages =
+        ram_bytes_total_common(false) >> TARGET_PAGE_BITS;
 
     memory_global_dirty_log_start();
+    migration_bitmap_sync(*rsp);
     if ((*rsp)->free_page_support) {
-        balloon_free_page_start();
+        /*
+         * The guest reports free pages while the bulk stage runs; the
+         * window is closed again by the next bitmap sync.
+         */
+        qemu_mutex_lock(&(*rsp)->bitmap_mutex);
+        (*rsp)->free_page_done = false;
+        qemu_mutex_unlock(&(*rsp)->bitmap_mutex);
+        if (balloon_free_page_start() < 0) {
+            qemu_mutex_lock(&(*rsp)->bitmap_mutex);
+            (*rsp)->free_page_done = true;
+            qemu_mutex_unlock(&(*rsp)->bitmap_mutex);
+        } else {
+            trace_migration_free_page_hint_start();
+        }
     }
-    migration_bitmap_sync(*rsp);
     qemu_mutex_unlock_ramlist();
     qemu_mutex_unlock_iothread();
     rcu_read_unlock();
@@ -1923,6 +3901,13 @@ static int ram_save_setup(QEMUFile *f, void *opaque)
         }
     }
     (*rsp)->f = f;
+    (*rsp)->multifd_sync_count = ram_counters.dirty_sync_count;
+
+    if (migrate_mapped_ram() && !qemu_file_is_seekable(f)) {
+        error_report("Mapped RAM needs a seekable migration stream, "
+                     "such as file:");
+        return -1;
+    }
 
     rcu_read_lock();
 
@@ -1935,10 +3920,23 @@ static int ram_save_setup(QEMUFile *f, void *opaque)
         if (migrate_postcopy_ram() && block->page_size != qemu_host_page_size) {
             qemu_put_be64(f, block->page_size);
         }
+        if (migrate_ignore_shared()) {
+            qemu_put_be64(f, block->mr->addr);
+            qemu_put_byte(f, ramblock_is_ignored(block));
+        }
+        if (migrate_mapped_ram() && !ramblock_is_ignored(block)) {
+            mapped_ram_save_setup_block(f, block);
+        }
+    }
+    /* Compressed pages can only be loaded with the same method */
+    if (migrate_use_compression()) {
+        qemu_put_byte(f, migrate_compress_method());
     }
 
     rcu_read_unlock();
-    compress_threads_save_setup();
+    if (compress_threads_save_setup(*rsp) < 0) {
+        return -1;
+    }
 
     ram_control_before_iterate(f, RAM_CONTROL_SETUP);
     ram_control_after_iterate(f, RAM_CONTROL_SETUP);
@@ -1948,14 +3946,58 @@ static int ram_save_setup(QEMUFile *f, void *opaque)
     return 0;
 }
 
-void skip_free_pages_from_dirty_bitmap(RAMBlock *block, ram_addr_t offset,
-                                       size_t len)
+/**
+ * skip_free_pages_from_dirty_bitmap: drop guest-reported free pages
+ *
+ * Clears the dirty bits of the pages covered by @hints so that they are
+ * not sent.  Only pages fully contained in a hint are dropped.  Hints
+ * are ignored when no migration is running or the hint window has
+ * already been closed by a bitmap sync.
+ *
+ * Called from the device with the iothread lock held.
+ *
+ * @hints: array of free page ranges reported by the guest
+ * @nr: number of entries in @hints
+ */
+void skip_free_pages_from_dirty_bitmap(const FreePageHint *hints,
+                                       unsigned int nr)
 {
-    long start = offset >> TARGET_PAGE_BITS,
-         nr = len >> TARGET_PAGE_BITS;
+    RAMState *rs = ram_state;
+    uint64_t cleared = 0;
+    unsigned int i;
+
+    if (!rs || !nr) {
+        return;
+    }
+
+    qemu_mutex_lock(&rs->bitmap_mutex);
+    if (rs->free_page_done) {
+        qemu_mutex_unlock(&rs->bitmap_mutex);
+        return;
+    }
+    for (i = 0; i < nr; i++) {
+        RAMBlock *block = hints[i].block;
+        ram_addr_t start, end;
+        unsigned long page;
+
+        if (!block || !block->bmap ||
+            hints[i].offset >= block->used_length) {
+            continue;
+        }
+        start = ROUND_UP(hints[i].offset, TARGET_PAGE_SIZE);
+        end = MIN(hints[i].offset + hints[i].len, block->used_length);
+        end &= TARGET_PAGE_MASK;
+        for (page = start >> TARGET_PAGE_BITS;
+             page < end >> TARGET_PAGE_BITS; page++) {
+            if (test_and_clear_bit(page, block->bmap)) {
+                cleared++;
+            }
+        }
+    }
+    rs->migration_dirty_pages -= cleared;
+    qemu_mutex_unlock(&rs->bitmap_mutex);
 
-    bitmap_clear(block->bmap, start, nr);
-    ram_state->migration_dirty_pages -= nr;
+    trace_skip_free_pages_from_dirty_bitmap(nr, cleared);
 }
 
 /**
@@ -1985,10 +4027,10 @@ static int ram_save_iterate(QEMUFile *f, void *opaque)
 
     ram_control_before_iterate(f, RAM_CONTROL_ROUND);
 
-    if (rs->free_page_support && !rs->free_page_done) {
-        balloon_free_page_stop();
-        rs->free_page_done = true;
-    }
+    /* The bitmap was synced since the last iteration, start a new round */
+    multifd_send_sync_round(rs);
+
+    rs->defer_hot = migrate_defer_hot_pages() && !migration_in_postcopy();
 
     t0 = qemu_clock_get_ns(QEMU_CLOCK_REALTIME);
     i = 0;
@@ -2018,6 +4060,7 @@ static int ram_save_iterate(QEMUFile *f, void *opaque)
         i++;
     }
     flush_compressed_data(rs);
+    mapped_ram_flush(rs);
     rcu_read_unlock();
 
     /*
@@ -2054,9 +4097,12 @@ static int ram_save_complete(QEMUFile *f, void *opaque)
 
     rcu_read_lock();
 
+    /* Everything that is still dirty goes now */
+    rs->defer_hot = false;
     if (!migration_in_postcopy()) {
         migration_bitmap_sync(rs);
     }
+    multifd_send_sync_round(rs);
 
     ram_control_before_iterate(f, RAM_CONTROL_FINISH);
 
@@ -2074,8 +4120,18 @@ static int ram_save_complete(QEMUFile *f, void *opaque)
     }
 
     flush_compressed_data(rs);
+    if (migrate_mapped_ram()) {
+        mapped_ram_flush(rs);
+        mapped_ram_save_bitmaps(f);
+    }
     ram_control_after_iterate(f, RAM_CONTROL_FINISH);
 
+    /* All pages must be loaded before the destination goes on */
+    if (migrate_use_multifd()) {
+        multifd_send_sync_main(rs);
+        multifd_send_flush();
+    }
+
     rcu_read_unlock();
 
     qemu_put_be64(f, RAM_SAVE_FLAG_EOS);
@@ -2137,8 +4193,437 @@ static int load_xbzrle(QEMUFile *f, ram_addr_t addr, void *host)
         error_report("Failed to load XBZRLE page - decode error!");
         return -1;
     }
-
-    return 0;
+
+    return 0;
+}
+
+typedef struct MappedRamLoad {
+    QEMUFile *f;
+    RAMBlock *block;
+    unsigned long *bitmap;
+    unsigned long pages;
+    int64_t pages_offset;
+    /* clear the pages that are not in the file, RAM isn't fresh */
+    bool zero_holes;
+    /* next chunk of MAPPED_RAM_RUN_MAX bytes to read, taken atomically */
+    unsigned long next_chunk;
+    /* first error, set atomically */
+    int ret;
+} MappedRamLoad;
+
+static void *mapped_ram_load_thread(void *opaque)
+{
+    MappedRamLoad *load = opaque;
+    unsigned long chunk_pages = MAPPED_RAM_RUN_MAX >> TARGET_PAGE_BITS;
+
+    while (!atomic_read(&load->ret)) {
+        unsigned long start, end, page, first, last;
+
+        start = atomic_fetch_inc(&load->next_chunk) * chunk_pages;
+        if (start >= load->pages) {
+            break;
+        }
+        end = MIN(start + chunk_pages, load->pages);
+
+        for (page = start; page < end; page = last) {
+            ram_addr_t offset = (ram_addr_t)page << TARGET_PAGE_BITS;
+            int ret;
+
+            first = find_next_bit(load->bitmap, end, page);
+            if (load->zero_holes && first > page) {
+                ram_handle_compressed(load->block->host + offset, 0,
+                                      (first - page) << TARGET_PAGE_BITS);
+            }
+            if (first >= end) {
+                break;
+            }
+
+            offset = (ram_addr_t)first << TARGET_PAGE_BITS;
+            last = find_next_zero_bit(load->bitmap, end, first);
+            ret = qemu_get_buffer_at(load->f, load->block->host + offset,
+                                     (last - first) << TARGET_PAGE_BITS,
+                                     load->pages_offset + offset);
+            if (ret < 0) {
+                atomic_cmpxchg(&load->ret, 0, ret);
+                break;
+            }
+        }
+    }
+    return NULL;
+}
+
+/* Whether the RAM of an incoming migration is loaded on demand */
+static bool mapped_ram_lazy(void)
+{
+    return migrate_lazy_restore() && runstate_check(RUN_STATE_INMIGRATE);
+}
+
+/**
+ * mapped_ram_load_block: load a RAMBlock laid out by
+ *                        mapped_ram_save_setup_block()
+ *
+ * The pages present in the file are read straight into guest memory, by
+ * the x-ram-load-threads helper threads and the calling thread at once.
+ * Pages missing from the file are zero.  RAM is zero already when the
+ * destination was started with -incoming; otherwise (loadvm of a
+ * snapshot on a running VM) those pages are cleared here.
+ * The stream then continues after the pages of the block.
+ *
+ * Returns zero to indicate success or negative on error
+ *
+ * @f: QEMUFile where to read the data from
+ * @block: RAMBlock to load
+ */
+static int mapped_ram_load_block(QEMUFile *f, RAMBlock *block)
+{
+    unsigned long pages = block->used_length >> TARGET_PAGE_BITS;
+    MappedRamLoad load = {
+        .f = f,
+        .block = block,
+        .pages = pages,
+        .zero_holes = !runstate_check(RUN_STATE_INMIGRATE),
+    };
+    int nr_threads = migrate_ram_load_threads();
+    QemuThread *threads;
+    uint64_t page_size;
+    uint32_t version;
+    int64_t bitmap_offset;
+    int i, ret;
+
+    if (!qemu_file_is_seekable(f)) {
+        error_report("Mapped RAM needs a seekable migration stream, "
+                     "such as file:");
+        return -EINVAL;
+    }
+
+    version = qemu_get_be32(f);
+    page_size = qemu_get_be64(f);
+    bitmap_offset = qemu_get_be64(f);
+    load.pages_offset = qemu_get_be64(f);
+    ret = qemu_file_get_error(f);
+    if (ret) {
+        return ret;
+    }
+    if (version != MAPPED_RAM_VERSION) {
+        error_report("Unsupported mapped RAM version %u for block %s",
+                     version, block->idstr);
+        return -EINVAL;
+    }
+    if (page_size != TARGET_PAGE_SIZE) {
+        error_report("Mismatched mapped RAM page size for block %s "
+                     "%" PRIu64 " != %d", block->idstr, page_size,
+                     TARGET_PAGE_SIZE);
+        return -EINVAL;
+    }
+
+    load.bitmap = bitmap_new(MAPPED_RAM_BITMAP_BITS(pages));
+    ret = qemu_get_buffer_at(f, (uint8_t *)load.bitmap,
+                             MAPPED_RAM_BITMAP_SIZE(pages), bitmap_offset);
+    if (ret < 0) {
+        goto out;
+    }
+    mapped_ram_bitmap_le(load.bitmap, MAPPED_RAM_BITMAP_BITS(pages));
+    /* Ignore the padding */
+    bitmap_clear(load.bitmap, pages, MAPPED_RAM_BITMAP_BITS(pages) - pages);
+
+    if (mapped_ram_lazy()) {
+        unsigned long host_pages = block->used_length / block->page_size;
+
+        /* Pages are read when touched, see ram_lazy_restore_start() */
+        g_free(block->file_bmap);
+        block->file_bmap = load.bitmap;
+        block->pages_offset = load.pages_offset;
+        g_free(block->lazymap);
+        block->lazymap = bitmap_new(host_pages);
+        bitmap_set(block->lazymap, 0, host_pages);
+        return qemu_file_set_offset(f, load.pages_offset +
+                                       block->used_length);
+    }
+
+    threads = g_new(QemuThread, nr_threads);
+    for (i = 0; i < nr_threads; i++) {
+        qemu_thread_create(&threads[i], "mapped-ram-load",
+                           mapped_ram_load_thread, &load,
+                           QEMU_THREAD_JOINABLE);
+    }
+    mapped_ram_load_thread(&load);
+    for (i = 0; i < nr_threads; i++) {
+        qemu_thread_join(&threads[i]);
+    }
+    g_free(threads);
+
+    trace_mapped_ram_load_block(block->idstr, nr_threads, load.ret);
+    ret = load.ret;
+    if (!ret) {
+        ret = qemu_file_set_offset(f, load.pages_offset + block->used_length);
+    }
+
+out:
+    g_free(load.bitmap);
+    return ret;
+}
+
+/*
+ * Lazy restore (x-lazy-restore): rather than reading the whole mapped RAM
+ * file before the guest starts, RAM is left empty and registered with
+ * userfaultfd.  Pages the guest touches are read by the postcopy fault
+ * thread, through ram_lazy_restore_load(), while a background thread
+ * reads everything else in order.
+ */
+typedef struct RAMLazyRestore {
+    QEMUFile *f;
+    QemuThread thread;
+    QEMUBH *bh;
+    size_t buf_size;
+    /* one buffer for the fault thread and one for the prefetch thread */
+    uint8_t *fault_buf;
+    uint8_t *prefetch_buf;
+    /* main thread only: the incoming side is done with @f */
+    bool file_released;
+    /* main thread only: every page is in place */
+    bool done;
+} RAMLazyRestore;
+
+static RAMLazyRestore *lazy_restore;
+
+/*
+ * Read the host pages [@first, @last) of @block, which the caller has
+ * claimed in its lazymap, into @buf and place them
+ */
+static int lazy_restore_place(RAMLazyRestore *lr, RAMBlock *block,
+                              unsigned long first, unsigned long last,
+                              uint8_t *buf)
+{
+    MigrationIncomingState *mis = migration_incoming_get_current();
+    size_t pagesize = block->page_size;
+    unsigned long host_tps = pagesize >> TARGET_PAGE_BITS;
+    ram_addr_t start = (ram_addr_t)first * pagesize;
+    ram_addr_t len = (ram_addr_t)(last - first) * pagesize;
+    unsigned long page = start >> TARGET_PAGE_BITS;
+    unsigned long end = (start + len) >> TARGET_PAGE_BITS;
+    ram_addr_t off;
+    int ret;
+
+    memset(buf, 0, len);
+    page = find_next_bit(block->file_bmap, end, page);
+    while (page < end) {
+        unsigned long run_end = find_next_zero_bit(block->file_bmap, end,
+                                                   page);
+        ram_addr_t run_start = (ram_addr_t)page << TARGET_PAGE_BITS;
+
+        ret = qemu_get_buffer_at(lr->f, buf + (run_start - start),
+                                 (run_end - page) << TARGET_PAGE_BITS,
+                                 block->pages_offset + run_start);
+        if (ret < 0) {
+            return ret;
+        }
+        page = find_next_bit(block->file_bmap, end, run_end);
+    }
+
+    for (off = 0; off < len; off += pagesize) {
+        unsigned long tp = (start + off) >> TARGET_PAGE_BITS;
+        void *host = block->host + start + off;
+
+        /* Zero pages are not in the file, the kernel fills small ones */
+        if (pagesize == getpagesize() &&
+            find_next_bit(block->file_bmap, tp + host_tps, tp) >=
+            tp + host_tps) {
+            ret = postcopy_place_page_zero(mis, host, pagesize);
+        } else {
+            ret = postcopy_place_page(mis, host, buf + off, pagesize);
+        }
+        if (ret) {
+            return ret;
+        }
+    }
+    return 0;
+}
+
+/*
+ * Load the host pages of @block covering [@start, @start + @len) that
+ * nobody has loaded yet, reading contiguous runs of up to the size of
+ * @buf at once.
+ */
+static int lazy_restore_load_range(RAMLazyRestore *lr, RAMBlock *block,
+                                   ram_addr_t start, ram_addr_t len,
+                                   uint8_t *buf)
+{
+    unsigned long max = lr->buf_size / block->page_size;
+    unsigned long i = start / block->page_size;
+    unsigned long end = DIV_ROUND_UP(start + len, block->page_size);
+    int ret;
+
+    while (i < end) {
+        unsigned long first;
+
+        if (!bitmap_test_and_clear_atomic(block->lazymap, i, 1)) {
+            /* Placed, or being placed, by the other thread */
+            i++;
+            continue;
+        }
+        first = i++;
+        while (i < end && i - first < max &&
+               bitmap_test_and_clear_atomic(block->lazymap, i, 1)) {
+            i++;
+        }
+        ret = lazy_restore_place(lr, block, first, i, buf);
+        if (ret < 0) {
+            return ret;
+        }
+    }
+    return 0;
+}
+
+/**
+ * ram_lazy_restore_load: load pages of a lazy restore on a userfault
+ *
+ * Called from the postcopy fault thread only.
+ *
+ * Returns negative errno on error, 0 on success.
+ *
+ * @rb: the RAMBlock the fault happened in
+ * @start: offset of the faulting host page in @rb
+ * @len: length to load, including any prefetch
+ */
+int ram_lazy_restore_load(RAMBlock *rb, ram_addr_t start, ram_addr_t len)
+{
+    return lazy_restore_load_range(lazy_restore, rb, start, len,
+                                   lazy_restore->fault_buf);
+}
+
+static void lazy_restore_free(RAMLazyRestore *lr)
+{
+    if (lr->file_released) {
+        qemu_fclose(lr->f);
+    }
+    qemu_vfree(lr->fault_buf);
+    qemu_vfree(lr->prefetch_buf);
+    g_free(lr);
+}
+
+/* Main thread side of the end of the lazy restore */
+static void lazy_restore_finish_bh(void *opaque)
+{
+    RAMLazyRestore *lr = opaque;
+    MigrationIncomingState *mis = migration_incoming_get_current();
+    RAMBlock *block;
+
+    qemu_bh_delete(lr->bh);
+    qemu_thread_join(&lr->thread);
+
+    /* RAM is all there, it does not need the fault thread anymore */
+    postcopy_ram_disable_notify(mis);
+    mis->lazy_restore = false;
+
+    rcu_read_lock();
+    RAMBLOCK_FOREACH(block) {
+        g_free(block->lazymap);
+        block->lazymap = NULL;
+        g_free(block->file_bmap);
+        block->file_bmap = NULL;
+    }
+    rcu_read_unlock();
+
+    lr->done = true;
+    if (lr->file_released) {
+        lazy_restore = NULL;
+        lazy_restore_free(lr);
+    }
+}
+
+static void *lazy_restore_thread(void *opaque)
+{
+    RAMLazyRestore *lr = opaque;
+    RAMBlock *block;
+    int ret = 0;
+
+    rcu_register_thread();
+
+    rcu_read_lock();
+    RAMBLOCK_FOREACH(block) {
+        ret = lazy_restore_load_range(lr, block, 0, block->used_length,
+                                      lr->prefetch_buf);
+        if (ret < 0) {
+            break;
+        }
+    }
+    rcu_read_unlock();
+
+    trace_ram_lazy_restore_done(ret);
+    if (ret < 0) {
+        /* Parts of RAM can't be provided, the guest can't go on */
+        error_report("Lazy restore of RAM failed: %s", strerror(-ret));
+        exit(EXIT_FAILURE);
+    }
+    qemu_bh_schedule(lr->bh);
+
+    rcu_unregister_thread();
+    return NULL;
+}
+
+/*
+ * Start a lazy restore once the layout of every RAMBlock has been read
+ * by mapped_ram_load_block().  Called with the RCU read lock held.
+ *
+ * Returns negative errno on error, 0 on success.
+ */
+static int ram_lazy_restore_start(QEMUFile *f)
+{
+    MigrationIncomingState *mis = migration_incoming_get_current();
+    RAMLazyRestore *lr;
+    RAMBlock *block;
+
+    RAMBLOCK_FOREACH(block) {
+        if (!block->lazymap) {
+            error_report("RAM block %s is not in the migration file",
+                         block->idstr);
+            return -EINVAL;
+        }
+    }
+
+    lr = g_new0(RAMLazyRestore, 1);
+    lr->f = f;
+    lr->buf_size = MAX(MAPPED_RAM_RUN_MAX, qemu_ram_pagesize_largest());
+    lr->fault_buf = qemu_memalign(getpagesize(), lr->buf_size);
+    lr->prefetch_buf = qemu_memalign(getpagesize(), lr->buf_size);
+    lr->bh = qemu_bh_new(lazy_restore_finish_bh, lr);
+    lazy_restore = lr;
+
+    if (postcopy_ram_lazy_restore_init(mis)) {
+        lazy_restore = NULL;
+        qemu_bh_delete(lr->bh);
+        lazy_restore_free(lr);
+        return -EINVAL;
+    }
+
+    trace_ram_lazy_restore_start(lr->buf_size);
+    qemu_thread_create(&lr->thread, "lazy-restore", lazy_restore_thread, lr,
+                       QEMU_THREAD_JOINABLE);
+    return 0;
+}
+
+/**
+ * ram_lazy_restore_release_file: the incoming migration is done with @f
+ *
+ * Returns true if a lazy restore still reads pages from @f, in which case
+ * it closes @f itself once it's over.
+ *
+ * @f: the incoming migration stream
+ */
+bool ram_lazy_restore_release_file(QEMUFile *f)
+{
+    RAMLazyRestore *lr = lazy_restore;
+
+    if (!lr || lr->f != f) {
+        return false;
+    }
+    if (lr->done) {
+        lazy_restore = NULL;
+        lazy_restore_free(lr);
+        return false;
+    }
+    lr->file_released = true;
+    return true;
 }
 
 /**
@@ -2175,6 +4660,11 @@ static inline RAMBlock *ram_block_from_stream(QEMUFile *f, int flags)
         return NULL;
     }
 
+    if (ramblock_is_ignored(block)) {
+        error_report("Block %s is shared and not migrated", id);
+        return NULL;
+    }
+
     return block;
 }
 
@@ -2188,6 +4678,113 @@ static inline void *host_from_ram_block_offset(RAMBlock *block,
     return block->host + offset;
 }
 
+static inline void *colo_cache_from_block_offset(RAMBlock *block,
+                                                 ram_addr_t offset)
+{
+    if (!offset_in_ramblock(block, offset)) {
+        return NULL;
+    }
+
+    /* The page is copied into guest memory by colo_flush_ram_cache() */
+    set_bit(offset >> TARGET_PAGE_BITS, block->bmap);
+    return block->colo_cache + offset;
+}
+
+/**
+ * colo_init_ram_cache: allocate the RAM cache of a COLO secondary
+ *
+ * While in COLO state, incoming pages are loaded into a copy of guest
+ * memory and only copied into place once a checkpoint has been received
+ * completely, so that a failover in the middle of a checkpoint leaves
+ * the secondary with the previous, consistent state.
+ *
+ * Returns zero to indicate success or negative on error
+ */
+int colo_init_ram_cache(void)
+{
+    RAMBlock *block;
+
+    rcu_read_lock();
+    RAMBLOCK_FOREACH(block) {
+        block->colo_cache = qemu_anon_ram_alloc(block->used_length, NULL);
+        if (!block->colo_cache) {
+            error_report("%s: Can't alloc memory for COLO cache of block %s,"
+                         " size 0x" RAM_ADDR_FMT, __func__, block->idstr,
+                         block->used_length);
+            goto out_locked;
+        }
+        memcpy(block->colo_cache, block->host, block->used_length);
+        block->bmap = bitmap_new(block->used_length >> TARGET_PAGE_BITS);
+    }
+    rcu_read_unlock();
+    return 0;
+
+out_locked:
+    RAMBLOCK_FOREACH(block) {
+        if (block->colo_cache) {
+            qemu_anon_ram_free(block->colo_cache, block->used_length);
+            block->colo_cache = NULL;
+        }
+        g_free(block->bmap);
+        block->bmap = NULL;
+    }
+    rcu_read_unlock();
+    return -ENOMEM;
+}
+
+/**
+ * colo_release_ram_cache: free the RAM cache of a COLO secondary
+ */
+void colo_release_ram_cache(void)
+{
+    RAMBlock *block;
+
+    rcu_read_lock();
+    RAMBLOCK_FOREACH(block) {
+        if (block->colo_cache) {
+            qemu_anon_ram_free(block->colo_cache, block->used_length);
+            block->colo_cache = NULL;
+        }
+        g_free(block->bmap);
+        block->bmap = NULL;
+    }
+    rcu_read_unlock();
+}
+
+/**
+ * colo_flush_ram_cache: copy the pages of a checkpoint into guest memory
+ *
+ * Returns the number of pages copied
+ *
+ * Called with iothread lock, once the whole checkpoint has been loaded
+ */
+uint64_t colo_flush_ram_cache(void)
+{
+    RAMBlock *block;
+    uint64_t pages = 0;
+
+    rcu_read_lock();
+    RAMBLOCK_FOREACH(block) {
+        unsigned long nr = block->used_length >> TARGET_PAGE_BITS;
+        unsigned long first = find_first_bit(block->bmap, nr);
+
+        while (first < nr) {
+            unsigned long last = find_next_zero_bit(block->bmap, nr, first);
+            ram_addr_t offset = (ram_addr_t)first << TARGET_PAGE_BITS;
+
+            /* Copy each run of dirty pages at once */
+            memcpy(block->host + offset, block->colo_cache + offset,
+                   (last - first) << TARGET_PAGE_BITS);
+            bitmap_clear(block->bmap, first, last - first);
+            pages += last - first;
+            first = find_next_bit(block->bmap, nr, last);
+        }
+    }
+    rcu_read_unlock();
+    trace_colo_flush_ram_cache(pages);
+    return pages;
+}
+
 /**
  * ram_handle_compressed: handle the zero page case
  *
@@ -2205,140 +4802,412 @@ void ram_handle_compressed(void *host, uint8_t ch, uint64_t size)
     }
 }
 
-static void *do_data_decompress(void *opaque)
+static void do_decompress_job(CompressWorker *worker, CompressJob *job)
 {
-    DecompressParam *param = opaque;
-    unsigned long pagesize;
-    uint8_t *des;
-    int len;
+    uint8_t *src = job->buf;
+    unsigned int i;
+    ssize_t ret;
 
-    qemu_mutex_lock(&param->mutex);
-    while (!param->quit) {
-        if (param->des) {
-            des = param->des;
-            len = param->len;
-            param->des = 0;
-            qemu_mutex_unlock(&param->mutex);
+    for (i = 0; i < job->nr_pages; i++) {
+        /*
+         * The source compresses a copy of each page, so its data always
+         * decodes: a failure means a corrupted stream or mismatched
+         * methods, and the page is left wrong.
+         */
+        ret = decompress_buffer(worker->ctx, job->host[i], TARGET_PAGE_SIZE,
+                                src, job->len[i]);
+        if (ret != TARGET_PAGE_SIZE) {
+            trace_ram_decompress_page_failed(job->host[i], job->len[i]);
+            atomic_cmpxchg(&worker->ring->ret, 0, -EINVAL);
+        }
+        src += job->len[i];
+    }
+}
 
-            pagesize = TARGET_PAGE_SIZE;
-            /* uncompress() will return failed in some case, especially
-             * when the page is dirted when doing the compression, it's
-             * not a problem because the dirty page will be retransferred
-             * and uncompress() won't break the data in other pages.
-             */
-            uncompress((Bytef *)des, &pagesize,
-                       (const Bytef *)param->compbuf, len);
+/*
+ * Wait until all compressed pages received so far are placed.
+ * Returns 0 for success or -EINVAL if one could not be decompressed.
+ */
+static int wait_for_decompress_done(void)
+{
+    int ret;
+
+    if (!migrate_use_compression()) {
+        return 0;
+    }
+    compress_ring_flush(&decompress_ring);
+    ret = atomic_xchg(&decompress_ring.ret, 0);
+    if (ret) {
+        error_report("Failed to decompress a page with method %s",
+                     MigrationCompressMethod_lookup[migrate_compress_method()]);
+    }
+    return ret;
+}
 
-            qemu_mutex_lock(&decomp_done_lock);
-            param->done = true;
-            qemu_cond_signal(&decomp_done_cond);
-            qemu_mutex_unlock(&decomp_done_lock);
+static int compress_threads_load_setup(void)
+{
+    Error *local_err = NULL;
 
-            qemu_mutex_lock(&param->mutex);
-        } else {
-            qemu_cond_wait(&param->cond, &param->mutex);
+    if (!migrate_use_compression()) {
+        return 0;
+    }
+    if (compress_ring_init(&decompress_ring, "decompress",
+                           migrate_decompress_threads(), true,
+                           do_decompress_job, NULL, NULL, &local_err) < 0) {
+        error_report_err(local_err);
+        return -1;
+    }
+    return 0;
+}
+
+static void compress_threads_load_cleanup(void)
+{
+    if (!migrate_use_compression()) {
+        return;
+    }
+    compress_ring_cleanup(&decompress_ring);
+}
+
+static void decompress_data_with_multi_threads(QEMUFile *f,
+                                               void *host, int len)
+{
+    CompressJob *job = compress_ring_get_job(&decompress_ring);
+
+    qemu_get_buffer(f, job->buf + job->used, len);
+    job->host[job->nr_pages] = host;
+    job->len[job->nr_pages] = len;
+    job->used += len;
+    if (++job->nr_pages == COMPRESS_BATCH_PAGES) {
+        compress_ring_submit(&decompress_ring);
+    }
+}
+
+/* Pages handed to a loader thread at once */
+#define RAM_LOAD_BATCH_PAGES 64
+/* Batches queued per loader thread */
+#define RAM_LOAD_JOBS_PER_THREAD 4
+
+typedef struct RAMLoadPage {
+    void *host;
+    ram_addr_t addr;
+    /* RAM_SAVE_FLAG_ZERO or RAM_SAVE_FLAG_XBZRLE */
+    int flags;
+    /* fill byte of a zero page */
+    uint8_t ch;
+    /* bytes of the job buffer used by the page */
+    uint32_t len;
+} RAMLoadPage;
+
+typedef struct RAMLoadJob {
+    unsigned int nr_pages;
+    RAMLoadPage pages[RAM_LOAD_BATCH_PAGES];
+    uint8_t *buf;
+    size_t used;
+} RAMLoadJob;
+
+/*
+ * A loader thread with its own queue of jobs.  Pages are assigned to
+ * threads by address, so all copies of one page go through the same
+ * queue and are placed in the order they were received.  Whole pages
+ * are read straight into guest memory by the incoming thread, which
+ * only has to wait for this queue if it holds an older copy of the
+ * page, see ram_load_pool_wait_page().
+ *
+ * @head and @filling are only accessed by the incoming thread, @tail
+ * only written by the loader thread.  @free counts the jobs that may be filled,
+ * @submitted the jobs that are ready to be loaded.
+ */
+typedef struct RAMLoadPool RAMLoadPool;
+
+typedef struct RAMLoadWorker {
+    QemuThread thread;
+    RAMLoadPool *pool;
+    RAMLoadJob jobs[RAM_LOAD_JOBS_PER_THREAD];
+    unsigned int head;
+    unsigned int tail;
+    bool filling;
+    QemuSemaphore free;
+    QemuSemaphore submitted;
+} RAMLoadWorker;
+
+struct RAMLoadPool {
+    unsigned int nr_workers;
+    RAMLoadWorker *workers;
+    bool quit;
+    /* First error a loader thread ran into */
+    int ret;
+};
+
+static RAMLoadPool *ram_load_pool;
+
+static void ram_load_job(RAMLoadPool *pool, RAMLoadJob *job)
+{
+    uint8_t *src = job->buf;
+    unsigned int i;
+
+    for (i = 0; i < job->nr_pages; i++) {
+        RAMLoadPage *page = &job->pages[i];
+
+        switch (page->flags) {
+        case RAM_SAVE_FLAG_ZERO:
+            ram_handle_compressed(page->host, page->ch, TARGET_PAGE_SIZE);
+            break;
+        case RAM_SAVE_FLAG_XBZRLE:
+            if (xbzrle_decode_buffer(src, page->len, page->host,
+                                     TARGET_PAGE_SIZE) == -1) {
+                error_report("Failed to decompress XBZRLE page at "
+                             RAM_ADDR_FMT, page->addr);
+                atomic_cmpxchg(&pool->ret, 0, -EINVAL);
+            }
+            break;
+        }
+        src += page->len;
+    }
+}
+
+static void *ram_load_thread(void *opaque)
+{
+    RAMLoadWorker *worker = opaque;
+    RAMLoadPool *pool = worker->pool;
+    RAMLoadJob *job;
+
+    while (true) {
+        qemu_sem_wait(&worker->submitted);
+        if (atomic_read(&pool->quit)) {
+            break;
         }
+        job = &worker->jobs[worker->tail % RAM_LOAD_JOBS_PER_THREAD];
+        ram_load_job(pool, job);
+        atomic_set(&worker->tail, worker->tail + 1);
+        qemu_sem_post(&worker->free);
     }
-    qemu_mutex_unlock(&param->mutex);
 
     return NULL;
 }
 
-static void wait_for_decompress_done(void)
+static void ram_load_pool_free(RAMLoadPool *pool)
 {
-    int idx, thread_count;
+    unsigned int i, j;
 
-    if (!migrate_use_compression()) {
-        return;
+    atomic_set(&pool->quit, true);
+    for (i = 0; i < pool->nr_workers; i++) {
+        qemu_sem_post(&pool->workers[i].submitted);
+    }
+    for (i = 0; i < pool->nr_workers; i++) {
+        RAMLoadWorker *worker = &pool->workers[i];
+
+        qemu_thread_join(&worker->thread);
+        qemu_sem_destroy(&worker->free);
+        qemu_sem_destroy(&worker->submitted);
+        for (j = 0; j < RAM_LOAD_JOBS_PER_THREAD; j++) {
+            g_free(worker->jobs[j].buf);
+        }
     }
+    g_free(pool->workers);
+    g_free(pool);
+}
 
-    thread_count = migrate_decompress_threads();
-    qemu_mutex_lock(&decomp_done_lock);
-    for (idx = 0; idx < thread_count; idx++) {
-        while (!decomp_param[idx].done) {
-            qemu_cond_wait(&decomp_done_cond, &decomp_done_lock);
+static RAMLoadPool *ram_load_pool_new(unsigned int nr_workers)
+{
+    RAMLoadPool *pool = g_new0(RAMLoadPool, 1);
+    unsigned int i, j;
+
+    pool->nr_workers = nr_workers;
+    pool->workers = g_new0(RAMLoadWorker, nr_workers);
+    for (i = 0; i < nr_workers; i++) {
+        RAMLoadWorker *worker = &pool->workers[i];
+
+        worker->pool = pool;
+        qemu_sem_init(&worker->free, RAM_LOAD_JOBS_PER_THREAD);
+        qemu_sem_init(&worker->submitted, 0);
+        for (j = 0; j < RAM_LOAD_JOBS_PER_THREAD; j++) {
+            worker->jobs[j].buf = g_malloc(RAM_LOAD_BATCH_PAGES *
+                                           TARGET_PAGE_SIZE);
         }
+        qemu_thread_create(&worker->thread, "ramload", ram_load_thread,
+                           worker, QEMU_THREAD_JOINABLE);
     }
-    qemu_mutex_unlock(&decomp_done_lock);
+    return pool;
 }
 
-static void compress_threads_load_setup(void)
+/* Consecutive pages go to the same thread, a batch at a time */
+static RAMLoadWorker *ram_load_pool_worker(RAMLoadPool *pool, void *host)
 {
-    int i, thread_count;
+    uintptr_t stripe = (uintptr_t)host / (RAM_LOAD_BATCH_PAGES *
+                                          TARGET_PAGE_SIZE);
 
-    if (!migrate_use_compression()) {
-        return;
+    return &pool->workers[stripe % pool->nr_workers];
+}
+
+static void ram_load_pool_submit(RAMLoadWorker *worker)
+{
+    worker->filling = false;
+    worker->head++;
+    qemu_sem_post(&worker->submitted);
+}
+
+/**
+ * ram_load_pool_queue: queue a page for one of the loader threads
+ *
+ * Returns where the @len bytes of data for the page must be stored.
+ *
+ * @pool: the loader threads
+ * @host: where the page goes in guest memory
+ * @addr: offset of the page in its RAMBlock, for error messages
+ * @flags: RAM_SAVE_FLAG_ZERO or RAM_SAVE_FLAG_XBZRLE
+ * @ch: fill byte of a zero page
+ * @len: size of the page data that follows in the stream
+ */
+static uint8_t *ram_load_pool_queue(RAMLoadPool *pool, void *host,
+                                    ram_addr_t addr, int flags, uint8_t ch,
+                                    uint32_t len)
+{
+    RAMLoadWorker *worker = ram_load_pool_worker(pool, host);
+    RAMLoadJob *job = &worker->jobs[worker->head % RAM_LOAD_JOBS_PER_THREAD];
+    RAMLoadPage *page;
+    uint8_t *data;
+
+    if (!worker->filling) {
+        qemu_sem_wait(&worker->free);
+        job->nr_pages = 0;
+        job->used = 0;
+        worker->filling = true;
     }
-    thread_count = migrate_decompress_threads();
-    decompress_threads = g_new0(QemuThread, thread_count);
-    decomp_param = g_new0(DecompressParam, thread_count);
-    qemu_mutex_init(&decomp_done_lock);
-    qemu_cond_init(&decomp_done_cond);
-    for (i = 0; i < thread_count; i++) {
-        qemu_mutex_init(&decomp_param[i].mutex);
-        qemu_cond_init(&decomp_param[i].cond);
-        decomp_param[i].compbuf = g_malloc0(compressBound(TARGET_PAGE_SIZE));
-        decomp_param[i].done = true;
-        decomp_param[i].quit = false;
-        qemu_thread_create(decompress_threads + i, "decompress",
-                           do_data_decompress, decomp_param + i,
-                           QEMU_THREAD_JOINABLE);
+
+    page = &job->pages[job->nr_pages];
+    page->host = host;
+    page->addr = addr;
+    page->flags = flags;
+    page->ch = ch;
+    page->len = len;
+    data = job->buf + job->used;
+    job->used += len;
+
+    job->nr_pages++;
+    return data;
+}
+
+/**
+ * ram_load_pool_commit: hand the page just queued and read to its thread
+ *
+ * @pool: the loader threads
+ * @host: the page passed to ram_load_pool_queue()
+ */
+static void ram_load_pool_commit(RAMLoadPool *pool, void *host)
+{
+    RAMLoadWorker *worker = ram_load_pool_worker(pool, host);
+    RAMLoadJob *job = &worker->jobs[worker->head % RAM_LOAD_JOBS_PER_THREAD];
+
+    if (job->nr_pages == RAM_LOAD_BATCH_PAGES) {
+        ram_load_pool_submit(worker);
     }
 }
 
-static void compress_threads_load_cleanup(void)
+/**
+ * ram_load_pool_wait_page: wait until no queued job touches a page
+ *
+ * Only the queue of the thread that owns @host is looked at, and only
+ * waited for if one of its pending jobs holds @host, so the incoming
+ * thread can then read or write the page itself.
+ *
+ * @pool: the loader threads
+ * @host: the page in guest memory
+ */
+static void ram_load_pool_wait_page(RAMLoadPool *pool, void *host)
 {
-    int i, thread_count;
+    RAMLoadWorker *worker = ram_load_pool_worker(pool, host);
+    unsigned int last = worker->head + worker->filling;
+    unsigned int tail = atomic_read(&worker->tail);
+    unsigned int idx, i, taken = 0;
+
+    /* Newest first: only the last job holding the page matters */
+    for (idx = last; idx != tail; idx--) {
+        RAMLoadJob *job = &worker->jobs[(idx - 1) % RAM_LOAD_JOBS_PER_THREAD];
+
+        for (i = 0; i < job->nr_pages; i++) {
+            if (job->pages[i].host == host) {
+                goto found;
+            }
+        }
+    }
+    return;
 
-    if (!migrate_use_compression()) {
-        return;
+found:
+    /* The job is number idx - 1, done once the thread's tail reaches idx */
+    if (worker->filling && idx == last) {
+        ram_load_pool_submit(worker);
     }
-    thread_count = migrate_decompress_threads();
-    for (i = 0; i < thread_count; i++) {
-        qemu_mutex_lock(&decomp_param[i].mutex);
-        decomp_param[i].quit = true;
-        qemu_cond_signal(&decomp_param[i].cond);
-        qemu_mutex_unlock(&decomp_param[i].mutex);
+    while ((int)(atomic_read(&worker->tail) - idx) < 0) {
+        qemu_sem_wait(&worker->free);
+        taken++;
     }
-    for (i = 0; i < thread_count; i++) {
-        qemu_thread_join(decompress_threads + i);
-        qemu_mutex_destroy(&decomp_param[i].mutex);
-        qemu_cond_destroy(&decomp_param[i].cond);
-        g_free(decomp_param[i].compbuf);
+    while (taken--) {
+        qemu_sem_post(&worker->free);
     }
-    g_free(decompress_threads);
-    g_free(decomp_param);
-    decompress_threads = NULL;
-    decomp_param = NULL;
+    trace_ram_load_pool_wait_page(host);
 }
 
-static void decompress_data_with_multi_threads(QEMUFile *f,
-                                               void *host, int len)
+/**
+ * ram_load_pool_flush: wait until every queued page has been placed
+ *
+ * Returns 0 for success or the first error of the loader threads.
+ *
+ * @pool: the loader threads
+ */
+static int ram_load_pool_flush(RAMLoadPool *pool)
 {
-    int idx, thread_count;
+    unsigned int i, j;
 
-    thread_count = migrate_decompress_threads();
-    qemu_mutex_lock(&decomp_done_lock);
-    while (true) {
-        for (idx = 0; idx < thread_count; idx++) {
-            if (decomp_param[idx].done) {
-                decomp_param[idx].done = false;
-                qemu_mutex_lock(&decomp_param[idx].mutex);
-                qemu_get_buffer(f, decomp_param[idx].compbuf, len);
-                decomp_param[idx].des = host;
-                decomp_param[idx].len = len;
-                qemu_cond_signal(&decomp_param[idx].cond);
-                qemu_mutex_unlock(&decomp_param[idx].mutex);
-                break;
-            }
+    for (i = 0; i < pool->nr_workers; i++) {
+        if (pool->workers[i].filling) {
+            ram_load_pool_submit(&pool->workers[i]);
         }
-        if (idx < thread_count) {
-            break;
-        } else {
-            qemu_cond_wait(&decomp_done_cond, &decomp_done_lock);
+    }
+    /* Once all jobs of a thread are free again, it is done */
+    for (i = 0; i < pool->nr_workers; i++) {
+        for (j = 0; j < RAM_LOAD_JOBS_PER_THREAD; j++) {
+            qemu_sem_wait(&pool->workers[i].free);
+        }
+        for (j = 0; j < RAM_LOAD_JOBS_PER_THREAD; j++) {
+            qemu_sem_post(&pool->workers[i].free);
         }
     }
-    qemu_mutex_unlock(&decomp_done_lock);
+    trace_ram_load_pool_flush(pool->nr_workers);
+    return atomic_xchg(&pool->ret, 0);
+}
+
+/**
+ * load_xbzrle_queued: read an XBZRLE page and queue it for decoding
+ *
+ * Returns 0 for success or -EINVAL if the header is invalid
+ *
+ * @f: QEMUFile where to read the data from
+ * @pool: the loader threads
+ * @addr: offset of the page in its RAMBlock
+ * @host: where the page goes in guest memory
+ */
+static int load_xbzrle_queued(QEMUFile *f, RAMLoadPool *pool,
+                              ram_addr_t addr, void *host)
+{
+    unsigned int xh_len;
+    int xh_flags;
+
+    xh_flags = qemu_get_byte(f);
+    xh_len = qemu_get_be16(f);
+
+    if (xh_flags != ENCODING_FLAG_XBZRLE) {
+        error_report("Failed to load XBZRLE page - wrong compression!");
+        return -EINVAL;
+    }
+    if (xh_len > TARGET_PAGE_SIZE) {
+        error_report("Failed to load XBZRLE page - len overflow!");
+        return -EINVAL;
+    }
+    qemu_get_buffer(f, ram_load_pool_queue(pool, host, addr,
+                                           RAM_SAVE_FLAG_XBZRLE, 0, xh_len),
+                    xh_len);
+    ram_load_pool_commit(pool, host);
+    return 0;
 }
 
 /**
@@ -2352,14 +5221,21 @@ static void decompress_data_with_multi_threads(QEMUFile *f,
 static int ram_load_setup(QEMUFile *f, void *opaque)
 {
     xbzrle_load_setup();
-    compress_threads_load_setup();
-    return 0;
+    /* Compressed pages are already spread over the decompression threads */
+    if (migrate_ram_load_threads() && !migrate_use_compression()) {
+        ram_load_pool = ram_load_pool_new(migrate_ram_load_threads());
+    }
+    return compress_threads_load_setup();
 }
 
 static int ram_load_cleanup(void *opaque)
 {
     xbzrle_load_cleanup();
     compress_threads_load_cleanup();
+    if (ram_load_pool) {
+        ram_load_pool_free(ram_load_pool);
+        ram_load_pool = NULL;
+    }
     return 0;
 }
 
@@ -2513,6 +5389,41 @@ static int ram_load_postcopy(QEMUFile *f)
     return ret;
 }
 
+/*
+ * Fill @host with a copy of the page the source says holds the same
+ * content; it was loaded earlier in the stream, possibly by @pool.
+ */
+static int load_dedup_page(QEMUFile *f, RAMLoadPool *pool, void *host)
+{
+    RAMBlock *block;
+    ram_addr_t offset;
+    void *src = NULL;
+    char id[256];
+    uint8_t len;
+
+    len = qemu_get_byte(f);
+    qemu_get_buffer(f, (uint8_t *)id, len);
+    id[len] = 0;
+    offset = qemu_get_be64(f);
+
+    block = qemu_ram_block_by_name(id);
+    if (block && !(offset & ~TARGET_PAGE_MASK)) {
+        src = host_from_ram_block_offset(block, offset);
+    }
+    if (!src) {
+        error_report("Illegal deduplicated page reference %s:" RAM_ADDR_FMT,
+                     id, offset);
+        return -EINVAL;
+    }
+    if (pool) {
+        ram_load_pool_wait_page(pool, src);
+        ram_load_pool_wait_page(pool, host);
+    }
+    memcpy(host, src, TARGET_PAGE_SIZE);
+
+    return 0;
+}
+
 static int ram_load(QEMUFile *f, void *opaque, int version_id)
 {
     int flags = 0, ret = 0, invalid_flags = 0;
@@ -2525,6 +5436,8 @@ static int ram_load(QEMUFile *f, void *opaque, int version_id)
     bool postcopy_running = postcopy_state_get() >= POSTCOPY_INCOMING_LISTENING;
     /* ADVISE is earlier, it shows the source has the postcopy capability on */
     bool postcopy_advised = postcopy_state_get() >= POSTCOPY_INCOMING_ADVISE;
+    /* Pages are placed by the loader threads, if there are any */
+    RAMLoadPool *pool = postcopy_running ? NULL : ram_load_pool;
 
     seq_iter++;
 
@@ -2535,6 +5448,9 @@ static int ram_load(QEMUFile *f, void *opaque, int version_id)
     if (!migrate_use_compression()) {
         invalid_flags |= RAM_SAVE_FLAG_COMPRESS_PAGE;
     }
+    if (!migrate_dedup_pages()) {
+        invalid_flags |= RAM_SAVE_FLAG_DEDUP;
+    }
     /* This RCU critical section can be very long running.
      * When RCU reclaims in the code start to become numerous,
      * it will be necessary to reduce the granularity of this
@@ -2559,22 +5475,36 @@ static int ram_load(QEMUFile *f, void *opaque, int version_id)
             if (flags & invalid_flags & RAM_SAVE_FLAG_COMPRESS_PAGE) {
                 error_report("Received an unexpected compressed page");
             }
+            if (flags & invalid_flags & RAM_SAVE_FLAG_DEDUP) {
+                error_report("Received an unexpected deduplicated page");
+            }
 
             ret = -EINVAL;
             break;
         }
 
         if (flags & (RAM_SAVE_FLAG_ZERO | RAM_SAVE_FLAG_PAGE |
-                     RAM_SAVE_FLAG_COMPRESS_PAGE | RAM_SAVE_FLAG_XBZRLE)) {
+                     RAM_SAVE_FLAG_COMPRESS_PAGE | RAM_SAVE_FLAG_XBZRLE |
+                     RAM_SAVE_FLAG_DEDUP)) {
             RAMBlock *block = ram_block_from_stream(f, flags);
 
-            host = host_from_ram_block_offset(block, addr);
+            if (block && block->colo_cache) {
+                host = colo_cache_from_block_offset(block, addr);
+            } else {
+                host = host_from_ram_block_offset(block, addr);
+            }
             if (!host) {
                 error_report("Illegal RAM offset " RAM_ADDR_FMT, addr);
                 ret = -EINVAL;
                 break;
             }
             trace_ram_load_loop(block->idstr, (uint64_t)addr, flags, host);
+        } else if (pool && !(flags & RAM_SAVE_FLAG_EOS)) {
+            /* Everything else may depend on the pages queued so far */
+            ret = ram_load_pool_flush(pool);
+            if (ret) {
+                break;
+            }
         }
 
         switch (flags & ~RAM_SAVE_FLAG_CONTINUE) {
@@ -2614,6 +5544,28 @@ static int ram_load(QEMUFile *f, void *opaque, int version_id)
                             ret = -EINVAL;
                         }
                     }
+                    /* Shared blocks must be mapped the same on both sides */
+                    if (migrate_ignore_shared()) {
+                        hwaddr addr = qemu_get_be64(f);
+                        bool ignored = qemu_get_byte(f);
+
+                        if (ignored != ramblock_is_ignored(block)) {
+                            error_report("RAM block %s is %sshared on the "
+                                         "destination", id,
+                                         ignored ? "not " : "");
+                            ret = -EINVAL;
+                        } else if (ignored && block->mr->addr != addr) {
+                            error_report("Mismatched GPAs for block %s "
+                                         "%" PRIx64 " != %" PRIx64,
+                                         id, (uint64_t)addr,
+                                         (uint64_t)block->mr->addr);
+                            ret = -EINVAL;
+                        }
+                    }
+                    if (!ret && migrate_mapped_ram() &&
+                        !ramblock_is_ignored(block)) {
+                        ret = mapped_ram_load_block(f, block);
+                    }
                     ram_control_load_hook(f, RAM_CONTROL_BLOCK_REG,
                                           block->idstr);
                 } else {
@@ -2624,20 +5576,46 @@ static int ram_load(QEMUFile *f, void *opaque, int version_id)
 
                 total_ram_bytes -= length;
             }
+            if (!ret && migrate_use_compression()) {
+                uint8_t method = qemu_get_byte(f);
+
+                if (method != migrate_compress_method()) {
+                    error_report("Mismatched compression method %s != %s",
+                                 method < MIGRATION_COMPRESS_METHOD__MAX ?
+                                 MigrationCompressMethod_lookup[method] :
+                                 "unknown",
+                                 MigrationCompressMethod_lookup[
+                                     migrate_compress_method()]);
+                    ret = -EINVAL;
+                }
+            }
+            if (!ret && mapped_ram_lazy()) {
+                ret = ram_lazy_restore_start(f);
+            }
             break;
 
         case RAM_SAVE_FLAG_ZERO:
             ch = qemu_get_byte(f);
+            if (pool) {
+                ram_load_pool_queue(pool, host, addr, RAM_SAVE_FLAG_ZERO,
+                                    ch, 0);
+                ram_load_pool_commit(pool, host);
+                break;
+            }
             ram_handle_compressed(host, ch, TARGET_PAGE_SIZE);
             break;
 
         case RAM_SAVE_FLAG_PAGE:
+            /* Copying is no cheaper on a loader thread, read it in place */
+            if (pool) {
+                ram_load_pool_wait_page(pool, host);
+            }
             qemu_get_buffer(f, host, TARGET_PAGE_SIZE);
             break;
 
         case RAM_SAVE_FLAG_COMPRESS_PAGE:
             len = qemu_get_be32(f);
-            if (len < 0 || len > compressBound(TARGET_PAGE_SIZE)) {
+            if (len < 0 || len > decompress_ring.page_bound) {
                 error_report("Invalid compressed data length: %d", len);
                 ret = -EINVAL;
                 break;
@@ -2646,6 +5624,10 @@ static int ram_load(QEMUFile *f, void *opaque, int version_id)
             break;
 
         case RAM_SAVE_FLAG_XBZRLE:
+            if (pool) {
+                ret = load_xbzrle_queued(f, pool, addr, host);
+                break;
+            }
             if (load_xbzrle(f, addr, host) < 0) {
                 error_report("Failed to decompress XBZRLE page at "
                              RAM_ADDR_FMT, addr);
@@ -2653,6 +5635,14 @@ static int ram_load(QEMUFile *f, void *opaque, int version_id)
                 break;
             }
             break;
+        case RAM_SAVE_FLAG_DEDUP:
+            ret = load_dedup_page(f, pool, host);
+            break;
+        case RAM_SAVE_FLAG_MULTIFD_SYNC:
+            if (multifd_recv_sync_main() < 0) {
+                ret = -EIO;
+            }
+            break;
         case RAM_SAVE_FLAG_EOS:
             /* normal exit */
             break;
@@ -2670,7 +5660,16 @@ static int ram_load(QEMUFile *f, void *opaque, int version_id)
         }
     }
 
-    wait_for_decompress_done();
+    if (pool) {
+        int pool_ret = ram_load_pool_flush(pool);
+
+        ret = ret ? ret : pool_ret;
+    }
+    if (migrate_use_compression()) {
+        int decompress_ret = wait_for_decompress_done();
+
+        ret = ret ? ret : decompress_ret;
+    }
     rcu_read_unlock();
     trace_ram_load_complete(ret, seq_iter);
     return ret;
@@ -31,12 +31,15 @@
 
 #include "qemu-common.h"
 #include "exec/cpu-common.h"
+#include "io/channel.h"
 
 extern MigrationStats ram_counters;
 extern XBZRLECacheStats xbzrle_counters;
 
 int64_t xbzrle_cache_resize(int64_t new_size);
+XBZRLECacheWayStatsList *xbzrle_cache_way_stats(void);
 uint64_t ram_bytes_remaining(void);
+MigrationConvergenceInfo *ram_convergence_info(void);
 uint64_t ram_bytes_total(void);
 
 uint64_t ram_pagesize_summary(void);
@@ -52,4 +55,15 @@ int ram_discard_range(const char *block_name, uint64_t start, size_t length);
 int ram_postcopy_incoming_init(MigrationIncomingState *mis);
 
 void ram_handle_compressed(void *host, uint8_t ch, uint64_t size);
+
+int ram_lazy_restore_load(RAMBlock *rb, ram_addr_t start, ram_addr_t len);
+bool ram_lazy_restore_release_file(QEMUFile *f);
+
+int multifd_save_setup(void);
+void multifd_save_cleanup(void);
+int multifd_send_wait_connected(void);
+int multifd_load_setup(void);
+void multifd_load_cleanup(void);
+bool multifd_recv_all_channels_created(void);
+void multifd_recv_new_channel(QIOChannel *ioc);
 #endif
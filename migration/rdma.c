@@ -26,6 +26,7 @@
 #include "qemu/main-loop.h"
 #include "qemu/sockets.h"
 #include "qemu/bitmap.h"
+#include "qemu/queue.h"
 #include "qemu/coroutine.h"
 #include <sys/socket.h>
 #include <netdb.h>
@@ -52,6 +53,15 @@
 
 #define RDMA_REG_CHUNK_SHIFT 20 /* 1 MB */
 
+/* Most queue pairs RAM writes are striped over */
+#define RDMA_DATA_QPS_MAX 16
+
+/* Completions fetched from the completion queue at once */
+#define RDMA_POLL_BATCH 16
+
+/* Chunks unregistered with a single control message */
+#define RDMA_UNREGISTER_BATCH 64
+
 /*
  * This is only for non-live state being migrated.
  * Instead of RDMA_WRITE messages, we use RDMA_SEND
@@ -71,12 +81,14 @@
  * Capabilities for negotiation.
  */
 #define RDMA_CAPABILITY_PIN_ALL 0x01
+#define RDMA_CAPABILITY_DATA_QPS 0x02
 
 /*
  * Add the other flags above to this list of known capabilities
  * as they are introduced.
  */
-static uint32_t known_capabilities = RDMA_CAPABILITY_PIN_ALL;
+static uint32_t known_capabilities = RDMA_CAPABILITY_PIN_ALL |
+                                     RDMA_CAPABILITY_DATA_QPS;
 
 #define CHECK_ERROR_STATE() \
     do { \
@@ -183,20 +195,40 @@ typedef struct {
 typedef struct {
     uint32_t version;
     uint32_t flags;
+    /*
+     * With RDMA_CAPABILITY_DATA_QPS: on the first connection, the number
+     * of queue pairs asked for and granted; on the extra connections, the
+     * index of their queue pair.  Only looked at when the flag is set, as
+     * older versions leave it out.
+     */
+    uint32_t data_qps;
 } RDMACapabilities;
 
 static void caps_to_network(RDMACapabilities *cap)
 {
     cap->version = htonl(cap->version);
     cap->flags = htonl(cap->flags);
+    cap->data_qps = htonl(cap->data_qps);
 }
 
 static void network_to_caps(RDMACapabilities *cap)
 {
     cap->version = ntohl(cap->version);
     cap->flags = ntohl(cap->flags);
+    cap->data_qps = ntohl(cap->data_qps);
 }
 
+/*
+ * Source only: a chunk registered on demand, in the LRU list used to
+ * bound how much memory stays registered.
+ */
+typedef struct RDMARegChunk {
+    QTAILQ_ENTRY(RDMARegChunk) next;
+    int index;
+    uint64_t chunk;
+    bool cached;
+} RDMARegChunk;
+
 /*
  * Representation of a RAMBlock from an RDMA perspective.
  * This is not transmitted, only local.
@@ -220,6 +252,7 @@ typedef struct RDMALocalBlock {
     int            nb_chunks;
     unsigned long *transit_bitmap;
     unsigned long *unregister_bitmap;
+    RDMARegChunk  *reg_chunks;      /* LRU state of each chunk (source) */
 } RDMALocalBlock;
 
 /*
@@ -355,6 +388,29 @@ typedef struct RDMAContext {
     struct ibv_pd *pd;                      /* protection domain */
     struct ibv_cq *cq;                      /* completion queue */
 
+    /*
+     * RAM writes are striped over nb_data_qps queue pairs sharing pd and
+     * cq.  The first one is qp, the others each have a connection of
+     * their own, data_ids[i].
+     */
+    int nb_data_qps;
+    struct ibv_qp *data_qps[RDMA_DATA_QPS_MAX];
+    struct rdma_cm_id *data_ids[RDMA_DATA_QPS_MAX];
+
+    /* Completions fetched from cq, not handled yet */
+    struct ibv_wc wc[RDMA_POLL_BATCH];
+    int wc_next;
+    int wc_count;
+
+    /*
+     * Source: chunks registered on demand, least recently written first,
+     * and the most there may be before some are unregistered (0 for no
+     * limit).
+     */
+    QTAILQ_HEAD(, RDMARegChunk) reg_lru;
+    unsigned int nb_reg_chunks;
+    unsigned int reg_cache_max;
+
     /*
      * If a previous write failed (perhaps because of a failed
      * memory registration, then do not attempt any future work
@@ -657,6 +713,18 @@ static int rdma_delete_block(RDMAContext *rdma, RDMALocalBlock *block)
     if (rdma->blockmap) {
         g_hash_table_remove(rdma->blockmap, (void *)(uintptr_t)block->offset);
     }
+    if (block->reg_chunks) {
+        int j;
+
+        for (j = 0; j < block->nb_chunks; j++) {
+            if (block->reg_chunks[j].cached) {
+                QTAILQ_REMOVE(&rdma->reg_lru, &block->reg_chunks[j], next);
+                rdma->nb_reg_chunks--;
+            }
+        }
+        g_free(block->reg_chunks);
+        block->reg_chunks = NULL;
+    }
     if (block->pmr) {
         int j;
 
@@ -1048,9 +1116,11 @@ static int qemu_rdma_alloc_pd_cq(RDMAContext *rdma)
 
     /*
      * Completion queue can be filled by both read and write work requests,
-     * so must reflect the sum of both possible queue sizes.
+     * of every data queue pair, so must reflect the sum of all possible
+     * queue sizes.
      */
-    rdma->cq = ibv_create_cq(rdma->verbs, (RDMA_SIGNALED_SEND_MAX * 3),
+    rdma->cq = ibv_create_cq(rdma->verbs,
+            RDMA_SIGNALED_SEND_MAX * (2 + rdma->nb_data_qps),
             NULL, rdma->comp_channel, 0);
     if (!rdma->cq) {
         error_report("failed to allocate completion queue");
@@ -1073,12 +1143,12 @@ err_alloc_pd_cq:
 }
 
 /*
- * Create queue pairs.
+ * Create the queue pair of @cm_id, on the shared protection domain and
+ * completion queue.
  */
-static int qemu_rdma_alloc_qp(RDMAContext *rdma)
+static int qemu_rdma_create_qp(RDMAContext *rdma, struct rdma_cm_id *cm_id)
 {
     struct ibv_qp_init_attr attr = { 0 };
-    int ret;
 
     attr.cap.max_send_wr = RDMA_SIGNALED_SEND_MAX;
     attr.cap.max_recv_wr = 3;
@@ -1088,15 +1158,47 @@ static int qemu_rdma_alloc_qp(RDMAContext *rdma)
     attr.recv_cq = rdma->cq;
     attr.qp_type = IBV_QPT_RC;
 
-    ret = rdma_create_qp(rdma->cm_id, rdma->pd, &attr);
-    if (ret) {
+    return rdma_create_qp(cm_id, rdma->pd, &attr) ? -1 : 0;
+}
+
+/*
+ * Create queue pairs.
+ */
+static int qemu_rdma_alloc_qp(RDMAContext *rdma)
+{
+    if (qemu_rdma_create_qp(rdma, rdma->cm_id)) {
         return -1;
     }
 
     rdma->qp = rdma->cm_id->qp;
+    rdma->data_qps[0] = rdma->qp;
     return 0;
 }
 
+/*
+ * Wait for the next connection manager event, which must be @expected.
+ */
+static int qemu_rdma_wait_cm_event(RDMAContext *rdma,
+                                   enum rdma_cm_event_type expected)
+{
+    struct rdma_cm_event *cm_event;
+    int ret;
+
+    ret = rdma_get_cm_event(rdma->channel, &cm_event);
+    if (ret) {
+        perror("rdma_get_cm_event");
+        return -1;
+    }
+    if (cm_event->event != expected) {
+        error_report("rdma: expected event %s, got %s",
+                     rdma_event_str(expected),
+                     rdma_event_str(cm_event->event));
+        ret = -1;
+    }
+    rdma_ack_cm_event(cm_event);
+    return ret;
+}
+
 static int qemu_rdma_reg_whole_ram_blocks(RDMAContext *rdma)
 {
     int i;
@@ -1251,19 +1353,59 @@ const char *print_wrid(int wrid)
     return wrid_desc[wrid];
 }
 
+/*
+ * Source: @chunk of @block, registered on demand, is being written.  Make
+ * it the most recently used registration.
+ */
+static void qemu_rdma_reg_cache_touch(RDMAContext *rdma, RDMALocalBlock *block,
+                                      uint64_t chunk)
+{
+    RDMARegChunk *rc;
+
+    if (!block->reg_chunks) {
+        block->reg_chunks = g_new0(RDMARegChunk, block->nb_chunks);
+    }
+
+    rc = &block->reg_chunks[chunk];
+    if (rc->cached) {
+        QTAILQ_REMOVE(&rdma->reg_lru, rc, next);
+    } else {
+        rc->index = block->index;
+        rc->chunk = chunk;
+        rc->cached = true;
+        rdma->nb_reg_chunks++;
+    }
+    QTAILQ_INSERT_TAIL(&rdma->reg_lru, rc, next);
+}
+
+/* Source: @chunk of @block is not registered anymore */
+static void qemu_rdma_reg_cache_forget(RDMAContext *rdma, RDMALocalBlock *block,
+                                       uint64_t chunk)
+{
+    RDMARegChunk *rc;
+
+    if (!block->reg_chunks || !block->reg_chunks[chunk].cached) {
+        return;
+    }
+
+    rc = &block->reg_chunks[chunk];
+    QTAILQ_REMOVE(&rdma->reg_lru, rc, next);
+    rc->cached = false;
+    rdma->nb_reg_chunks--;
+}
+
 /*
  * RDMA requires memory registration (mlock/pinning), but this is not good for
  * overcommitment.
  *
- * In preparation for the future where LRU information or workload-specific
- * writable writable working set memory access behavior is available to QEMU
- * it would be nice to have in place the ability to UN-register/UN-pin
- * particular memory regions from the RDMA hardware when it is determine that
- * those regions of memory will likely not be accessed again in the near future.
+ * When x-rdma-reg-cache-size is set, the source keeps the chunks it has
+ * registered in LRU order, and before registering one more beyond the limit
+ * it UN-registers/UN-pins the least recently written ones on both sides,
+ * see qemu_rdma_reg_cache_evict().
  *
- * While we do not yet have such information right now, the following
- * compile-time option allows us to perform a non-optimized version of this
- * behavior.
+ * Workload-specific writable working set information could do better, but
+ * is not available to QEMU.  For testing, the following compile-time option
+ * performs a non-optimized version of this behavior.
  *
  * By uncommenting this option, you will cause *all* RDMA transfers to be
  * unregistered immediately after the transfer completes on both sides of the
@@ -1276,18 +1418,46 @@ const char *print_wrid(int wrid)
 //#define RDMA_UNREGISTRATION_EXAMPLE
 
 /*
- * Perform a non-optimized memory unregistration after every transfer
- * for demonstration purposes, only if pin-all is not requested.
+ * Ask the destination to unregister the @nb_regs chunks in @regs, which
+ * are already in network byte order.
+ */
+static int qemu_rdma_unregister_send(RDMAContext *rdma, RDMARegister *regs,
+                                     int nb_regs)
+{
+    RDMAControlHeader resp = { .type = RDMA_CONTROL_UNREGISTER_FINISHED,
+                             };
+    RDMAControlHeader head = { .len = nb_regs * sizeof(RDMARegister),
+                               .type = RDMA_CONTROL_UNREGISTER_REQUEST,
+                               .repeat = nb_regs,
+                             };
+    int ret;
+
+    ret = qemu_rdma_exchange_send(rdma, &head, (uint8_t *) regs,
+                                  &resp, NULL, NULL);
+    if (ret < 0) {
+        return ret;
+    }
+
+    trace_qemu_rdma_unregister_waiting_complete(nb_regs);
+    return 0;
+}
+
+/*
+ * Unregister the chunks queued by qemu_rdma_signal_unregister(), on
+ * the source and then, batched in as few messages as possible, on the
+ * destination.
  *
  * Potential optimizations:
  * 1. Start a new thread to run this function continuously
         - for bit clearing
         - and for receipt of unregister messages
- * 2. Use an LRU.
- * 3. Use workload hints.
+ * 2. Use workload hints.
  */
 static int qemu_rdma_unregister_waiting(RDMAContext *rdma)
 {
+    RDMARegister regs[RDMA_UNREGISTER_BATCH];
+    int nb_regs = 0;
+
     while (rdma->unregistrations[rdma->unregister_current]) {
         int ret;
         uint64_t wr_id = rdma->unregistrations[rdma->unregister_current];
@@ -1297,13 +1467,6 @@ static int qemu_rdma_unregister_waiting(RDMAContext *rdma)
             (wr_id & RDMA_WRID_BLOCK_MASK) >> RDMA_WRID_BLOCK_SHIFT;
         RDMALocalBlock *block =
             &(rdma->local_ram_blocks.block[index]);
-        RDMARegister reg = { .current_index = index };
-        RDMAControlHeader resp = { .type = RDMA_CONTROL_UNREGISTER_FINISHED,
-                                 };
-        RDMAControlHeader head = { .len = sizeof(RDMARegister),
-                                   .type = RDMA_CONTROL_UNREGISTER_REQUEST,
-                                   .repeat = 1,
-                                 };
 
         trace_qemu_rdma_unregister_waiting_proc(chunk,
                                                 rdma->unregister_current);
@@ -1330,11 +1493,17 @@ static int qemu_rdma_unregister_waiting(RDMAContext *rdma)
             continue;
         }
 
+        if (!block->pmr || !block->pmr[chunk]) {
+            /* Never registered, or already unregistered */
+            continue;
+        }
+
         trace_qemu_rdma_unregister_waiting_send(chunk);
 
         ret = ibv_dereg_mr(block->pmr[chunk]);
         block->pmr[chunk] = NULL;
         block->remote_keys[chunk] = 0;
+        qemu_rdma_reg_cache_forget(rdma, block, chunk);
 
         if (ret != 0) {
             perror("unregistration chunk failed");
@@ -1342,17 +1511,26 @@ static int qemu_rdma_unregister_waiting(RDMAContext *rdma)
         }
         rdma->total_registrations--;
 
-        reg.key.chunk = chunk;
-        register_to_network(rdma, &reg);
-        ret = qemu_rdma_exchange_send(rdma, &head, (uint8_t *) &reg,
-                                &resp, NULL, NULL);
-        if (ret < 0) {
-            return ret;
+        /*
+         * Not register_to_network(): key is the chunk here, not an
+         * address to translate.
+         */
+        regs[nb_regs].key.chunk = htonll(chunk);
+        regs[nb_regs].current_index = htonl(index);
+        regs[nb_regs].padding = 0;
+        regs[nb_regs].chunks = 0;
+        if (++nb_regs == RDMA_UNREGISTER_BATCH) {
+            ret = qemu_rdma_unregister_send(rdma, regs, nb_regs);
+            if (ret < 0) {
+                return ret;
+            }
+            nb_regs = 0;
         }
-
-        trace_qemu_rdma_unregister_waiting_complete(chunk);
     }
 
+    if (nb_regs) {
+        return qemu_rdma_unregister_send(rdma, regs, nb_regs);
+    }
     return 0;
 }
 
@@ -1395,6 +1573,40 @@ static void qemu_rdma_signal_unregister(RDMAContext *rdma, uint64_t index,
     }
 }
 
+/*
+ * Source: make room for one more chunk registration by unregistering
+ * the least recently written chunks above x-rdma-reg-cache-size.  Chunks
+ * with writes in flight are skipped, so the limit may be overshot until
+ * they complete.
+ */
+static int qemu_rdma_reg_cache_evict(RDMAContext *rdma)
+{
+    RDMARegChunk *rc, *next;
+
+    if (!rdma->reg_cache_max || rdma->nb_reg_chunks < rdma->reg_cache_max) {
+        return 0;
+    }
+
+    QTAILQ_FOREACH_SAFE(rc, &rdma->reg_lru, next, next) {
+        RDMALocalBlock *block = &rdma->local_ram_blocks.block[rc->index];
+
+        if (rdma->nb_reg_chunks < rdma->reg_cache_max) {
+            break;
+        }
+        if (test_bit(rc->chunk, block->transit_bitmap)) {
+            continue;
+        }
+
+        trace_qemu_rdma_reg_cache_evict(rc->index, rc->chunk,
+                                        rdma->nb_reg_chunks);
+        qemu_rdma_signal_unregister(rdma, rc->index, rc->chunk,
+                                    RDMA_WRID_RDMA_WRITE);
+        qemu_rdma_reg_cache_forget(rdma, block, rc->chunk);
+    }
+
+    return qemu_rdma_unregister_waiting(rdma);
+}
+
 /*
  * Consult the connection manager to see a work request
  * (of any kind) has completed.
@@ -1407,17 +1619,24 @@ static uint64_t qemu_rdma_poll(RDMAContext *rdma, uint64_t *wr_id_out,
     struct ibv_wc wc;
     uint64_t wr_id;
 
-    ret = ibv_poll_cq(rdma->cq, 1, &wc);
+    /* Fetch completions in batches, one CQ access serves several calls */
+    if (rdma->wc_next == rdma->wc_count) {
+        ret = ibv_poll_cq(rdma->cq, RDMA_POLL_BATCH, rdma->wc);
 
-    if (!ret) {
-        *wr_id_out = RDMA_WRID_NONE;
-        return 0;
-    }
+        if (!ret) {
+            *wr_id_out = RDMA_WRID_NONE;
+            return 0;
+        }
 
-    if (ret < 0) {
-        error_report("ibv_poll_cq return %d", ret);
-        return ret;
+        if (ret < 0) {
+            error_report("ibv_poll_cq return %d", ret);
+            return ret;
+        }
+
+        rdma->wc_next = 0;
+        rdma->wc_count = ret;
     }
+    wc = rdma->wc[rdma->wc_next++];
 
     wr_id = wc.wr_id & RDMA_WRID_TYPE_MASK;
 
@@ -1930,6 +2149,7 @@ static int qemu_rdma_write_one(QEMUFile *f, RDMAContext *rdma,
     struct ibv_sge sge;
     struct ibv_send_wr send_wr = { 0 };
     struct ibv_send_wr *bad_wr;
+    struct ibv_qp *qp;
     int reg_result_idx, ret, count = 0;
     uint64_t chunk, chunks;
     uint8_t *chunk_start, *chunk_end;
@@ -1951,6 +2171,12 @@ retry:
                             (uint8_t *)(uintptr_t)sge.addr);
     chunk_start = ram_chunk_start(block, chunk);
 
+    /*
+     * Stripe chunks over the data queue pairs.  A chunk always uses the
+     * same one, which keeps writes to it in order.
+     */
+    qp = rdma->data_qps[(current_index + chunk) % rdma->nb_data_qps];
+
     if (block->is_ram_block) {
         chunks = length / (1UL << RDMA_REG_CHUNK_SHIFT);
 
@@ -2029,8 +2255,14 @@ retry:
             }
 
             /*
-             * Otherwise, tell other side to register.
+             * Otherwise, tell other side to register, once older
+             * registrations have made room if there is a limit.
              */
+            ret = qemu_rdma_reg_cache_evict(rdma);
+            if (ret < 0) {
+                return ret;
+            }
+
             reg.current_index = current_index;
             if (block->is_ram_block) {
                 reg.key.current_addr = current_addr;
@@ -2077,6 +2309,7 @@ retry:
             }
         }
 
+        qemu_rdma_reg_cache_touch(rdma, block, chunk);
         send_wr.wr.rdma.rkey = block->remote_keys[chunk];
     } else {
         send_wr.wr.rdma.rkey = block->remote_rkey;
@@ -2112,7 +2345,7 @@ retry:
      * ibv_post_send() does not return negative error numbers,
      * per the specification they are positive - no idea why.
      */
-    ret = ibv_post_send(rdma->qp, &send_wr, &bad_wr);
+    ret = ibv_post_send(qp, &send_wr, &bad_wr);
 
     if (ret == ENOMEM) {
         trace_qemu_rdma_write_one_queue_full();
@@ -2309,9 +2542,25 @@ static void qemu_rdma_cleanup(RDMAContext *rdma)
         }
     }
 
+    for (idx = 1; idx < RDMA_DATA_QPS_MAX; idx++) {
+        struct rdma_cm_id *id = rdma->data_ids[idx];
+
+        if (!id) {
+            continue;
+        }
+        if (id->qp) {
+            rdma_disconnect(id);
+            rdma_destroy_qp(id);
+        }
+        rdma_destroy_id(id);
+        rdma->data_ids[idx] = NULL;
+        rdma->data_qps[idx] = NULL;
+    }
+
     if (rdma->qp) {
         rdma_destroy_qp(rdma->cm_id);
         rdma->qp = NULL;
+        rdma->data_qps[0] = NULL;
     }
     if (rdma->cq) {
         ibv_destroy_cq(rdma->cq);
@@ -2403,6 +2652,72 @@ err_rdma_source_init:
     return -1;
 }
 
+/*
+ * Source: open the extra data queue pairs the destination granted, each
+ * with a connection of its own to the same address.
+ */
+static int qemu_rdma_connect_data_qps(RDMAContext *rdma, Error **errp)
+{
+    struct sockaddr *dst_addr = rdma_get_peer_addr(rdma->cm_id);
+    int i, ret;
+
+    trace_qemu_rdma_connect_data_qps(rdma->nb_data_qps);
+
+    for (i = 1; i < rdma->nb_data_qps; i++) {
+        RDMACapabilities cap = {
+                                    .version = RDMA_CONTROL_VERSION_CURRENT,
+                                    .flags = RDMA_CAPABILITY_DATA_QPS,
+                                    .data_qps = i,
+                               };
+        struct rdma_conn_param conn_param = { .initiator_depth = 2,
+                                              .retry_count = 5,
+                                              .private_data = &cap,
+                                              .private_data_len = sizeof(cap),
+                                            };
+        struct rdma_cm_id *id;
+
+        ret = rdma_create_id(rdma->channel, &id, NULL, RDMA_PS_TCP);
+        if (ret) {
+            ERROR(errp, "could not create id of data queue pair %d", i);
+            return -1;
+        }
+        rdma->data_ids[i] = id;
+
+        ret = rdma_resolve_addr(id, NULL, dst_addr, RDMA_RESOLVE_TIMEOUT_MS);
+        if (!ret) {
+            ret = qemu_rdma_wait_cm_event(rdma, RDMA_CM_EVENT_ADDR_RESOLVED);
+        }
+        if (!ret) {
+            ret = rdma_resolve_route(id, RDMA_RESOLVE_TIMEOUT_MS);
+        }
+        if (!ret) {
+            ret = qemu_rdma_wait_cm_event(rdma, RDMA_CM_EVENT_ROUTE_RESOLVED);
+        }
+        if (ret || id->verbs != rdma->verbs) {
+            ERROR(errp, "could not resolve data queue pair %d", i);
+            return -1;
+        }
+
+        if (qemu_rdma_create_qp(rdma, id)) {
+            ERROR(errp, "rdma migration: error allocating data qp %d!", i);
+            return -1;
+        }
+        rdma->data_qps[i] = id->qp;
+
+        caps_to_network(&cap);
+        ret = rdma_connect(id, &conn_param);
+        if (!ret) {
+            ret = qemu_rdma_wait_cm_event(rdma, RDMA_CM_EVENT_ESTABLISHED);
+        }
+        if (ret) {
+            ERROR(errp, "connecting data queue pair %d to destination!", i);
+            return -1;
+        }
+    }
+
+    return 0;
+}
+
 static int qemu_rdma_connect(RDMAContext *rdma, Error **errp)
 {
     RDMACapabilities cap = {
@@ -2426,6 +2741,11 @@ static int qemu_rdma_connect(RDMAContext *rdma, Error **errp)
         cap.flags |= RDMA_CAPABILITY_PIN_ALL;
     }
 
+    if (rdma->nb_data_qps > 1) {
+        cap.flags |= RDMA_CAPABILITY_DATA_QPS;
+        cap.data_qps = rdma->nb_data_qps;
+    }
+
     caps_to_network(&cap);
 
     ret = qemu_rdma_post_recv_control(rdma, RDMA_WRID_READY);
@@ -2472,8 +2792,20 @@ static int qemu_rdma_connect(RDMAContext *rdma, Error **errp)
 
     trace_qemu_rdma_connect_pin_all_outcome(rdma->pin_all);
 
+    /* Older destinations only know about the one queue pair */
+    if (!(cap.flags & RDMA_CAPABILITY_DATA_QPS)) {
+        rdma->nb_data_qps = 1;
+    } else if (cap.data_qps < rdma->nb_data_qps) {
+        rdma->nb_data_qps = MAX(cap.data_qps, 1);
+    }
+
     rdma_ack_cm_event(cm_event);
 
+    ret = qemu_rdma_connect_data_qps(rdma, errp);
+    if (ret) {
+        goto err_rdma_source_connect;
+    }
+
     rdma->control_ready_expected = 1;
     rdma->nb_sent = 0;
     return 0;
@@ -2570,6 +2902,8 @@ static void *qemu_rdma_data_init(const char *host_port, Error **errp)
         rdma = g_new0(RDMAContext, 1);
         rdma->current_index = -1;
         rdma->current_chunk = -1;
+        rdma->nb_data_qps = 1;
+        QTAILQ_INIT(&rdma->reg_lru);
 
         addr = g_new(InetSocketAddress, 1);
         if (!inet_parse(addr, host_port, NULL)) {
@@ -2597,6 +2931,7 @@ static ssize_t qio_channel_rdma_writev(QIOChannel *ioc,
                                        size_t niov,
                                        int *fds,
                                        size_t nfds,
+                                       int flags,
                                        Error **errp)
 {
     QIOChannelRDMA *rioc = QIO_CHANNEL_RDMA(ioc);
@@ -3014,6 +3349,66 @@ err:
     return ret;
 }
 
+/*
+ * Destination: accept the connections of the extra data queue pairs,
+ * which the source opens right after the first one.  They only receive
+ * RDMA writes, so nothing is ever posted on them.
+ */
+static int qemu_rdma_accept_data_qps(RDMAContext *rdma)
+{
+    struct rdma_conn_param conn_param = { .responder_resources = 2 };
+    struct rdma_cm_event *cm_event;
+    RDMACapabilities cap;
+    struct rdma_cm_id *id;
+    int i, ret;
+
+    trace_qemu_rdma_accept_data_qps(rdma->nb_data_qps);
+
+    for (i = 1; i < rdma->nb_data_qps; i++) {
+        ret = rdma_get_cm_event(rdma->channel, &cm_event);
+        if (ret) {
+            return -EIO;
+        }
+        if (cm_event->event != RDMA_CM_EVENT_CONNECT_REQUEST) {
+            error_report("rdma: expected data queue pair %d, got %s", i,
+                         rdma_event_str(cm_event->event));
+            rdma_ack_cm_event(cm_event);
+            return -EINVAL;
+        }
+
+        memcpy(&cap, cm_event->param.conn.private_data, sizeof(cap));
+        network_to_caps(&cap);
+        id = cm_event->id;
+        rdma_ack_cm_event(cm_event);
+
+        if (!(cap.flags & RDMA_CAPABILITY_DATA_QPS) || cap.data_qps != i ||
+            id->verbs != rdma->verbs) {
+            error_report("rdma: unexpected connection for data queue pair %d",
+                         i);
+            rdma_reject(id, NULL, 0);
+            rdma_destroy_id(id);
+            return -EINVAL;
+        }
+        rdma->data_ids[i] = id;
+
+        if (qemu_rdma_create_qp(rdma, id)) {
+            error_report("rdma migration: error allocating data qp %d!", i);
+            return -EINVAL;
+        }
+        rdma->data_qps[i] = id->qp;
+
+        ret = rdma_accept(id, &conn_param);
+        if (!ret) {
+            ret = qemu_rdma_wait_cm_event(rdma, RDMA_CM_EVENT_ESTABLISHED);
+        }
+        if (ret) {
+            return -EIO;
+        }
+    }
+
+    return 0;
+}
+
 static int qemu_rdma_accept(RDMAContext *rdma)
 {
     RDMACapabilities cap;
@@ -3060,6 +3455,10 @@ static int qemu_rdma_accept(RDMAContext *rdma)
     if (cap.flags & RDMA_CAPABILITY_PIN_ALL) {
         rdma->pin_all = true;
     }
+    if (cap.flags & RDMA_CAPABILITY_DATA_QPS) {
+        rdma->nb_data_qps = MIN(MAX(cap.data_qps, 1), RDMA_DATA_QPS_MAX);
+        cap.data_qps = rdma->nb_data_qps;
+    }
 
     rdma->cm_id = cm_event->id;
     verbs = cm_event->id->verbs;
@@ -3137,6 +3536,12 @@ static int qemu_rdma_accept(RDMAContext *rdma)
         goto err_rdma_dest_wait;
     }
 
+    ret = qemu_rdma_accept_data_qps(rdma);
+    if (ret) {
+        error_report("rdma migration: error accepting data queue pairs");
+        goto err_rdma_dest_wait;
+    }
+
     qemu_rdma_dump_gid("dest_connect", rdma->cm_id);
 
     return 0;
@@ -3384,7 +3789,22 @@ static int qemu_rdma_registration_handle(QEMUFile *f, void *opaque)
                 trace_qemu_rdma_registration_handle_unregister_loop(count,
                            reg->current_index, reg->key.chunk);
 
+                if (reg->current_index >= rdma->local_ram_blocks.nb_blocks) {
+                    error_report("rdma: 'unregister' bad block index %u "
+                                 "(vs %d)", (unsigned int)reg->current_index,
+                                 rdma->local_ram_blocks.nb_blocks);
+                    ret = -ENOENT;
+                    goto out;
+                }
                 block = &(rdma->local_ram_blocks.block[reg->current_index]);
+                if (reg->key.chunk >= block->nb_chunks || !block->pmr ||
+                    !block->pmr[reg->key.chunk]) {
+                    error_report("rdma: 'unregister' bad chunk %" PRIu64
+                                 " for block %s", reg->key.chunk,
+                                 block->block_name);
+                    ret = -ERANGE;
+                    goto out;
+                }
 
                 ret = ibv_dereg_mr(block->pmr[reg->key.chunk]);
                 block->pmr[reg->key.chunk] = NULL;
@@ -3741,6 +4161,12 @@ void rdma_start_outgoing_migration(void *opaque,
         goto err;
     }
 
+    /* Both are only known to the source, the destination follows */
+    rdma->nb_data_qps = migrate_rdma_queue_pairs();
+    rdma->reg_cache_max = MIN(DIV_ROUND_UP(migrate_rdma_reg_cache_size(),
+                                           1ULL << RDMA_REG_CHUNK_SHIFT),
+                              UINT_MAX);
+
     ret = qemu_rdma_source_init(rdma,
         s->enabled_capabilities[MIGRATION_CAPABILITY_RDMA_PIN_ALL], errp);
 
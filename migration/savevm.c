@@ -41,6 +41,9 @@
 #include "savevm.h"
 #include "postcopy-ram.h"
 #include "qapi/qmp/qerror.h"
+#include "qapi/qmp/qjson.h"
+#include "qapi/qobject-output-visitor.h"
+#include "qapi-visit.h"
 #include "qemu/error-report.h"
 #include "sysemu/cpus.h"
 #include "exec/memory.h"
@@ -183,19 +186,43 @@ static ssize_t block_get_buffer(void *opaque, uint8_t *buf, int64_t pos,
     return bdrv_load_vmstate(opaque, buf, pos, size);
 }
 
+static ssize_t block_pwrite_buffer(void *opaque, const uint8_t *buf,
+                                   size_t size, int64_t pos)
+{
+    return bdrv_save_vmstate(opaque, buf, pos, size);
+}
+
+static ssize_t block_pread_buffer(void *opaque, uint8_t *buf,
+                                  size_t size, int64_t pos)
+{
+    int ret = bdrv_load_vmstate(opaque, buf, pos, size);
+
+    return ret < 0 ? ret : size;
+}
+
+/* The stream position is passed along with every access already */
+static int block_seek(void *opaque, int64_t pos)
+{
+    return 0;
+}
+
 static int bdrv_fclose(void *opaque)
 {
     return bdrv_flush(opaque);
 }
 
 static const QEMUFileOps bdrv_read_ops = {
-    .get_buffer = block_get_buffer,
-    .close =      bdrv_fclose
+    .get_buffer   = block_get_buffer,
+    .close        = bdrv_fclose,
+    .pread_buffer = block_pread_buffer,
+    .seek         = block_seek
 };
 
 static const QEMUFileOps bdrv_write_ops = {
     .writev_buffer  = block_writev_buffer,
-    .close          = bdrv_fclose
+    .close          = bdrv_fclose,
+    .pwrite_buffer  = block_pwrite_buffer,
+    .seek           = block_seek
 };
 
 static QEMUFile *qemu_fopen_bdrv(BlockDriverState *bs, int is_writable)
@@ -264,6 +291,19 @@ typedef struct CompatEntry {
     int instance_id;
 } CompatEntry;
 
+/* Stream bytes and time taken by the sections of an entry */
+typedef struct SaveStateStats {
+    /* Saved while the VM was running */
+    uint64_t live_bytes;
+    int64_t live_ns;
+    /* Saved after the VM was stopped, adding to the downtime */
+    uint64_t stop_bytes;
+    int64_t stop_ns;
+    /* Loaded on the destination */
+    uint64_t load_bytes;
+    int64_t load_ns;
+} SaveStateStats;
+
 typedef struct SaveStateEntry {
     QTAILQ_ENTRY(SaveStateEntry) entry;
     char idstr[256];
@@ -280,6 +320,7 @@ typedef struct SaveStateEntry {
     void *opaque;
     CompatEntry *compat;
     int is_ram;
+    SaveStateStats stats;
 } SaveStateEntry;
 
 typedef struct SaveState {
@@ -759,6 +800,115 @@ static void vmstate_save(QEMUFile *f, SaveStateEntry *se, QJSON *vmdesc)
     vmstate_save_state(f, se->vmsd, se->opaque, vmdesc);
 }
 
+/* Position in the stream and time at which a section started */
+typedef struct SectionMark {
+    int64_t pos;
+    int64_t start_ns;
+} SectionMark;
+
+static void section_mark(QEMUFile *f, SectionMark *mark)
+{
+    mark->pos = qemu_ftell_fast(f);
+    mark->start_ns = qemu_clock_get_ns(QEMU_CLOCK_REALTIME);
+}
+
+/* Account the bytes and time since @mark to a section */
+static void section_account(QEMUFile *f, const SectionMark *mark,
+                            uint64_t *bytes, int64_t *ns)
+{
+    *bytes += qemu_ftell_fast(f) - mark->pos;
+    *ns += qemu_clock_get_ns(QEMU_CLOCK_REALTIME) - mark->start_ns;
+}
+
+static void section_stats_reset(bool load)
+{
+    SaveStateEntry *se;
+
+    QTAILQ_FOREACH(se, &savevm_state.handlers, entry) {
+        if (load) {
+            se->stats.load_bytes = 0;
+            se->stats.load_ns = 0;
+        } else {
+            se->stats.live_bytes = 0;
+            se->stats.live_ns = 0;
+            se->stats.stop_bytes = 0;
+            se->stats.stop_ns = 0;
+        }
+    }
+}
+
+MigrationSectionInfoList *qmp_query_migrate_sections(Error **errp)
+{
+    MigrationSectionInfoList *head = NULL;
+    MigrationSectionInfoList *sections = NULL;
+    SaveStateEntry *se;
+
+    QTAILQ_FOREACH(se, &savevm_state.handlers, entry) {
+        SaveStateStats *stats = &se->stats;
+        MigrationSectionInfo *info;
+
+        if (!stats->live_bytes && !stats->stop_bytes && !stats->load_bytes) {
+            continue;
+        }
+        if (head == NULL) {
+            head = g_malloc0(sizeof(*sections));
+            sections = head;
+        } else {
+            sections->next = g_malloc0(sizeof(*sections));
+            sections = sections->next;
+        }
+        info = g_malloc0(sizeof(*info));
+        info->name = g_strdup(se->idstr);
+        info->instance_id = se->instance_id;
+        info->live_bytes = stats->live_bytes;
+        info->live_time = stats->live_ns / SCALE_US;
+        info->stop_bytes = stats->stop_bytes;
+        info->stop_time = stats->stop_ns / SCALE_US;
+        info->load_bytes = stats->load_bytes;
+        info->load_time = stats->load_ns / SCALE_US;
+        sections->value = info;
+    }
+
+    return head;
+}
+
+/*
+ * Write what query-migrate-sections returns to the file set with the
+ * x-section-stats-file migration parameter, if any.
+ */
+void qemu_savevm_dump_section_stats(void)
+{
+    const char *filename =
+        migrate_get_current()->parameters.x_section_stats_file;
+    MigrationSectionInfoList *sections;
+    QObject *obj;
+    QString *json;
+    Visitor *v;
+    GError *gerr = NULL;
+
+    if (!filename || !filename[0]) {
+        return;
+    }
+
+    sections = qmp_query_migrate_sections(&error_abort);
+    v = qobject_output_visitor_new(&obj);
+    visit_type_MigrationSectionInfoList(v, NULL, &sections, &error_abort);
+    visit_complete(v, &obj);
+    visit_free(v);
+    json = qobject_to_json_pretty(obj);
+
+    trace_qemu_savevm_dump_section_stats(filename);
+    if (!g_file_set_contents(filename, qstring_get_str(json), -1, &gerr)) {
+        error_report("Failed to write migration section statistics: %s",
+                     gerr->message);
+        g_error_free(gerr);
+    }
+
+    QDECREF(json);
+    qobject_decref(obj);
+    qapi_free_MigrationSectionInfoList(sections);
+}
+
 /*
  * Write the header for device section (QEMU_VM_SECTION START/END/PART/FULL)
  */
@@ -961,7 +1111,10 @@ void qemu_savevm_state_setup(QEMUFile *f)
     int ret;
 
     trace_savevm_state_setup();
+    section_stats_reset(false);
     QTAILQ_FOREACH(se, &savevm_state.handlers, entry) {
+        SectionMark mark;
+
         if (!se->ops || !se->ops->save_setup) {
             continue;
         }
@@ -970,10 +1123,12 @@ void qemu_savevm_state_setup(QEMUFile *f)
                 continue;
             }
         }
+        section_mark(f, &mark);
         save_section_header(f, se, QEMU_VM_SECTION_START);
 
         ret = se->ops->save_setup(f, se->opaque);
         save_section_footer(f, se);
+        section_account(f, &mark, &se->stats.live_bytes, &se->stats.live_ns);
         if (ret < 0) {
             qemu_file_set_error(f, ret);
             break;
@@ -994,6 +1149,8 @@ int qemu_savevm_state_iterate(QEMUFile *f, bool postcopy)
 
     trace_savevm_state_iterate();
     QTAILQ_FOREACH(se, &savevm_state.handlers, entry) {
+        SectionMark mark;
+
         if (!se->ops || !se->ops->save_live_iterate) {
             continue;
         }
@@ -1016,11 +1173,13 @@ int qemu_savevm_state_iterate(QEMUFile *f, bool postcopy)
         }
         trace_savevm_section_start(se->idstr, se->section_id);
 
+        section_mark(f, &mark);
         save_section_header(f, se, QEMU_VM_SECTION_PART);
 
         ret = se->ops->save_live_iterate(f, se->opaque);
         trace_savevm_section_end(se->idstr, se->section_id, ret);
         save_section_footer(f, se);
+        section_account(f, &mark, &se->stats.live_bytes, &se->stats.live_ns);
 
         if (ret < 0) {
             qemu_file_set_error(f, ret);
@@ -1056,6 +1215,8 @@ void qemu_savevm_state_complete_postcopy(QEMUFile *f)
     int ret;
 
     QTAILQ_FOREACH(se, &savevm_state.handlers, entry) {
+        SectionMark mark;
+
         if (!se->ops || !se->ops->save_live_complete_postcopy) {
             continue;
         }
@@ -1065,6 +1226,8 @@ void qemu_savevm_state_complete_postcopy(QEMUFile *f)
             }
         }
         trace_savevm_section_start(se->idstr, se->section_id);
+        /* The destination is running already */
+        section_mark(f, &mark);
         /* Section type */
         qemu_put_byte(f, QEMU_VM_SECTION_END);
         qemu_put_be32(f, se->section_id);
@@ -1072,6 +1235,7 @@ void qemu_savevm_state_complete_postcopy(QEMUFile *f)
         ret = se->ops->save_live_complete_postcopy(f, se->opaque);
         trace_savevm_section_end(se->idstr, se->section_id, ret);
         save_section_footer(f, se);
+        section_account(f, &mark, &se->stats.live_bytes, &se->stats.live_ns);
         if (ret < 0) {
             qemu_file_set_error(f, ret);
             return;
@@ -1088,6 +1252,7 @@ int qemu_savevm_state_complete_precopy(QEMUFile *f, bool iterable_only,
     QJSON *vmdesc;
     int vmdesc_len;
     SaveStateEntry *se;
+    SectionMark mark;
     int ret;
     bool in_postcopy = migration_in_postcopy();
 
@@ -1110,11 +1275,13 @@ int qemu_savevm_state_complete_precopy(QEMUFile *f, bool iterable_only,
         }
         trace_savevm_section_start(se->idstr, se->section_id);
 
+        section_mark(f, &mark);
         save_section_header(f, se, QEMU_VM_SECTION_END);
 
         ret = se->ops->save_live_complete_precopy(f, se->opaque);
         trace_savevm_section_end(se->idstr, se->section_id, ret);
         save_section_footer(f, se);
+        section_account(f, &mark, &se->stats.stop_bytes, &se->stats.stop_ns);
         if (ret < 0) {
             qemu_file_set_error(f, ret);
             return -1;
@@ -1144,10 +1311,12 @@ int qemu_savevm_state_complete_precopy(QEMUFile *f, bool iterable_only,
         json_prop_str(vmdesc, "name", se->idstr);
         json_prop_int(vmdesc, "instance_id", se->instance_id);
 
+        section_mark(f, &mark);
         save_section_header(f, se, QEMU_VM_SECTION_FULL);
         vmstate_save(f, se, vmdesc);
         trace_savevm_section_end(se->idstr, se->section_id, 0);
         save_section_footer(f, se);
+        section_account(f, &mark, &se->stats.stop_bytes, &se->stats.stop_ns);
 
         json_end_object(vmdesc);
     }
@@ -1181,6 +1350,16 @@ int qemu_savevm_state_complete_precopy(QEMUFile *f, bool iterable_only,
     return 0;
 }
 
+/*
+ * Send the iterable sections of a stopped VM and no device state, so that
+ * COLO can stream the dirty RAM of a checkpoint straight to the secondary.
+ */
+void qemu_savevm_live_state(QEMUFile *f)
+{
+    qemu_savevm_state_complete_precopy(f, true, false);
+    qemu_put_byte(f, QEMU_VM_EOF);
+}
+
 /* Give an estimate of the amount left to be transferred,
  * the result is split into the amount for units that can and
  * for units that can't do postcopy.
@@ -1275,7 +1454,7 @@ done:
     return ret;
 }
 
-static int qemu_save_device_state(QEMUFile *f)
+int qemu_save_device_state(QEMUFile *f)
 {
     SaveStateEntry *se;
 
@@ -1285,6 +1464,8 @@ static int qemu_save_device_state(QEMUFile *f)
     cpu_synchronize_all_states();
 
     QTAILQ_FOREACH(se, &savevm_state.handlers, entry) {
+        SectionMark mark;
+
         if (se->is_ram) {
             continue;
         }
@@ -1295,11 +1476,13 @@ static int qemu_save_device_state(QEMUFile *f)
             continue;
         }
 
+        section_mark(f, &mark);
         save_section_header(f, se, QEMU_VM_SECTION_FULL);
 
         vmstate_save(f, se, NULL);
 
         save_section_footer(f, se);
+        section_account(f, &mark, &se->stats.stop_bytes, &se->stats.stop_ns);
     }
 
     qemu_put_byte(f, QEMU_VM_EOF);
@@ -1332,8 +1515,6 @@ enum LoadVMExitCodes {
     LOADVM_QUIT     =  1,
 };
 
-static int qemu_loadvm_state_main(QEMUFile *f, MigrationIncomingState *mis);
-
 /* ------ incoming postcopy messages ------ */
 /* 'advise' arrives before any transfers just to tell us that a postcopy
  * *might* happen - it might be skipped if precopy transferred everything
@@ -1486,10 +1667,29 @@ static int loadvm_postcopy_ram_handle_discard(MigrationIncomingState *mis,
  * (TODO:This could do with being in a postcopy file - but there again it's
  * just another input loop, not that postcopy specific)
  */
+typedef struct {
+    QEMUBH *bh;
+} ListenDoneBhData;
+
+/*
+ * The end of an incoming postcopy, on the main thread: the section
+ * statistics are read under the BQL like for query-migrate-sections.
+ */
+static void postcopy_ram_listen_done_bh(void *opaque)
+{
+    ListenDoneBhData *data = opaque;
+
+    qemu_savevm_dump_section_stats();
+
+    qemu_bh_delete(data->bh);
+    g_free(data);
+}
+
 static void *postcopy_ram_listen_thread(void *opaque)
 {
     QEMUFile *f = opaque;
     MigrationIncomingState *mis = migration_incoming_get_current();
+    ListenDoneBhData *data;
     int load_res;
 
     migrate_set_state(&mis->state, MIGRATION_STATUS_ACTIVE,
@@ -1534,6 +1734,9 @@ static void *postcopy_ram_listen_thread(void *opaque)
 
     migrate_set_state(&mis->state, MIGRATION_STATUS_POSTCOPY_ACTIVE,
                                    MIGRATION_STATUS_COMPLETED);
+    data = g_new(ListenDoneBhData, 1);
+    data->bh = qemu_bh_new(postcopy_ram_listen_done_bh, data);
+    qemu_bh_schedule(data->bh);
     /*
      * If everything has worked fine, then the main thread has waited
      * for us to start, and we're the last use of the mis.
@@ -1817,9 +2020,11 @@ qemu_loadvm_section_start_full(QEMUFile *f, MigrationIncomingState *mis)
 {
     uint32_t instance_id, version_id, section_id;
     SaveStateEntry *se;
+    SectionMark mark;
     char idstr[256];
     int ret;
 
+    section_mark(f, &mark);
     /* Read section start */
     section_id = qemu_get_be32(f);
     if (!qemu_get_counted_string(f, idstr)) {
@@ -1864,6 +2069,7 @@ qemu_loadvm_section_start_full(QEMUFile *f, MigrationIncomingState *mis)
     if (!check_section_footer(f, se)) {
         return -EINVAL;
     }
+    section_account(f, &mark, &se->stats.load_bytes, &se->stats.load_ns);
 
     return 0;
 }
@@ -1873,8 +2079,10 @@ qemu_loadvm_section_part_end(QEMUFile *f, MigrationIncomingState *mis)
 {
     uint32_t section_id;
     SaveStateEntry *se;
+    SectionMark mark;
     int ret;
 
+    section_mark(f, &mark);
     section_id = qemu_get_be32(f);
 
     trace_qemu_loadvm_state_section_partend(section_id);
@@ -1897,11 +2105,12 @@ qemu_loadvm_section_part_end(QEMUFile *f, MigrationIncomingState *mis)
     if (!check_section_footer(f, se)) {
         return -EINVAL;
     }
+    section_account(f, &mark, &se->stats.load_bytes, &se->stats.load_ns);
 
     return 0;
 }
 
-static int qemu_loadvm_state_setup(QEMUFile *f)
+int qemu_loadvm_state_setup(QEMUFile *f)
 {
     SaveStateEntry *se;
     int ret;
@@ -1939,7 +2148,7 @@ void qemu_loadvm_state_cleanup(void)
     }
 }
 
-static int qemu_loadvm_state_main(QEMUFile *f, MigrationIncomingState *mis)
+int qemu_loadvm_state_main(QEMUFile *f, MigrationIncomingState *mis)
 {
     uint8_t section_type;
     int ret = 0;
@@ -2014,6 +2223,7 @@ int qemu_loadvm_state(QEMUFile *f)
     if (qemu_loadvm_state_setup(f) != 0) {
         return -EINVAL;
     }
+    section_stats_reset(true);
 
     if (migrate_get_current()->send_configuration) {
         if (qemu_get_byte(f) != QEMU_VM_CONFIGURATION) {
@@ -2084,6 +2294,31 @@ int qemu_loadvm_state(QEMUFile *f)
     return ret;
 }
 
+/*
+ * Load the output of qemu_save_device_state() into a stopped VM whose RAM
+ * is already in place.
+ */
+int qemu_load_device_state(QEMUFile *f)
+{
+    MigrationIncomingState *mis = migration_incoming_get_current();
+    int ret;
+
+    if (qemu_get_be32(f) != QEMU_VM_FILE_MAGIC ||
+        qemu_get_be32(f) != QEMU_VM_FILE_VERSION) {
+        error_report("Not a device state stream");
+        return -EINVAL;
+    }
+
+    cpu_synchronize_all_pre_loadvm();
+    ret = qemu_loadvm_state_main(f, mis);
+    if (ret < 0) {
+        error_report("Failed to load device state: %d", ret);
+        return ret;
+    }
+    cpu_synchronize_all_post_init();
+    return 0;
+}
+
 int save_snapshot(const char *name, Error **errp)
 {
     BlockDriverState *bs, *bs1;
@@ -27,6 +27,37 @@
 #include "trace.h"
 
 
+static struct SocketOutgoingArgs {
+    SocketAddress *saddr;
+} outgoing_args;
+
+int socket_send_channel_create(QIOTaskFunc f, void *data)
+{
+    QIOChannelSocket *sioc;
+
+    if (!outgoing_args.saddr) {
+        return -1;
+    }
+    sioc = qio_channel_socket_new();
+    qio_channel_set_name(QIO_CHANNEL(sioc), "migration-multifd-outgoing");
+    qio_channel_socket_connect_async(sioc, outgoing_args.saddr,
+                                     f, data, NULL);
+    return 0;
+}
+
+void socket_send_channel_destroy(QIOChannel *send)
+{
+    object_unref(OBJECT(send));
+}
+
+void socket_send_channel_cleanup(void)
+{
+    if (outgoing_args.saddr) {
+        qapi_free_SocketAddress(outgoing_args.saddr);
+        outgoing_args.saddr = NULL;
+    }
+}
+
 static SocketAddress *tcp_build_address(const char *host_port, Error **errp)
 {
     SocketAddress *saddr;
@@ -106,7 +137,9 @@ static void socket_start_outgoing_migration(MigrationState *s,
                                      socket_outgoing_migration,
                                      data,
                                      socket_connect_data_free);
-    qapi_free_SocketAddress(saddr);
+    /* Keep the address around for the multifd channels */
+    socket_send_channel_cleanup();
+    outgoing_args.saddr = saddr;
 }
 
 void tcp_start_outgoing_migration(MigrationState *s,
@@ -151,6 +184,11 @@ static gboolean socket_accept_incoming_migration(QIOChannel *ioc,
     migration_channel_process_incoming(QIO_CHANNEL(sioc));
     object_unref(OBJECT(sioc));
 
+    if (migrate_use_multifd() && !migration_has_all_channels()) {
+        /* Wait for the rest of the multifd channels */
+        return TRUE;
+    }
+
 out:
     /* Close listening socket as its no longer needed */
     qio_channel_close(ioc, NULL);
@@ -166,7 +204,15 @@ static void socket_start_incoming_migration(SocketAddress *saddr,
     qio_channel_set_name(QIO_CHANNEL(listen_ioc),
                          "migration-socket-listener");
 
-    if (qio_channel_socket_listen_sync(listen_ioc, saddr, errp) < 0) {
+    /*
+     * The multifd channels all connect at once, with a backlog of one
+     * connection most of them would be dropped and retried.  The
+     * capability may still be set after this, so allow for the maximum
+     * number of channels.
+     */
+    if (qio_channel_socket_listen_sync(listen_ioc, saddr,
+                                       MULTIFD_MAX_CHANNELS + 1,
+                                       errp) < 0) {
         object_unref(OBJECT(listen_ioc));
         qapi_free_SocketAddress(saddr);
         return;
@@ -17,7 +17,9 @@
 #include "migration/savevm.h"
 #include "qemu-file.h"
 #include "qemu/bitops.h"
+#include "qemu/bswap.h"
 #include "qemu/error-report.h"
+#include "qemu/thread.h"
 #include "trace.h"
 #include "qjson.h"
 
@@ -25,6 +27,17 @@ static void vmstate_subsection_save(QEMUFile *f, const VMStateDescription *vmsd,
                                     void *opaque, QJSON *vmdesc);
 static int vmstate_subsection_load(QEMUFile *f, const VMStateDescription *vmsd,
                                    void *opaque);
+static void vmstate_save_field(QEMUFile *f, const VMStateDescription *vmsd,
+                               VMStateField *field, void *opaque,
+                               QJSON *vmdesc);
+
+typedef struct VMStateProgram VMStateProgram;
+static VMStateProgram *vmstate_get_program(const VMStateDescription *vmsd);
+static int vmstate_run_load(QEMUFile *f, const VMStateDescription *vmsd,
+                            VMStateProgram *prog, void *opaque);
+static void vmstate_run_save(QEMUFile *f, const VMStateDescription *vmsd,
+                             VMStateProgram *prog, void *opaque,
+                             QJSON *vmdesc);
 
 static int vmstate_n_elems(void *opaque, VMStateField *field)
 {
@@ -75,10 +88,66 @@ static void vmstate_handle_alloc(void *ptr, VMStateField *field, void *opaque)
     }
 }
 
+static int vmstate_load_field(QEMUFile *f, const VMStateDescription *vmsd,
+                              VMStateField *field, void *opaque,
+                              int version_id)
+{
+    int ret = 0;
+
+    trace_vmstate_load_state_field(vmsd->name, field->name);
+    if ((field->field_exists &&
+         field->field_exists(opaque, version_id)) ||
+        (!field->field_exists &&
+         field->version_id <= version_id)) {
+        void *first_elem = opaque + field->offset;
+        int i, n_elems = vmstate_n_elems(opaque, field);
+        int size = vmstate_size(opaque, field);
+
+        vmstate_handle_alloc(first_elem, field, opaque);
+        if (field->flags & VMS_POINTER) {
+            first_elem = *(void **)first_elem;
+            assert(first_elem || !n_elems || !size);
+        }
+        for (i = 0; i < n_elems; i++) {
+            void *curr_elem = first_elem + size * i;
+
+            if (field->flags & VMS_ARRAY_OF_POINTER) {
+                curr_elem = *(void **)curr_elem;
+            }
+            if (!curr_elem && size) {
+                /* if null pointer check placeholder and do not follow */
+                assert(field->flags & VMS_ARRAY_OF_POINTER);
+                ret = vmstate_info_nullptr.get(f, curr_elem, size, NULL);
+            } else if (field->flags & VMS_STRUCT) {
+                ret = vmstate_load_state(f, field->vmsd, curr_elem,
+                                         field->vmsd->version_id);
+            } else {
+                ret = field->info->get(f, curr_elem, size, field);
+            }
+            if (ret >= 0) {
+                ret = qemu_file_get_error(f);
+            }
+            if (ret < 0) {
+                qemu_file_set_error(f, ret);
+                error_report("Failed to load %s:%s", vmsd->name,
+                             field->name);
+                trace_vmstate_load_field_error(field->name, ret);
+                return ret;
+            }
+        }
+    } else if (field->flags & VMS_MUST_EXIST) {
+        error_report("Input validation failed: %s/%s",
+                     vmsd->name, field->name);
+        return -1;
+    }
+    return 0;
+}
+
 int vmstate_load_state(QEMUFile *f, const VMStateDescription *vmsd,
                        void *opaque, int version_id)
 {
     VMStateField *field = vmsd->fields;
+    VMStateProgram *prog;
     int ret = 0;
 
     trace_vmstate_load_state(vmsd->name, version_id);
@@ -108,54 +177,20 @@ int vmstate_load_state(QEMUFile *f, const VMStateDescription *vmsd,
             return ret;
         }
     }
-    while (field->name) {
-        trace_vmstate_load_state_field(vmsd->name, field->name);
-        if ((field->field_exists &&
-             field->field_exists(opaque, version_id)) ||
-            (!field->field_exists &&
-             field->version_id <= version_id)) {
-            void *first_elem = opaque + field->offset;
-            int i, n_elems = vmstate_n_elems(opaque, field);
-            int size = vmstate_size(opaque, field);
-
-            vmstate_handle_alloc(first_elem, field, opaque);
-            if (field->flags & VMS_POINTER) {
-                first_elem = *(void **)first_elem;
-                assert(first_elem || !n_elems || !size);
-            }
-            for (i = 0; i < n_elems; i++) {
-                void *curr_elem = first_elem + size * i;
-
-                if (field->flags & VMS_ARRAY_OF_POINTER) {
-                    curr_elem = *(void **)curr_elem;
-                }
-                if (!curr_elem && size) {
-                    /* if null pointer check placeholder and do not follow */
-                    assert(field->flags & VMS_ARRAY_OF_POINTER);
-                    ret = vmstate_info_nullptr.get(f, curr_elem, size, NULL);
-                } else if (field->flags & VMS_STRUCT) {
-                    ret = vmstate_load_state(f, field->vmsd, curr_elem,
-                                             field->vmsd->version_id);
-                } else {
-                    ret = field->info->get(f, curr_elem, size, field);
-                }
-                if (ret >= 0) {
-                    ret = qemu_file_get_error(f);
-                }
-                if (ret < 0) {
-                    qemu_file_set_error(f, ret);
-                    error_report("Failed to load %s:%s", vmsd->name,
-                                 field->name);
-                    trace_vmstate_load_field_error(field->name, ret);
-                    return ret;
-                }
+    prog = version_id == vmsd->version_id ? vmstate_get_program(vmsd) : NULL;
+    if (prog) {
+        ret = vmstate_run_load(f, vmsd, prog, opaque);
+        if (ret < 0) {
+            return ret;
+        }
+    } else {
+        while (field->name) {
+            ret = vmstate_load_field(f, vmsd, field, opaque, version_id);
+            if (ret < 0) {
+                return ret;
             }
-        } else if (field->flags & VMS_MUST_EXIST) {
-            error_report("Input validation failed: %s/%s",
-                         vmsd->name, field->name);
-            return -1;
+            field++;
         }
-        field++;
     }
     ret = vmstate_subsection_load(f, vmsd, opaque);
     if (ret != 0) {
@@ -298,6 +333,240 @@ static void vmsd_desc_field_end(const VMStateDescription *vmsd, QJSON *vmdesc,
 }
 
 
+/*
+ * Compiled field programs
+ *
+ * Most descriptions are long lists of plain integers and byte buffers
+ * that sit next to each other in the device struct.  Walking those
+ * through the interpreter costs an indirect call, a handful of flag tests
+ * and a trace point per element.  The first time a description is used
+ * we flatten its fields into a list of ops where each stretch of
+ * contiguous plain fields of the same width becomes a single buffer copy
+ * (plus an in-register byte swap on little endian hosts).  Anything else
+ * stays an op that hands one field to the interpreter, so the stream
+ * format is unchanged.
+ */
+
+typedef struct VMStateOp {
+    VMStateField *field;    /* first field covered by the op */
+    int nr_fields;
+    int width;              /* element width of a run, 0 for interpreted */
+    size_t offset;          /* run only: start of the run in opaque */
+    size_t len;             /* run only: total bytes */
+} VMStateOp;
+
+struct VMStateProgram {
+    int nr_ops;
+    VMStateOp ops[];
+};
+
+static GHashTable *vmstate_programs;
+static QemuMutex vmstate_programs_lock;
+
+static void __attribute__((__constructor__)) vmstate_programs_init(void)
+{
+    qemu_mutex_init(&vmstate_programs_lock);
+    vmstate_programs = g_hash_table_new_full(NULL, NULL, NULL, g_free);
+}
+
+/* Element width if @field can be folded into a run, 0 otherwise */
+static int vmstate_plain_width(const VMStateDescription *vmsd,
+                               VMStateField *field)
+{
+    const VMStateInfo *info = field->info;
+    int width = 0;
+
+    if (field->field_exists || field->version_id > vmsd->version_id ||
+        (field->flags & ~(VMS_SINGLE | VMS_ARRAY | VMS_BUFFER |
+                          VMS_MUST_EXIST))) {
+        return 0;
+    }
+
+    if (info == &vmstate_info_buffer) {
+        return 1;
+    } else if (info == &vmstate_info_int8 || info == &vmstate_info_uint8) {
+        width = 1;
+    } else if (info == &vmstate_info_int16 || info == &vmstate_info_uint16) {
+        width = 2;
+    } else if (info == &vmstate_info_int32 || info == &vmstate_info_uint32) {
+        width = 4;
+    } else if (info == &vmstate_info_int64 || info == &vmstate_info_uint64) {
+        width = 8;
+    }
+
+    return field->size == width ? width : 0;
+}
+
+static VMStateProgram *vmstate_compile(const VMStateDescription *vmsd)
+{
+    VMStateProgram *prog;
+    VMStateField *field;
+    VMStateOp *op = NULL;
+    int nr_fields = 0, nr_runs = 0;
+
+    for (field = vmsd->fields; field->name; field++) {
+        nr_fields++;
+    }
+    prog = g_malloc0(sizeof(*prog) + nr_fields * sizeof(VMStateOp));
+
+    for (field = vmsd->fields; field->name; field++) {
+        int width = vmstate_plain_width(vmsd, field);
+        size_t len = field->size;
+
+        if (field->flags & VMS_ARRAY) {
+            len *= field->num;
+        }
+        if (width && op && op->width == width &&
+            op->offset + op->len == field->offset) {
+            op->nr_fields++;
+            op->len += len;
+            continue;
+        }
+        op = &prog->ops[prog->nr_ops++];
+        op->field = field;
+        op->nr_fields = 1;
+        op->width = width;
+        if (width) {
+            op->offset = field->offset;
+            op->len = len;
+            nr_runs++;
+        }
+    }
+
+    trace_vmstate_compile(vmsd->name, nr_fields, prog->nr_ops, nr_runs);
+    if (!nr_runs) {
+        /* Nothing to gain, keep using the interpreter */
+        g_free(prog);
+        return NULL;
+    }
+    return prog;
+}
+
+static VMStateProgram *vmstate_get_program(const VMStateDescription *vmsd)
+{
+    gpointer prog;
+
+    qemu_mutex_lock(&vmstate_programs_lock);
+    if (!g_hash_table_lookup_extended(vmstate_programs, vmsd, NULL, &prog)) {
+        prog = vmstate_compile(vmsd);
+        g_hash_table_insert(vmstate_programs, (gpointer)vmsd, prog);
+    }
+    qemu_mutex_unlock(&vmstate_programs_lock);
+
+    return prog;
+}
+
+/* Can a run of @width-wide elements go to/from the wire untouched? */
+static inline bool vmstate_run_is_raw(int width)
+{
+#ifdef HOST_WORDS_BIGENDIAN
+    return true;
+#else
+    return width == 1;
+#endif
+}
+
+/* Byte swap @len bytes of @width-wide elements, @dst may equal @src */
+static void vmstate_run_bswap(uint8_t *dst, const uint8_t *src, size_t len,
+                              int width)
+{
+    size_t i;
+
+    switch (width) {
+    case 2:
+        for (i = 0; i < len; i += 2) {
+            stw_be_p(dst + i, lduw_he_p(src + i));
+        }
+        break;
+    case 4:
+        for (i = 0; i < len; i += 4) {
+            stl_be_p(dst + i, ldl_he_p(src + i));
+        }
+        break;
+    case 8:
+        for (i = 0; i < len; i += 8) {
+            stq_be_p(dst + i, ldq_he_p(src + i));
+        }
+        break;
+    default:
+        g_assert_not_reached();
+    }
+}
+
+static int vmstate_run_load(QEMUFile *f, const VMStateDescription *vmsd,
+                            VMStateProgram *prog, void *opaque)
+{
+    int i, ret;
+
+    for (i = 0; i < prog->nr_ops; i++) {
+        VMStateOp *op = &prog->ops[i];
+        uint8_t *p = opaque + op->offset;
+
+        if (!op->width) {
+            ret = vmstate_load_field(f, vmsd, op->field, opaque,
+                                     vmsd->version_id);
+            if (ret < 0) {
+                return ret;
+            }
+            continue;
+        }
+
+        qemu_get_buffer(f, p, op->len);
+        ret = qemu_file_get_error(f);
+        if (ret < 0) {
+            error_report("Failed to load %s:%s", vmsd->name,
+                         op->field->name);
+            trace_vmstate_load_field_error(op->field->name, ret);
+            return ret;
+        }
+        if (!vmstate_run_is_raw(op->width)) {
+            vmstate_run_bswap(p, p, op->len, op->width);
+        }
+    }
+
+    return 0;
+}
+
+static void vmstate_run_save(QEMUFile *f, const VMStateDescription *vmsd,
+                             VMStateProgram *prog, void *opaque,
+                             QJSON *vmdesc)
+{
+    uint8_t buf[512];
+    int i, j;
+
+    for (i = 0; i < prog->nr_ops; i++) {
+        VMStateOp *op = &prog->ops[i];
+        uint8_t *p = opaque + op->offset;
+        size_t done, chunk;
+
+        if (!op->width) {
+            vmstate_save_field(f, vmsd, op->field, opaque, vmdesc);
+            continue;
+        }
+
+        if (vmstate_run_is_raw(op->width)) {
+            qemu_put_buffer(f, p, op->len);
+        } else {
+            for (done = 0; done < op->len; done += chunk) {
+                chunk = MIN(op->len - done, sizeof(buf));
+                vmstate_run_bswap(buf, p + done, chunk, op->width);
+                qemu_put_buffer(f, buf, chunk);
+            }
+        }
+
+        /* Describe the run the way the interpreter would, field by field */
+        for (j = 0; vmdesc && j < op->nr_fields; j++) {
+            VMStateField *field = op->field + j;
+            int n_elems = field->flags & VMS_ARRAY ? field->num : 1;
+
+            if (n_elems) {
+                vmsd_desc_field_start(vmsd, vmdesc, field, 0, n_elems);
+                vmsd_desc_field_end(vmsd, vmdesc, field, field->size, 0);
+            }
+        }
+    }
+}
+
 bool vmstate_save_needed(const VMStateDescription *vmsd, void *opaque)
 {
     if (vmsd->needed && !vmsd->needed(opaque)) {
@@ -308,10 +577,64 @@ bool vmstate_save_needed(const VMStateDescription *vmsd, void *opaque)
 }
 
 
+static void vmstate_save_field(QEMUFile *f, const VMStateDescription *vmsd,
+                               VMStateField *field, void *opaque,
+                               QJSON *vmdesc)
+{
+    if (!field->field_exists ||
+        field->field_exists(opaque, vmsd->version_id)) {
+        void *first_elem = opaque + field->offset;
+        int i, n_elems = vmstate_n_elems(opaque, field);
+        int size = vmstate_size(opaque, field);
+        int64_t old_offset, written_bytes;
+        QJSON *vmdesc_loop = vmdesc;
+
+        trace_vmstate_save_state_loop(vmsd->name, field->name, n_elems);
+        if (field->flags & VMS_POINTER) {
+            first_elem = *(void **)first_elem;
+            assert(first_elem || !n_elems || !size);
+        }
+        for (i = 0; i < n_elems; i++) {
+            void *curr_elem = first_elem + size * i;
+
+            vmsd_desc_field_start(vmsd, vmdesc_loop, field, i, n_elems);
+            old_offset = qemu_ftell_fast(f);
+            if (field->flags & VMS_ARRAY_OF_POINTER) {
+                assert(curr_elem);
+                curr_elem = *(void **)curr_elem;
+            }
+            if (!curr_elem && size) {
+                /* if null pointer write placeholder and do not follow */
+                assert(field->flags & VMS_ARRAY_OF_POINTER);
+                vmstate_info_nullptr.put(f, curr_elem, size, NULL, NULL);
+            } else if (field->flags & VMS_STRUCT) {
+                vmstate_save_state(f, field->vmsd, curr_elem, vmdesc_loop);
+            } else {
+                field->info->put(f, curr_elem, size, field, vmdesc_loop);
+            }
+
+            written_bytes = qemu_ftell_fast(f) - old_offset;
+            vmsd_desc_field_end(vmsd, vmdesc_loop, field, written_bytes, i);
+
+            /* Compressed arrays only care about the first element */
+            if (vmdesc_loop && vmsd_can_compress(field)) {
+                vmdesc_loop = NULL;
+            }
+        }
+    } else {
+        if (field->flags & VMS_MUST_EXIST) {
+            error_report("Output state validation failed: %s/%s",
+                    vmsd->name, field->name);
+            assert(!(field->flags & VMS_MUST_EXIST));
+        }
+    }
+}
+
 void vmstate_save_state(QEMUFile *f, const VMStateDescription *vmsd,
                         void *opaque, QJSON *vmdesc)
 {
     VMStateField *field = vmsd->fields;
+    VMStateProgram *prog;
 
     trace_vmstate_save_state_top(vmsd->name);
 
@@ -325,55 +648,14 @@ void vmstate_save_state(QEMUFile *f, const VMStateDescription *vmsd,
         json_start_array(vmdesc, "fields");
     }
 
-    while (field->name) {
-        if (!field->field_exists ||
-            field->field_exists(opaque, vmsd->version_id)) {
-            void *first_elem = opaque + field->offset;
-            int i, n_elems = vmstate_n_elems(opaque, field);
-            int size = vmstate_size(opaque, field);
-            int64_t old_offset, written_bytes;
-            QJSON *vmdesc_loop = vmdesc;
-
-            trace_vmstate_save_state_loop(vmsd->name, field->name, n_elems);
-            if (field->flags & VMS_POINTER) {
-                first_elem = *(void **)first_elem;
-                assert(first_elem || !n_elems || !size);
-            }
-            for (i = 0; i < n_elems; i++) {
-                void *curr_elem = first_elem + size * i;
-
-                vmsd_desc_field_start(vmsd, vmdesc_loop, field, i, n_elems);
-                old_offset = qemu_ftell_fast(f);
-                if (field->flags & VMS_ARRAY_OF_POINTER) {
-                    assert(curr_elem);
-                    curr_elem = *(void **)curr_elem;
-                }
-                if (!curr_elem && size) {
-                    /* if null pointer write placeholder and do not follow */
-                    assert(field->flags & VMS_ARRAY_OF_POINTER);
-                    vmstate_info_nullptr.put(f, curr_elem, size, NULL, NULL);
-                } else if (field->flags & VMS_STRUCT) {
-                    vmstate_save_state(f, field->vmsd, curr_elem, vmdesc_loop);
-                } else {
-                    field->info->put(f, curr_elem, size, field, vmdesc_loop);
-                }
-
-                written_bytes = qemu_ftell_fast(f) - old_offset;
-                vmsd_desc_field_end(vmsd, vmdesc_loop, field, written_bytes, i);
-
-                /* Compressed arrays only care about the first element */
-                if (vmdesc_loop && vmsd_can_compress(field)) {
-                    vmdesc_loop = NULL;
-                }
-            }
-        } else {
-            if (field->flags & VMS_MUST_EXIST) {
-                error_report("Output state validation failed: %s/%s",
-                        vmsd->name, field->name);
-                assert(!(field->flags & VMS_MUST_EXIST));
-            }
+    prog = vmstate_get_program(vmsd);
+    if (prog) {
+        vmstate_run_save(f, vmsd, prog, opaque, vmdesc);
+    } else {
+        while (field->name) {
+            vmstate_save_field(f, vmsd, field, opaque, vmdesc);
+            field++;
         }
-        field++;
     }
 
     if (vmdesc) {
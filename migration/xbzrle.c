@@ -12,6 +12,8 @@
  */
 #include "qemu/osdep.h"
 #include "qemu/cutils.h"
+#include "qemu/host-utils.h"
+#include "qemu/bswap.h"
 #include "xbzrle.h"
 
 /*
@@ -24,8 +26,8 @@
 
   length = uleb128 encoded integer
  */
-int xbzrle_encode_buffer(uint8_t *old_buf, uint8_t *new_buf, int slen,
-                         uint8_t *dst, int dlen)
+static int xbzrle_encode_buffer_int(uint8_t *old_buf, uint8_t *new_buf,
+                                    int slen, uint8_t *dst, int dlen)
 {
     uint32_t zrun_len = 0, nzrun_len = 0;
     int d = 0, i = 0;
@@ -126,6 +128,353 @@ int xbzrle_encode_buffer(uint8_t *old_buf, uint8_t *new_buf, int slen,
     return d;
 }
 
+/*
+ * The accelerated encoders below emit exactly the same stream as
+ * xbzrle_encode_buffer_int(): both zero and non-zero runs are maximal,
+ * so the output only depends on where the runs start and end.  They
+ * share xbzrle_encode_runs() and differ in how those boundaries are
+ * found.
+ */
+
+/* Number of leading bytes that are equal in @a and @b */
+static inline int xbzrle_count_eq_int(const uint8_t *a, const uint8_t *b,
+                                      int len)
+{
+    int k = 0;
+
+    while (k + 8 <= len && ldq_he_p(a + k) == ldq_he_p(b + k)) {
+        k += 8;
+    }
+    while (k < len && a[k] == b[k]) {
+        k++;
+    }
+    return k;
+}
+
+/* Number of leading bytes that differ in @a and @b */
+static inline int xbzrle_count_ne_int(const uint8_t *a, const uint8_t *b,
+                                      int len)
+{
+    const uint64_t mask = 0x0101010101010101ULL;
+    int k = 0;
+
+    while (k + 8 <= len) {
+        uint64_t xor = ldq_he_p(a + k) ^ ldq_he_p(b + k);
+
+        /* stop at the first word holding an equal byte */
+        if ((xor - mask) & ~xor & (mask << 7)) {
+            break;
+        }
+        k += 8;
+    }
+    while (k < len && a[k] != b[k]) {
+        k++;
+    }
+    return k;
+}
+
+static inline int xbzrle_encode_runs(uint8_t *old_buf, uint8_t *new_buf,
+                                     int slen, uint8_t *dst, int dlen,
+                                     int (*count_eq)(const uint8_t *,
+                                                     const uint8_t *, int),
+                                     int (*count_ne)(const uint8_t *,
+                                                     const uint8_t *, int))
+{
+    uint32_t zrun_len, nzrun_len;
+    int d = 0, i = 0;
+
+    while (i < slen) {
+        /* overflow */
+        if (d + 2 > dlen) {
+            return -1;
+        }
+
+        zrun_len = count_eq(old_buf + i, new_buf + i, slen - i);
+        i += zrun_len;
+
+        /* buffer unchanged */
+        if (zrun_len == slen) {
+            return 0;
+        }
+
+        /* skip last zero run */
+        if (i == slen) {
+            return d;
+        }
+
+        d += uleb128_encode_small(dst + d, zrun_len);
+
+        /* overflow */
+        if (d + 2 > dlen) {
+            return -1;
+        }
+
+        nzrun_len = count_ne(old_buf + i, new_buf + i, slen - i);
+        d += uleb128_encode_small(dst + d, nzrun_len);
+        /* overflow */
+        if (d + nzrun_len > dlen) {
+            return -1;
+        }
+        memcpy(dst + d, new_buf + i, nzrun_len);
+        d += nzrun_len;
+        i += nzrun_len;
+    }
+
+    return d;
+}
+
+#if defined(CONFIG_AVX2_OPT) || defined(__SSE2__)
+#include <emmintrin.h>
+
+static inline int xbzrle_count_eq_sse2(const uint8_t *a, const uint8_t *b,
+                                       int len)
+{
+    int k = 0;
+
+    for (; k + 16 <= len; k += 16) {
+        __m128i x = _mm_loadu_si128((const __m128i *)(a + k));
+        __m128i y = _mm_loadu_si128((const __m128i *)(b + k));
+        uint32_t eq = _mm_movemask_epi8(_mm_cmpeq_epi8(x, y));
+
+        if (eq != 0xffff) {
+            return k + cto32(eq);
+        }
+    }
+    return k + xbzrle_count_eq_int(a + k, b + k, len - k);
+}
+
+static inline int xbzrle_count_ne_sse2(const uint8_t *a, const uint8_t *b,
+                                       int len)
+{
+    int k = 0;
+
+    for (; k + 16 <= len; k += 16) {
+        __m128i x = _mm_loadu_si128((const __m128i *)(a + k));
+        __m128i y = _mm_loadu_si128((const __m128i *)(b + k));
+        uint32_t eq = _mm_movemask_epi8(_mm_cmpeq_epi8(x, y));
+
+        if (eq) {
+            return k + ctz32(eq);
+        }
+    }
+    return k + xbzrle_count_ne_int(a + k, b + k, len - k);
+}
+
+static int xbzrle_encode_buffer_sse2(uint8_t *old_buf, uint8_t *new_buf,
+                                     int slen, uint8_t *dst, int dlen)
+{
+    return xbzrle_encode_runs(old_buf, new_buf, slen, dst, dlen,
+                              xbzrle_count_eq_sse2, xbzrle_count_ne_sse2);
+}
+#endif
+
+#ifdef CONFIG_AVX2_OPT
+#pragma GCC push_options
+#pragma GCC target("avx2")
+#include <immintrin.h>
+
+static inline int xbzrle_count_eq_avx2(const uint8_t *a, const uint8_t *b,
+                                       int len)
+{
+    int k = 0;
+
+    for (; k + 32 <= len; k += 32) {
+        __m256i x = _mm256_loadu_si256((const __m256i *)(a + k));
+        __m256i y = _mm256_loadu_si256((const __m256i *)(b + k));
+        uint32_t eq = _mm256_movemask_epi8(_mm256_cmpeq_epi8(x, y));
+
+        if (eq != 0xffffffff) {
+            return k + cto32(eq);
+        }
+    }
+    return k + xbzrle_count_eq_int(a + k, b + k, len - k);
+}
+
+static inline int xbzrle_count_ne_avx2(const uint8_t *a, const uint8_t *b,
+                                       int len)
+{
+    int k = 0;
+
+    for (; k + 32 <= len; k += 32) {
+        __m256i x = _mm256_loadu_si256((const __m256i *)(a + k));
+        __m256i y = _mm256_loadu_si256((const __m256i *)(b + k));
+        uint32_t eq = _mm256_movemask_epi8(_mm256_cmpeq_epi8(x, y));
+
+        if (eq) {
+            return k + ctz32(eq);
+        }
+    }
+    return k + xbzrle_count_ne_int(a + k, b + k, len - k);
+}
+
+static int xbzrle_encode_buffer_avx2(uint8_t *old_buf, uint8_t *new_buf,
+                                     int slen, uint8_t *dst, int dlen)
+{
+    return xbzrle_encode_runs(old_buf, new_buf, slen, dst, dlen,
+                              xbzrle_count_eq_avx2, xbzrle_count_ne_avx2);
+}
+#pragma GCC pop_options
+#endif /* CONFIG_AVX2_OPT */
+
+#ifdef CONFIG_AVX512BW_OPT
+#pragma GCC push_options
+#pragma GCC target("avx512bw")
+#include <immintrin.h>
+
+static inline int xbzrle_count_eq_avx512bw(const uint8_t *a, const uint8_t *b,
+                                           int len)
+{
+    int k = 0;
+
+    for (; k + 64 <= len; k += 64) {
+        __m512i x = _mm512_loadu_si512(a + k);
+        __m512i y = _mm512_loadu_si512(b + k);
+        uint64_t eq = _mm512_cmpeq_epi8_mask(x, y);
+
+        if (eq != UINT64_MAX) {
+            return k + cto64(eq);
+        }
+    }
+    return k + xbzrle_count_eq_int(a + k, b + k, len - k);
+}
+
+static inline int xbzrle_count_ne_avx512bw(const uint8_t *a, const uint8_t *b,
+                                           int len)
+{
+    int k = 0;
+
+    for (; k + 64 <= len; k += 64) {
+        __m512i x = _mm512_loadu_si512(a + k);
+        __m512i y = _mm512_loadu_si512(b + k);
+        uint64_t eq = _mm512_cmpeq_epi8_mask(x, y);
+
+        if (eq) {
+            return k + ctz64(eq);
+        }
+    }
+    return k + xbzrle_count_ne_int(a + k, b + k, len - k);
+}
+
+static int xbzrle_encode_buffer_avx512bw(uint8_t *old_buf, uint8_t *new_buf,
+                                         int slen, uint8_t *dst, int dlen)
+{
+    return xbzrle_encode_runs(old_buf, new_buf, slen, dst, dlen,
+                              xbzrle_count_eq_avx512bw,
+                              xbzrle_count_ne_avx512bw);
+}
+#pragma GCC pop_options
+#endif /* CONFIG_AVX512BW_OPT */
+
+/* Note that for test_xbzrle_encode_next_accel, the most preferred
+ * ISA must have the least significant bit.
+ */
+#define CACHE_AVX512BW 1
+#define CACHE_AVX2     2
+#define CACHE_SSE2     4
+
+#if defined(CONFIG_AVX2_OPT) || defined(__SSE2__)
+# ifdef CONFIG_AVX2_OPT
+#  define INIT_CACHE 0
+#  define INIT_ACCEL xbzrle_encode_buffer_int
+# else
+#  define INIT_CACHE CACHE_SSE2
+#  define INIT_ACCEL xbzrle_encode_buffer_sse2
+# endif
+
+static unsigned cpuid_cache = INIT_CACHE;
+static int (*xbzrle_encode_accel)(uint8_t *, uint8_t *, int,
+                                  uint8_t *, int) = INIT_ACCEL;
+
+static void init_accel(unsigned cache)
+{
+    int (*fn)(uint8_t *, uint8_t *, int, uint8_t *, int) =
+        xbzrle_encode_buffer_int;
+
+    if (cache & CACHE_SSE2) {
+        fn = xbzrle_encode_buffer_sse2;
+    }
+#ifdef CONFIG_AVX2_OPT
+    if (cache & CACHE_AVX2) {
+        fn = xbzrle_encode_buffer_avx2;
+    }
+#endif
+#ifdef CONFIG_AVX512BW_OPT
+    if (cache & CACHE_AVX512BW) {
+        fn = xbzrle_encode_buffer_avx512bw;
+    }
+#endif
+    xbzrle_encode_accel = fn;
+}
+
+#ifdef CONFIG_AVX2_OPT
+#include "qemu/cpuid.h"
+
+static void __attribute__((constructor)) init_cpuid_cache(void)
+{
+    int max = __get_cpuid_max(0, NULL);
+    int a, b, c, d;
+    unsigned cache = 0;
+
+    if (max >= 1) {
+        __cpuid(1, a, b, c, d);
+        if (d & bit_SSE2) {
+            cache |= CACHE_SSE2;
+        }
+
+        /* We must check that AVX is not just available, but usable.  */
+        if ((c & bit_OSXSAVE) && (c & bit_AVX) && max >= 7) {
+            int bv;
+            __asm("xgetbv" : "=a"(bv), "=d"(d) : "c"(0));
+            __cpuid_count(7, 0, a, b, c, d);
+            if ((bv & 6) == 6 && (b & bit_AVX2)) {
+                cache |= CACHE_AVX2;
+            }
+            /* 0xe0 covers the opmask and the upper ZMM state */
+            if ((bv & 0xe6) == 0xe6 && (b & bit_AVX512F) &&
+                (b & bit_AVX512BW)) {
+                cache |= CACHE_AVX512BW;
+            }
+        }
+    }
+    cpuid_cache = cache;
+    init_accel(cache);
+}
+#endif /* CONFIG_AVX2_OPT */
+
+bool test_xbzrle_encode_next_accel(void)
+{
+    /* If no bits set, we just tested xbzrle_encode_buffer_int, and there
+       are no more acceleration options to test.  */
+    if (cpuid_cache == 0) {
+        return false;
+    }
+    /* Disable the accelerator we used before and select a new one.  */
+    cpuid_cache &= cpuid_cache - 1;
+    init_accel(cpuid_cache);
+    return true;
+}
+
+int xbzrle_encode_buffer(uint8_t *old_buf, uint8_t *new_buf, int slen,
+                         uint8_t *dst, int dlen)
+{
+    g_assert(!(((uintptr_t)old_buf | (uintptr_t)new_buf | slen) %
+               sizeof(long)));
+
+    return xbzrle_encode_accel(old_buf, new_buf, slen, dst, dlen);
+}
+#else
+bool test_xbzrle_encode_next_accel(void)
+{
+    return false;
+}
+
+int xbzrle_encode_buffer(uint8_t *old_buf, uint8_t *new_buf, int slen,
+                         uint8_t *dst, int dlen)
+{
+    return xbzrle_encode_buffer_int(old_buf, new_buf, slen, dst, dlen);
+}
+#endif
+
 int xbzrle_decode_buffer(uint8_t *src, int slen, uint8_t *dst, int dlen)
 {
     int i = 0, d = 0;
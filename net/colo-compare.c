@@ -39,6 +39,8 @@
 
 /* TODO: Should be configurable */
 #define REGULAR_PACKET_CHECK_MS 3000
+/* Granularity of the packet aging */
+#define PACKET_AGE_SLOT_MS (REGULAR_PACKET_CHECK_MS / 8)
 
 /*
   + CompareState ++
@@ -82,6 +84,13 @@ typedef struct CompareState {
     GQueue conn_list;
     /* hashtable to save connection */
     GHashTable *connection_track_table;
+    /*
+     * connections that got packets from the current read, compared once
+     * the read has been parsed.  element type: Connection
+     */
+    GQueue compare_pending;
+    /* creation time of the queued primary packets */
+    AgeWheel age_wheel;
     /* compare thread, a thread for each NIC */
     QemuThread thread;
 
@@ -103,13 +112,17 @@ static int compare_chr_send(CompareState *s,
                             uint32_t size,
                             uint32_t vnet_hdr_len);
 
-static gint seq_sorter(Packet *a, Packet *b, gpointer data)
+static void colo_compare_connection(void *opaque, void *user_data);
+
+/* Compare the connections that got packets since the last call */
+static void colo_compare_pending(CompareState *s)
 {
-    struct tcphdr *atcp, *btcp;
+    Connection *conn;
 
-    atcp = (struct tcphdr *)(a->transport_header);
-    btcp = (struct tcphdr *)(b->transport_header);
-    return ntohl(atcp->th_seq) - ntohl(btcp->th_seq);
+    while ((conn = g_queue_pop_head(&s->compare_pending))) {
+        conn->compare_pending = false;
+        colo_compare_connection(conn, s);
+    }
 }
 
 /*
@@ -121,6 +134,7 @@ static int packet_enqueue(CompareState *s, int mode)
     ConnectionKey key;
     Packet *pkt = NULL;
     Connection *conn;
+    bool table_full;
 
     if (mode == PRIMARY_IN) {
         pkt = packet_new(s->pri_rs.buf,
@@ -139,10 +153,24 @@ static int packet_enqueue(CompareState *s, int mode)
     }
     fill_connection_key(pkt, &key);
 
+    /*
+     * A full table is reset when a new connection comes in, which frees
+     * all queued packets: compare what is pending while it still exists.
+     */
+    table_full = g_hash_table_size(s->connection_track_table) >
+                 HASHTABLE_MAX_SIZE;
+    if (table_full) {
+        colo_compare_pending(s);
+    }
+
     conn = connection_get(s->connection_track_table,
                           &key,
                           &s->conn_list);
 
+    if (table_full && g_hash_table_size(s->connection_track_table) == 1) {
+        age_wheel_init(&s->age_wheel, PACKET_AGE_SLOT_MS);
+    }
+
     if (!conn->processing) {
         g_queue_push_tail(&s->conn_list, conn);
         conn->processing = true;
@@ -151,31 +179,33 @@ static int packet_enqueue(CompareState *s, int mode)
     if (mode == PRIMARY_IN) {
         if (g_queue_get_length(&conn->primary_list) <=
                                MAX_QUEUE_SIZE) {
-            g_queue_push_tail(&conn->primary_list, pkt);
-            if (conn->ip_proto == IPPROTO_TCP) {
-                g_queue_sort(&conn->primary_list,
-                             (GCompareDataFunc)seq_sorter,
-                             NULL);
-            }
+            connection_queue_packet(&conn->primary_list, pkt,
+                                    conn->ip_proto == IPPROTO_TCP);
+            age_wheel_add(&s->age_wheel, pkt->creation_ms);
         } else {
             error_report("colo compare primary queue size too big,"
                          "drop packet");
+            packet_destroy(pkt, NULL);
+            return 0;
         }
     } else {
         if (g_queue_get_length(&conn->secondary_list) <=
                                MAX_QUEUE_SIZE) {
-            g_queue_push_tail(&conn->secondary_list, pkt);
-            if (conn->ip_proto == IPPROTO_TCP) {
-                g_queue_sort(&conn->secondary_list,
-                             (GCompareDataFunc)seq_sorter,
-                             NULL);
-            }
+            connection_queue_packet(&conn->secondary_list, pkt,
+                                    conn->ip_proto == IPPROTO_TCP);
         } else {
             error_report("colo compare secondary queue size too big,"
                          "drop packet");
+            packet_destroy(pkt, NULL);
+            return 0;
         }
     }
 
+    if (!conn->compare_pending) {
+        g_queue_push_tail(&s->compare_pending, conn);
+        conn->compare_pending = true;
+    }
+
     return 0;
 }
 
@@ -407,52 +437,38 @@ static int colo_packet_compare_other(Packet *spkt, Packet *ppkt)
     return colo_packet_compare_common(ppkt, spkt, 0);
 }
 
-static int colo_old_packet_check_one(Packet *pkt, int64_t *check_time)
+/*
+ * Look for old packets that the secondary hasn't matched,
+ * if we have some then we have to checkpoint to wake
+ * the secondary up.
+ */
+static void colo_old_packet_check(void *opaque)
 {
+    CompareState *s = opaque;
     int64_t now = qemu_clock_get_ms(QEMU_CLOCK_HOST);
 
-    if ((now - pkt->creation_ms) > (*check_time)) {
-        trace_colo_old_packet_check_found(pkt->creation_ms);
-        return 0;
-    } else {
-        return 1;
-    }
-}
-
-static int colo_old_packet_check_one_conn(Connection *conn,
-                                          void *user_data)
-{
-    GList *result = NULL;
-    int64_t check_time = REGULAR_PACKET_CHECK_MS;
-
-    result = g_queue_find_custom(&conn->primary_list,
-                                 &check_time,
-                                 (GCompareFunc)colo_old_packet_check_one);
-
-    if (result) {
+    if (age_wheel_expired(&s->age_wheel, now, REGULAR_PACKET_CHECK_MS)) {
+        trace_colo_old_packet_check_found(now - REGULAR_PACKET_CHECK_MS);
         /* do checkpoint will flush old packet */
         /* TODO: colo_notify_checkpoint();*/
-        return 0;
     }
-
-    return 1;
 }
 
-/*
- * Look for old packets that the secondary hasn't matched,
- * if we have some then we have to checkpoint to wake
- * the secondary up.
- */
-static void colo_old_packet_check(void *opaque)
+/* Send a primary packet that has been matched by the secondary */
+static void colo_release_primary_pkt(Packet *pkt, void *opaque)
 {
     CompareState *s = opaque;
+    int ret;
 
-    /*
-     * If we find one old packet, stop finding job and notify
-     * COLO frame do checkpoint.
-     */
-    g_queue_find_custom(&s->conn_list, NULL,
-                        (GCompareFunc)colo_old_packet_check_one_conn);
+    ret = compare_chr_send(s,
+                           pkt->data,
+                           pkt->size,
+                           pkt->vnet_hdr_len);
+    if (ret < 0) {
+        error_report("colo_send_primary_packet failed");
+    }
+    age_wheel_del(&s->age_wheel, pkt->creation_ms);
+    packet_destroy(pkt, NULL);
 }
 
 /*
@@ -465,16 +481,20 @@ static void colo_compare_connection(void *opaque, void *user_data)
     Connection *conn = opaque;
     Packet *pkt = NULL;
     GList *result = NULL;
-    int ret;
+
+    if (conn->ip_proto == IPPROTO_TCP) {
+        if (connection_compare_tcp(conn, colo_packet_compare_tcp,
+                                   colo_release_primary_pkt, s)) {
+            trace_colo_compare_main("packet different");
+            /* TODO: colo_notify_checkpoint();*/
+        }
+        return;
+    }
 
     while (!g_queue_is_empty(&conn->primary_list) &&
            !g_queue_is_empty(&conn->secondary_list)) {
         pkt = g_queue_pop_tail(&conn->primary_list);
         switch (conn->ip_proto) {
-        case IPPROTO_TCP:
-            result = g_queue_find_custom(&conn->secondary_list,
-                     pkt, (GCompareFunc)colo_packet_compare_tcp);
-            break;
         case IPPROTO_UDP:
             result = g_queue_find_custom(&conn->secondary_list,
                      pkt, (GCompareFunc)colo_packet_compare_udp);
@@ -490,16 +510,10 @@ static void colo_compare_connection(void *opaque, void *user_data)
         }
 
         if (result) {
-            ret = compare_chr_send(s,
-                                   pkt->data,
-                                   pkt->size,
-                                   pkt->vnet_hdr_len);
-            if (ret < 0) {
-                error_report("colo_send_primary_packet failed");
-            }
             trace_colo_compare_main("packet same and release packet");
-            g_queue_remove(&conn->secondary_list, result->data);
-            packet_destroy(pkt, NULL);
+            packet_destroy(result->data, NULL);
+            g_queue_delete_link(&conn->secondary_list, result);
+            colo_release_primary_pkt(pkt, s);
         } else {
             /*
              * If one packet arrive late, the secondary_list or
@@ -574,6 +588,7 @@ static void compare_pri_chr_in(void *opaque, const uint8_t *buf, int size)
                                  NULL, NULL, true);
         error_report("colo-compare primary_in error");
     }
+    colo_compare_pending(s);
 }
 
 /*
@@ -591,6 +606,7 @@ static void compare_sec_chr_in(void *opaque, const uint8_t *buf, int size)
                                  NULL, NULL, true);
         error_report("colo-compare secondary_in error");
     }
+    colo_compare_pending(s);
 }
 
 /*
@@ -702,15 +718,13 @@ static void compare_pri_rs_finalize(SocketReadState *pri_rs)
 {
     CompareState *s = container_of(pri_rs, CompareState, pri_rs);
 
+    /* Connections are compared once the whole read has been parsed */
     if (packet_enqueue(s, PRIMARY_IN)) {
         trace_colo_compare_main("primary: unsupported packet in");
         compare_chr_send(s,
                          pri_rs->buf,
                          pri_rs->packet_len,
                          pri_rs->vnet_hdr_len);
-    } else {
-        /* compare connection */
-        g_queue_foreach(&s->conn_list, colo_compare_connection, s);
     }
 }
 
@@ -720,9 +734,6 @@ static void compare_sec_rs_finalize(SocketReadState *sec_rs)
 
     if (packet_enqueue(s, SECONDARY_IN)) {
         trace_colo_compare_main("secondary: unsupported packet in");
-    } else {
-        /* compare connection */
-        g_queue_foreach(&s->conn_list, colo_compare_connection, s);
     }
 }
 
@@ -793,6 +804,8 @@ static void colo_compare_complete(UserCreatable *uc, Error **errp)
     net_socket_rs_init(&s->sec_rs, compare_sec_rs_finalize, s->vnet_hdr);
 
     g_queue_init(&s->conn_list);
+    g_queue_init(&s->compare_pending);
+    age_wheel_init(&s->age_wheel, PACKET_AGE_SLOT_MS);
 
     s->connection_track_table = g_hash_table_new_full(connection_key_hash,
                                                       connection_key_equal,
@@ -869,6 +882,7 @@ static void colo_compare_finalize(Object *obj)
     g_queue_foreach(&s->conn_list, colo_flush_packets, s);
 
     g_queue_clear(&s->conn_list);
+    g_queue_clear(&s->compare_pending);
 
     g_hash_table_destroy(s->connection_track_table);
     g_free(s->pri_indev);
@@ -136,6 +136,8 @@ Connection *connection_new(ConnectionKey *key)
     conn->processing = false;
     conn->offset = 0;
     conn->syn_flag = 0;
+    conn->compare_pending = false;
+    conn->compared_seq_valid = false;
     g_queue_init(&conn->primary_list);
     g_queue_init(&conn->secondary_list);
 
@@ -161,6 +163,8 @@ Packet *packet_new(const void *data, int size, int vnet_hdr_len)
     pkt->size = size;
     pkt->creation_ms = qemu_clock_get_ms(QEMU_CLOCK_HOST);
     pkt->vnet_hdr_len = vnet_hdr_len;
+    pkt->payload_compared = 0;
+    pkt->control_compared = 0;
 
     return pkt;
 }
@@ -173,6 +177,263 @@ void packet_destroy(void *opaque, void *user_data)
     g_slice_free(Packet, pkt);
 }
 
+static tcp_seq packet_tcp_seq(Packet *pkt)
+{
+    return ntohl(((struct tcphdr *)pkt->transport_header)->th_seq);
+}
+
+/*
+ * Returns the TCP payload of @pkt and its length in @len, ignoring the
+ * Ethernet padding of short frames.
+ */
+static uint8_t *packet_tcp_payload(Packet *pkt, uint32_t *len)
+{
+    struct tcphdr *tcp = (struct tcphdr *)pkt->transport_header;
+    uint8_t *end = (uint8_t *)pkt->data + pkt->size;
+    uint8_t *ip_end = pkt->network_header + ntohs(pkt->ip->ip_len);
+    uint8_t *payload;
+
+    if (pkt->transport_header + sizeof(*tcp) > end) {
+        *len = 0;
+        return end;
+    }
+    payload = pkt->transport_header + tcp->th_off * 4;
+    end = MIN(end, ip_end);
+    *len = payload < end ? end - payload : 0;
+    return payload;
+}
+
+/*
+ * Queue @pkt on @queue, in sequence order for TCP.  Segments mostly
+ * arrive in order, so the position is searched from the tail.
+ */
+void connection_queue_packet(GQueue *queue, Packet *pkt, bool tcp)
+{
+    GList *link = queue->tail;
+
+    if (tcp) {
+        tcp_seq seq = packet_tcp_seq(pkt);
+
+        while (link && (int32_t)(packet_tcp_seq(link->data) - seq) > 0) {
+            link = link->prev;
+        }
+    }
+    if (link) {
+        g_queue_insert_after(queue, link, pkt);
+    } else {
+        g_queue_push_head(queue, pkt);
+    }
+}
+
+#define TH_CONTROL (TH_SYN | TH_FIN | TH_RST)
+
+/*
+ * Control flags of @pkt that have to be matched before anything else of
+ * it: SYN comes before the payload in sequence space, FIN and RST after.
+ */
+static uint8_t packet_tcp_control_due(Packet *pkt, uint32_t len)
+{
+    struct tcphdr *tcp = (struct tcphdr *)pkt->transport_header;
+    uint8_t flags = tcp->th_flags & TH_CONTROL & ~pkt->control_compared;
+
+    if (pkt->payload_compared < len) {
+        flags &= TH_SYN;
+    }
+    return flags;
+}
+
+/* Whether everything in @pkt has been matched */
+static bool packet_tcp_compared(Packet *pkt, uint32_t len)
+{
+    struct tcphdr *tcp = (struct tcphdr *)pkt->transport_header;
+
+    return pkt->payload_compared == len &&
+           !(tcp->th_flags & TH_CONTROL & ~pkt->control_compared);
+}
+
+/* Sequence number following what has been matched of @pkt */
+static tcp_seq packet_tcp_compared_seq(Packet *pkt)
+{
+    /* SYN and FIN take a sequence number of their own */
+    return packet_tcp_seq(pkt) + !!(pkt->control_compared & TH_SYN) +
+           pkt->payload_compared + !!(pkt->control_compared & TH_FIN);
+}
+
+/*
+ * Drop what was already matched from a packet at the head of a queue.
+ * Returns true if nothing of @pkt is left to compare.
+ */
+static bool connection_skip_compared(Connection *conn, Packet *pkt,
+                                     tcp_seq compared_seq)
+{
+    struct tcphdr *tcp = (struct tcphdr *)pkt->transport_header;
+    uint32_t len;
+    int32_t done;
+
+    if (!conn->compared_seq_valid) {
+        return false;
+    }
+    packet_tcp_payload(pkt, &len);
+    done = compared_seq - packet_tcp_seq(pkt);
+    if (done <= 0) {
+        return false;
+    }
+    if (tcp->th_flags & TH_SYN) {
+        pkt->control_compared |= TH_SYN;
+        done--;
+    }
+    /* RST takes no sequence number, it can't be told from a new one */
+    if (done >= (int32_t)len + !!(tcp->th_flags & TH_FIN) &&
+        !(tcp->th_flags & TH_RST)) {
+        /* Retransmission of a segment that has been matched */
+        return true;
+    }
+    if (done > (int32_t)pkt->payload_compared && done <= (int32_t)len) {
+        pkt->payload_compared = done;
+    }
+    return false;
+}
+
+/*
+ * Compare the TCP payload queued on both sides of @conn as two byte
+ * streams, so that the guests may segment it differently.  SYN, FIN and
+ * RST are part of the streams too: they are matched when both sides get
+ * to them, whether they came with payload or on their own.  Control
+ * segments without payload on both sides are also compared as a whole
+ * with @compare.  Other segments without payload are not compared.
+ * A primary packet is handed to @release once all of it has been
+ * matched, secondary packets are freed.
+ *
+ * Returns 0 once one side has run out of packets, or -1 on the first
+ * difference, which stays at the head of the queues.
+ */
+int connection_compare_tcp(Connection *conn, PacketCompareFunc *compare,
+                           PacketReleaseFunc *release, void *opaque)
+{
+    while (!g_queue_is_empty(&conn->primary_list) &&
+           !g_queue_is_empty(&conn->secondary_list)) {
+        Packet *ppkt = g_queue_peek_head(&conn->primary_list);
+        Packet *spkt = g_queue_peek_head(&conn->secondary_list);
+        struct tcphdr *ptcp = (struct tcphdr *)ppkt->transport_header;
+        struct tcphdr *stcp = (struct tcphdr *)spkt->transport_header;
+        uint8_t *pdata, *sdata;
+        uint8_t pdue, sdue;
+        uint32_t plen, slen, len;
+
+        pdata = packet_tcp_payload(ppkt, &plen);
+        sdata = packet_tcp_payload(spkt, &slen);
+
+        if (connection_skip_compared(conn, ppkt, conn->pri_compared_seq) ||
+            (!plen && !(ptcp->th_flags & TH_CONTROL))) {
+            g_queue_pop_head(&conn->primary_list);
+            release(ppkt, opaque);
+            continue;
+        }
+        if (connection_skip_compared(conn, spkt, conn->sec_compared_seq) ||
+            (!slen && !(stcp->th_flags & TH_CONTROL))) {
+            g_queue_pop_head(&conn->secondary_list);
+            packet_destroy(spkt, NULL);
+            continue;
+        }
+
+        /*
+         * Either side is at a control flag: the other must be at the same
+         * one.  Otherwise both have payload left, as packets are dropped
+         * once all of them has been matched.
+         */
+        pdue = packet_tcp_control_due(ppkt, plen);
+        sdue = packet_tcp_control_due(spkt, slen);
+        if (pdue || sdue) {
+            if (pdue != sdue ||
+                (!plen && !slen && compare(spkt, ppkt))) {
+                return -1;
+            }
+            ppkt->control_compared |= pdue;
+            spkt->control_compared |= sdue;
+        } else {
+            len = MIN(plen - ppkt->payload_compared,
+                      slen - spkt->payload_compared);
+            if (memcmp(pdata + ppkt->payload_compared,
+                       sdata + spkt->payload_compared, len)) {
+                return -1;
+            }
+            ppkt->payload_compared += len;
+            spkt->payload_compared += len;
+        }
+
+        conn->compared_seq_valid = true;
+        conn->pri_compared_seq = packet_tcp_compared_seq(ppkt);
+        conn->sec_compared_seq = packet_tcp_compared_seq(spkt);
+
+        if (packet_tcp_compared(ppkt, plen)) {
+            g_queue_pop_head(&conn->primary_list);
+            release(ppkt, opaque);
+        }
+        if (packet_tcp_compared(spkt, slen)) {
+            g_queue_pop_head(&conn->secondary_list);
+            packet_destroy(spkt, NULL);
+        }
+    }
+
+    return 0;
+}
+
+void age_wheel_init(AgeWheel *wheel, int64_t slot_ms)
+{
+    memset(wheel, 0, sizeof(*wheel));
+    wheel->slot_ms = slot_ms;
+}
+
+/* Account a packet created at @ms */
+void age_wheel_add(AgeWheel *wheel, int64_t ms)
+{
+    int64_t tick = ms / wheel->slot_ms;
+    unsigned int i = tick % AGE_WHEEL_SLOTS;
+
+    if (wheel->slots[i].tick != tick) {
+        /* Whatever is left in the slot has gone round the wheel */
+        wheel->expired += wheel->slots[i].count;
+        wheel->slots[i].tick = tick;
+        wheel->slots[i].count = 0;
+    }
+    wheel->slots[i].count++;
+}
+
+/* Forget a packet created at @ms */
+void age_wheel_del(AgeWheel *wheel, int64_t ms)
+{
+    int64_t tick = ms / wheel->slot_ms;
+    unsigned int i = tick % AGE_WHEEL_SLOTS;
+
+    if (wheel->slots[i].tick == tick) {
+        assert(wheel->slots[i].count);
+        wheel->slots[i].count--;
+    } else {
+        assert(wheel->expired);
+        wheel->expired--;
+    }
+}
+
+/*
+ * Returns true if a packet older than @age ms at @now is accounted.
+ * The answer may come up to a slot late.
+ */
+bool age_wheel_expired(AgeWheel *wheel, int64_t now, int64_t age)
+{
+    unsigned int i;
+
+    if (wheel->expired) {
+        return true;
+    }
+    for (i = 0; i < AGE_WHEEL_SLOTS; i++) {
+        if (wheel->slots[i].count &&
+            (wheel->slots[i].tick + 1) * wheel->slot_ms <= now - age) {
+            return true;
+        }
+    }
+    return false;
+}
+
 /*
  * Clear hashtable, stop this hash growing really huge
  */
@@ -45,6 +45,10 @@ typedef struct Packet {
     int64_t creation_ms;
     /* Get vnet_hdr_len from filter */
     uint32_t vnet_hdr_len;
+    /* TCP payload bytes already matched by connection_compare_tcp() */
+    uint32_t payload_compared;
+    /* TCP SYN, FIN and RST flags already matched, likewise */
+    uint8_t control_compared;
 } Packet;
 
 typedef struct ConnectionKey {
@@ -71,8 +75,36 @@ typedef struct Connection {
      * run once in independent tcp connection
      */
     int syn_flag;
+    /* queued on the compare batch, see colo-compare */
+    bool compare_pending;
+    /*
+     * End of the TCP payload matched so far on each side, so that
+     * retransmitted segments are not compared twice
+     */
+    bool compared_seq_valid;
+    tcp_seq pri_compared_seq;
+    tcp_seq sec_compared_seq;
 } Connection;
 
+#define AGE_WHEEL_SLOTS 16
+
+/*
+ * Counts queued packets by creation time in slots of @slot_ms, so that
+ * finding out whether any packet is too old does not walk the queues.
+ */
+typedef struct AgeWheel {
+    int64_t slot_ms;
+    struct {
+        int64_t tick;
+        unsigned int count;
+    } slots[AGE_WHEEL_SLOTS];
+    /* packets created before the oldest slot */
+    unsigned int expired;
+} AgeWheel;
+
+typedef int PacketCompareFunc(Packet *spkt, Packet *ppkt);
+typedef void PacketReleaseFunc(Packet *pkt, void *opaque);
+
 uint32_t connection_key_hash(const void *opaque);
 int connection_key_equal(const void *opaque1, const void *opaque2);
 int parse_packet_early(Packet *pkt);
@@ -86,5 +118,13 @@ Connection *connection_get(GHashTable *connection_track_table,
 void connection_hashtable_reset(GHashTable *connection_track_table);
 Packet *packet_new(const void *data, int size, int vnet_hdr_len);
 void packet_destroy(void *opaque, void *user_data);
+void connection_queue_packet(GQueue *queue, Packet *pkt, bool tcp);
+int connection_compare_tcp(Connection *conn, PacketCompareFunc *compare,
+                           PacketReleaseFunc *release, void *opaque);
+
+void age_wheel_init(AgeWheel *wheel, int64_t slot_ms);
+void age_wheel_add(AgeWheel *wheel, int64_t ms);
+void age_wheel_del(AgeWheel *wheel, int64_t ms);
+bool age_wheel_expired(AgeWheel *wheel, int64_t now, int64_t age);
 
 #endif /* QEMU_COLO_PROXY_H */
@@ -54,6 +54,9 @@ int nb_numa_nodes;
 bool have_numa_distance;
 NodeInfo numa_info[MAX_NODES];
 
+/* Main RAM when it is not split into per-node memory backends */
+static MemoryRegion *nonnuma_system_memory;
+
 void numa_set_mem_node_id(ram_addr_t addr, uint64_t size, uint32_t node)
 {
     struct numa_addr_range *range;
@@ -552,6 +555,7 @@ static void allocate_system_memory_nonnuma(MemoryRegion *mr, Object *owner,
         memory_region_init_ram_nomigrate(mr, owner, name, ram_size, &error_fatal);
     }
     vmstate_register_ram_global(mr);
+    nonnuma_system_memory = mr;
 }
 
 void memory_region_allocate_system_memory(MemoryRegion *mr, Object *owner,
@@ -591,6 +595,51 @@ void memory_region_allocate_system_memory(MemoryRegion *mr, Object *owner,
     }
 }
 
+/*
+ * Return the NUMA node of the guest RAM at @offset in @rb, or -1 if it
+ * isn't assigned to a node.  *@len is set to the length of the range
+ * starting at @offset that is on the same node.
+ */
+int numa_ram_block_node(RAMBlock *rb, ram_addr_t offset, ram_addr_t *len)
+{
+    ram_addr_t node_start = 0;
+    int i;
+
+    *len = qemu_ram_get_used_length(rb) - offset;
+    if (!nb_numa_nodes) {
+        return -1;
+    }
+
+    if (have_memdevs) {
+        for (i = 0; i < nb_numa_nodes; i++) {
+            HostMemoryBackend *backend = numa_info[i].node_memdev;
+            MemoryRegion *mr;
+
+            if (!backend) {
+                continue;
+            }
+            mr = host_memory_backend_get_memory(backend, &error_abort);
+            if (mr->ram_block == rb) {
+                return i;
+            }
+        }
+        return -1;
+    }
+
+    /* Nodes take consecutive ranges of the main RAM block */
+    if (!nonnuma_system_memory || nonnuma_system_memory->ram_block != rb) {
+        return -1;
+    }
+    for (i = 0; i < nb_numa_nodes; i++) {
+        if (offset < node_start + numa_info[i].node_mem) {
+            *len = MIN(*len, node_start + numa_info[i].node_mem - offset);
+            return i;
+        }
+        node_start += numa_info[i].node_mem;
+    }
+    return -1;
+}
+
 static void numa_stat_memory_devices(uint64_t node_mem[])
 {
     MemoryDeviceInfoList *info_list = NULL;
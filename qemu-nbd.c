@@ -920,7 +920,8 @@ int main(int argc, char **argv)
     if (socket_activation == 0) {
         server_ioc = qio_channel_socket_new();
         saddr = nbd_build_socket_address(sockpath, bindto, port);
-        if (qio_channel_socket_listen_sync(server_ioc, saddr, &local_err) < 0) {
+        if (qio_channel_socket_listen_sync(server_ioc, saddr, 1,
+                                           &local_err) < 0) {
             object_unref(OBJECT(server_ioc));
             error_report_err(local_err);
             return 1;
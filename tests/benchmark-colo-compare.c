@@ -0,0 +1,168 @@
+/*
+ * COLO compare TCP payload comparison speed benchmark
+ *
+ * This work is licensed under the terms of the GNU GPL, version 2 or
+ * (at your option) any later version.  See the COPYING file in the
+ * top-level directory.
+ */
+#include "qemu/osdep.h"
+#include "qemu/timer.h"
+#include "net/colo.h"
+
+#define FLOWS 16
+#define FLOW_BYTES (256 * 1024)
+
+typedef struct FlowBenchParams {
+    /* payload bytes per segment sent by the primary and the secondary */
+    uint32_t pri_mss;
+    uint32_t sec_mss;
+} FlowBenchParams;
+
+static uint64_t released;
+
+static int compare_whole(Packet *spkt, Packet *ppkt)
+{
+    if (spkt->size != ppkt->size) {
+        return -1;
+    }
+    return memcmp(spkt->data, ppkt->data, spkt->size);
+}
+
+static void release(Packet *pkt, void *opaque)
+{
+    released += pkt->size;
+    packet_destroy(pkt, NULL);
+}
+
+static Packet *make_segment(uint16_t port, uint32_t seq,
+                            const uint8_t *payload, uint32_t len)
+{
+    uint32_t size = ETH_HLEN + sizeof(struct ip) + sizeof(struct tcphdr) +
+                    len;
+    uint8_t *frame = g_malloc0(size);
+    struct ip *ip = (struct ip *)(frame + ETH_HLEN);
+    struct tcphdr *tcp = (struct tcphdr *)(ip + 1);
+    Packet *pkt;
+
+    frame[12] = ETH_P_IP >> 8;
+    frame[13] = ETH_P_IP & 0xff;
+    ip->ip_v = 4;
+    ip->ip_hl = sizeof(*ip) / 4;
+    ip->ip_len = htons(size - ETH_HLEN);
+    ip->ip_p = IPPROTO_TCP;
+    ip->ip_src.s_addr = htonl(0x0a000001);
+    ip->ip_dst.s_addr = htonl(0x0a000002);
+    tcp->th_sport = htons(port);
+    tcp->th_dport = htons(80);
+    tcp->th_seq = htonl(seq);
+    tcp->th_off = sizeof(*tcp) / 4;
+    tcp->th_flags = TH_ACK;
+    memcpy(tcp + 1, payload, len);
+
+    pkt = packet_new(frame, size, 0);
+    g_free(frame);
+    g_assert(parse_packet_early(pkt) == 0);
+    return pkt;
+}
+
+/* Queue the next segment of every flow, as the compare thread would */
+static bool queue_segments(GHashTable *table, GQueue *conn_list,
+                           const uint8_t *payload, uint32_t *sent,
+                           uint32_t mss, bool primary)
+{
+    bool more = false;
+    int i;
+
+    for (i = 0; i < FLOWS; i++) {
+        uint32_t len = MIN(mss, FLOW_BYTES - sent[i]);
+        ConnectionKey key;
+        Connection *conn;
+        Packet *pkt;
+
+        if (!len) {
+            continue;
+        }
+        pkt = make_segment(1024 + i, 1000 + sent[i], payload + sent[i], len);
+        sent[i] += len;
+        more = true;
+
+        fill_connection_key(pkt, &key);
+        conn = connection_get(table, &key, conn_list);
+        connection_queue_packet(primary ? &conn->primary_list :
+                                &conn->secondary_list, pkt, true);
+        g_assert(connection_compare_tcp(conn, compare_whole,
+                                        release, NULL) == 0);
+    }
+    return more;
+}
+
+static void test_compare_speed(const void *opaque)
+{
+    const FlowBenchParams *params = opaque;
+    uint8_t *payload = g_malloc(FLOW_BYTES);
+    uint32_t pri_sent[FLOWS], sec_sent[FLOWS];
+    double total = 0.0;
+    GHashTable *table;
+    GQueue conn_list;
+    bool more;
+    int i;
+
+    for (i = 0; i < FLOW_BYTES; i++) {
+        payload[i] = g_test_rand_int();
+    }
+
+    g_test_timer_start();
+    do {
+        g_queue_init(&conn_list);
+        table = g_hash_table_new_full(connection_key_hash,
+                                      connection_key_equal,
+                                      g_free, connection_destroy);
+        memset(pri_sent, 0, sizeof(pri_sent));
+        memset(sec_sent, 0, sizeof(sec_sent));
+        released = 0;
+
+        do {
+            more = queue_segments(table, &conn_list, payload, pri_sent,
+                                  params->pri_mss, true);
+            more |= queue_segments(table, &conn_list, payload, sec_sent,
+                                   params->sec_mss, false);
+        } while (more);
+
+        g_assert(released >= (uint64_t)FLOWS * FLOW_BYTES);
+        g_hash_table_destroy(table);
+        g_queue_clear(&conn_list);
+
+        total += FLOWS * FLOW_BYTES;
+    } while (g_test_timer_elapsed() < 5.0);
+
+    total /= 1024 * 1024; /* to MB */
+    g_print("colo-compare: ");
+    g_print("Testing mss %u/%u ", params->pri_mss, params->sec_mss);
+    g_print("done: %.2f MB in %.2f secs: ", total, g_test_timer_last());
+    g_print("%.2f MB/sec\n", total / g_test_timer_last());
+
+    g_free(payload);
+}
+
+static const FlowBenchParams params[] = {
+    { 1448, 1448 },
+    { 1448, 1000 },
+    { 536, 8948 },
+};
+
+int main(int argc, char **argv)
+{
+    size_t i;
+    char name[64];
+
+    g_test_init(&argc, &argv, NULL);
+    init_clocks(NULL);
+
+    for (i = 0; i < ARRAY_SIZE(params); i++) {
+        snprintf(name, sizeof(name), "/colo-compare/speed-%u-%u",
+                 params[i].pri_mss, params[i].sec_mss);
+        g_test_add_data_func(name, &params[i], test_compare_speed);
+    }
+
+    return g_test_run();
+}
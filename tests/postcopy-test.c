@@ -353,14 +353,46 @@ static void cleanup(const char *filename)
     g_free(path);
 }
 
-static void test_migrate(void)
+static void migrate_set_capability(QTestState *who, const char *capability)
 {
-    char *uri = g_strdup_printf("unix:%s/migsocket", tmpfs);
-    QTestState *global = global_qtest, *from, *to;
-    unsigned char dest_byte_a, dest_byte_b, dest_byte_c, dest_byte_d;
-    gchar *cmd, *cmd_src, *cmd_dst;
+    QTestState *global = global_qtest;
+    gchar *cmd;
+    QDict *rsp;
+
+    global_qtest = who;
+    cmd = g_strdup_printf("{ 'execute': 'migrate-set-capabilities',"
+                          "'arguments': { "
+                              "'capabilities': [ {"
+                                  "'capability': '%s',"
+                                  "'state': true } ] } }",
+                          capability);
+    rsp = qmp(cmd);
+    g_free(cmd);
+    g_assert(qdict_haskey(rsp, "return"));
+    QDECREF(rsp);
+    global_qtest = global;
+}
+
+static void migrate_set_downtime(QTestState *who, const char *value)
+{
+    QTestState *global = global_qtest;
+    gchar *cmd;
     QDict *rsp;
 
+    global_qtest = who;
+    cmd = g_strdup_printf("{ 'execute': 'migrate_set_downtime',"
+                          "'arguments': { 'value': %s } }", value);
+    rsp = return_or_event(qmp(cmd));
+    g_free(cmd);
+    g_assert(qdict_haskey(rsp, "return"));
+    QDECREF(rsp);
+    global_qtest = global;
+}
+
+static void test_migrate_start(QTestState **from, QTestState **to,
+                               const char *uri)
+{
+    gchar *cmd_src, *cmd_dst;
     char *bootpath = g_strdup_printf("%s/bootsect", tmpfs);
     const char *arch = qtest_get_arch();
 
@@ -401,29 +433,22 @@ static void test_migrate(void)
 
     g_free(bootpath);
 
-    from = qtest_start(cmd_src);
+    *from = qtest_start(cmd_src);
     g_free(cmd_src);
 
-    to = qtest_init(cmd_dst);
+    *to = qtest_init(cmd_dst);
     g_free(cmd_dst);
+}
 
-    global_qtest = from;
-    rsp = qmp("{ 'execute': 'migrate-set-capabilities',"
-                  "'arguments': { "
-                      "'capabilities': [ {"
-                          "'capability': 'postcopy-ram',"
-                          "'state': true } ] } }");
-    g_assert(qdict_haskey(rsp, "return"));
-    QDECREF(rsp);
-
-    global_qtest = to;
-    rsp = qmp("{ 'execute': 'migrate-set-capabilities',"
-                  "'arguments': { "
-                      "'capabilities': [ {"
-                          "'capability': 'postcopy-ram',"
-                          "'state': true } ] } }");
-    g_assert(qdict_haskey(rsp, "return"));
-    QDECREF(rsp);
+/*
+ * Start migrating @from to @uri, slowly enough that it doesn't complete
+ * on its own even on a fast machine; the caller decides how it ends.
+ */
+static void test_migrate_begin(QTestState *from, const char *uri)
+{
+    QTestState *global = global_qtest;
+    gchar *cmd;
+    QDict *rsp;
 
     /* We want to pick a speed slow enough that the test completes
      * quickly, but that it doesn't complete precopy even on a slow
@@ -436,11 +461,7 @@ static void test_migrate(void)
     QDECREF(rsp);
 
     /* 1ms downtime - it should never finish precopy */
-    rsp = qmp("{ 'execute': 'migrate_set_downtime',"
-              "'arguments': { 'value': 0.001 } }");
-    g_assert(qdict_haskey(rsp, "return"));
-    QDECREF(rsp);
-
+    migrate_set_downtime(from, "0.001");
 
     /* Wait for the first serial output from the source */
     wait_for_serial("src_serial");
@@ -453,24 +474,17 @@ static void test_migrate(void)
     g_assert(qdict_haskey(rsp, "return"));
     QDECREF(rsp);
 
-    wait_for_migration_pass();
-
-    rsp = return_or_event(qmp("{ 'execute': 'migrate-start-postcopy' }"));
-    g_assert(qdict_haskey(rsp, "return"));
-    QDECREF(rsp);
-
-    if (!got_stop) {
-        qmp_eventwait("STOP");
-    }
-
-    global_qtest = to;
-    qmp_eventwait("RESUME");
-
-    wait_for_serial("dest_serial");
-    global_qtest = from;
-    wait_for_migration_complete();
+    global_qtest = global;
+}
 
-    qtest_quit(from);
+/*
+ * The destination is running after a completed migration: check it is
+ * the guest we expect, stop it and check its RAM, then clean up.
+ */
+static void test_migrate_end(QTestState *to)
+{
+    QTestState *global = global_qtest;
+    unsigned char dest_byte_a, dest_byte_b, dest_byte_c, dest_byte_d;
 
     global_qtest = to;
 
@@ -492,7 +506,6 @@ static void test_migrate(void)
     check_guests_ram();
 
     qtest_quit(to);
-    g_free(uri);
 
     global_qtest = global;
 
@@ -502,6 +515,87 @@ static void test_migrate(void)
     cleanup("dest_serial");
 }
 
+static void test_migrate(void)
+{
+    char *uri = g_strdup_printf("unix:%s/migsocket", tmpfs);
+    QTestState *global = global_qtest, *from, *to;
+    QDict *rsp;
+
+    test_migrate_start(&from, &to, uri);
+
+    migrate_set_capability(from, "postcopy-ram");
+    migrate_set_capability(to, "postcopy-ram");
+
+    test_migrate_begin(from, uri);
+
+    global_qtest = from;
+    wait_for_migration_pass();
+
+    rsp = return_or_event(qmp("{ 'execute': 'migrate-start-postcopy' }"));
+    g_assert(qdict_haskey(rsp, "return"));
+    QDECREF(rsp);
+
+    if (!got_stop) {
+        qmp_eventwait("STOP");
+    }
+
+    global_qtest = to;
+    qmp_eventwait("RESUME");
+
+    wait_for_serial("dest_serial");
+    global_qtest = from;
+    wait_for_migration_complete();
+
+    qtest_quit(from);
+    global_qtest = global;
+
+    test_migrate_end(to);
+    g_free(uri);
+}
+
+/*
+ * Precopy with x-dedup-pages.  The guest keeps rewriting most pages with
+ * the same byte pattern, so nearly every page after the first few goes as
+ * a reference to another one, and pages are redirtied while they are
+ * being hashed and sent.  Any page whose digest doesn't match the bytes
+ * the destination got shows up in check_guests_ram().
+ */
+static void test_migrate_dedup(void)
+{
+    char *uri = g_strdup_printf("unix:%s/migsocket", tmpfs);
+    QTestState *global = global_qtest, *from, *to;
+
+    test_migrate_start(&from, &to, uri);
+
+    migrate_set_capability(from, "x-dedup-pages");
+    migrate_set_capability(to, "x-dedup-pages");
+
+    test_migrate_begin(from, uri);
+
+    /* Go through a couple of passes with the guest dirtying pages */
+    global_qtest = from;
+    wait_for_migration_pass();
+    wait_for_migration_pass();
+
+    /* Then let it converge */
+    migrate_set_downtime(from, "10");
+
+    if (!got_stop) {
+        qmp_eventwait("STOP");
+    }
+    wait_for_migration_complete();
+
+    global_qtest = to;
+    qmp_eventwait("RESUME");
+    wait_for_serial("dest_serial");
+
+    qtest_quit(from);
+    global_qtest = global;
+
+    test_migrate_end(to);
+    g_free(uri);
+}
+
 int main(int argc, char **argv)
 {
     char template[] = "/tmp/postcopy-test-XXXXXX";
@@ -509,10 +603,6 @@ int main(int argc, char **argv)
 
     g_test_init(&argc, &argv, NULL);
 
-    if (!ufd_version_check()) {
-        return 0;
-    }
-
     tmpfs = mkdtemp(template);
     if (!tmpfs) {
         g_test_message("mkdtemp on path (%s): %s\n", template, strerror(errno));
@@ -521,7 +611,10 @@ int main(int argc, char **argv)
 
     module_call_init(MODULE_INIT_QOM);
 
-    qtest_add_func("/postcopy", test_migrate);
+    if (ufd_version_check()) {
+        qtest_add_func("/postcopy", test_migrate);
+    }
+    qtest_add_func("/migration/dedup", test_migrate_dedup);
 
     ret = g_test_run();
 
@@ -0,0 +1,264 @@
+/*
+ * COLO compare TCP stream comparison tests
+ *
+ * This work is licensed under the terms of the GNU GPL, version 2 or
+ * (at your option) any later version.  See the COPYING file in the
+ * top-level directory.
+ */
+#include "qemu/osdep.h"
+#include "qemu/timer.h"
+#include "net/colo.h"
+
+#define ISN 1000
+
+static const uint8_t stream[] = "The quick brown fox jumps over the lazy dog";
+
+static int released;
+static int compared;
+
+static int compare_ok(Packet *spkt, Packet *ppkt)
+{
+    compared++;
+    return 0;
+}
+
+static void release(Packet *pkt, void *opaque)
+{
+    released++;
+    packet_destroy(pkt, NULL);
+}
+
+/*
+ * Queue a segment carrying @len bytes of @data from sequence number
+ * @seq, on the primary side of @conn or on the secondary one.
+ */
+static void queue_segment(Connection *conn, bool primary, uint32_t seq,
+                          uint8_t flags, const uint8_t *data, uint32_t len)
+{
+    uint32_t size = ETH_HLEN + sizeof(struct ip) + sizeof(struct tcphdr) +
+                    len;
+    uint8_t *frame = g_malloc0(size);
+    struct ip *ip = (struct ip *)(frame + ETH_HLEN);
+    struct tcphdr *tcp = (struct tcphdr *)(ip + 1);
+    Packet *pkt;
+
+    frame[12] = ETH_P_IP >> 8;
+    frame[13] = ETH_P_IP & 0xff;
+    ip->ip_v = 4;
+    ip->ip_hl = sizeof(*ip) / 4;
+    ip->ip_len = htons(size - ETH_HLEN);
+    ip->ip_p = IPPROTO_TCP;
+    ip->ip_src.s_addr = htonl(0x0a000001);
+    ip->ip_dst.s_addr = htonl(0x0a000002);
+    tcp->th_sport = htons(1024);
+    tcp->th_dport = htons(80);
+    tcp->th_seq = htonl(seq);
+    tcp->th_off = sizeof(*tcp) / 4;
+    tcp->th_flags = TH_ACK | flags;
+    memcpy(tcp + 1, data, len);
+
+    pkt = packet_new(frame, size, 0);
+    g_free(frame);
+    g_assert(parse_packet_early(pkt) == 0);
+    connection_queue_packet(primary ? &conn->primary_list :
+                            &conn->secondary_list, pkt, true);
+}
+
+/* Queue bytes [@start, @end) of the stream, following a SYN at ISN */
+static void queue_data(Connection *conn, bool primary, uint32_t start,
+                       uint32_t end, uint8_t flags)
+{
+    queue_segment(conn, primary, ISN + 1 + start, flags, stream + start,
+                  end - start);
+}
+
+static Connection *conn_new(void)
+{
+    ConnectionKey key = { .ip_proto = IPPROTO_TCP };
+
+    released = 0;
+    compared = 0;
+    return connection_new(&key);
+}
+
+static int conn_compare(Connection *conn)
+{
+    return connection_compare_tcp(conn, compare_ok, release, NULL);
+}
+
+static void conn_check_empty(Connection *conn, int nr_released)
+{
+    g_assert(g_queue_is_empty(&conn->primary_list));
+    g_assert(g_queue_is_empty(&conn->secondary_list));
+    g_assert_cmpint(released, ==, nr_released);
+    connection_destroy(conn);
+}
+
+static void test_same_segments(void)
+{
+    Connection *conn = conn_new();
+
+    queue_segment(conn, true, ISN, TH_SYN, stream, 0);
+    queue_data(conn, true, 0, 20, 0);
+    queue_data(conn, true, 20, 43, TH_FIN);
+    queue_segment(conn, false, ISN, TH_SYN, stream, 0);
+    queue_data(conn, false, 0, 20, 0);
+    queue_data(conn, false, 20, 43, TH_FIN);
+
+    g_assert_cmpint(conn_compare(conn), ==, 0);
+    /* Only the bare SYNs are compared whole */
+    g_assert_cmpint(compared, ==, 1);
+    conn_check_empty(conn, 3);
+}
+
+static void test_different_segments(void)
+{
+    Connection *conn = conn_new();
+
+    queue_data(conn, true, 0, 5, 0);
+    queue_data(conn, true, 5, 30, 0);
+    queue_data(conn, true, 30, 43, 0);
+    queue_data(conn, false, 0, 17, 0);
+    queue_data(conn, false, 17, 43, 0);
+
+    g_assert_cmpint(conn_compare(conn), ==, 0);
+    conn_check_empty(conn, 3);
+}
+
+static void test_partial(void)
+{
+    Connection *conn = conn_new();
+
+    /* The secondary lags behind: keep what is left until it catches up */
+    queue_data(conn, true, 0, 43, 0);
+    queue_data(conn, false, 0, 10, 0);
+    g_assert_cmpint(conn_compare(conn), ==, 0);
+    g_assert_cmpint(g_queue_get_length(&conn->primary_list), ==, 1);
+    g_assert(g_queue_is_empty(&conn->secondary_list));
+    g_assert_cmpint(released, ==, 0);
+
+    queue_data(conn, false, 10, 43, 0);
+    g_assert_cmpint(conn_compare(conn), ==, 0);
+    conn_check_empty(conn, 1);
+}
+
+static void test_fin_with_data(void)
+{
+    Connection *conn = conn_new();
+
+    /* data+FIN on one side, data then a bare FIN on the other */
+    queue_data(conn, true, 0, 43, TH_FIN);
+    queue_data(conn, false, 0, 43, 0);
+    g_assert_cmpint(conn_compare(conn), ==, 0);
+    g_assert_cmpint(g_queue_get_length(&conn->primary_list), ==, 1);
+    g_assert_cmpint(released, ==, 0);
+
+    queue_data(conn, false, 43, 43, TH_FIN);
+    g_assert_cmpint(conn_compare(conn), ==, 0);
+    g_assert_cmpint(compared, ==, 0);
+    conn_check_empty(conn, 1);
+}
+
+static void test_rst_with_data(void)
+{
+    Connection *conn = conn_new();
+
+    queue_data(conn, true, 0, 20, 0);
+    queue_data(conn, true, 20, 20, TH_RST);
+    queue_data(conn, false, 0, 20, TH_RST);
+
+    g_assert_cmpint(conn_compare(conn), ==, 0);
+    conn_check_empty(conn, 2);
+}
+
+static void test_retransmission(void)
+{
+    Connection *conn = conn_new();
+
+    queue_segment(conn, true, ISN, TH_SYN, stream, 0);
+    queue_data(conn, true, 0, 20, 0);
+    queue_segment(conn, false, ISN, TH_SYN, stream, 0);
+    queue_data(conn, false, 0, 25, 0);
+    g_assert_cmpint(conn_compare(conn), ==, 0);
+    g_assert_cmpint(released, ==, 2);
+
+    /* Retransmitted segments that were matched are dropped unmatched */
+    queue_segment(conn, true, ISN, TH_SYN, stream, 0);
+    queue_data(conn, true, 0, 20, 0);
+    queue_data(conn, false, 0, 10, 0);
+    /* A retransmission overlapping what is matched is compared past it */
+    queue_data(conn, true, 10, 43, TH_FIN);
+    queue_data(conn, false, 25, 43, TH_FIN);
+    g_assert_cmpint(conn_compare(conn), ==, 0);
+    g_assert_cmpint(compared, ==, 1);
+    g_assert(g_queue_is_empty(&conn->primary_list));
+    g_assert(g_queue_is_empty(&conn->secondary_list));
+    g_assert_cmpint(released, ==, 5);
+
+    /* So is a FIN sent again, once there is something on the other side */
+    queue_data(conn, true, 43, 43, TH_FIN);
+    queue_data(conn, false, 10, 43, TH_FIN);
+    g_assert_cmpint(conn_compare(conn), ==, 0);
+    g_assert(g_queue_is_empty(&conn->primary_list));
+    g_assert_cmpint(g_queue_get_length(&conn->secondary_list), ==, 1);
+    g_assert_cmpint(released, ==, 6);
+    connection_destroy(conn);
+}
+
+static void test_payload_differs(void)
+{
+    Connection *conn = conn_new();
+    uint8_t other[43];
+
+    memcpy(other, stream, sizeof(other));
+    other[25] ^= 1;
+
+    queue_data(conn, true, 0, 20, 0);
+    queue_data(conn, true, 20, 43, 0);
+    queue_segment(conn, false, ISN + 1, 0, other, 43);
+
+    g_assert_cmpint(conn_compare(conn), ==, -1);
+    /* The difference stays at the head of both queues */
+    g_assert_cmpint(g_queue_get_length(&conn->primary_list), ==, 1);
+    g_assert_cmpint(g_queue_get_length(&conn->secondary_list), ==, 1);
+    g_assert_cmpint(conn_compare(conn), ==, -1);
+    g_assert_cmpint(released, ==, 1);
+    connection_destroy(conn);
+}
+
+static void test_control_differs(void)
+{
+    Connection *conn = conn_new();
+
+    /* The primary closes the stream where the secondary goes on */
+    queue_data(conn, true, 0, 20, TH_FIN);
+    queue_data(conn, false, 0, 43, 0);
+    g_assert_cmpint(conn_compare(conn), ==, -1);
+    connection_destroy(conn);
+
+    conn = conn_new();
+    queue_data(conn, true, 0, 20, TH_FIN);
+    queue_data(conn, false, 0, 20, TH_RST);
+    g_assert_cmpint(conn_compare(conn), ==, -1);
+    connection_destroy(conn);
+}
+
+int main(int argc, char **argv)
+{
+    g_test_init(&argc, &argv, NULL);
+    init_clocks(NULL);
+
+    g_test_add_func("/colo-compare/tcp/same-segments", test_same_segments);
+    g_test_add_func("/colo-compare/tcp/different-segments",
+                    test_different_segments);
+    g_test_add_func("/colo-compare/tcp/partial", test_partial);
+    g_test_add_func("/colo-compare/tcp/fin-with-data", test_fin_with_data);
+    g_test_add_func("/colo-compare/tcp/rst-with-data", test_rst_with_data);
+    g_test_add_func("/colo-compare/tcp/retransmission", test_retransmission);
+    g_test_add_func("/colo-compare/tcp/payload-differs",
+                    test_payload_differs);
+    g_test_add_func("/colo-compare/tcp/control-differs",
+                    test_control_differs);
+
+    return g_test_run();
+}
@@ -72,6 +72,47 @@ static void test_io_channel_fd(void)
 
 
 #ifndef _WIN32
+static void test_io_channel_file_pos(void)
+{
+    QIOChannel *src, *dst;
+    char buf[8];
+
+#define TEST_FILE "tests/test-io-channel-file.txt"
+    unlink(TEST_FILE);
+    src = QIO_CHANNEL(qio_channel_file_new_path(
+                          TEST_FILE,
+                          O_WRONLY | O_CREAT | O_TRUNC | O_BINARY, 0600,
+                          &error_abort));
+    dst = QIO_CHANNEL(qio_channel_file_new_path(
+                          TEST_FILE,
+                          O_RDONLY | O_BINARY, 0,
+                          &error_abort));
+    g_assert(qio_channel_has_feature(src, QIO_CHANNEL_FEATURE_SEEKABLE));
+    g_assert(qio_channel_has_feature(dst, QIO_CHANNEL_FEATURE_SEEKABLE));
+
+    /* Positioned writes leave the stream position alone */
+    g_assert_cmpint(qio_channel_pwrite(src, "world", 5, 4096, &error_abort),
+                    ==, 5);
+    g_assert_cmpint(qio_channel_write(src, "hello", 5, &error_abort), ==, 5);
+
+    g_assert_cmpint(qio_channel_pread(dst, buf, 5, 4096, &error_abort),
+                    ==, 5);
+    g_assert(!memcmp(buf, "world", 5));
+    g_assert_cmpint(qio_channel_read(dst, buf, 5, &error_abort), ==, 5);
+    g_assert(!memcmp(buf, "hello", 5));
+
+    /* The hole in between reads as zeroes, the end of the file fails */
+    g_assert_cmpint(qio_channel_pread(dst, buf, 8, 100, &error_abort),
+                    ==, 8);
+    g_assert(!memcmp(buf, "\0\0\0\0\0\0\0\0", 8));
+    g_assert_cmpint(qio_channel_pread(dst, buf, 8, 4096, NULL), ==, -1);
+
+    unlink(TEST_FILE);
+    object_unref(OBJECT(src));
+    object_unref(OBJECT(dst));
+}
+
+
 static void test_io_channel_pipe(bool async)
 {
     QIOChannel *src, *dst;
@@ -116,6 +157,7 @@ int main(int argc, char **argv)
     g_test_add_func("/io/channel/file", test_io_channel_file);
     g_test_add_func("/io/channel/file/fd", test_io_channel_fd);
 #ifndef _WIN32
+    g_test_add_func("/io/channel/file/pos", test_io_channel_file_pos);
     g_test_add_func("/io/channel/pipe/sync", test_io_channel_pipe_sync);
     g_test_add_func("/io/channel/pipe/async", test_io_channel_pipe_async);
 #endif
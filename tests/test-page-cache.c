@@ -0,0 +1,132 @@
+/*
+ * XBZRLE page cache unit tests
+ *
+ * This work is licensed under the terms of the GNU GPL, version 2 or later.
+ * See the COPYING file in the top-level directory.
+ *
+ */
+#include "qemu/osdep.h"
+#include "qemu-common.h"
+#include "../migration/page_cache.h"
+
+#define PAGE_SIZE 4096
+#define NUM_PAGES 64
+
+/* address of the @n-th page that maps to the same set as page 0 */
+static uint64_t set0_addr(int n)
+{
+    return (uint64_t)n * (NUM_PAGES / PAGE_CACHE_WAYS) * PAGE_SIZE;
+}
+
+static void fill_page(uint8_t *page, uint8_t val)
+{
+    memset(page, val, PAGE_SIZE);
+}
+
+static void test_insert_lookup(void)
+{
+    PageCache *cache = cache_init(NUM_PAGES, PAGE_SIZE);
+    uint8_t page[PAGE_SIZE];
+    int i;
+
+    g_assert(cache);
+    /* colliding pages no longer evict each other up to the set size */
+    for (i = 0; i < PAGE_CACHE_WAYS; i++) {
+        fill_page(page, i + 1);
+        g_assert_cmpint(cache_insert(cache, set0_addr(i), page, 1), ==, 0);
+    }
+    for (i = 0; i < PAGE_CACHE_WAYS; i++) {
+        g_assert(cache_is_cached(cache, set0_addr(i), 1));
+        g_assert_cmpint(get_cached_data(cache, set0_addr(i))[0], ==, i + 1);
+    }
+    g_assert(!cache_is_cached(cache, set0_addr(PAGE_CACHE_WAYS), 1));
+    g_assert(get_cached_data(cache, set0_addr(PAGE_CACHE_WAYS)) == NULL);
+
+    /* a full set of fresh pages is not replaced */
+    fill_page(page, 0xff);
+    g_assert_cmpint(cache_insert(cache, set0_addr(PAGE_CACHE_WAYS), page, 1),
+                    ==, -1);
+
+    cache_fini(cache);
+}
+
+static void test_replacement(void)
+{
+    PageCache *cache = cache_init(NUM_PAGES, PAGE_SIZE);
+    PageCacheWayStats stats[PAGE_CACHE_WAYS] = { };
+    uint64_t hits = 0, misses = 0, evictions = 0;
+    uint8_t page[PAGE_SIZE];
+    int i;
+
+    fill_page(page, 0);
+    for (i = 0; i < PAGE_CACHE_WAYS; i++) {
+        g_assert_cmpint(cache_insert(cache, set0_addr(i), page, 1), ==, 0);
+    }
+    /* every page but the last one is hot */
+    for (i = 0; i < PAGE_CACHE_WAYS - 1; i++) {
+        g_assert(cache_is_cached(cache, set0_addr(i), 1));
+    }
+
+    /* once they are stale, the least used page is the one evicted */
+    g_assert_cmpint(cache_insert(cache, set0_addr(PAGE_CACHE_WAYS), page, 10),
+                    ==, 0);
+    g_assert(get_cached_data(cache, set0_addr(PAGE_CACHE_WAYS - 1)) == NULL);
+    for (i = 0; i < PAGE_CACHE_WAYS - 1; i++) {
+        g_assert(get_cached_data(cache, set0_addr(i)) != NULL);
+    }
+
+    cache_get_way_stats(cache, stats);
+    for (i = 0; i < PAGE_CACHE_WAYS; i++) {
+        hits += stats[i].hits;
+        misses += stats[i].misses;
+        evictions += stats[i].evictions;
+    }
+    g_assert_cmpint(hits, ==, PAGE_CACHE_WAYS - 1);
+    g_assert_cmpint(misses, ==, PAGE_CACHE_WAYS + 1);
+    g_assert_cmpint(evictions, ==, 1);
+    g_assert_cmpint(stats[PAGE_CACHE_WAYS - 1].evictions, ==, 1);
+
+    cache_fini(cache);
+}
+
+static void test_resize(void)
+{
+    PageCache *cache = cache_init(NUM_PAGES, PAGE_SIZE);
+    uint8_t page[PAGE_SIZE];
+    int i;
+
+    for (i = 0; i < NUM_PAGES; i++) {
+        fill_page(page, i);
+        g_assert_cmpint(cache_insert(cache, (uint64_t)i * PAGE_SIZE, page, 1),
+                        ==, 0);
+    }
+
+    g_assert_cmpint(cache_resize(cache, NUM_PAGES * 2), ==, NUM_PAGES * 2);
+    for (i = 0; i < NUM_PAGES; i++) {
+        uint8_t *data = get_cached_data(cache, (uint64_t)i * PAGE_SIZE);
+
+        g_assert(data);
+        g_assert_cmpint(data[PAGE_SIZE - 1], ==, i);
+    }
+
+    g_assert_cmpint(cache_resize(cache, NUM_PAGES / 2), ==, NUM_PAGES / 2);
+    for (i = 0; i < NUM_PAGES; i++) {
+        uint8_t *data = get_cached_data(cache, (uint64_t)i * PAGE_SIZE);
+
+        if (data) {
+            g_assert_cmpint(data[0], ==, i);
+        }
+    }
+
+    cache_fini(cache);
+}
+
+int main(int argc, char **argv)
+{
+    g_test_init(&argc, &argv, NULL);
+    g_test_add_func("/page_cache/insert_lookup", test_insert_lookup);
+    g_test_add_func("/page_cache/replacement", test_replacement);
+    g_test_add_func("/page_cache/resize", test_resize);
+
+    return g_test_run();
+}
@@ -31,6 +31,7 @@
 #include "../migration/qemu-file.h"
 #include "../migration/qemu-file-channel.h"
 #include "../migration/savevm.h"
+#include "qemu/bswap.h"
 #include "qemu/coroutine.h"
 #include "io/channel-file.h"
 
@@ -848,6 +849,137 @@ static void test_tmp_struct(void)
     g_assert_cmpint(obj.f, ==, 8); /* From the child->parent */
 }
 
+/* Plain fields laid out back to back get merged into runs */
+
+typedef struct TestRuns {
+    uint32_t regs[64];
+    uint32_t ctrl, status;
+    uint16_t idx[8];
+    uint8_t  mac[6];
+    uint8_t  tag[2];
+    uint64_t counters[16];
+    bool     on;
+} TestRuns;
+
+static const VMStateDescription vmstate_runs = {
+    .name = "test/runs",
+    .version_id = 1,
+    .minimum_version_id = 1,
+    .fields = (VMStateField[]) {
+        VMSTATE_UINT32_ARRAY(regs, TestRuns, 64),
+        VMSTATE_UINT32(ctrl, TestRuns),
+        VMSTATE_UINT32(status, TestRuns),
+        VMSTATE_UINT16_ARRAY(idx, TestRuns, 8),
+        VMSTATE_UINT8_ARRAY(mac, TestRuns, 6),
+        VMSTATE_BUFFER(tag, TestRuns),
+        VMSTATE_UINT64_ARRAY(counters, TestRuns, 16),
+        VMSTATE_BOOL(on, TestRuns),
+        VMSTATE_END_OF_LIST()
+    }
+};
+
+#define WIRE_RUNS_SIZE (64 * 4 + 2 * 4 + 8 * 2 + 6 + 2 + 16 * 8 + 1 + 1)
+
+static void runs_init(TestRuns *obj, uint8_t *wire)
+{
+    uint8_t *p = wire;
+    int i;
+
+    memset(obj, 0, sizeof(*obj));
+    for (i = 0; i < 64; i++) {
+        obj->regs[i] = 0x01020304 * i;
+        stl_be_p(p, obj->regs[i]);
+        p += 4;
+    }
+    obj->ctrl = 0xdeadbeef;
+    stl_be_p(p, obj->ctrl);
+    p += 4;
+    obj->status = 0x80000001;
+    stl_be_p(p, obj->status);
+    p += 4;
+    for (i = 0; i < 8; i++) {
+        obj->idx[i] = 0x1111 * i;
+        stw_be_p(p, obj->idx[i]);
+        p += 2;
+    }
+    for (i = 0; i < 6; i++) {
+        obj->mac[i] = 0x52 + i;
+        *p++ = obj->mac[i];
+    }
+    for (i = 0; i < 2; i++) {
+        obj->tag[i] = 0xa0 + i;
+        *p++ = obj->tag[i];
+    }
+    for (i = 0; i < 16; i++) {
+        obj->counters[i] = 0x0102030405060708ULL * i;
+        stq_be_p(p, obj->counters[i]);
+        p += 8;
+    }
+    obj->on = true;
+    *p++ = 1;
+    *p++ = QEMU_VM_EOF;
+    g_assert_cmpint(p - wire, ==, WIRE_RUNS_SIZE);
+}
+
+static void obj_runs_copy(void *target, void *source)
+{
+    memcpy(target, source, sizeof(TestRuns));
+}
+
+static void test_runs(void)
+{
+    TestRuns obj_runs, obj, obj_clone;
+    uint8_t wire[WIRE_RUNS_SIZE];
+
+    runs_init(&obj_runs, wire);
+    save_vmstate(&vmstate_runs, &obj_runs);
+
+    compare_vmstate(wire, sizeof(wire));
+
+    memset(&obj, 0, sizeof(obj));
+    SUCCESS(load_vmstate(&vmstate_runs, &obj, &obj_clone,
+                         obj_runs_copy, 1, wire, sizeof(wire)));
+    SUCCESS(memcmp(&obj, &obj_runs, sizeof(obj)));
+}
+
+/* Only run with -m perf: time save and load of the same description */
+static void test_runs_perf(void)
+{
+    TestRuns obj_runs, obj;
+    uint8_t wire[WIRE_RUNS_SIZE];
+    const int loops = 100000;
+    double save_secs, load_secs;
+    QEMUFile *f;
+    int i;
+
+    runs_init(&obj_runs, wire);
+
+    f = open_test_file(true);
+    g_test_timer_start();
+    for (i = 0; i < loops; i++) {
+        vmstate_save_state(f, &vmstate_runs, &obj_runs, NULL);
+    }
+    qemu_put_byte(f, QEMU_VM_EOF);
+    qemu_fflush(f);
+    save_secs = g_test_timer_elapsed();
+    g_assert(!qemu_file_get_error(f));
+    qemu_fclose(f);
+
+    f = open_test_file(false);
+    g_test_timer_start();
+    for (i = 0; i < loops; i++) {
+        SUCCESS(vmstate_load_state(f, &vmstate_runs, &obj, 1));
+    }
+    load_secs = g_test_timer_elapsed();
+    qemu_fclose(f);
+    SUCCESS(memcmp(&obj, &obj_runs, sizeof(obj)));
+
+    g_test_minimized_result(save_secs, "save: %.0f ns/state",
+                            save_secs * 1e9 / loops);
+    g_test_minimized_result(load_secs, "load: %.0f ns/state",
+                            load_secs * 1e9 / loops);
+}
+
 int main(int argc, char **argv)
 {
     temp_fd = mkstemp(temp_file);
@@ -876,6 +1008,10 @@ int main(int argc, char **argv)
     g_test_add_func("/vmstate/qtailq/save/saveq", test_save_q);
     g_test_add_func("/vmstate/qtailq/load/loadq", test_load_q);
     g_test_add_func("/vmstate/tmp_struct", test_tmp_struct);
+    g_test_add_func("/vmstate/runs", test_runs);
+    if (g_test_perf()) {
+        g_test_add_func("/vmstate/runs/perf", test_runs_perf);
+    }
     g_test_run();
 
     close(temp_fd);
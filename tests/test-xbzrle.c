@@ -174,6 +174,152 @@ static void test_encode_decode(void)
     }
 }
 
+/*
+ * Make @new_buf differ from @old_buf in roughly @permille of its bytes,
+ * either scattered or in runs of up to 64 bytes.
+ */
+static void make_dirty(GRand *rand, uint8_t *old_buf, uint8_t *new_buf,
+                       int permille, bool clustered)
+{
+    int i, len;
+
+    for (i = 0; i < PAGE_SIZE; i++) {
+        old_buf[i] = g_rand_int(rand);
+    }
+    memcpy(new_buf, old_buf, PAGE_SIZE);
+
+    for (i = 0; i < PAGE_SIZE; i += len) {
+        len = clustered ? g_rand_int_range(rand, 1, 65) : 1;
+        if (g_rand_int_range(rand, 0, 1000) < permille) {
+            int j;
+
+            for (j = i; j < i + len && j < PAGE_SIZE; j++) {
+                new_buf[j] = old_buf[j] ^ g_rand_int_range(rand, 1, 256);
+            }
+        }
+    }
+}
+
+static const int dirty_permille[] = { 0, 1, 10, 50, 250, 500, 1000 };
+
+#define ACCEL_PATTERNS 2000
+
+/*
+ * Every accelerated encoder must produce the same stream, and fail with
+ * the same overflow, as the plain C one.
+ */
+static void test_encode_accel(void)
+{
+    static const int dlens[] = { PAGE_SIZE, PAGE_SIZE / 4, 64, 3 };
+    uint8_t *old_buf = g_malloc(PAGE_SIZE);
+    uint8_t *new_buf = g_malloc(PAGE_SIZE);
+    uint8_t *compressed = g_malloc(PAGE_SIZE);
+    uint8_t *decoded = g_malloc(PAGE_SIZE);
+    uint8_t (*ref)[PAGE_SIZE] = g_malloc(ACCEL_PATTERNS * PAGE_SIZE);
+    int *ref_len = g_new(int, ACCEL_PATTERNS);
+    bool first = true;
+
+    do {
+        GRand *rand = g_rand_new_with_seed(0x7862);
+        int n;
+
+        for (n = 0; n < ACCEL_PATTERNS; n++) {
+            int permille = dirty_permille[n % ARRAY_SIZE(dirty_permille)];
+            int dlen = dlens[(n / ARRAY_SIZE(dirty_permille)) %
+                             ARRAY_SIZE(dlens)];
+            int rc;
+
+            make_dirty(rand, old_buf, new_buf, permille, n & 1);
+            rc = xbzrle_encode_buffer(old_buf, new_buf, PAGE_SIZE,
+                                      compressed, dlen);
+            if (first) {
+                ref_len[n] = rc;
+                if (rc > 0) {
+                    memcpy(ref[n], compressed, rc);
+                }
+            } else {
+                g_assert_cmpint(rc, ==, ref_len[n]);
+                if (rc > 0) {
+                    g_assert(memcmp(ref[n], compressed, rc) == 0);
+                }
+            }
+
+            if (rc >= 0) {
+                memcpy(decoded, old_buf, PAGE_SIZE);
+                g_assert_cmpint(xbzrle_decode_buffer(compressed, rc, decoded,
+                                                     PAGE_SIZE), <=, PAGE_SIZE);
+                g_assert(memcmp(decoded, new_buf, PAGE_SIZE) == 0);
+            }
+        }
+        g_rand_free(rand);
+        first = false;
+    } while (test_xbzrle_encode_next_accel());
+
+    g_free(ref_len);
+    g_free(ref);
+    g_free(decoded);
+    g_free(compressed);
+    g_free(new_buf);
+    g_free(old_buf);
+}
+
+#define PERF_PAGES 256
+
+/*
+ * Encode throughput of each implementation for several dirty ratios;
+ * run with -m perf.  Implementations are listed from the most preferred
+ * one on this host down to plain C.
+ */
+static void test_encode_perf(void)
+{
+    uint8_t *old_buf = g_malloc(PERF_PAGES * PAGE_SIZE);
+    uint8_t *new_buf = g_malloc(PERF_PAGES * PAGE_SIZE);
+    uint8_t *compressed = g_malloc(PAGE_SIZE);
+    int accel = 0;
+
+    do {
+        int p, clustered;
+
+        for (clustered = 0; clustered < 2; clustered++) {
+            for (p = 0; p < ARRAY_SIZE(dirty_permille); p++) {
+                GRand *rand = g_rand_new_with_seed(p);
+                uint64_t bytes = 0;
+                double secs;
+                int i;
+
+                for (i = 0; i < PERF_PAGES; i++) {
+                    make_dirty(rand, old_buf + i * PAGE_SIZE,
+                               new_buf + i * PAGE_SIZE, dirty_permille[p],
+                               clustered);
+                }
+                g_rand_free(rand);
+
+                g_test_timer_start();
+                do {
+                    for (i = 0; i < PERF_PAGES; i++) {
+                        xbzrle_encode_buffer(old_buf + i * PAGE_SIZE,
+                                             new_buf + i * PAGE_SIZE,
+                                             PAGE_SIZE, compressed,
+                                             PAGE_SIZE);
+                    }
+                    bytes += PERF_PAGES * PAGE_SIZE;
+                } while (g_test_timer_elapsed() < 0.2);
+                secs = g_test_timer_last();
+
+                g_test_message("accel %d, %s, %2d.%d%% dirty: %.0f MB/s",
+                               accel, clustered ? "clustered" : "scattered",
+                               dirty_permille[p] / 10, dirty_permille[p] % 10,
+                               bytes / secs / (1024 * 1024));
+            }
+        }
+        accel++;
+    } while (test_xbzrle_encode_next_accel());
+
+    g_free(compressed);
+    g_free(new_buf);
+    g_free(old_buf);
+}
+
 int main(int argc, char **argv)
 {
     g_test_init(&argc, &argv, NULL);
@@ -186,6 +332,12 @@ int main(int argc, char **argv)
     g_test_add_func("/xbzrle/encode_decode_overflow",
                     test_encode_decode_overflow);
     g_test_add_func("/xbzrle/encode_decode", test_encode_decode);
+    /* both of these step through all the accelerators, run one of them */
+    if (g_test_perf()) {
+        g_test_add_func("/xbzrle/encode_perf", test_encode_perf);
+    } else {
+        g_test_add_func("/xbzrle/encode_accel", test_encode_accel);
+    }
 
     return g_test_run();
 }
@@ -3688,7 +3688,8 @@ static int vnc_display_listen_addr(VncDisplay *vd,
 
         qio_channel_set_name(QIO_CHANNEL(sioc), name);
         if (qio_channel_socket_listen_sync(
-                sioc, rawaddrs[i], listenerr == NULL ? &listenerr : NULL) < 0) {
+                sioc, rawaddrs[i], 1,
+                listenerr == NULL ? &listenerr : NULL) < 0) {
             object_unref(OBJECT(sioc));
             continue;
         }
@@ -287,6 +287,39 @@ bool bitmap_test_and_clear_atomic(unsigned long *map, long start, long nr)
     return dirty != 0;
 }
 
+long bitmap_count_and_clear_atomic(unsigned long *map, long start, long nr)
+{
+    unsigned long *p = map + BIT_WORD(start);
+    const long size = start + nr;
+    int bits_to_clear = BITS_PER_LONG - (start % BITS_PER_LONG);
+    unsigned long mask_to_clear = BITMAP_FIRST_WORD_MASK(start);
+    long count = 0;
+
+    assert(start >= 0 && nr >= 0);
+
+    while (nr >= bits_to_clear) {
+        if (mask_to_clear == ~0UL) {
+            if (*p) {
+                count += ctpopl(atomic_xchg(p, 0));
+            }
+        } else {
+            count += ctpopl(atomic_fetch_and(p, ~mask_to_clear) &
+                            mask_to_clear);
+        }
+        nr -= bits_to_clear;
+        bits_to_clear = BITS_PER_LONG;
+        mask_to_clear = ~0UL;
+        p++;
+    }
+
+    if (nr) {
+        mask_to_clear &= BITMAP_LAST_WORD_MASK(size);
+        count += ctpopl(atomic_fetch_and(p, ~mask_to_clear) & mask_to_clear);
+    }
+
+    return count;
+}
+
 void bitmap_copy_and_clear_atomic(unsigned long *dst, unsigned long *src,
                                   long nr)
 {
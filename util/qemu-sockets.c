@@ -152,6 +152,7 @@ int inet_ai_family_from_address(InetSocketAddress *addr,
 static int inet_listen_saddr(InetSocketAddress *saddr,
                              int port_offset,
                              bool update_addr,
+                             int num,
                              Error **errp)
 {
     struct addrinfo ai,*res,*e;
@@ -273,7 +274,7 @@ static int inet_listen_saddr(InetSocketAddress *saddr,
     return -1;
 
 listen:
-    if (listen(slisten,1) != 0) {
+    if (listen(slisten, num) != 0) {
         error_setg_errno(errp, errno, "Failed to listen on socket");
         closesocket(slisten);
         freeaddrinfo(res);
@@ -792,6 +793,7 @@ static int vsock_connect_saddr(VsockSocketAddress *vaddr,
 }
 
 static int vsock_listen_saddr(VsockSocketAddress *vaddr,
+                              int num,
                               Error **errp)
 {
     struct sockaddr_vm svm;
@@ -813,7 +815,7 @@ static int vsock_listen_saddr(VsockSocketAddress *vaddr,
         return -1;
     }
 
-    if (listen(slisten, 1) != 0) {
+    if (listen(slisten, num) != 0) {
         error_setg_errno(errp, errno, "Failed to listen on socket");
         closesocket(slisten);
         return -1;
@@ -856,6 +858,7 @@ static int vsock_connect_saddr(VsockSocketAddress *vaddr,
 }
 
 static int vsock_listen_saddr(VsockSocketAddress *vaddr,
+                              int num,
                               Error **errp)
 {
     vsock_unsupported(errp);
@@ -874,6 +877,7 @@ static int vsock_parse(VsockSocketAddress *addr, const char *str,
 
 static int unix_listen_saddr(UnixSocketAddress *saddr,
                              bool update_addr,
+                             int num,
                              Error **errp)
 {
     struct sockaddr_un un;
@@ -933,7 +937,7 @@ static int unix_listen_saddr(UnixSocketAddress *saddr,
         error_setg_errno(errp, errno, "Failed to bind socket to %s", path);
         goto err;
     }
-    if (listen(sock, 1) < 0) {
+    if (listen(sock, num) < 0) {
         error_setg_errno(errp, errno, "Failed to listen on socket");
         goto err;
     }
@@ -1026,6 +1030,7 @@ static int unix_connect_saddr(UnixSocketAddress *saddr,
 
 static int unix_listen_saddr(UnixSocketAddress *saddr,
                              bool update_addr,
+                             int num,
                              Error **errp)
 {
     error_setg(errp, "unix sockets are not available on windows");
@@ -1064,7 +1069,7 @@ int unix_listen(const char *str, char *ostr, int olen, Error **errp)
         saddr->path = g_strdup(str);
     }
 
-    sock = unix_listen_saddr(saddr, true, errp);
+    sock = unix_listen_saddr(saddr, true, 1, errp);
 
     if (sock != -1 && ostr) {
         snprintf(ostr, olen, "%s%s", saddr->path, optstr ? optstr : "");
@@ -1158,17 +1163,17 @@ int socket_connect(SocketAddress *addr, NonBlockingConnectHandler *callback,
     return fd;
 }
 
-int socket_listen(SocketAddress *addr, Error **errp)
+int socket_listen(SocketAddress *addr, int num, Error **errp)
 {
     int fd;
 
     switch (addr->type) {
     case SOCKET_ADDRESS_TYPE_INET:
-        fd = inet_listen_saddr(&addr->u.inet, 0, false, errp);
+        fd = inet_listen_saddr(&addr->u.inet, 0, false, num, errp);
         break;
 
     case SOCKET_ADDRESS_TYPE_UNIX:
-        fd = unix_listen_saddr(&addr->u.q_unix, false, errp);
+        fd = unix_listen_saddr(&addr->u.q_unix, false, num, errp);
         break;
 
     case SOCKET_ADDRESS_TYPE_FD:
@@ -1176,7 +1181,7 @@ int socket_listen(SocketAddress *addr, Error **errp)
         break;
 
     case SOCKET_ADDRESS_TYPE_VSOCK:
-        fd = vsock_listen_saddr(&addr->u.vsock, errp);
+        fd = vsock_listen_saddr(&addr->u.vsock, num, errp);
         break;
 
     default: